@@ -0,0 +1,34 @@
+/*-------------------------------------------------------------------------
+ *
+ * include/colocated_join.h
+ *
+ * Declarations for public functions related to planning joins between
+ * co-located distributed tables.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_COLOCATED_JOIN_H
+#define PG_SHARD_COLOCATED_JOIN_H
+
+#include "c.h"
+
+#include "distribution_metadata.h"
+
+#include "nodes/parsenodes.h"
+#include "nodes/pg_list.h"
+
+
+/* function declarations for planning joins between co-located tables */
+extern bool QueryHasJoin(Query *query);
+extern void ErrorIfJoinNotSupported(Query *query);
+extern bool TablesColocated(Oid leftRelationId, Oid rightRelationId);
+extern List * PruneColocatedShardList(Query *query, List *restrictClauseList);
+extern List * ColocatedRelationShardList(Query *query, ShardInterval *shardInterval);
+extern List * ColocatedPlacementList(List *relationShardList);
+extern Query * FlattenJoinAliasColumns(Query *query);
+
+
+#endif /* PG_SHARD_COLOCATED_JOIN_H */
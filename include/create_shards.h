@@ -48,6 +48,7 @@ extern Oid ResolveRelationId(text *relationName);
 /* function declarations for initializing a distributed table */
 extern Datum master_create_distributed_table(PG_FUNCTION_ARGS);
 extern Datum master_create_worker_shards(PG_FUNCTION_ARGS);
+extern Datum master_create_reference_table(PG_FUNCTION_ARGS);
 
 
 #endif /* PG_SHARD_CREATE_SHARDS_H */
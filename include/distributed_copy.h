@@ -12,12 +12,59 @@
 #ifndef DISTRIBUTED_COPY_H
 #define DISTRIBUTED_COPY_H
 
-typedef struct
+#include "lib/stringinfo.h"
+
+#include "connection.h"
+
+/* default size of per-placement COPY send buffer, in kilobytes */
+#define DEFAULT_COPY_BUFFER_SIZE 64
+
+/* default amount of unsent data after which COPY waits for a placement, in kB */
+#define DEFAULT_COPY_HIGH_WATER_MARK 1024
+
+/* interval after which a COPY waiting for slow placements checks interrupts */
+#define COPY_POLL_TIMEOUT_MS 100
+
+/* minimum size of the part of a COPY file loaded by one parallel worker */
+#define PARALLEL_COPY_MIN_RANGE_SIZE (16 * 1024 * 1024)
+
+/* length of the error message a parallel COPY worker reports to the leader */
+#define PARALLEL_COPY_ERROR_LENGTH 256
+
+/*
+ * CopyConnection is a connection to a worker node shared by several shard
+ * placements when COPY limits the number of connections per node. Buffered
+ * rows of its placements are sent as a sequence of per-shard COPY commands
+ * within a single remote transaction.
+ */
+typedef struct CopyConnection
+{
+	PGconn *conn;
+	int64 transactionId;                   /* names its prepared transaction */
+	ShardId lastShardId;                   /* shard of the last batch sent */
+	struct PlacementConnection *activePlacement; /* placement in COPY, if any */
+	bool prepared;
+} CopyConnection;
+
+/* NodeCopyConnections holds the shared COPY connections to one worker node */
+typedef struct NodeCopyConnections
+{
+	NodeConnectionKey key;        /* hash entry key */
+	int nextConnection;           /* connection the next placement is bound to */
+	CopyConnection *connections;  /* pg_shard.copy_connections_per_node entries */
+} NodeCopyConnections;
+
+typedef struct PlacementConnection
 {
 	int64   id;
 	bool    copied;
 	bool    prepared;
 	PGconn* conn;
+	StringInfoData buffer; /* rows not yet sent to this placement */
+	bool    flushPending;  /* libpq still holds unsent data for this placement */
+	bool    backlogged;    /* placement is in the COPY's PlacementBacklog */
+	CopyConnection *copyConnection; /* shared connection, if any, see above */
+	char const *copyCommand;        /* COPY command starting a shared batch */
 } PlacementConnection;
 
 typedef struct 
@@ -27,6 +74,16 @@ typedef struct
 	PlacementConnection* placements;
 } ShardConnections;
 
+/* configuration for distributed COPY */
+extern int PgShardCopyBufferSize;
+extern int PgShardCopyHighWaterMark;
+extern int PgShardCopyParallelWorkers;
+extern int PgShardCopyConnectionsPerNode;
+extern int PgShardCopyPrefetchShards;
+
 extern void PgShardCopy(CopyStmt *copyStatement, char const* query, char* completionTag);
+#if PG_VERSION_NUM >= 90500
+extern void PgShardCopyWorkerMain(Datum mainArgument);
+#endif
 
 #endif
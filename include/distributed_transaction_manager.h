@@ -12,6 +12,20 @@
 #ifndef DISTRIBUTED_TRANSACTION_MANAGER_H
 #define DISTRIBUTED_TRANSACTION_MANAGER_H
 
+/* values of pg_shard.copy_transaction_manager, indexes PgShardTransManagerImpl */
+typedef enum
+{
+	TRANSACTION_MANAGER_NONE = 0,
+	TRANSACTION_MANAGER_1PC = 1,
+	TRANSACTION_MANAGER_2PC = 2
+} PgShardTransactionManagerType;
+
+/*
+ * PgShardTransactionManager runs the remote side of a distributed transaction.
+ * Besides the blocking functions, it provides the commands that prepare and
+ * commit a transaction so that callers can send them to many connections at
+ * once; a NULL command means there is nothing to send in that step.
+ */
 typedef struct
 {
 	bool (*Begin)(PGconn *conn);
@@ -19,11 +33,16 @@ typedef struct
 	bool (*CommitPrepared)(PGconn *conn, ShardId shardId);
 	bool (*RollbackPrepared)(PGconn *conn, ShardId shardId);
 	bool (*Rollback)(PGconn *conn);
+	char * (*PrepareCommand)(ShardId shardId);
+	char * (*CommitPreparedCommand)(ShardId shardId);
 } PgShardTransactionManager;
 
 extern int PgShardCurrTransManager;
 extern PgShardTransactionManager const PgShardTransManagerImpl[];
 
 extern bool PgShardExecute(PGconn *conn, ExecStatusType expectedResult, char const *sql);
+extern char * PgShardPreparedTransactionName(ShardId shardId);
+extern bool PgShardFinishPreparedTransaction(PGconn *conn, char const *transactionName,
+											 bool commit);
 
 #endif
@@ -14,10 +14,12 @@
 
 #include "postgres.h"
 #include "c.h"
+#include "fmgr.h"
 
 #include "nodes/pg_list.h"
 #include "nodes/primnodes.h"
 #include "storage/lock.h"
+#include "utils/palloc.h"
 
 #include "pg_shard.h"
 
@@ -55,6 +57,7 @@
 #define APPEND_PARTITION_TYPE 'a'
 #define HASH_PARTITION_TYPE 'h'
 #define RANGE_PARTITION_TYPE 'r'
+#define REFERENCE_PARTITION_TYPE 'n'
 
 
 /* ShardState represents the last known state of a shard on a given node */
@@ -105,14 +108,28 @@ typedef struct ShardPlacement
 
 
 /*
- * ShardIntervalListCacheEntry contains the information for a cache entry in
- * shard interval list cache entry.
+ * DistributedTableCacheEntry holds the partition and shard metadata of a
+ * distributed table, along with what is needed to route partition column values
+ * to its shards. Entries are marked invalid when the table's relcache entry is
+ * invalidated, which changes to its shard and partition metadata trigger, and
+ * are rebuilt on their next lookup. Everything an entry points to is allocated
+ * in its memory context.
  */
-typedef struct ShardIntervalListCacheEntry
+typedef struct DistributedTableCacheEntry
 {
-	Oid distributedTableId; /* cache key */
-	List *shardIntervalList;
-} ShardIntervalListCacheEntry;
+	Oid relationId;                           /* cache key */
+	bool isValid;                             /* false once metadata changed */
+	MemoryContext cacheContext;               /* holds the fields below */
+	char partitionType;                       /* partition method of the table */
+	Var *partitionColumn;                     /* NULL for reference tables */
+	List *shardIntervalList;                  /* shard intervals in metadata order */
+	int shardIntervalCount;                   /* number of shard intervals */
+	ShardInterval **sortedShardIntervalArray; /* shard intervals by min value */
+	FmgrInfo *shardIntervalCompareFunction;   /* compares shard min and max values */
+	FmgrInfo *hashFunction;                   /* hashes partition values, if hashed */
+	bool hasUniformHashDistribution;          /* shards split hash space evenly */
+	bool hasDisjointShardIntervals;           /* no two shard intervals overlap */
+} DistributedTableCacheEntry;
 
 
 /*
@@ -128,6 +145,8 @@ typedef enum
 } ShardLockType;
 
 /* function declarations to access and manipulate the metadata */
+extern DistributedTableCacheEntry * LookupDistributedTableCacheEntry(
+	Oid distributedTableId);
 extern List * LookupShardIntervalList(Oid distributedTableId);
 extern List * LoadShardIntervalList(Oid distributedTableId);
 extern ShardInterval * LoadShardInterval(int64 shardId);
@@ -136,6 +155,7 @@ extern List * LoadShardPlacementList(int64 shardId);
 extern Var * PartitionColumn(Oid distributedTableId);
 extern char PartitionType(Oid distributedTableId);
 extern bool IsDistributedTable(Oid tableId);
+extern bool IsReferenceTable(Oid distributedTableId);
 extern bool DistributedTablesExist(void);
 extern Var * ColumnNameToColumn(Oid relationId, char *columnName);
 extern void InsertPartitionRow(Oid distributedTableId, char partitionType,
@@ -149,5 +169,7 @@ extern void UpdateShardPlacementRowState(int64 shardPlacementId, ShardState newS
 extern void LockShardData(int64 shardId, LOCKMODE lockMode);
 extern void LockShardDistributionMetadata(int64 shardId, LOCKMODE lockMode);
 extern void LockRelationDistributionMetadata(Oid relationId, LOCKMODE lockMode);
+extern void InvalidateDistributedTableCache(Oid distributedTableId);
+extern Datum invalidate_metadata_cache(PG_FUNCTION_ARGS);
 
 #endif /* PG_SHARD_DISTRIBUTION_METADATA_H */
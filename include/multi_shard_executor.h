@@ -0,0 +1,65 @@
+/*-------------------------------------------------------------------------
+ *
+ * include/multi_shard_executor.h
+ *
+ * Declarations for public functions and types related to running the tasks
+ * of a multi-shard SELECT concurrently.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_MULTI_SHARD_EXECUTOR_H
+#define PG_SHARD_MULTI_SHARD_EXECUTOR_H
+
+#include "c.h"
+#include "fmgr.h"
+
+#include "pg_shard.h"
+
+#include "access/tupdesc.h"
+#include "nodes/execnodes.h"
+#include "nodes/pg_list.h"
+#include "utils/tuplestore.h"
+
+
+/* default number of connections the executor opens to each worker node */
+#define DEFAULT_EXECUTOR_CONNECTIONS_PER_NODE 4
+
+/* name of the function that returns the rows of a multi-shard SELECT */
+#define INTERMEDIATE_RESULT_FUNCTION_NAME "pg_shard_intermediate_result"
+
+/* how long the executor waits for remote results before checking interrupts */
+#define EXECUTOR_POLL_TIMEOUT_MS 100
+
+
+/*
+ * IntermediateResult holds the rows a multi-shard SELECT fetched from its shards
+ * until the function scan of the local plan reads them. The executor passes it
+ * to pg_shard_intermediate_result through an executor parameter.
+ */
+typedef struct IntermediateResult
+{
+	TupleDesc tupleDescriptor;     /* shape of the fetched rows */
+	Tuplestorestate *tupleStore;   /* fetched rows, NULL once handed over */
+} IntermediateResult;
+
+
+/* config variable managed via guc.c */
+extern int ExecutorConnectionsPerNode;
+
+
+/* function declarations for executing multi-shard SELECT tasks */
+extern void ExecuteTasksConcurrently(DistributedPlan *distributedPlan,
+									 TupleDesc tupleDescriptor,
+									 Tuplestorestate *tupleStore);
+extern IntermediateResult * CreateIntermediateResult(EState *executorState,
+													 TupleDesc tupleDescriptor);
+extern Oid IntermediateResultFunctionId(void);
+
+/* function declarations for reading intermediate results from SQL */
+extern Datum pg_shard_intermediate_result(PG_FUNCTION_ARGS);
+
+
+#endif /* PG_SHARD_MULTI_SHARD_EXECUTOR_H */
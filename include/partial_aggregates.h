@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ *
+ * include/partial_aggregates.h
+ *
+ * Declarations for public functions related to pushing down partial
+ * aggregates of multi-shard SELECTs.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_PARTIAL_AGGREGATES_H
+#define PG_SHARD_PARTIAL_AGGREGATES_H
+
+#include "c.h"
+
+#include "nodes/parsenodes.h"
+#include "nodes/pg_list.h"
+
+
+/* function declarations for splitting aggregates across shards */
+extern bool BuildPartialAggregateQueries(Query *query, List *remoteRestrictList,
+										 List *localRestrictList, Query **remoteQuery,
+										 Query **localQuery);
+
+
+#endif /* PG_SHARD_PARTIAL_AGGREGATES_H */
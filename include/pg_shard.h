@@ -13,9 +13,13 @@
 #define PG_SHARD_H
 
 #include "c.h"
+#include "libpq-fe.h"
+
+#include "remote_results.h"
 
 #include "access/tupdesc.h"
 #include "catalog/indexing.h"
+#include "nodes/execnodes.h"
 #include "nodes/parsenodes.h"
 #include "nodes/pg_list.h"
 #include "nodes/plannodes.h"
@@ -30,9 +34,6 @@
 #define BUILT_AGAINST_CITUSDB false
 #endif
 
-/* prefix used for temporary tables created on the master node */
-#define TEMPORARY_TABLE_PREFIX "pg_shard_temp_table"
-
 /* extension name used to determine if extension has been created */
 #define PG_SHARD_EXTENSION_NAME "pg_shard"
 
@@ -45,6 +46,7 @@ typedef enum DistributedNodeTag
 {
 	/* Tags for distributed planning begin a safe distance after all other tags. */
 	T_DistributedPlan = 2100,       /* plan to be built and passed to executor */
+	T_DistributedExecState = 2101,  /* state of a single-shard select being run */
 } DistributedNodeTag;
 
 
@@ -73,10 +75,35 @@ typedef struct DistributedPlan
 	List *targetList;   /* copy of the target list for remote SELECT queries only */
 
 	bool selectFromMultipleShards; /* does the select run across multiple shards? */
-	CreateStmt *createTemporaryTableStmt; /* valid for multiple shard selects */
+	int intermediateResultParamId; /* passes fetched rows, multi-shard selects only */
+	bool modifyReferenceTable;     /* commit the modification on all placements? */
+
+	/* order in which rows of multi-shard selects are merged, as in MergeAppend */
+	int sortColumnCount;           /* number of sort-key columns */
+	AttrNumber *sortColumnIndexes; /* their indexes in the target list */
+	Oid *sortOperators;            /* OIDs of operators to sort them by */
+	Oid *sortCollations;           /* OIDs of collations */
+	bool *sortNullsFirst;          /* NULLS FIRST/LAST directions */
+	int64 rowLimit;                /* rows multi-shard selects need, or -1 for all */
 } DistributedPlan;
 
 
+/*
+ * DistributedExecState tracks a single-shard SELECT across calls to the executor,
+ * so that a cursor can fetch its rows in portions. The remote query is left
+ * running on its connection while it has rows left to fetch.
+ */
+typedef struct DistributedExecState
+{
+	PlanState planState;                  /* this is a "subclass" of PlanState */
+	RemoteResultState *remoteResultState; /* builds tuples and sends them on */
+	PGconn *connection;                   /* connection running the query, if any */
+	bool cachedConnection;                /* connection comes from the cache */
+	int placementIndex;                   /* placement the query runs or will run on */
+	bool finished;                        /* all rows were fetched */
+} DistributedExecState;
+
+
 #define INVALID_SHARD_ID (-1)
 typedef int64 ShardId;
 
@@ -15,7 +15,10 @@
 
 #include "c.h"
 
+#include "distribution_metadata.h"
+
 #include "access/attnum.h"
+#include "nodes/nodes.h"
 #include "nodes/pg_list.h"
 #include "nodes/primnodes.h"
 
@@ -41,6 +44,8 @@ typedef struct OperatorIdCacheEntry
 /* function declarations for shard pruning */
 extern List * PruneShardList(Oid relationId, List *whereClauseList,
 							 List *shardIntervalList);
+extern Node * FilterPartitionValueArrays(Oid relationId, Node *whereClause,
+										 ShardInterval *shardInterval);
 extern OpExpr * MakeOpExpression(Var *variable, int16 strategyNumber);
 extern Oid GetOperatorByType(Oid typeId, Oid accessMethodId, int16 strategyNumber);
 
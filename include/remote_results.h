@@ -0,0 +1,73 @@
+/*-------------------------------------------------------------------------
+ *
+ * include/remote_results.h
+ *
+ * Declarations for public functions and types related to turning the results
+ * of remote SELECT queries into tuples.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_REMOTE_RESULTS_H
+#define PG_SHARD_REMOTE_RESULTS_H
+
+#include "c.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "libpq-fe.h"
+
+#include "access/tupdesc.h"
+#include "executor/tuptable.h"
+#include "tcop/dest.h"
+#include "utils/palloc.h"
+#include "utils/tuplestore.h"
+
+
+/* result formats of PQsendQueryParams and COPY */
+#define TEXT_RESULT_FORMAT 0
+#define BINARY_RESULT_FORMAT 1
+
+
+/*
+ * RemoteResultState holds what is needed to build tuples of the given shape from
+ * the rows of remote results, in text or in binary format. Binary receive
+ * functions are only looked up if all columns have a format which is safe to
+ * exchange between nodes.
+ */
+typedef struct RemoteResultState
+{
+	TupleDesc tupleDescriptor;              /* shape of the built tuples */
+	AttInMetadata *attributeInputMetadata;  /* input functions of columns */
+	bool binaryFormatSafe;                  /* may results come in binary format? */
+	FmgrInfo *receiveFunctionArray;         /* receive functions of columns */
+	Oid *typeIOParamArray;                  /* type parameters of receive functions */
+	char **columnArray;                     /* text values of the current row */
+	Datum *valueArray;                      /* binary values of the current row */
+	bool *isNullArray;                      /* null flags of the current row */
+	MemoryContext ioContext;                /* reset after each tuple */
+	DestReceiver *destination;              /* receives tuples if not stored */
+	TupleTableSlot *tupleSlot;              /* slot to send tuples in */
+	int64 sentRowCount;                     /* number of tuples sent so far */
+	int64 sendRowLimit;                     /* stop when as many were sent, if set */
+} RemoteResultState;
+
+
+/* config variables managed via guc.c */
+extern bool UseBinaryResults;
+extern bool UseCopyFetch;
+
+
+/* function declarations for receiving remote results */
+extern RemoteResultState * CreateRemoteResultState(TupleDesc tupleDescriptor);
+extern void SetRemoteResultDestination(RemoteResultState *resultState,
+									   DestReceiver *destination, int64 rowCount);
+extern void FreeRemoteResultState(RemoteResultState *resultState);
+extern bool SendRemoteQuery(PGconn *connection, char *queryString,
+							RemoteResultState *resultState);
+extern bool ReadRemoteResults(PGconn *connection, RemoteResultState *resultState,
+							  Tuplestorestate *tupleStore, bool wait, bool *failed);
+
+
+#endif /* PG_SHARD_REMOTE_RESULTS_H */
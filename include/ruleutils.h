@@ -19,10 +19,24 @@
 
 #include "lib/stringinfo.h"
 #include "nodes/parsenodes.h"
+#include "nodes/pg_list.h"
+
+
+/*
+ * RelationShard gives the shard whose name a relation takes when deparsing a
+ * query that joins co-located shards of several relations.
+ */
+typedef struct RelationShard
+{
+	Oid relationId;     /* relation in the query */
+	int64 shardId;      /* shard of the relation to run the query on */
+} RelationShard;
 
 
 /* function declarations for extending and deparsing a query */
 extern void deparse_shard_query(Query *query, int64 shardid, StringInfo buffer);
+extern void deparse_shard_join_query(Query *query, List *relationShardList,
+									 StringInfo buffer);
 
 
 #endif /* PG_SHARD_RULEUTILS_H */
@@ -0,0 +1,74 @@
+/*-------------------------------------------------------------------------
+ *
+ * include/shard_router.h
+ *
+ * Declarations for public functions and types related to routing partition
+ * column values to the shards of a distributed table.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PG_SHARD_SHARD_ROUTER_H
+#define PG_SHARD_SHARD_ROUTER_H
+
+#include "c.h"
+#include "fmgr.h"
+
+#include "distribution_metadata.h"
+
+#include "nodes/pg_list.h"
+#include "nodes/primnodes.h"
+
+
+/* number of partition values callers route at once with ShardRouterRouteBatch */
+#define SHARD_ROUTER_BATCH_SIZE 64
+
+
+/*
+ * PartitionHashKind identifies built-in hash functions whose code the router
+ * runs directly instead of calling them through the function manager.
+ */
+typedef enum
+{
+	PARTITION_HASH_FMGR = 0,
+	PARTITION_HASH_INT4 = 1,
+	PARTITION_HASH_INT8 = 2,
+	PARTITION_HASH_TEXT = 3,
+	PARTITION_HASH_UUID = 4
+} PartitionHashKind;
+
+
+/*
+ * ShardRouter maps partition column values of a distributed table to positions
+ * in its shard interval array. Hash partitioned tables whose shards evenly split
+ * the hash space, as master_create_worker_shards creates them, are routed by
+ * arithmetic on the hash value; other tables by binary search over the shard
+ * intervals sorted by their minimum values.
+ */
+typedef struct ShardRouter
+{
+	char partitionType;                 /* partition method of the table */
+	int shardCount;                     /* number of shard intervals */
+	ShardInterval **shardIntervalArray; /* shard intervals in routing order */
+	PartitionHashKind hashKind;         /* how partition values are hashed */
+	FmgrInfo *hashFunction;             /* hash function for PARTITION_HASH_FMGR */
+	bool useBinarySearch;               /* shards do not split hash space evenly */
+	FmgrInfo *compareFunction;          /* compares values to shard boundaries */
+	uint64 hashTokenIncrement;          /* hash tokens per shard */
+	uint64 hashTokenReciprocal;         /* 2^32 / hashTokenIncrement, rounded down */
+} ShardRouter;
+
+
+/* function declarations for routing partition column values */
+extern ShardRouter * CreateShardRouter(DistributedTableCacheEntry *cacheEntry);
+extern int ShardRouterRoute(ShardRouter *router, Datum partitionValue);
+extern void ShardRouterRouteBatch(ShardRouter *router, Datum *partitionValues,
+								  int valueCount, int *shardIndexArray);
+extern int32 HashPartitionValue(FmgrInfo *hashFunction, Datum partitionValue);
+extern int CompareShardIntervalsByMinValue(const void *leftElement,
+										   const void *rightElement, void *comparator);
+
+
+#endif /* PG_SHARD_SHARD_ROUTER_H */
@@ -9,6 +9,12 @@ RETURNS text
 AS 'MODULE_PATHNAME'
 LANGUAGE C STABLE STRICT;
 
+-- needed in our metadata triggers
+CREATE FUNCTION invalidate_metadata_cache()
+RETURNS trigger
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
 DO $$
 DECLARE
 	use_citus_metadata boolean := false;
@@ -159,6 +165,17 @@ BEGIN
 				key text not null
 			)
 
+			-- invalidate cached metadata of tables whose shards or partition change
+			CREATE TRIGGER shard_invalidate_cache
+				AFTER INSERT OR UPDATE OR DELETE ON shard
+				FOR EACH ROW
+				EXECUTE PROCEDURE invalidate_metadata_cache()
+
+			CREATE TRIGGER partition_invalidate_cache
+				AFTER INSERT OR UPDATE OR DELETE ON partition
+				FOR EACH ROW
+				EXECUTE PROCEDURE invalidate_metadata_cache()
+
 			-- make a few more indexes for fast access
 			CREATE INDEX shard_relation_index ON shard (relation_id)
 			CREATE INDEX shard_placement_node_name_node_port_index
@@ -199,6 +216,11 @@ RETURNS void
 AS 'MODULE_PATHNAME'
 LANGUAGE C STRICT;
 
+CREATE FUNCTION master_create_reference_table(table_name text)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
 -- define the repair functions
 CREATE FUNCTION master_copy_shard_placement(shard_id bigint,
 											source_node_name text,
@@ -225,6 +247,12 @@ RETURNS text
 AS 'MODULE_PATHNAME'
 LANGUAGE C STABLE STRICT;
 
+-- define the function through which multi-shard SELECTs read fetched rows
+CREATE FUNCTION pg_shard_intermediate_result(internal)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
 COMMENT ON FUNCTION partition_column_to_node_string(oid)
 		IS 'return textual form of distributed table''s partition column';
 
@@ -0,0 +1,957 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/colocated_join.c
+ *
+ * This file contains functions to plan joins between co-located distributed
+ * tables. Tables are co-located if they are partitioned by the same method on
+ * columns of the same type and have shards with identical ranges; a join which
+ * equates their partition columns then only ever matches rows of shards at the
+ * same position in the tables' sorted shard lists, and runs on the workers as
+ * one join of such a group of shards per task.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "fmgr.h"
+
+#include "colocated_join.h"
+#include "distribution_metadata.h"
+#include "prune_shard_list.h"
+#include "ruleutils.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "catalog/pg_collation.h"
+#include "nodes/bitmapset.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/nodes.h"
+#include "nodes/parsenodes.h"
+#include "nodes/pg_list.h"
+#include "nodes/primnodes.h"
+#include "nodes/relation.h"
+#include "optimizer/clauses.h"
+#include "optimizer/prep.h"
+#include "optimizer/var.h"
+#include "parser/parsetree.h"
+#include "rewrite/rewriteManip.h"
+#include "utils/builtins.h"
+#include "utils/elog.h"
+#include "utils/errcodes.h"
+#include "utils/lsyscache.h"
+#include "utils/palloc.h"
+#include "utils/typcache.h"
+
+
+/*
+ * PartitionJoinContext holds what is needed to recognize the clauses of a query
+ * which equate the partition columns of two tables, and the groups of tables
+ * these clauses join together so far.
+ */
+typedef struct PartitionJoinContext
+{
+	Query *query;                       /* query whose join tree is checked */
+	AttrNumber *partitionColumnIdArray; /* partition column of each table, if any */
+	Oid equalityOperatorId;             /* equality operator of partition columns */
+	Index *joinGroupArray;              /* parent of each table in its join group */
+} PartitionJoinContext;
+
+
+/* local function forward declarations */
+static void JoinTablesOnPartitionColumns(Node *joinTreeNode,
+										 PartitionJoinContext *context);
+static bool OnlyReferenceTables(Relids tableIds, PartitionJoinContext *context);
+static bool PartitionColumnEquality(Node *clause, PartitionJoinContext *context,
+									Index *leftTableId, Index *rightTableId);
+static Var * ClauseColumn(Node *argument);
+static Index JoinGroup(PartitionJoinContext *context, Index tableId);
+static List * ClauseList(Node *quals);
+static Relids NullableTableIds(Node *joinTreeNode);
+static List * TableRestrictClauseList(List *restrictClauseList, Index tableId);
+static ShardInterval ** SortedShardIntervalArray(Oid relationId, int *shardCount);
+static int32 CompareShardValues(FmgrInfo *compareFunction, Datum leftValue,
+								Datum rightValue);
+static bool PlacementOnNode(List *placementList, ShardPlacement *placement);
+static Node * FlattenJoinAliasMutator(Node *node, List *rangeTableList);
+
+
+/*
+ * QueryHasJoin returns whether the given query reads from more than one
+ * relation, that is whether it joins relations.
+ */
+bool
+QueryHasJoin(Query *query)
+{
+	ListCell *rangeTableCell = NULL;
+	int relationCount = 0;
+
+	foreach(rangeTableCell, query->rtable)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		if (rangeTableEntry->rtekind == RTE_RELATION)
+		{
+			relationCount++;
+		}
+	}
+
+	return (relationCount > 1);
+}
+
+
+/*
+ * ErrorIfJoinNotSupported errors out if the given select joins tables which
+ * aren't distributed or co-located with each other, or if its clauses don't
+ * equate the partition columns of all joined tables. Outer joins need such an
+ * equality between their two sides in their own join clause, as rows of one
+ * side are kept even where the other side has no matching rows. Reference
+ * tables are exempt from these checks, since every node holds all their rows;
+ * they may only not keep their rows in outer joins with distributed tables.
+ */
+void
+ErrorIfJoinNotSupported(Query *query)
+{
+	List *rangeTableList = query->rtable;
+	int rangeTableCount = list_length(rangeTableList);
+	ListCell *rangeTableCell = NULL;
+	Index tableId = 0;
+	Index firstTableId = 0;
+	Oid firstRelationId = InvalidOid;
+	PartitionJoinContext context;
+
+	Assert(query->commandType == CMD_SELECT);
+
+	memset(&context, 0, sizeof(PartitionJoinContext));
+	context.query = query;
+	context.partitionColumnIdArray = palloc0((rangeTableCount + 1) * sizeof(AttrNumber));
+	context.joinGroupArray = palloc0((rangeTableCount + 1) * sizeof(Index));
+
+	foreach(rangeTableCell, rangeTableList)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		Oid relationId = rangeTableEntry->relid;
+		Var *partitionColumn = NULL;
+
+		tableId++;
+		if (rangeTableEntry->rtekind != RTE_RELATION)
+		{
+			continue;
+		}
+
+		if (!IsDistributedTable(relationId))
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot perform distributed planning for the given"
+								   " query"),
+							errdetail("Joins with local tables are not supported in "
+									  "distributed queries.")));
+		}
+
+		/* reference tables are on all nodes, and join with any table there */
+		if (IsReferenceTable(relationId))
+		{
+			continue;
+		}
+
+		partitionColumn = PartitionColumn(relationId);
+
+		if (firstTableId == 0)
+		{
+			TypeCacheEntry *typeEntry = lookup_type_cache(partitionColumn->vartype,
+														  TYPECACHE_EQ_OPR);
+
+			firstTableId = tableId;
+			firstRelationId = relationId;
+			context.equalityOperatorId = typeEntry->eq_opr;
+		}
+		else if (!TablesColocated(firstRelationId, relationId))
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot perform distributed planning for the given"
+								   " query"),
+							errdetail("Tables \"%s\" and \"%s\" are not co-located.",
+									  get_rel_name(firstRelationId),
+									  get_rel_name(relationId)),
+							errhint("Only tables partitioned by the same method on "
+									"columns of the same type and having shards with "
+									"identical ranges can be joined.")));
+		}
+
+		context.partitionColumnIdArray[tableId] = partitionColumn->varattno;
+		context.joinGroupArray[tableId] = tableId;
+	}
+
+	JoinTablesOnPartitionColumns((Node *) query->jointree, &context);
+
+	/* all tables must have ended up in the group of the first one */
+	for (tableId = 1; tableId <= (Index) rangeTableCount; tableId++)
+	{
+		if (context.joinGroupArray[tableId] == 0)
+		{
+			continue;
+		}
+
+		if (JoinGroup(&context, tableId) != JoinGroup(&context, firstTableId))
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot perform distributed planning for the given"
+								   " query"),
+							errdetail("Joins must equate the partition columns of all "
+									  "joined tables.")));
+		}
+	}
+}
+
+
+/*
+ * JoinTablesOnPartitionColumns walks over the given join tree and merges the
+ * join groups of any two tables whose partition columns a clause of the tree
+ * equates. The function errors out for outer joins without such a clause
+ * between their sides, unless only reference tables are on their nullable side.
+ */
+static void
+JoinTablesOnPartitionColumns(Node *joinTreeNode, PartitionJoinContext *context)
+{
+	List *clauseList = NIL;
+	ListCell *clauseCell = NULL;
+	Relids leftTableIds = NULL;
+	Relids rightTableIds = NULL;
+	Relids nullableTableIds = NULL;
+	bool checkOuterJoin = false;
+	bool joinsSides = false;
+
+	if (joinTreeNode == NULL || IsA(joinTreeNode, RangeTblRef))
+	{
+		return;
+	}
+
+	if (IsA(joinTreeNode, FromExpr))
+	{
+		FromExpr *fromExpr = (FromExpr *) joinTreeNode;
+		ListCell *fromCell = NULL;
+
+		foreach(fromCell, fromExpr->fromlist)
+		{
+			JoinTablesOnPartitionColumns((Node *) lfirst(fromCell), context);
+		}
+
+		clauseList = ClauseList(fromExpr->quals);
+	}
+	else if (IsA(joinTreeNode, JoinExpr))
+	{
+		JoinExpr *joinExpr = (JoinExpr *) joinTreeNode;
+
+		JoinTablesOnPartitionColumns(joinExpr->larg, context);
+		JoinTablesOnPartitionColumns(joinExpr->rarg, context);
+
+		clauseList = ClauseList(joinExpr->quals);
+
+		if (joinExpr->jointype != JOIN_INNER)
+		{
+			JoinType joinType = joinExpr->jointype;
+
+			leftTableIds = get_relids_in_jointree(joinExpr->larg, false);
+			rightTableIds = get_relids_in_jointree(joinExpr->rarg, false);
+			checkOuterJoin = true;
+
+			if (joinType == JOIN_RIGHT || joinType == JOIN_FULL)
+			{
+				nullableTableIds = bms_add_members(nullableTableIds, leftTableIds);
+			}
+
+			if (joinType == JOIN_LEFT || joinType == JOIN_ANTI || joinType == JOIN_FULL)
+			{
+				nullableTableIds = bms_add_members(nullableTableIds, rightTableIds);
+			}
+		}
+	}
+	else
+	{
+		ereport(ERROR, (errmsg("unrecognized node type: %d",
+							   (int) nodeTag(joinTreeNode))));
+	}
+
+	foreach(clauseCell, clauseList)
+	{
+		Node *clause = (Node *) lfirst(clauseCell);
+		Index leftTableId = 0;
+		Index rightTableId = 0;
+
+		if (!PartitionColumnEquality(clause, context, &leftTableId, &rightTableId))
+		{
+			continue;
+		}
+
+		context->joinGroupArray[JoinGroup(context, leftTableId)] =
+			JoinGroup(context, rightTableId);
+
+		if ((bms_is_member(leftTableId, leftTableIds) &&
+			 bms_is_member(rightTableId, rightTableIds)) ||
+			(bms_is_member(leftTableId, rightTableIds) &&
+			 bms_is_member(rightTableId, leftTableIds)))
+		{
+			joinsSides = true;
+		}
+	}
+
+	if (checkOuterJoin && !joinsSides &&
+		!OnlyReferenceTables(nullableTableIds, context))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot perform distributed planning for the given"
+							   " query"),
+						errdetail("Outer joins must equate the partition columns of "
+								  "the joined tables in their join clause.")));
+	}
+}
+
+
+/*
+ * OnlyReferenceTables returns whether all the tables with the given range table
+ * indexes are reference tables, which are the only tables in the join without
+ * a partition column.
+ */
+static bool
+OnlyReferenceTables(Relids tableIds, PartitionJoinContext *context)
+{
+	Relids remainingTableIds = bms_copy(tableIds);
+	int tableId = -1;
+
+	while ((tableId = bms_first_member(remainingTableIds)) >= 0)
+	{
+		if (context->partitionColumnIdArray[tableId] != InvalidAttrNumber)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * PartitionColumnEquality returns whether the given clause equates the partition
+ * columns of two different tables, and if so stores the tables' range table
+ * indexes in leftTableId and rightTableId.
+ */
+static bool
+PartitionColumnEquality(Node *clause, PartitionJoinContext *context,
+						Index *leftTableId, Index *rightTableId)
+{
+	OpExpr *operatorExpression = NULL;
+	Var *leftColumn = NULL;
+	Var *rightColumn = NULL;
+
+	if (!IsA(clause, OpExpr) || list_length(((OpExpr *) clause)->args) != 2)
+	{
+		return false;
+	}
+
+	operatorExpression = (OpExpr *) clause;
+	if (operatorExpression->opno != context->equalityOperatorId)
+	{
+		return false;
+	}
+
+	leftColumn = ClauseColumn((Node *) linitial(operatorExpression->args));
+	rightColumn = ClauseColumn((Node *) lsecond(operatorExpression->args));
+	if (leftColumn == NULL || rightColumn == NULL ||
+		leftColumn->varno == rightColumn->varno)
+	{
+		return false;
+	}
+
+	if (context->partitionColumnIdArray[leftColumn->varno] != leftColumn->varattno ||
+		context->partitionColumnIdArray[rightColumn->varno] != rightColumn->varattno)
+	{
+		return false;
+	}
+
+	*leftTableId = leftColumn->varno;
+	*rightTableId = rightColumn->varno;
+
+	return true;
+}
+
+
+/*
+ * ClauseColumn returns the given operator argument if it is a column of a table
+ * in the query, looking through binary compatible casts, and NULL otherwise.
+ */
+static Var *
+ClauseColumn(Node *argument)
+{
+	Var *column = NULL;
+
+	if (IsA(argument, RelabelType))
+	{
+		argument = (Node *) ((RelabelType *) argument)->arg;
+	}
+
+	if (!IsA(argument, Var))
+	{
+		return NULL;
+	}
+
+	column = (Var *) argument;
+	if (column->varlevelsup != 0 || column->varattno <= 0)
+	{
+		return NULL;
+	}
+
+	return column;
+}
+
+
+/*
+ * JoinGroup returns the table representing the join group of the given table,
+ * shortening the path to it along the way.
+ */
+static Index
+JoinGroup(PartitionJoinContext *context, Index tableId)
+{
+	Index *joinGroupArray = context->joinGroupArray;
+
+	while (joinGroupArray[tableId] != tableId)
+	{
+		joinGroupArray[tableId] = joinGroupArray[joinGroupArray[tableId]];
+		tableId = joinGroupArray[tableId];
+	}
+
+	return tableId;
+}
+
+
+/*
+ * ClauseList returns the clauses of the given qualifier, which the planner may
+ * already have turned into an implicitly and'd list.
+ */
+static List *
+ClauseList(Node *quals)
+{
+	if (quals == NULL)
+	{
+		return NIL;
+	}
+	else if (IsA(quals, List))
+	{
+		return (List *) quals;
+	}
+
+	return make_ands_implicit((Expr *) quals);
+}
+
+
+/*
+ * TablesColocated returns whether the given distributed tables are partitioned
+ * by the same method on columns of the same type and have shards with identical
+ * ranges. The shards at the same position of the tables' sorted shard lists then
+ * hold rows with the same partition values.
+ */
+bool
+TablesColocated(Oid leftRelationId, Oid rightRelationId)
+{
+	Var *leftPartitionColumn = NULL;
+	Var *rightPartitionColumn = NULL;
+	ShardInterval **leftShardArray = NULL;
+	ShardInterval **rightShardArray = NULL;
+	int leftShardCount = 0;
+	int rightShardCount = 0;
+	DistributedTableCacheEntry *leftCacheEntry = NULL;
+	FmgrInfo *compareFunction = NULL;
+	int shardIndex = 0;
+
+	if (leftRelationId == rightRelationId)
+	{
+		return true;
+	}
+
+	if (PartitionType(leftRelationId) != PartitionType(rightRelationId))
+	{
+		return false;
+	}
+
+	leftPartitionColumn = PartitionColumn(leftRelationId);
+	rightPartitionColumn = PartitionColumn(rightRelationId);
+	if (leftPartitionColumn->vartype != rightPartitionColumn->vartype ||
+		leftPartitionColumn->varcollid != rightPartitionColumn->varcollid)
+	{
+		return false;
+	}
+
+	leftShardArray = SortedShardIntervalArray(leftRelationId, &leftShardCount);
+	rightShardArray = SortedShardIntervalArray(rightRelationId, &rightShardCount);
+	if (leftShardCount != rightShardCount)
+	{
+		return false;
+	}
+
+	if (leftShardCount == 0)
+	{
+		return true;
+	}
+
+	leftCacheEntry = LookupDistributedTableCacheEntry(leftRelationId);
+	compareFunction = leftCacheEntry->shardIntervalCompareFunction;
+
+	for (shardIndex = 0; shardIndex < leftShardCount; shardIndex++)
+	{
+		ShardInterval *leftShardInterval = leftShardArray[shardIndex];
+		ShardInterval *rightShardInterval = rightShardArray[shardIndex];
+
+		if (CompareShardValues(compareFunction, leftShardInterval->minValue,
+							   rightShardInterval->minValue) != 0 ||
+			CompareShardValues(compareFunction, leftShardInterval->maxValue,
+							   rightShardInterval->maxValue) != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * PruneColocatedShardList prunes the shards of a join between co-located tables
+ * based on the given restriction clauses, and returns the remaining shards of
+ * the first table in the join which isn't a reference table. The shards at a
+ * position in the sorted shard lists are pruned if the clauses on any one table
+ * rule out its shard there.
+ * Tables on the nullable side of an outer join are left out, since the join
+ * yields rows for their shards' positions even where they have no rows, and so
+ * are reference tables, whose single shard joins with the shards at all of the
+ * positions. If only reference tables are joined, the shard of the first one
+ * is returned.
+ */
+List *
+PruneColocatedShardList(Query *query, List *restrictClauseList)
+{
+	Relids nullableTableIds = NullableTableIds((Node *) query->jointree);
+	ShardInterval **firstShardArray = NULL;
+	bool *shardPrunedArray = NULL;
+	int shardCount = 0;
+	int shardIndex = 0;
+	List *remainingShardList = NIL;
+	ListCell *rangeTableCell = NULL;
+	Index tableId = 0;
+
+	foreach(rangeTableCell, query->rtable)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		Oid relationId = rangeTableEntry->relid;
+		ShardInterval **shardIntervalArray = NULL;
+		int tableShardCount = 0;
+		List *shardIntervalList = NIL;
+		List *tableClauseList = NIL;
+		List *tableShardList = NIL;
+
+		tableId++;
+		if (rangeTableEntry->rtekind != RTE_RELATION || IsReferenceTable(relationId))
+		{
+			continue;
+		}
+
+		shardIntervalArray = SortedShardIntervalArray(relationId, &tableShardCount);
+		if (firstShardArray == NULL)
+		{
+			firstShardArray = shardIntervalArray;
+			shardCount = tableShardCount;
+			shardPrunedArray = palloc0((shardCount + 1) * sizeof(bool));
+		}
+
+		Assert(tableShardCount == shardCount);
+
+		if (bms_is_member(tableId, nullableTableIds))
+		{
+			continue;
+		}
+
+		tableClauseList = TableRestrictClauseList(restrictClauseList, tableId);
+		if (tableClauseList == NIL)
+		{
+			continue;
+		}
+
+		/* the cached list holds the same shard intervals as the sorted array */
+		shardIntervalList = LookupShardIntervalList(relationId);
+		tableShardList = PruneShardList(relationId, tableClauseList, shardIntervalList);
+
+		for (shardIndex = 0; shardIndex < tableShardCount; shardIndex++)
+		{
+			if (!list_member_ptr(tableShardList, shardIntervalArray[shardIndex]))
+			{
+				shardPrunedArray[shardIndex] = true;
+			}
+		}
+	}
+
+	if (firstShardArray == NULL)
+	{
+		RangeTblEntry *firstTableEntry = NULL;
+
+		foreach(rangeTableCell, query->rtable)
+		{
+			firstTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+			if (firstTableEntry->rtekind == RTE_RELATION)
+			{
+				break;
+			}
+		}
+
+		return LookupShardIntervalList(firstTableEntry->relid);
+	}
+
+	for (shardIndex = 0; shardIndex < shardCount; shardIndex++)
+	{
+		if (!shardPrunedArray[shardIndex])
+		{
+			remainingShardList = lappend(remainingShardList, firstShardArray[shardIndex]);
+		}
+	}
+
+	return remainingShardList;
+}
+
+
+/*
+ * NullableTableIds returns the range table indexes of tables which are on the
+ * nullable side of an outer join in the given join tree. The planner may have
+ * turned left joins into anti joins, whose right side is nullable as well.
+ */
+static Relids
+NullableTableIds(Node *joinTreeNode)
+{
+	Relids nullableTableIds = NULL;
+
+	if (joinTreeNode == NULL || IsA(joinTreeNode, RangeTblRef))
+	{
+		return NULL;
+	}
+
+	if (IsA(joinTreeNode, FromExpr))
+	{
+		FromExpr *fromExpr = (FromExpr *) joinTreeNode;
+		ListCell *fromCell = NULL;
+
+		foreach(fromCell, fromExpr->fromlist)
+		{
+			Relids childTableIds = NullableTableIds((Node *) lfirst(fromCell));
+			nullableTableIds = bms_add_members(nullableTableIds, childTableIds);
+		}
+	}
+	else if (IsA(joinTreeNode, JoinExpr))
+	{
+		JoinExpr *joinExpr = (JoinExpr *) joinTreeNode;
+		JoinType joinType = joinExpr->jointype;
+
+		nullableTableIds = bms_union(NullableTableIds(joinExpr->larg),
+									 NullableTableIds(joinExpr->rarg));
+
+		if (joinType == JOIN_RIGHT || joinType == JOIN_FULL)
+		{
+			Relids leftTableIds = get_relids_in_jointree(joinExpr->larg, false);
+			nullableTableIds = bms_add_members(nullableTableIds, leftTableIds);
+		}
+
+		if (joinType == JOIN_LEFT || joinType == JOIN_ANTI || joinType == JOIN_FULL)
+		{
+			Relids rightTableIds = get_relids_in_jointree(joinExpr->rarg, false);
+			nullableTableIds = bms_add_members(nullableTableIds, rightTableIds);
+		}
+	}
+
+	return nullableTableIds;
+}
+
+
+/*
+ * TableRestrictClauseList returns the restriction clauses which only refer to
+ * the table with the given range table index. Their columns are changed to
+ * refer to the first range table entry instead, like the partition columns
+ * shard pruning compares them with.
+ */
+static List *
+TableRestrictClauseList(List *restrictClauseList, Index tableId)
+{
+	List *tableClauseList = NIL;
+	ListCell *clauseCell = NULL;
+
+	foreach(clauseCell, restrictClauseList)
+	{
+		Node *clause = (Node *) lfirst(clauseCell);
+		Relids clauseTableIds = pull_varnos(clause);
+		Node *tableClause = NULL;
+
+		if (bms_membership(clauseTableIds) != BMS_SINGLETON ||
+			!bms_is_member(tableId, clauseTableIds))
+		{
+			continue;
+		}
+
+		tableClause = copyObject(clause);
+		ChangeVarNodes(tableClause, tableId, 1, 0);
+
+		tableClauseList = lappend(tableClauseList, tableClause);
+	}
+
+	return tableClauseList;
+}
+
+
+/*
+ * ColocatedRelationShardList returns for each relation in the given join the
+ * shard at the same position in its sorted shard list as the given shard of the
+ * join's first relation, in the form deparse_shard_join_query expects. Reference
+ * tables contribute their single shard.
+ */
+List *
+ColocatedRelationShardList(Query *query, ShardInterval *shardInterval)
+{
+	List *relationShardList = NIL;
+	ShardInterval **firstShardArray = NULL;
+	int shardCount = 0;
+	int shardIndex = 0;
+	ListCell *rangeTableCell = NULL;
+
+	firstShardArray = SortedShardIntervalArray(shardInterval->relationId, &shardCount);
+	while (shardIndex < shardCount &&
+		   firstShardArray[shardIndex]->id != shardInterval->id)
+	{
+		shardIndex++;
+	}
+
+	if (shardIndex == shardCount)
+	{
+		ereport(ERROR, (errmsg("could not find shard " INT64_FORMAT " of relation "
+							   "\"%s\"", shardInterval->id,
+							   get_rel_name(shardInterval->relationId))));
+	}
+
+	foreach(rangeTableCell, query->rtable)
+	{
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+		Oid relationId = rangeTableEntry->relid;
+		ShardInterval **shardIntervalArray = NULL;
+		int tableShardCount = 0;
+		RelationShard *relationShard = NULL;
+		ListCell *relationShardCell = NULL;
+		bool relationListed = false;
+
+		if (rangeTableEntry->rtekind != RTE_RELATION)
+		{
+			continue;
+		}
+
+		/* a relation joined with itself reads the same shard on both sides */
+		foreach(relationShardCell, relationShardList)
+		{
+			RelationShard *listedShard = (RelationShard *) lfirst(relationShardCell);
+			if (listedShard->relationId == relationId)
+			{
+				relationListed = true;
+				break;
+			}
+		}
+
+		if (relationListed)
+		{
+			continue;
+		}
+
+		shardIntervalArray = SortedShardIntervalArray(relationId, &tableShardCount);
+
+		relationShard = palloc0(sizeof(RelationShard));
+		relationShard->relationId = relationId;
+
+		if (IsReferenceTable(relationId))
+		{
+			Assert(tableShardCount == 1);
+			relationShard->shardId = shardIntervalArray[0]->id;
+		}
+		else
+		{
+			Assert(tableShardCount == shardCount);
+			relationShard->shardId = shardIntervalArray[shardIndex]->id;
+		}
+
+		relationShardList = lappend(relationShardList, relationShard);
+	}
+
+	return relationShardList;
+}
+
+
+/*
+ * ColocatedPlacementList returns the finalized placements of the first shard in
+ * the given list which are on nodes holding finalized placements of all other
+ * shards in the list as well, so that the shards can be joined there. If there
+ * is no such node, the function errors out.
+ */
+List *
+ColocatedPlacementList(List *relationShardList)
+{
+	RelationShard *firstRelationShard = (RelationShard *) linitial(relationShardList);
+	List *firstPlacementList = LoadFinalizedShardPlacementList(
+		firstRelationShard->shardId);
+	List *otherPlacementLists = NIL;
+	List *colocatedPlacementList = NIL;
+	ListCell *relationShardCell = NULL;
+	ListCell *placementCell = NULL;
+
+	for_each_cell(relationShardCell, lnext(list_head(relationShardList)))
+	{
+		RelationShard *relationShard = (RelationShard *) lfirst(relationShardCell);
+		List *placementList = LoadFinalizedShardPlacementList(relationShard->shardId);
+
+		otherPlacementLists = lappend(otherPlacementLists, placementList);
+	}
+
+	foreach(placementCell, firstPlacementList)
+	{
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		ListCell *placementListCell = NULL;
+		bool placedWithAllShards = true;
+
+		foreach(placementListCell, otherPlacementLists)
+		{
+			List *placementList = (List *) lfirst(placementListCell);
+			if (!PlacementOnNode(placementList, placement))
+			{
+				placedWithAllShards = false;
+				break;
+			}
+		}
+
+		if (placedWithAllShards)
+		{
+			colocatedPlacementList = lappend(colocatedPlacementList, placement);
+		}
+	}
+
+	if (colocatedPlacementList == NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("could not find a node holding all shards joined with "
+							   "shard " INT64_FORMAT, firstRelationShard->shardId),
+						errhint("Use master_copy_shard_placement to place the joined "
+								"shards on a common node and try again.")));
+	}
+
+	return colocatedPlacementList;
+}
+
+
+/*
+ * PlacementOnNode returns whether the given placement list has a placement on
+ * the node of the given placement.
+ */
+static bool
+PlacementOnNode(List *placementList, ShardPlacement *placement)
+{
+	ListCell *placementCell = NULL;
+
+	foreach(placementCell, placementList)
+	{
+		ShardPlacement *listedPlacement = (ShardPlacement *) lfirst(placementCell);
+
+		if (listedPlacement->nodePort == placement->nodePort &&
+			strcmp(listedPlacement->nodeName, placement->nodeName) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * SortedShardIntervalArray returns the shard intervals of the given distributed
+ * table in an array sorted by their min values, and their number in shardCount.
+ * The array is the one kept in the table's cache entry and must not be changed.
+ */
+static ShardInterval **
+SortedShardIntervalArray(Oid relationId, int *shardCount)
+{
+	DistributedTableCacheEntry *cacheEntry = LookupDistributedTableCacheEntry(relationId);
+
+	Assert(cacheEntry != NULL);
+
+	*shardCount = cacheEntry->shardIntervalCount;
+
+	return cacheEntry->sortedShardIntervalArray;
+}
+
+
+/* CompareShardValues compares two shard min or max values */
+static int32
+CompareShardValues(FmgrInfo *compareFunction, Datum leftValue, Datum rightValue)
+{
+	Datum comparisonResult = FunctionCall2Coll(compareFunction, DEFAULT_COLLATION_OID,
+											   leftValue, rightValue);
+
+	return DatumGetInt32(comparisonResult);
+}
+
+
+/*
+ * FlattenJoinAliasColumns returns a copy of the given query in which columns of
+ * joins are replaced by the expressions over the joined tables' columns they
+ * stand for, so that the query only refers to columns of tables.
+ */
+Query *
+FlattenJoinAliasColumns(Query *query)
+{
+	return query_tree_mutator(query, FlattenJoinAliasMutator, query->rtable,
+							  QTW_IGNORE_JOINALIASES);
+}
+
+
+/* FlattenJoinAliasMutator replaces columns of joins in the given expression */
+static Node *
+FlattenJoinAliasMutator(Node *node, List *rangeTableList)
+{
+	if (node == NULL)
+	{
+		return NULL;
+	}
+
+	if (IsA(node, Var))
+	{
+		Var *column = (Var *) node;
+		RangeTblEntry *rangeTableEntry = NULL;
+		Node *aliasExpression = NULL;
+
+		if (column->varlevelsup != 0)
+		{
+			return (Node *) copyObject(column);
+		}
+
+		rangeTableEntry = rt_fetch(column->varno, rangeTableList);
+		if (rangeTableEntry->rtekind != RTE_JOIN)
+		{
+			return (Node *) copyObject(column);
+		}
+
+		if (column->varattno <= 0)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot perform distributed planning for the given"
+								   " query"),
+							errdetail("Whole-row references to joins are not supported "
+									  "in distributed queries.")));
+		}
+
+		aliasExpression = (Node *) list_nth(rangeTableEntry->joinaliasvars,
+											column->varattno - 1);
+
+		return FlattenJoinAliasMutator(aliasExpression, rangeTableList);
+	}
+
+	return expression_tree_mutator(node, FlattenJoinAliasMutator,
+								   (void *) rangeTableList);
+}
@@ -61,6 +61,7 @@ static Oid SupportFunctionForColumn(Var *partitionColumn, Oid accessMethodId,
 /* declarations for dynamic loading */
 PG_FUNCTION_INFO_V1(master_create_distributed_table);
 PG_FUNCTION_INFO_V1(master_create_worker_shards);
+PG_FUNCTION_INFO_V1(master_create_reference_table);
 
 
 /*
@@ -331,6 +332,119 @@ master_create_worker_shards(PG_FUNCTION_ARGS)
 }
 
 
+/*
+ * master_create_reference_table distributes the given table as a reference
+ * table, which has no partition column and is replicated in full to every node
+ * in the worker list. The function inserts the table's partition metadata and
+ * then creates a single shard covering the whole hash space, with a placement
+ * on each worker node. Nodes on which the shard cannot be created are skipped
+ * with a warning; master_copy_shard_placement can place the shard there later.
+ */
+Datum
+master_create_reference_table(PG_FUNCTION_ARGS)
+{
+	text *tableNameText = PG_GETARG_TEXT_P(0);
+	Oid distributedTableId = ResolveRelationId(tableNameText);
+	char relationKind = get_rel_relkind(distributedTableId);
+	char *tableName = text_to_cstring(tableNameText);
+	char shardStorageType = '\0';
+	List *workerNodeList = NIL;
+	List *ddlCommandList = NIL;
+	List *extendedDDLCommands = NIL;
+	ListCell *workerNodeCell = NULL;
+	int64 shardId = -1;
+	int32 placementCount = 0;
+
+	/* CitusDB's metadata has no partition method for reference tables */
+	if (BUILT_AGAINST_CITUSDB)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("reference tables are not supported with CitusDB")));
+	}
+
+	/* verify target relation is either regular or foreign table */
+	if (relationKind != RELKIND_RELATION && relationKind != RELKIND_FOREIGN_TABLE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+						errmsg("cannot distribute relation: %s", tableName),
+						errdetail("Distributed relations must be regular or "
+								  "foreign tables.")));
+	}
+
+	/* reference tables have no partition column, so their key is left empty */
+	InsertPartitionRow(distributedTableId, REFERENCE_PARTITION_TYPE,
+					   cstring_to_text(""));
+
+	/* we plan to add the shard: get an exclusive metadata lock */
+	LockRelationDistributionMetadata(distributedTableId, ExclusiveLock);
+
+	/* load and sort the worker node list for deterministic placement */
+	workerNodeList = ParseWorkerNodeFile(WORKER_LIST_FILENAME);
+	workerNodeList = SortList(workerNodeList, CompareWorkerNodes);
+
+	/* make sure we don't process cancel signals until the shard is created */
+	HOLD_INTERRUPTS();
+
+	/* retrieve the DDL commands for the table */
+	ddlCommandList = TableDDLCommandList(distributedTableId);
+
+	/* set shard storage type according to relation type */
+	if (relationKind == RELKIND_FOREIGN_TABLE)
+	{
+		shardStorageType = SHARD_STORAGE_FOREIGN;
+	}
+	else
+	{
+		shardStorageType = SHARD_STORAGE_TABLE;
+	}
+
+	/* the shard covers the whole hash space, so pruning never removes it */
+	shardId = CreateShardRow(distributedTableId, shardStorageType,
+							 IntegerToText(INT32_MIN), IntegerToText(INT32_MAX));
+
+	extendedDDLCommands = ExtendedDDLCommandList(distributedTableId, shardId,
+												 ddlCommandList);
+
+	LockShardDistributionMetadata(shardId, ExclusiveLock);
+
+	foreach(workerNodeCell, workerNodeList)
+	{
+		WorkerNode *workerNode = (WorkerNode *) lfirst(workerNodeCell);
+		char *nodeName = workerNode->nodeName;
+		uint32 nodePort = workerNode->nodePort;
+
+		bool created = ExecuteRemoteCommandList(nodeName, nodePort,
+												extendedDDLCommands);
+		if (created)
+		{
+			CreateShardPlacementRow(shardId, STATE_FINALIZED, nodeName, nodePort);
+			placementCount++;
+		}
+		else
+		{
+			ereport(WARNING, (errmsg("could not create shard on \"%s:%u\"",
+									 nodeName, nodePort)));
+		}
+	}
+
+	if (placementCount == 0)
+	{
+		ereport(ERROR, (errmsg("could not create any placements of reference "
+							   "table \"%s\"", tableName)));
+	}
+
+	if (QueryCancelPending)
+	{
+		ereport(WARNING, (errmsg("cancel requests are ignored during shard creation")));
+		QueryCancelPending = false;
+	}
+
+	RESUME_INTERRUPTS();
+
+	PG_RETURN_VOID();
+}
+
+
 /* Finds the relationId from a potentially qualified relation name. */
 Oid
 ResolveRelationId(text *relationName)
@@ -24,10 +24,15 @@
 #include "create_shards.h"
 #include "distribution_metadata.h"
 #include "prune_shard_list.h"
+#include "shard_router.h"
 #include "ruleutils.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "access/heapam.h"
 #include "access/htup_details.h"
@@ -48,6 +53,8 @@
 #include "executor/instrument.h"
 #include "executor/tuptable.h"
 #include "lib/stringinfo.h"
+#include "libpq/libpq.h"
+#include "libpq/pqformat.h"
 #include "nodes/execnodes.h"
 #include "nodes/makefuncs.h"
 #include "nodes/memnodes.h" /* IWYU pragma: keep */
@@ -72,6 +79,7 @@
 #include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "tsearch/ts_locale.h"
+#include "utils/acl.h"
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/errcodes.h"
@@ -84,6 +92,16 @@
 #include "utils/snapmgr.h"
 #include "utils/tuplestore.h"
 #include "utils/memutils.h"
+#include "mb/pg_wchar.h"
+#include "storage/buffile.h"
+#include "storage/fd.h"
+#include "storage/lmgr.h"
+#if PG_VERSION_NUM >= 90500
+#include "libpq/pqsignal.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "utils/resowner.h"
+#endif
 
 /*
  * TODO: this fragment was copied from src/backend/commands/copy.c
@@ -227,6 +245,97 @@ CopyGetLineBuf(CopyStateData *cs)
 
 #define INITIAL_CONNECTION_CACHE_SIZE 1001
 
+/* binary COPY header: signature, flags field and header extension length */
+static const char BinarySignature[11] = "PGCOPY\n\377\r\n\0";
+static const char BinaryHeaderTail[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+/* binary COPY trailer: a field count of -1 */
+static const char BinaryTrailer[2] = { '\377', '\377' };
+
+
+/*
+ * PartitionField describes where the partition column is found in the fields
+ * of an input row and how to convert it to a Datum.
+ */
+typedef struct PartitionField
+{
+	int fieldIndex;         /* position of the column in the COPY field list */
+	char *columnName;       /* column name used in error context */
+	FmgrInfo receiveFunction;
+	Oid typeIOParam;
+	int32 typeMod;
+} PartitionField;
+
+
+/*
+ * CopyInputRange is a byte range of a COPY input file. A range contains all
+ * lines that start at or after startOffset and before endOffset.
+ */
+typedef struct CopyInputRange
+{
+	off_t startOffset;
+	off_t endOffset;
+} CopyInputRange;
+
+
+/*
+ * PreparedPlacement identifies a transaction that was prepared on a placement
+ * and must still be committed or rolled back, possibly by another backend.
+ */
+typedef struct PreparedPlacement
+{
+	char nodeName[MAX_NODE_LENGTH + 1];
+	int32 nodePort;
+	char transactionName[NAMEDATALEN];
+} PreparedPlacement;
+
+
+/*
+ * RemoteTransaction is a remote transaction of a COPY, on a placement's own
+ * connection or on a shared node connection, to which a command was sent and
+ * whose result is awaited together with those of other transactions.
+ */
+typedef struct RemoteTransaction
+{
+	PGconn *conn;
+	int64 transactionId;               /* names the prepared transaction */
+	ShardId shardId;                   /* shard reported on failure */
+	PlacementConnection *placement;    /* set for a placement's own connection */
+	CopyConnection *copyConnection;    /* set for a shared node connection */
+	bool pending;                      /* results of the command not yet read */
+	bool succeeded;                    /* command completed successfully */
+} RemoteTransaction;
+
+
+/*
+ * PlacementBacklog tracks the placements of a COPY whose rows libpq could not
+ * take without blocking, so that waiting for slow placements only polls those
+ * rather than all placements of the table. Its arrays live for the whole COPY
+ * and grow with the number of backlogged placements.
+ */
+typedef struct PlacementBacklog
+{
+	PlacementConnection **placements;  /* backlogged placements */
+	struct pollfd *pollDescriptors;    /* one poll descriptor per placement */
+	int placementCount;                /* number of backlogged placements */
+	int maxPlacementCount;             /* allocated length of the arrays */
+} PlacementBacklog;
+
+/* per-placement send buffer in kilobytes, 0 sends each row over own connections */
+int PgShardCopyBufferSize = DEFAULT_COPY_BUFFER_SIZE;
+
+/* unsent data in kilobytes after which COPY waits for a slow placement */
+int PgShardCopyHighWaterMark = DEFAULT_COPY_HIGH_WATER_MARK;
+
+/* number of background workers used for COPY from a file, 0 disables them */
+int PgShardCopyParallelWorkers = 0;
+
+/* connections COPY opens per worker node, 0 opens one per shard placement */
+int PgShardCopyConnectionsPerNode = 0;
+
+/* shards COPY TO starts copying ahead of the shard being sent */
+int PgShardCopyPrefetchShards = 0;
+
 static uint32
 shard_id_hash_fn(const void *key, Size keysize)
 {
@@ -252,6 +361,81 @@ CreateShardToConnectionHash()
 	return hash_create("shardToConn", INITIAL_CONNECTION_CACHE_SIZE, &info, HASH_ELEM | HASH_FUNCTION);
 }
 
+/*
+ * CreateNodeToConnectionHash creates the hash of COPY connections shared by the
+ * placements on each worker node, see NodeCopyConnection.
+ */
+static HTAB *
+CreateNodeToConnectionHash(void)
+{
+	HASHCTL info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(NodeConnectionKey);
+	info.entrysize = sizeof(NodeCopyConnections);
+	info.hash = tag_hash;
+	info.hcxt = CurrentMemoryContext;
+
+	return hash_create("nodeToConn", INITIAL_CONNECTION_CACHE_SIZE, &info,
+					   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+}
+
+/*
+ * AppendCopyOptions appends the given COPY options to the buffer as a
+ * parenthesized WITH list, or does nothing if there are no options.
+ */
+static void
+AppendCopyOptions(StringInfo buf, List *options)
+{
+	ListCell *optionCell = NULL;
+	char sep = '(';
+
+	if (options == NIL)
+	{
+		return;
+	}
+
+	appendStringInfoString(buf, " WITH ");
+	foreach(optionCell, options)
+	{
+		DefElem *def = (DefElem *) lfirst(optionCell);
+
+		appendStringInfo(buf, "%c%s", sep, quote_identifier(def->defname));
+		if (def->arg == NULL)
+		{
+			/* option without an argument, such as a bare FREEZE */
+		}
+		else if (IsA(def->arg, Integer))
+		{
+			appendStringInfo(buf, " %ld", intVal(def->arg));
+		}
+		else if (IsA(def->arg, A_Star))
+		{
+			appendStringInfoString(buf, " *");
+		}
+		else if (IsA(def->arg, List))
+		{
+			ListCell *columnCell = NULL;
+			char columnSep = '(';
+
+			appendStringInfoChar(buf, ' ');
+			foreach(columnCell, (List *) def->arg)
+			{
+				appendStringInfo(buf, "%c%s", columnSep,
+								 quote_identifier(strVal(lfirst(columnCell))));
+				columnSep = ',';
+			}
+			appendStringInfoChar(buf, ')');
+		}
+		else
+		{
+			appendStringInfo(buf, " %s", quote_literal_cstr(defGetString(def)));
+		}
+		sep = ',';
+	}
+	appendStringInfoChar(buf, ')');
+}
+
 /* 
  * Reconstruct text of COPY statement based on CopyStmt for the particular shard
  */
@@ -277,20 +461,176 @@ ConstructCopyStatement(CopyStmt *copyStatement, ShardId shardId)
 		appendStringInfoChar(buf, ')');
 	}
 	appendStringInfoString(buf, "FROM STDIN");
+	AppendCopyOptions(buf, copyStatement->options);
+
+	return buf->data;
+}
+
+/*
+ * SendPlacementBuffer passes rows accumulated in the placement's buffer to libpq
+ * without blocking. Data is only handed over once libpq has written out all it
+ * was given before, so unsent data for a slow placement stays in the buffer
+ * where its size can be tracked. The function returns false if the connection
+ * failed.
+ */
+static bool
+SendPlacementBuffer(PlacementConnection *placement)
+{
+	StringInfo buffer = &placement->buffer;
+	PGconn *conn = placement->conn;
+	int flushStatus = PQflush(conn);
 
-	if (copyStatement->options)
+	if (flushStatus == 0 && buffer->len > 0)
 	{
-		appendStringInfoString(buf, " WITH ");
-		sep = '(';
-		foreach(cell, copyStatement->options)
+		int putStatus = PQputCopyData(conn, buffer->data, buffer->len);
+		if (putStatus < 0)
 		{
-			DefElem *def = (DefElem *) lfirst(cell);
-			appendStringInfo(buf, "%c%s '%s'", sep, def->defname, defGetString(def));
-			sep = ',';
+			return false;
+		}
+		else if (putStatus > 0)
+		{
+			resetStringInfo(buffer);
+			flushStatus = PQflush(conn);
 		}
-		appendStringInfoChar(buf, ')');
 	}
-	return buf->data;
+
+	placement->flushPending = (flushStatus != 0);
+
+	return (flushStatus >= 0);
+}
+
+/*
+ * InitPlacementBacklog initializes an empty placement backlog in the current
+ * memory context.
+ */
+static void
+InitPlacementBacklog(PlacementBacklog *backlog)
+{
+	backlog->placementCount = 0;
+	backlog->maxPlacementCount = 16;
+	backlog->placements = palloc0(backlog->maxPlacementCount *
+								  sizeof(PlacementConnection *));
+	backlog->pollDescriptors = palloc0(backlog->maxPlacementCount *
+									   sizeof(struct pollfd));
+}
+
+/*
+ * AddToPlacementBacklog adds the given placement to the backlog, unless it is
+ * already part of it.
+ */
+static void
+AddToPlacementBacklog(PlacementBacklog *backlog, PlacementConnection *placement)
+{
+	if (placement->backlogged)
+	{
+		return;
+	}
+
+	if (backlog->placementCount == backlog->maxPlacementCount)
+	{
+		backlog->maxPlacementCount *= 2;
+		backlog->placements = repalloc(backlog->placements,
+									   backlog->maxPlacementCount *
+									   sizeof(PlacementConnection *));
+		backlog->pollDescriptors = repalloc(backlog->pollDescriptors,
+											backlog->maxPlacementCount *
+											sizeof(struct pollfd));
+	}
+
+	backlog->placements[backlog->placementCount++] = placement;
+	placement->backlogged = true;
+}
+
+/*
+ * WaitForPlacementBuffers polls the sockets of the backlogged placements and
+ * writes to whichever of them can accept more, dropping placements from the
+ * backlog once all their data was sent. If a target placement is given, the
+ * function returns as soon as that placement's buffer drops below the
+ * high-water mark; otherwise it waits until all backlogged data has been sent.
+ * Either way, fast placements keep draining while we wait for the slow one.
+ */
+static void
+WaitForPlacementBuffers(PlacementBacklog *backlog, PlacementConnection *target,
+						int highWaterMark)
+{
+	struct pollfd *pollDescriptors = backlog->pollDescriptors;
+
+	while (true)
+	{
+		int pollCount = 0;
+		int pollIndex = 0;
+		int pollResult = 0;
+
+		if (target != NULL && target->buffer.len < highWaterMark)
+		{
+			break;
+		}
+
+		/* keep the placements which still have data to send */
+		for (pollIndex = 0; pollIndex < backlog->placementCount; pollIndex++)
+		{
+			PlacementConnection *placement = backlog->placements[pollIndex];
+
+			if (placement->buffer.len > 0 || placement->flushPending)
+			{
+				pollDescriptors[pollCount].fd = PQsocket(placement->conn);
+				pollDescriptors[pollCount].events = POLLIN | POLLOUT;
+				pollDescriptors[pollCount].revents = 0;
+				backlog->placements[pollCount] = placement;
+				pollCount++;
+			}
+			else
+			{
+				placement->backlogged = false;
+			}
+		}
+		backlog->placementCount = pollCount;
+
+		if (pollCount == 0)
+		{
+			break;
+		}
+
+		pollResult = poll(pollDescriptors, pollCount, COPY_POLL_TIMEOUT_MS);
+		if (pollResult < 0 && errno != EINTR)
+		{
+			ereport(ERROR, (errcode_for_socket_access(),
+							errmsg("could not wait for COPY connections: %m")));
+		}
+
+		for (pollIndex = 0; pollResult > 0 && pollIndex < pollCount; pollIndex++)
+		{
+			PlacementConnection *placement = backlog->placements[pollIndex];
+			short readyEvents = pollDescriptors[pollIndex].revents;
+			bool connectionOK = true;
+
+			if (readyEvents == 0)
+			{
+				continue;
+			}
+
+			/* absorb notices or errors sent by the worker during COPY */
+			if (readyEvents & POLLIN)
+			{
+				connectionOK = (PQconsumeInput(placement->conn) != 0);
+			}
+
+			if (connectionOK)
+			{
+				connectionOK = SendPlacementBuffer(placement);
+			}
+
+			if (!connectionOK)
+			{
+				ReportRemoteError(placement->conn, NULL);
+				ereport(ERROR, (errcode(ERRCODE_IO_ERROR),
+								errmsg("Copy failed for placement %ld",
+									   (long) placement->id)));
+			}
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
 }
 
 /*
@@ -322,128 +662,648 @@ PgCopyEnd(PGconn *con, char const* msg)
 }
 
 /*
- * End copy and prepare transaction.
- * This function is applied for each shard placement unless some error happen.
- * Status of this function is stored in ShardConnections::status field
+ * NodeCopyConnection binds a placement on the given node to one of the node's
+ * shared COPY connections in round-robin order, and opens that connection and
+ * starts its remote transaction on first use. The placement id names the
+ * connection's prepared transaction. The function returns NULL if no connection
+ * could be established.
  */
-static ShardId
-PgCopyPrepareTransaction(HTAB *connectionHash)
+static CopyConnection *
+NodeCopyConnection(HTAB *nodeConnectionHash, char *nodeName, int32 nodePort,
+				   int64 placementId, PgShardTransactionManager const *transactionManager)
 {
-	HASH_SEQ_STATUS hashCursor;
-	ShardConnections* shardConn;
-	int i = 0;
+	NodeConnectionKey nodeKey;
+	NodeCopyConnections *nodeConnections = NULL;
+	CopyConnection *copyConnection = NULL;
+	bool found = false;
+
+	memset(&nodeKey, 0, sizeof(nodeKey));
+	strlcpy(nodeKey.nodeName, nodeName, MAX_NODE_LENGTH + 1);
+	nodeKey.nodePort = nodePort;
+
+	nodeConnections = (NodeCopyConnections *) hash_search(nodeConnectionHash, &nodeKey,
+														  HASH_ENTER, &found);
+	if (!found)
+	{
+		nodeConnections->nextConnection = 0;
+		nodeConnections->connections =
+			palloc0(PgShardCopyConnectionsPerNode * sizeof(CopyConnection));
+	}
 
-	PgShardTransactionManager const *tmgr =
-		&PgShardTransManagerImpl[PgShardCurrTransManager];
+	copyConnection = &nodeConnections->connections[nodeConnections->nextConnection];
+	nodeConnections->nextConnection =
+		(nodeConnections->nextConnection + 1) % PgShardCopyConnectionsPerNode;
 
-	hash_seq_init(&hashCursor, connectionHash);
-	while ((shardConn = (ShardConnections*)hash_seq_search(&hashCursor)) != NULL)
+	if (copyConnection->conn == NULL)
 	{
-		for (i = 0; i < shardConn->replicaCount; i++) 
+		PGconn *conn = ConnectToNode(nodeName, nodePort);
+		if (conn == NULL)
 		{
-			PGconn* conn = shardConn->placements[i].conn;
-			shardConn->placements[i].copied = true;
-			if (PgCopyEnd(conn, NULL) && tmgr->Prepare(conn, shardConn->placements[i].id))
-			{
-				shardConn->placements[i].prepared = true;
-			}
-			else
-			{
-				return shardConn->shardId;
-			}
+			return NULL;
+		}
+
+		if (!transactionManager->Begin(conn))
+		{
+			PQfinish(conn);
+			return NULL;
 		}
+
+		copyConnection->conn = conn;
+		copyConnection->transactionId = placementId;
 	}
-	return INVALID_SHARD_ID;
+
+	return copyConnection;
 }
 
 /*
- * Abort transaction.
- * If COPY is already completed for this connection, then abort prepared transaction,
- * otherwise end copy and rollback current transaction
+ * EndPlacementBatch ends the COPY in progress on a shared connection, if any.
  */
-static void
-PgCopyAbortTransaction(HTAB *connectionHash)
+static bool
+EndPlacementBatch(CopyConnection *copyConnection, bool binary)
 {
-	HASH_SEQ_STATUS hashCursor;
-	ShardConnections* shardConn;
-	int i = 0;
+	PGconn *conn = copyConnection->conn;
 
-	PgShardTransactionManager const *tmgr =
-		&PgShardTransManagerImpl[PgShardCurrTransManager];
+	if (copyConnection->activePlacement == NULL)
+	{
+		return true;
+	}
 
-	hash_seq_init(&hashCursor, connectionHash);
-	while ((shardConn = (ShardConnections*)hash_seq_search(&hashCursor)) != NULL)
+	copyConnection->activePlacement = NULL;
+	if (binary && PQputCopyData(conn, BinaryTrailer, sizeof(BinaryTrailer)) != 1)
 	{
-		for (i = 0; i < shardConn->replicaCount; i++) 
+		ReportRemoteError(conn, NULL);
+		return false;
+	}
+
+	return PgCopyEnd(conn, NULL);
+}
+
+/*
+ * SendPlacementBatch sends the rows buffered for a placement over its shared
+ * connection. If a COPY for another placement is in progress there, it is ended
+ * first and a COPY into this placement's shard is started; consecutive batches
+ * for the same placement go into the same COPY. The function returns false if
+ * the connection failed.
+ */
+static bool
+SendPlacementBatch(PlacementConnection *placement, ShardId shardId, bool binary)
+{
+	CopyConnection *copyConnection = placement->copyConnection;
+	PGconn *conn = copyConnection->conn;
+	StringInfo buffer = &placement->buffer;
+
+	if (copyConnection->activePlacement != placement)
+	{
+		if (!EndPlacementBatch(copyConnection, binary) ||
+			!PgShardExecute(conn, PGRES_COPY_IN, placement->copyCommand))
 		{
-			PGconn* conn = shardConn->placements[i].conn;
-			if (shardConn->placements[i].prepared)
-			{
-				if (!tmgr->RollbackPrepared(conn, shardConn->placements[i].id))
-				{
-					ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
-									  errmsg("Failed to rollback prepared transactionb for shard %ld", 
-											 (long)shardConn->shardId)));
-				}
-			}
-			else
-			{
-				if (!shardConn->placements[i].copied)
-				{
-					PgCopyEnd(conn, "Aborted because of failure on some shard");
-				}
-				if (!tmgr->Rollback(conn))
-				{
-					ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
-									  errmsg("Failed to rollback transactionb for shard %ld", 
-											 (long)shardConn->shardId)));
-				}
-			}
-			PQfinish(conn);
+			return false;
 		}
+
+		copyConnection->activePlacement = placement;
+		copyConnection->lastShardId = shardId;
+
+		/* each COPY on the connection needs its own binary header */
+		if (binary &&
+			(PQputCopyData(conn, BinarySignature, sizeof(BinarySignature)) != 1 ||
+			 PQputCopyData(conn, BinaryHeaderTail, sizeof(BinaryHeaderTail)) != 1))
+		{
+			ReportRemoteError(conn, NULL);
+			return false;
+		}
+	}
+
+	if (buffer->len > 0)
+	{
+		if (PQputCopyData(conn, buffer->data, buffer->len) != 1)
+		{
+			ReportRemoteError(conn, NULL);
+			return false;
+		}
+		resetStringInfo(buffer);
 	}
+
+	return true;
 }
 
 /*
- * Complete copy transaction.
- * This function is called only of COPY is successfully completed at all nodes
+ * RemoteTransactionArray returns the remote transactions of a COPY: one per
+ * placement with a connection of its own, and one per shared node connection.
  */
-static void
-PgCopyEndTransaction(HTAB *connectionHash)
+static RemoteTransaction *
+RemoteTransactionArray(HTAB *connectionHash, HTAB *nodeConnectionHash,
+					   int *transactionCount)
 {
 	HASH_SEQ_STATUS hashCursor;
-	ShardConnections* shardConn;
+	ShardConnections *shardConn = NULL;
+	NodeCopyConnections *nodeConnections = NULL;
+	RemoteTransaction *transactionArray = NULL;
+	int maxTransactionCount = 0;
 	int i = 0;
 
-	PgShardTransactionManager const *tmgr =
-		&PgShardTransManagerImpl[PgShardCurrTransManager];
+	*transactionCount = 0;
 
 	hash_seq_init(&hashCursor, connectionHash);
-	while ((shardConn = (ShardConnections*)hash_seq_search(&hashCursor)) != NULL)
+	while ((shardConn = (ShardConnections *) hash_seq_search(&hashCursor)) != NULL)
 	{
-		for (i = 0; i < shardConn->replicaCount; i++) 
+		maxTransactionCount += shardConn->replicaCount;
+	}
+	if (nodeConnectionHash != NULL)
+	{
+		maxTransactionCount += hash_get_num_entries(nodeConnectionHash) *
+							   PgShardCopyConnectionsPerNode;
+	}
+
+	transactionArray = palloc0(Max(maxTransactionCount, 1) * sizeof(RemoteTransaction));
+
+	hash_seq_init(&hashCursor, connectionHash);
+	while ((shardConn = (ShardConnections *) hash_seq_search(&hashCursor)) != NULL)
+	{
+		for (i = 0; i < shardConn->replicaCount; i++)
 		{
-			PGconn* conn = shardConn->placements[i].conn;
-			Assert(shardConn->placements[i].prepared);
-			if (!tmgr->CommitPrepared(conn, shardConn->placements[i].id))
+			PlacementConnection *placement = &shardConn->placements[i];
+			RemoteTransaction *transaction = &transactionArray[*transactionCount];
+
+			if (placement->copyConnection != NULL)
 			{
-				ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
-								  errmsg("Failed to commit prepared transaction for shard %ld", 
-										 (long)shardConn->shardId)));
+				continue;
 			}
-			PQfinish(conn);
+
+			transaction->conn = placement->conn;
+			transaction->transactionId = placement->id;
+			transaction->shardId = shardConn->shardId;
+			transaction->placement = placement;
+			(*transactionCount)++;
+		}
+	}
+
+	if (nodeConnectionHash != NULL)
+	{
+		hash_seq_init(&hashCursor, nodeConnectionHash);
+		while ((nodeConnections = (NodeCopyConnections *) hash_seq_search(&hashCursor)) != NULL)
+		{
+			for (i = 0; i < PgShardCopyConnectionsPerNode; i++)
+			{
+				CopyConnection *copyConnection = &nodeConnections->connections[i];
+				RemoteTransaction *transaction = &transactionArray[*transactionCount];
+
+				if (copyConnection->conn == NULL)
+				{
+					continue;
+				}
+
+				transaction->conn = copyConnection->conn;
+				transaction->transactionId = copyConnection->transactionId;
+				transaction->shardId = copyConnection->lastShardId;
+				transaction->copyConnection = copyConnection;
+				(*transactionCount)++;
+			}
+		}
+	}
+
+	return transactionArray;
+}
+
+/*
+ * SendRemoteCommand sends a command to the transaction's connection without
+ * waiting for its result, which WaitForRemoteResults collects. A NULL command
+ * succeeds without sending anything.
+ */
+static void
+SendRemoteCommand(RemoteTransaction *transaction, char const *command)
+{
+	transaction->succeeded = true;
+	transaction->pending = false;
+
+	if (command == NULL)
+	{
+		return;
+	}
+
+	if (PQsetnonblocking(transaction->conn, 1) != 0 ||
+		PQsendQuery(transaction->conn, command) != 1)
+	{
+		ReportRemoteError(transaction->conn, NULL);
+		transaction->succeeded = false;
+		return;
+	}
+
+	transaction->pending = true;
+}
+
+/*
+ * WaitForRemoteResults collects the results of the commands sent to all given
+ * connections in a single poll loop, so that the commands run concurrently on
+ * the remote nodes. A transaction succeeds if all results of its command were
+ * successful. Interrupts are only checked if the caller allows it: once prepared
+ * transactions are being committed, a cancel must not stop halfway.
+ */
+static void
+WaitForRemoteResults(RemoteTransaction *transactionArray, int transactionCount,
+					 bool interruptible)
+{
+	struct pollfd *pollDescriptors = palloc0(Max(transactionCount, 1) *
+											 sizeof(struct pollfd));
+	int *pollTransactions = palloc0(Max(transactionCount, 1) * sizeof(int));
+
+	while (true)
+	{
+		int pollCount = 0;
+		int transactionIndex = 0;
+
+		for (transactionIndex = 0; transactionIndex < transactionCount; transactionIndex++)
+		{
+			RemoteTransaction *transaction = &transactionArray[transactionIndex];
+			PGconn *conn = transaction->conn;
+			int flushStatus = 0;
+
+			if (!transaction->pending)
+			{
+				continue;
+			}
+
+			flushStatus = PQflush(conn);
+			if (flushStatus < 0 || PQconsumeInput(conn) == 0)
+			{
+				ReportRemoteError(conn, NULL);
+				transaction->succeeded = false;
+				transaction->pending = false;
+				continue;
+			}
+
+			while (transaction->pending && !PQisBusy(conn))
+			{
+				PGresult *result = PQgetResult(conn);
+				if (result == NULL)
+				{
+					transaction->pending = false;
+					break;
+				}
+
+				if (PQresultStatus(result) != PGRES_COMMAND_OK)
+				{
+					ReportRemoteError(conn, result);
+					transaction->succeeded = false;
+				}
+				PQclear(result);
+			}
+
+			if (transaction->pending)
+			{
+				pollDescriptors[pollCount].fd = PQsocket(conn);
+				pollDescriptors[pollCount].events = POLLIN;
+				if (flushStatus > 0)
+				{
+					pollDescriptors[pollCount].events |= POLLOUT;
+				}
+				pollDescriptors[pollCount].revents = 0;
+				pollTransactions[pollCount] = transactionIndex;
+				pollCount++;
+			}
+		}
+
+		if (pollCount == 0)
+		{
+			break;
+		}
+
+		if (interruptible)
+		{
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (poll(pollDescriptors, pollCount, COPY_POLL_TIMEOUT_MS) < 0 && errno != EINTR)
+		{
+			int pollIndex = 0;
+
+			ereport(WARNING, (errcode_for_socket_access(),
+							  errmsg("could not wait for remote results: %m")));
+			for (pollIndex = 0; pollIndex < pollCount; pollIndex++)
+			{
+				transactionArray[pollTransactions[pollIndex]].succeeded = false;
+				transactionArray[pollTransactions[pollIndex]].pending = false;
+			}
+		}
+	}
+
+	pfree(pollDescriptors);
+	pfree(pollTransactions);
+}
+
+/*
+ * SetTransactionPrepared records whether the given remote transaction is
+ * prepared on its placement or shared node connection.
+ */
+static void
+SetTransactionPrepared(RemoteTransaction *transaction, bool prepared)
+{
+	if (transaction->copyConnection != NULL)
+	{
+		transaction->copyConnection->prepared = prepared;
+	}
+	else
+	{
+		transaction->placement->prepared = prepared;
+	}
+}
+
+/*
+ * End copy and prepare transaction on all placements. Each step is sent to all
+ * connections before any result is awaited, so ending the COPY and preparing
+ * take about one round trip each, however many placements there are. The
+ * function returns the id of a shard whose transaction failed to prepare, or
+ * INVALID_SHARD_ID if all of them were prepared.
+ */
+static ShardId
+PgCopyPrepareTransaction(HTAB *connectionHash, HTAB *nodeConnectionHash,
+						 PlacementBacklog *backlog, bool binary)
+{
+	HASH_SEQ_STATUS hashCursor;
+	ShardConnections* shardConn;
+	RemoteTransaction *transactionArray = NULL;
+	int transactionCount = 0;
+	int transactionIndex = 0;
+	int i = 0;
+
+	PgShardTransactionManager const *tmgr =
+		&PgShardTransManagerImpl[PgShardCurrTransManager];
+
+	/* send out everything still buffered */
+	hash_seq_init(&hashCursor, connectionHash);
+	while ((shardConn = (ShardConnections *) hash_seq_search(&hashCursor)) != NULL)
+	{
+		for (i = 0; i < shardConn->replicaCount; i++)
+		{
+			PlacementConnection *placement = &shardConn->placements[i];
+
+			/* shared connections send their batches synchronously */
+			if (placement->copyConnection == NULL &&
+				(placement->buffer.len > 0 || placement->flushPending))
+			{
+				AddToPlacementBacklog(backlog, placement);
+			}
+		}
+	}
+
+	WaitForPlacementBuffers(backlog, NULL, 0);
+
+	hash_seq_init(&hashCursor, connectionHash);
+	while ((shardConn = (ShardConnections*)hash_seq_search(&hashCursor)) != NULL)
+	{
+		for (i = 0; i < shardConn->replicaCount; i++) 
+		{
+			PlacementConnection *placement = &shardConn->placements[i];
+
+			if (placement->copyConnection != NULL && placement->buffer.len > 0 &&
+				!SendPlacementBatch(placement, shardConn->shardId, binary))
+			{
+				hash_seq_term(&hashCursor);
+				return shardConn->shardId;
+			}
+		}
+	}
+
+	transactionArray = RemoteTransactionArray(connectionHash, nodeConnectionHash,
+											  &transactionCount);
+
+	/* end the COPY in progress on each connection */
+	for (transactionIndex = 0; transactionIndex < transactionCount; transactionIndex++)
+	{
+		RemoteTransaction *transaction = &transactionArray[transactionIndex];
+		CopyConnection *copyConnection = transaction->copyConnection;
+		PGconn *conn = transaction->conn;
+
+		transaction->succeeded = true;
+		transaction->pending = false;
+
+		if (copyConnection != NULL)
+		{
+			if (copyConnection->activePlacement == NULL)
+			{
+				continue;
+			}
+
+			copyConnection->activePlacement = NULL;
+			if (binary && PQputCopyData(conn, BinaryTrailer, sizeof(BinaryTrailer)) != 1)
+			{
+				ReportRemoteError(conn, NULL);
+				return transaction->shardId;
+			}
+		}
+		else
+		{
+			transaction->placement->copied = true;
+		}
+
+		if (PQsetnonblocking(conn, 1) != 0 || PQputCopyEnd(conn, NULL) != 1)
+		{
+			ReportRemoteError(conn, NULL);
+			return transaction->shardId;
+		}
+		transaction->pending = true;
+	}
+
+	WaitForRemoteResults(transactionArray, transactionCount, true);
+	for (transactionIndex = 0; transactionIndex < transactionCount; transactionIndex++)
+	{
+		if (!transactionArray[transactionIndex].succeeded)
+		{
+			return transactionArray[transactionIndex].shardId;
+		}
+	}
+
+	/*
+	 * Prepare all transactions at once. Until their results arrive, they count
+	 * as prepared: if the wait is canceled, aborting then rolls back whatever
+	 * the nodes prepared, after waiting for the outstanding results.
+	 */
+	for (transactionIndex = 0; transactionIndex < transactionCount; transactionIndex++)
+	{
+		RemoteTransaction *transaction = &transactionArray[transactionIndex];
+
+		SetTransactionPrepared(transaction, true);
+		SendRemoteCommand(transaction, tmgr->PrepareCommand(transaction->transactionId));
+	}
+
+	WaitForRemoteResults(transactionArray, transactionCount, true);
+
+	/* record which transactions are prepared, so that aborting rolls them back */
+	for (transactionIndex = 0; transactionIndex < transactionCount; transactionIndex++)
+	{
+		RemoteTransaction *transaction = &transactionArray[transactionIndex];
+
+		SetTransactionPrepared(transaction, transaction->succeeded);
+	}
+
+	for (transactionIndex = 0; transactionIndex < transactionCount; transactionIndex++)
+	{
+		if (!transactionArray[transactionIndex].succeeded)
+		{
+			return transactionArray[transactionIndex].shardId;
+		}
+	}
+
+	return INVALID_SHARD_ID;
+}
+
+/*
+ * Abort transaction.
+ * If COPY is already completed for this connection, then abort prepared transaction,
+ * otherwise end copy and rollback current transaction
+ */
+static void
+PgCopyAbortTransaction(HTAB *connectionHash, HTAB *nodeConnectionHash)
+{
+	HASH_SEQ_STATUS hashCursor;
+	ShardConnections* shardConn;
+	int i = 0;
+
+	PgShardTransactionManager const *tmgr =
+		&PgShardTransManagerImpl[PgShardCurrTransManager];
+
+	hash_seq_init(&hashCursor, connectionHash);
+	while ((shardConn = (ShardConnections*)hash_seq_search(&hashCursor)) != NULL)
+	{
+		for (i = 0; i < shardConn->replicaCount; i++) 
+		{
+			PGconn* conn = shardConn->placements[i].conn;
+
+			/* shared connections are rolled back below */
+			if (shardConn->placements[i].copyConnection != NULL)
+			{
+				continue;
+			}
+
+			if (shardConn->placements[i].prepared)
+			{
+				if (!tmgr->RollbackPrepared(conn, shardConn->placements[i].id))
+				{
+					ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
+									  errmsg("Failed to rollback prepared transactionb for shard %ld", 
+											 (long)shardConn->shardId)));
+				}
+			}
+			else
+			{
+				if (!shardConn->placements[i].copied)
+				{
+					PgCopyEnd(conn, "Aborted because of failure on some shard");
+				}
+				if (!tmgr->Rollback(conn))
+				{
+					ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
+									  errmsg("Failed to rollback transactionb for shard %ld", 
+											 (long)shardConn->shardId)));
+				}
+			}
+			PQfinish(conn);
+		}
+	}
+
+	if (nodeConnectionHash != NULL)
+	{
+		NodeCopyConnections *nodeConnections = NULL;
+
+		hash_seq_init(&hashCursor, nodeConnectionHash);
+		while ((nodeConnections = (NodeCopyConnections *) hash_seq_search(&hashCursor)) != NULL)
+		{
+			for (i = 0; i < PgShardCopyConnectionsPerNode; i++)
+			{
+				CopyConnection *copyConnection = &nodeConnections->connections[i];
+				PGconn *conn = copyConnection->conn;
+				bool rolledBack = false;
+
+				if (conn == NULL)
+				{
+					continue;
+				}
+
+				if (copyConnection->prepared)
+				{
+					rolledBack = tmgr->RollbackPrepared(conn, copyConnection->transactionId);
+				}
+				else
+				{
+					if (copyConnection->activePlacement != NULL)
+					{
+						PgCopyEnd(conn, "Aborted because of failure on some shard");
+					}
+					rolledBack = tmgr->Rollback(conn);
+				}
+
+				if (!rolledBack)
+				{
+					ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
+									  errmsg("Failed to rollback transaction on node %s:%d",
+											 nodeConnections->key.nodeName,
+											 nodeConnections->key.nodePort)));
+				}
+
+				PQfinish(conn);
+				copyConnection->conn = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * Complete copy transaction.
+ * This function is called only of COPY is successfully completed at all nodes.
+ * Prepared transactions are committed on all connections concurrently.
+ */
+static void
+PgCopyEndTransaction(HTAB *connectionHash, HTAB *nodeConnectionHash)
+{
+	RemoteTransaction *transactionArray = NULL;
+	int transactionCount = 0;
+	int transactionIndex = 0;
+
+	PgShardTransactionManager const *tmgr =
+		&PgShardTransManagerImpl[PgShardCurrTransManager];
+
+	transactionArray = RemoteTransactionArray(connectionHash, nodeConnectionHash,
+											  &transactionCount);
+
+	for (transactionIndex = 0; transactionIndex < transactionCount; transactionIndex++)
+	{
+		RemoteTransaction *transaction = &transactionArray[transactionIndex];
+
+		SendRemoteCommand(transaction,
+						  tmgr->CommitPreparedCommand(transaction->transactionId));
+	}
+
+	WaitForRemoteResults(transactionArray, transactionCount, false);
+
+	for (transactionIndex = 0; transactionIndex < transactionCount; transactionIndex++)
+	{
+		RemoteTransaction *transaction = &transactionArray[transactionIndex];
+
+		if (!transaction->succeeded)
+		{
+			ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
+							  errmsg("Failed to commit prepared transaction for shard %ld", 
+									 (long) transaction->shardId)));
+		}
+
+		PQfinish(transaction->conn);
+		if (transaction->copyConnection != NULL)
+		{
+			transaction->copyConnection->conn = NULL;
 		}
 	}
 }
 
 /*
- * Create hash entry for connections for this shard placements
+ * Create hash entry for connections for this shard placements. If a node
+ * connection hash is given, placements are bound to shared node connections
+ * instead of opening a connection and starting a COPY of their own.
  */
 static void
 InitializeShardConnections(CopyStmt *copyStatement,
 						   ShardConnections *shardConnections,
 						   ShardId shardId,
-						   PgShardTransactionManager const *transactionManager)
+						   PgShardTransactionManager const *transactionManager,
+						   bool binary, HTAB *nodeConnectionHash)
 {
 	ListCell *taskPlacementCell = NULL;
 	List *finalizedPlacementList = NULL;
@@ -464,12 +1324,40 @@ InitializeShardConnections(CopyStmt *copyStatement,
 		ShardPlacement *taskPlacement = (ShardPlacement *) lfirst(taskPlacementCell);
 		char *nodeName = taskPlacement->nodeName;
 		PGconn *conn = NULL;
-		conn = ConnectToNode(nodeName, taskPlacement->nodePort);
+
+		if (nodeConnectionHash != NULL)
+		{
+			CopyConnection *copyConnection =
+				NodeCopyConnection(nodeConnectionHash, nodeName, taskPlacement->nodePort,
+								   taskPlacement->id, transactionManager);
+
+			if (copyConnection != NULL)
+			{
+				PlacementConnection *placement =
+					&shardConnections->placements[placementCount++];
+
+				placement->id = taskPlacement->id;
+				placement->copyConnection = copyConnection;
+				placement->copyCommand = ConstructCopyStatement(copyStatement, shardId);
+				initStringInfo(&placement->buffer);
+			}
+			else
+			{
+				failedPlacementList = lappend(failedPlacementList, taskPlacement);
+				ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
+								  errmsg("Failed to connect to node %s:%d",
+										 nodeName, taskPlacement->nodePort)));
+			}
+			continue;
+		}
+
+		conn = ConnectToNode(nodeName, taskPlacement->nodePort);
 		if (conn != NULL)
 		{
 			char const *copy = ConstructCopyStatement(copyStatement, shardId);
 			shardConnections->placements[placementCount].conn = conn;
 			shardConnections->placements[placementCount].id = taskPlacement->id;
+			initStringInfo(&shardConnections->placements[placementCount].buffer);
 			placementCount += 1;
 
 			/*
@@ -484,6 +1372,22 @@ InitializeShardConnections(CopyStmt *copyStatement,
 								  errmsg("Failed to start '%s' on node %s:%d", 
 										 copy, nodeName, taskPlacement->nodePort)));
 			}
+			else
+			{
+				StringInfo buffer = &shardConnections->placements[placementCount - 1].buffer;
+
+				/* binary data sent to each placement starts with its own header */
+				if (binary)
+				{
+					appendBinaryStringInfo(buffer, BinarySignature,
+										   sizeof(BinarySignature));
+					appendBinaryStringInfo(buffer, BinaryHeaderTail,
+										   sizeof(BinaryHeaderTail));
+				}
+
+				/* rows are sent without blocking, see SendPlacementBuffer */
+				PQsetnonblocking(conn, 1);
+			}
 		}
 		else
 		{
@@ -507,385 +1411,2215 @@ InitializeShardConnections(CopyStmt *copyStatement,
 	{
 		ShardPlacement *failedPlacement = (ShardPlacement *) lfirst(failedPlacementCell);
 
-		UpdateShardPlacementRowState(failedPlacement->id, STATE_INACTIVE);
+		UpdateShardPlacementRowState(failedPlacement->id, STATE_INACTIVE);
+	}
+	shardConnections->replicaCount = placementCount;
+}
+
+/*
+ * CopyOutShard tracks the COPY OUT of one shard of a distributed table. Data a
+ * shard sends before its turn comes is buffered in memory up to bufferLimit
+ * bytes, and spilled to a temporary file beyond that.
+ */
+typedef struct CopyOutShard
+{
+	ShardId shardId;          /* shard being copied */
+	char *copyCommand;        /* COPY ... TO STDOUT command for the shard */
+	List *placementList;      /* finalized placements of the shard */
+	int nextPlacement;        /* index of the next placement to try */
+	PGconn *conn;             /* connection running the COPY, NULL if not running */
+	bool received;            /* data of the shard was passed to the destination */
+	bool finished;            /* the shard's COPY completed */
+	uint64 rowCount;          /* number of rows copied, once finished */
+	StringInfoData buffer;    /* data received before the shard's turn */
+	BufFile *spillFile;       /* buffered data past bufferLimit, or NULL */
+	int bufferLimit;          /* bytes of data the shard may buffer in memory */
+} CopyOutShard;
+
+/*
+ * CopyOutDestination describes where COPY TO data goes and how the binary
+ * headers and trailers of individual shards are merged into one stream.
+ */
+typedef struct CopyOutDestination
+{
+	FILE *copyFile;           /* file or program, NULL for the frontend */
+	bool isProgram;           /* copyFile is a pipe to a program */
+	bool binary;              /* binary format */
+	int headerBytesLeft;      /* binary header bytes of current shard to skip */
+	char heldBytes[2];        /* last bytes received, possibly a binary trailer */
+	int heldCount;            /* number of bytes in heldBytes */
+} CopyOutDestination;
+
+/* size of binary COPY header without header extension */
+#define BINARY_COPY_HEADER_SIZE (sizeof(BinarySignature) + sizeof(BinaryHeaderTail))
+
+
+/*
+ * CompareShardIntervalsById orders shard intervals by their shard identifiers.
+ */
+static int
+CompareShardIntervalsById(const void *leftElement, const void *rightElement)
+{
+	ShardInterval *leftInterval = *((ShardInterval **) leftElement);
+	ShardInterval *rightInterval = *((ShardInterval **) rightElement);
+
+	if (leftInterval->id < rightInterval->id)
+	{
+		return -1;
+	}
+	else if (leftInterval->id > rightInterval->id)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * ConstructCopyOutStatement builds a COPY ... TO STDOUT command for the given
+ * shard. The header option is only kept when includeHeader is set, so a CSV
+ * header is emitted once, and the client encoding is requested explicitly
+ * unless the statement already names an encoding.
+ */
+static char *
+ConstructCopyOutStatement(CopyStmt *copyStatement, ShardId shardId,
+						  bool includeHeader, bool addEncoding)
+{
+	StringInfo buf = makeStringInfo();
+	List *optionList = NIL;
+	ListCell *cell = NULL;
+	char sep = '(';
+	char const *qualifiedName = quote_qualified_identifier(
+		copyStatement->relation->schemaname,
+		copyStatement->relation->relname);
+
+	appendStringInfo(buf, "COPY %s_%ld ", qualifiedName, (long) shardId);
+	if (copyStatement->attlist)
+	{
+		foreach(cell, copyStatement->attlist)
+		{
+			appendStringInfo(buf, "%c%s", sep, quote_identifier(strVal(lfirst(cell))));
+			sep = ',';
+		}
+		appendStringInfoString(buf, ") ");
+	}
+	appendStringInfoString(buf, "TO STDOUT");
+
+	foreach(cell, copyStatement->options)
+	{
+		DefElem *option = (DefElem *) lfirst(cell);
+		if (strcmp(option->defname, "header") != 0 || includeHeader)
+		{
+			optionList = lappend(optionList, option);
+		}
+	}
+	if (addEncoding)
+	{
+		char *encodingName = (char *) pg_get_client_encoding_name();
+		optionList = lappend(optionList,
+							 makeDefElem("encoding", (Node *) makeString(encodingName)));
+	}
+	AppendCopyOptions(buf, optionList);
+
+	return buf->data;
+}
+
+/*
+ * StartShardCopyOut starts the COPY OUT of a shard on the next placement that
+ * accepts it. The function errors out if no placement is left to try.
+ */
+static void
+StartShardCopyOut(CopyOutShard *shard)
+{
+	while (shard->nextPlacement < list_length(shard->placementList))
+	{
+		ShardPlacement *placement = (ShardPlacement *)
+			list_nth(shard->placementList, shard->nextPlacement++);
+		PGconn *conn = ConnectToNode(placement->nodeName, placement->nodePort);
+		PGresult *result = NULL;
+
+		if (conn == NULL)
+		{
+			continue;
+		}
+
+		result = PQexec(conn, shard->copyCommand);
+		if (PQresultStatus(result) == PGRES_COPY_OUT)
+		{
+			PQclear(result);
+			shard->conn = conn;
+			return;
+		}
+
+		ReportRemoteError(conn, result);
+		PQclear(result);
+		PQfinish(conn);
+	}
+
+	ereport(ERROR, (errmsg("could not copy shard " INT64_FORMAT " from any placement",
+						   shard->shardId)));
+}
+
+/*
+ * FinishShardCopyOut closes the connection used to copy out the shard.
+ */
+static void
+FinishShardCopyOut(CopyOutShard *shard)
+{
+	if (shard->conn != NULL)
+	{
+		PQfinish(shard->conn);
+		shard->conn = NULL;
+	}
+}
+
+/*
+ * CopyOutSendData writes COPY data to the destination. Data for the frontend
+ * is sent as a CopyData message.
+ */
+static void
+CopyOutSendData(CopyOutDestination *destination, char const *data, int length)
+{
+	if (length == 0)
+	{
+		return;
+	}
+
+	if (destination->copyFile == NULL)
+	{
+		(void) pq_putmessage('d', data, length);
+	}
+	else if (fwrite(data, 1, length, destination->copyFile) != (size_t) length)
+	{
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not write to COPY file: %m")));
+	}
+}
+
+/*
+ * CopyOutShardData passes data received from a shard to the destination. In
+ * binary format the header of every shard is skipped and the last two bytes
+ * received are held back, as they are the shard's trailer once its COPY ends.
+ */
+static void
+CopyOutShardData(CopyOutDestination *destination, char const *data, int length)
+{
+	if (!destination->binary)
+	{
+		CopyOutSendData(destination, data, length);
+		return;
+	}
+
+	if (destination->headerBytesLeft > 0)
+	{
+		int skipCount = Min(destination->headerBytesLeft, length);
+
+		destination->headerBytesLeft -= skipCount;
+		data += skipCount;
+		length -= skipCount;
+	}
+
+	if (length >= (int) sizeof(destination->heldBytes))
+	{
+		int keepFrom = length - sizeof(destination->heldBytes);
+
+		CopyOutSendData(destination, destination->heldBytes, destination->heldCount);
+		CopyOutSendData(destination, data, keepFrom);
+		memcpy(destination->heldBytes, data + keepFrom, sizeof(destination->heldBytes));
+		destination->heldCount = sizeof(destination->heldBytes);
+	}
+	else
+	{
+		int byteIndex = 0;
+
+		for (byteIndex = 0; byteIndex < length; byteIndex++)
+		{
+			if (destination->heldCount == sizeof(destination->heldBytes))
+			{
+				CopyOutSendData(destination, destination->heldBytes, 1);
+				destination->heldBytes[0] = destination->heldBytes[1];
+				destination->heldCount--;
+			}
+			destination->heldBytes[destination->heldCount++] = data[byteIndex];
+		}
+	}
+}
+
+/*
+ * BufferShardCopyData keeps COPY data which a shard sent before its turn came.
+ * The data stays in memory up to the shard's buffer limit; anything beyond it is
+ * appended to a temporary file, so that the data is kept in order.
+ */
+static void
+BufferShardCopyData(CopyOutShard *shard, char const *data, int length)
+{
+	if (shard->buffer.data == NULL)
+	{
+		initStringInfo(&shard->buffer);
+	}
+
+	if (shard->spillFile == NULL && shard->buffer.len + length <= shard->bufferLimit)
+	{
+		appendBinaryStringInfo(&shard->buffer, data, length);
+		return;
+	}
+
+	if (shard->spillFile == NULL)
+	{
+		shard->spillFile = BufFileCreateTemp(false);
+	}
+
+	if (BufFileWrite(shard->spillFile, (void *) data, length) != (size_t) length)
+	{
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not write to temporary file: %m")));
+	}
+}
+
+/*
+ * DiscardShardCopyData drops the data buffered for a shard.
+ */
+static void
+DiscardShardCopyData(CopyOutShard *shard)
+{
+	if (shard->buffer.data != NULL)
+	{
+		resetStringInfo(&shard->buffer);
+	}
+
+	if (shard->spillFile != NULL)
+	{
+		BufFileClose(shard->spillFile);
+		shard->spillFile = NULL;
+	}
+}
+
+/*
+ * EmitShardCopyData passes the data buffered for a shard to the destination, in
+ * the order it was received, and then drops it.
+ */
+static void
+EmitShardCopyData(CopyOutShard *shard, CopyOutDestination *destination)
+{
+	if (shard->buffer.data != NULL && shard->buffer.len > 0)
+	{
+		shard->received = true;
+		CopyOutShardData(destination, shard->buffer.data, shard->buffer.len);
+	}
+
+	if (shard->spillFile != NULL)
+	{
+		char chunk[BLCKSZ];
+		size_t length = 0;
+
+		if (BufFileSeek(shard->spillFile, 0, 0, SEEK_SET) != 0)
+		{
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not rewind temporary file: %m")));
+		}
+
+		while ((length = BufFileRead(shard->spillFile, chunk, sizeof(chunk))) > 0)
+		{
+			shard->received = true;
+			CopyOutShardData(destination, chunk, (int) length);
+
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	DiscardShardCopyData(shard);
+}
+
+/*
+ * ReadShardCopyOut reads the COPY OUT data a shard has sent so far, without
+ * waiting for more. The data is passed to the destination, or buffered if the
+ * destination is NULL because the shard's turn has not come yet. Once the COPY
+ * ends, the shard is marked as finished. If the placement fails before any data
+ * was passed on, its buffered data is dropped and the COPY is restarted on the
+ * next placement of the shard; otherwise, failures are errors.
+ */
+static void
+ReadShardCopyOut(CopyOutShard *shard, CopyOutDestination *destination)
+{
+	PGconn *conn = shard->conn;
+	PGresult *result = NULL;
+	bool succeeded = false;
+	char *data = NULL;
+	int length = -2;
+
+	if (PQconsumeInput(conn) != 0)
+	{
+		while ((length = PQgetCopyData(conn, &data, 1)) > 0)
+		{
+			if (destination != NULL)
+			{
+				shard->received = true;
+				CopyOutShardData(destination, data, length);
+			}
+			else
+			{
+				BufferShardCopyData(shard, data, length);
+			}
+			PQfreemem(data);
+
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	/* the COPY is still running, but no further data has arrived yet */
+	if (length == 0)
+	{
+		return;
+	}
+
+	if (length == -1)
+	{
+		result = PQgetResult(conn);
+		succeeded = (PQresultStatus(result) == PGRES_COMMAND_OK);
+		if (succeeded)
+		{
+			shard->rowCount = strtoull(PQcmdTuples(result), NULL, 10);
+		}
+	}
+	if (!succeeded)
+	{
+		ReportRemoteError(conn, result);
+	}
+	PQclear(result);
+	FinishShardCopyOut(shard);
+
+	if (succeeded)
+	{
+		shard->finished = true;
+		return;
+	}
+
+	if (shard->received)
+	{
+		ereport(ERROR, (errmsg("could not copy shard " INT64_FORMAT
+							   " after data was sent", shard->shardId)));
+	}
+
+	DiscardShardCopyData(shard);
+	StartShardCopyOut(shard);
+}
+
+/*
+ * StreamShardCopyOut passes the COPY OUT data of the shard at the given index to
+ * the destination: first the data buffered for it, then the data it sends until
+ * its COPY ends. Meanwhile, the following shards up to startedCount, whose COPY
+ * was started ahead of time, are read as well and their data buffered, so that
+ * all of them make progress. The function returns the number of rows copied.
+ */
+static uint64
+StreamShardCopyOut(CopyOutShard *shardArray, int shardIndex, int startedCount,
+				   CopyOutDestination *destination)
+{
+	CopyOutShard *shard = &shardArray[shardIndex];
+	int maxPollCount = startedCount - shardIndex;
+	struct pollfd *pollDescriptors = palloc0(maxPollCount * sizeof(struct pollfd));
+
+	destination->headerBytesLeft = destination->binary ? BINARY_COPY_HEADER_SIZE : 0;
+	destination->heldCount = 0;
+
+	EmitShardCopyData(shard, destination);
+
+	for (;;)
+	{
+		int pollCount = 0;
+		int readIndex = 0;
+
+		/*
+		 * Drain what every shard has received first: libpq may hold data which
+		 * was read from the socket already, and which poll would not report.
+		 */
+		for (readIndex = shardIndex; readIndex < startedCount; readIndex++)
+		{
+			CopyOutShard *readShard = &shardArray[readIndex];
+
+			if (readShard->conn != NULL)
+			{
+				ReadShardCopyOut(readShard, (readShard == shard) ? destination : NULL);
+			}
+		}
+
+		if (shard->finished)
+		{
+			break;
+		}
+
+		for (readIndex = shardIndex; readIndex < startedCount; readIndex++)
+		{
+			CopyOutShard *readShard = &shardArray[readIndex];
+
+			if (readShard->conn != NULL)
+			{
+				pollDescriptors[pollCount].fd = PQsocket(readShard->conn);
+				pollDescriptors[pollCount].events = POLLIN;
+				pollDescriptors[pollCount].revents = 0;
+				pollCount++;
+			}
+		}
+
+		if (poll(pollDescriptors, pollCount, COPY_POLL_TIMEOUT_MS) < 0 && errno != EINTR)
+		{
+			ereport(ERROR, (errcode_for_socket_access(),
+							errmsg("could not wait for COPY connections: %m")));
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	pfree(pollDescriptors);
+
+	if (destination->binary &&
+		(destination->heldCount != sizeof(BinaryTrailer) ||
+		 memcmp(destination->heldBytes, BinaryTrailer, sizeof(BinaryTrailer)) != 0))
+	{
+		ereport(ERROR, (errmsg("unexpected binary COPY data from shard "
+							   INT64_FORMAT, shard->shardId)));
+	}
+
+	return shard->rowCount;
+}
+
+/*
+ * SendCopyOutBegin sends a CopyOutResponse message to the frontend.
+ */
+static void
+SendCopyOutBegin(bool binary, int columnCount)
+{
+	StringInfoData message;
+	int16 format = (binary ? 1 : 0);
+	int columnIndex = 0;
+
+	pq_beginmessage(&message, 'H');
+	pq_sendbyte(&message, format);
+	pq_sendint(&message, columnCount, 2);
+	for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+	{
+		pq_sendint(&message, format, 2);
+	}
+	pq_endmessage(&message);
+}
+
+/*
+ * CopyOutColumnCount returns the number of columns COPY TO emits for the table.
+ */
+static int
+CopyOutColumnCount(CopyStmt *copyStatement, Oid tableId)
+{
+	Relation relation = NULL;
+	TupleDesc tupleDescriptor = NULL;
+	int columnCount = 0;
+	int attributeIndex = 0;
+
+	if (copyStatement->attlist != NIL)
+	{
+		return list_length(copyStatement->attlist);
+	}
+
+	relation = heap_open(tableId, AccessShareLock);
+	tupleDescriptor = RelationGetDescr(relation);
+	for (attributeIndex = 0; attributeIndex < tupleDescriptor->natts; attributeIndex++)
+	{
+		if (!tupleDescriptor->attrs[attributeIndex]->attisdropped)
+		{
+			columnCount++;
+		}
+	}
+	heap_close(relation, AccessShareLock);
+
+	return columnCount;
+}
+
+/*
+ * CopyToThroughSelect copies the table by rewriting the statement into a COPY
+ * of a SELECT query, which the executor runs across all shards. It is used for
+ * the cases the streaming COPY TO does not handle.
+ */
+static void
+CopyToThroughSelect(CopyStmt *copyStatement, char const *query, char *completionTag)
+{
+	RangeVar *relation = copyStatement->relation;
+	uint64 processedCount = 0;
+	char const *qualifiedName = quote_qualified_identifier(relation->schemaname,
+														   relation->relname);
+	StringInfo queryString = makeStringInfo();
+	List *queryList = NULL;
+
+	appendStringInfo(queryString, "select * from %s", qualifiedName);
+	queryList = raw_parser(queryString->data);
+
+	copyStatement->query = linitial(queryList);
+	copyStatement->relation = NULL;
+	
+	/* Collecting data from shards will be done by select handler */
+	DoCopy(copyStatement, query, &processedCount);
+	if (completionTag)
+	{
+		snprintf(completionTag, COMPLETION_TAG_BUFSIZE,
+				 "COPY " UINT64_FORMAT, processedCount);
+	}
+}
+
+/*
+ * PgShardCopyTo copies a distributed table by running COPY TO STDOUT on one
+ * healthy placement of every shard and passing the data on to the client, file
+ * or program without parsing it. Shards are emitted in shard identifier order.
+ * Up to pg_shard.copy_prefetch_shards following shards are read concurrently with
+ * the current one; their data is buffered until their turn comes, within work_mem
+ * in total and in temporary files beyond it.
+ */
+static void
+PgShardCopyTo(CopyStmt *copyStatement, char const *query, char *completionTag)
+{
+	RangeVar *relation = copyStatement->relation;
+	Oid tableId = RangeVarGetRelid(relation, AccessShareLock, false);
+	CopyOutDestination destination;
+	CopyOutShard *shardArray = NULL;
+	List *shardIntervalList = NIL;
+	ListCell *cell = NULL;
+	bool toFrontend = (copyStatement->filename == NULL);
+	bool csvHeader = false;
+	bool hasEncoding = false;
+	bool withOids = false;
+	uint64 processedCount = 0;
+	int shardCount = 0;
+	int shardIndex = 0;
+	int bufferLimit = 0;
+	AclResult aclResult = ACLCHECK_OK;
+
+	memset(&destination, 0, sizeof(destination));
+
+	/* shards are read with the worker's permissions, so check the table here */
+	aclResult = pg_class_aclcheck(tableId, GetUserId(), ACL_SELECT);
+	if (aclResult != ACLCHECK_OK)
+	{
+		aclcheck_error(aclResult, ACL_KIND_CLASS, get_rel_name(tableId));
+	}
+
+	foreach(cell, copyStatement->options)
+	{
+		DefElem *option = (DefElem *) lfirst(cell);
+
+		if (strcmp(option->defname, "format") == 0)
+		{
+			destination.binary = (strcmp(defGetString(option), "binary") == 0);
+		}
+		else if (strcmp(option->defname, "header") == 0)
+		{
+			csvHeader = defGetBoolean(option);
+		}
+		else if (strcmp(option->defname, "encoding") == 0)
+		{
+			hasEncoding = true;
+		}
+		else if (strcmp(option->defname, "oids") == 0)
+		{
+			withOids = defGetBoolean(option);
+		}
+	}
+
+	/* OIDs differ between shards, and the 2.0 protocol uses its own messages */
+	if (withOids || (toFrontend && PG_PROTOCOL_MAJOR(FrontendProtocol) < 3))
+	{
+		CopyToThroughSelect(copyStatement, query, completionTag);
+		return;
+	}
+
+	shardIntervalList = LookupShardIntervalList(tableId);
+	if (shardIntervalList == NIL)
+	{
+		char *relationName = get_rel_name(tableId);
+		ereport(ERROR, (errmsg("could not find any shards for query"),
+						errdetail("No shards exist for distributed table \"%s\".",
+								  relationName)));
+	}
+	shardIntervalList = SortList(shardIntervalList, CompareShardIntervalsById);
+
+	shardCount = list_length(shardIntervalList);
+	shardArray = palloc0(shardCount * sizeof(CopyOutShard));
+
+	/* shards read ahead share work_mem for the data they buffer */
+	bufferLimit = (int) Min((int64) work_mem * 1024L / Max(PgShardCopyPrefetchShards, 1),
+							(int64) (MaxAllocSize / 2));
+	foreach(cell, shardIntervalList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(cell);
+		CopyOutShard *shard = &shardArray[shardIndex];
+
+		LockShardDistributionMetadata(shardInterval->id, ShareLock);
+
+		shard->shardId = shardInterval->id;
+		shard->placementList = LoadFinalizedShardPlacementList(shardInterval->id);
+		shard->bufferLimit = bufferLimit;
+		shard->copyCommand = ConstructCopyOutStatement(copyStatement, shard->shardId,
+													   csvHeader && shardIndex == 0,
+													   !hasEncoding && !destination.binary);
+		shardIndex++;
+	}
+
+	if (toFrontend)
+	{
+		SendCopyOutBegin(destination.binary, CopyOutColumnCount(copyStatement, tableId));
+	}
+	else if (copyStatement->is_program)
+	{
+		destination.isProgram = true;
+		destination.copyFile = OpenPipeStream(copyStatement->filename, PG_BINARY_W);
+		if (destination.copyFile == NULL)
+		{
+			ereport(ERROR, (errmsg("could not execute command \"%s\": %m",
+								   copyStatement->filename)));
+		}
+	}
+	else
+	{
+		mode_t oldUmask = 0;
+
+		if (!is_absolute_path(copyStatement->filename))
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_NAME),
+							errmsg("relative path not allowed for COPY to file")));
+		}
+
+		oldUmask = umask(S_IWGRP | S_IWOTH);
+		destination.copyFile = AllocateFile(copyStatement->filename, PG_BINARY_W);
+		umask(oldUmask);
+		if (destination.copyFile == NULL)
+		{
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not open file \"%s\" for writing: %m",
+								   copyStatement->filename)));
+		}
+	}
+
+	PG_TRY();
+	{
+		int startedCount = 0;
+
+		if (destination.binary)
+		{
+			CopyOutSendData(&destination, BinarySignature, sizeof(BinarySignature));
+			CopyOutSendData(&destination, BinaryHeaderTail, sizeof(BinaryHeaderTail));
+		}
+
+		for (shardIndex = 0; shardIndex < shardCount; shardIndex++)
+		{
+			int lastPrefetched = Min(shardIndex + PgShardCopyPrefetchShards, shardCount - 1);
+
+			for (; startedCount <= lastPrefetched; startedCount++)
+			{
+				StartShardCopyOut(&shardArray[startedCount]);
+			}
+
+			processedCount += StreamShardCopyOut(shardArray, shardIndex, startedCount,
+												 &destination);
+		}
+
+		if (destination.binary)
+		{
+			CopyOutSendData(&destination, BinaryTrailer, sizeof(BinaryTrailer));
+		}
+	}
+	PG_CATCH();
+	{
+		for (shardIndex = 0; shardIndex < shardCount; shardIndex++)
+		{
+			FinishShardCopyOut(&shardArray[shardIndex]);
+		}
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (toFrontend)
+	{
+		pq_putemptymessage('c');
+	}
+	else if (destination.isProgram)
+	{
+		int exitStatus = ClosePipeStream(destination.copyFile);
+		if (exitStatus != 0)
+		{
+			ereport(ERROR, (errmsg("program \"%s\" failed", copyStatement->filename),
+							errdetail_internal("%s", wait_result_to_str(exitStatus))));
+		}
+	}
+	else if (FreeFile(destination.copyFile) != 0)
+	{
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not close file \"%s\": %m",
+							   copyStatement->filename)));
+	}
+
+	if (completionTag)
+	{
+		snprintf(completionTag, COMPLETION_TAG_BUFSIZE,
+				 "COPY " UINT64_FORMAT, processedCount);
+	}
+}
+
+/*
+ * CopyGetBinaryData reads up to length bytes of binary COPY data from the COPY
+ * source. It mirrors CopyGetData in copy.c, which is not exported, for files,
+ * programs and the 3.0 frontend protocol. The function returns the number of
+ * bytes read, which is less than length only at the end of the input.
+ */
+static int
+CopyGetBinaryData(CopyStateData *copyState, char *destination, int length)
+{
+	int bytesRead = 0;
+
+	if (copyState->copy_dest == COPY_FILE)
+	{
+		bytesRead = fread(destination, 1, length, copyState->copy_file);
+		if (ferror(copyState->copy_file))
+		{
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not read from COPY file: %m")));
+		}
+
+		return bytesRead;
+	}
+
+	Assert(copyState->copy_dest == COPY_NEW_FE);
+
+	while (bytesRead < length && !copyState->fe_eof)
+	{
+		StringInfo messageBuffer = copyState->fe_msgbuf;
+		int availableBytes = 0;
+
+		while (messageBuffer->cursor >= messageBuffer->len)
+		{
+			int messageType = 0;
+
+readmessage:
+#if PG_VERSION_NUM >= 90500
+			HOLD_CANCEL_INTERRUPTS();
+#endif
+			pq_startmsgread();
+			messageType = pq_getbyte();
+			if (messageType == EOF || pq_getmessage(messageBuffer, 0))
+			{
+				ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+								errmsg("unexpected EOF on client connection with "
+									   "an open transaction")));
+			}
+#if PG_VERSION_NUM >= 90500
+			RESUME_CANCEL_INTERRUPTS();
+#endif
+
+			switch (messageType)
+			{
+				case 'd':   /* CopyData */
+				{
+					break;
+				}
+
+				case 'c':   /* CopyDone */
+				{
+					copyState->fe_eof = true;
+					return bytesRead;
+				}
+
+				case 'f':   /* CopyFail */
+				{
+					ereport(ERROR, (errcode(ERRCODE_QUERY_CANCELED),
+									errmsg("COPY from stdin failed: %s",
+										   pq_getmsgstring(messageBuffer))));
+					break;
+				}
+
+				case 'H':   /* Flush */
+				case 'S':   /* Sync */
+				{
+					/* ignore, as copy.c does */
+					goto readmessage;
+				}
+
+				default:
+				{
+					ereport(ERROR, (errcode(ERRCODE_PROTOCOL_VIOLATION),
+									errmsg("unexpected message type 0x%02X during "
+										   "COPY from stdin", messageType)));
+					break;
+				}
+			}
+		}
+
+		availableBytes = Min(messageBuffer->len - messageBuffer->cursor,
+							 length - bytesRead);
+		pq_copymsgbytes(messageBuffer, destination + bytesRead, availableBytes);
+		bytesRead += availableBytes;
+	}
+
+	return bytesRead;
+}
+
+
+/*
+ * AppendBinaryCopyData reads byteCount bytes of binary COPY data and appends them
+ * to the given row buffer. The function returns false if the input ended first.
+ */
+static bool
+AppendBinaryCopyData(CopyStateData *copyState, StringInfo rowBuffer, int byteCount)
+{
+	int bytesRead = 0;
+
+	enlargeStringInfo(rowBuffer, byteCount);
+	bytesRead = CopyGetBinaryData(copyState, rowBuffer->data + rowBuffer->len,
+								  byteCount);
+	rowBuffer->len += bytesRead;
+	rowBuffer->data[rowBuffer->len] = '\0';
+
+	return (bytesRead == byteCount);
+}
+
+
+/*
+ * NextBinaryCopyRow reads the next row of a binary COPY into rowBuffer without
+ * converting its fields. Only the partition column is passed to its receive
+ * function so that the row can be routed; the raw row bytes are forwarded to
+ * shard placements unchanged. The function returns false at the end of input.
+ */
+static bool
+NextBinaryCopyRow(CopyStateData *copyState, StringInfo rowBuffer,
+				  PartitionField *partitionField, Datum *partitionValue,
+				  bool *partitionNull)
+{
+	int16 fieldCount = 0;
+	int expectedFieldCount = list_length(copyState->attnumlist);
+	int fieldIndex = 0;
+	uint16 networkInt16 = 0;
+	uint32 networkInt32 = 0;
+
+	resetStringInfo(rowBuffer);
+	copyState->cur_lineno++;
+
+	if (!AppendBinaryCopyData(copyState, rowBuffer, sizeof(int16)))
+	{
+		/* end of input without a trailer, which copy.c also accepts */
+		return false;
+	}
+
+	memcpy(&networkInt16, rowBuffer->data, sizeof(int16));
+	fieldCount = (int16) ntohs(networkInt16);
+
+	if (fieldCount == -1)
+	{
+		char dummy = '\0';
+
+		/* after the trailer, the client may only send CopyDone */
+		if (copyState->copy_dest == COPY_NEW_FE &&
+			CopyGetBinaryData(copyState, &dummy, 1) > 0)
+		{
+			ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+							errmsg("received copy data after EOF marker")));
+		}
+
+		return false;
+	}
+
+	if (fieldCount != expectedFieldCount)
+	{
+		ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+						errmsg("row field count is %d, expected %d",
+							   (int) fieldCount, expectedFieldCount)));
+	}
+
+	for (fieldIndex = 0; fieldIndex < fieldCount; fieldIndex++)
+	{
+		int32 fieldLength = 0;
+		int fieldStart = 0;
+
+		if (!AppendBinaryCopyData(copyState, rowBuffer, sizeof(int32)))
+		{
+			ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+							errmsg("unexpected EOF in COPY data")));
+		}
+
+		memcpy(&networkInt32, rowBuffer->data + rowBuffer->len - sizeof(int32),
+			   sizeof(int32));
+		fieldLength = (int32) ntohl(networkInt32);
+		if (fieldLength < -1)
+		{
+			ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+							errmsg("invalid field size")));
+		}
+
+		fieldStart = rowBuffer->len;
+		if (fieldLength > 0 && !AppendBinaryCopyData(copyState, rowBuffer, fieldLength))
+		{
+			ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+							errmsg("unexpected EOF in COPY data")));
+		}
+
+		if (fieldIndex != partitionField->fieldIndex)
+		{
+			continue;
+		}
+
+		*partitionNull = (fieldLength == -1);
+		if (!(*partitionNull))
+		{
+			StringInfoData fieldBuffer;
+
+			/* the field is followed by the terminating zero AppendBinaryCopyData adds */
+			fieldBuffer.data = rowBuffer->data + fieldStart;
+			fieldBuffer.len = fieldLength;
+			fieldBuffer.maxlen = fieldLength + 1;
+			fieldBuffer.cursor = 0;
+
+			copyState->cur_attname = partitionField->columnName;
+			*partitionValue = ReceiveFunctionCall(&partitionField->receiveFunction,
+												  &fieldBuffer,
+												  partitionField->typeIOParam,
+												  partitionField->typeMod);
+			if (fieldBuffer.cursor != fieldBuffer.len)
+			{
+				ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+								errmsg("incorrect binary data format")));
+			}
+			copyState->cur_attname = NULL;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * InitPartitionField finds the position of the partition column among the
+ * fields of the COPY input and, for binary input, looks up the function that
+ * converts it from the binary format. The function returns false if the
+ * partition column is not part of the input.
+ */
+static bool
+InitPartitionField(CopyStateData *copyState, TupleDesc tupleDescriptor,
+				   Var *partitionColumn, PartitionField *partitionField)
+{
+	Form_pg_attribute partitionAttribute =
+		tupleDescriptor->attrs[partitionColumn->varattno - 1];
+	ListCell *attnumCell = NULL;
+	int fieldIndex = 0;
+	Oid receiveFunctionId = InvalidOid;
+
+	partitionField->fieldIndex = -1;
+	partitionField->columnName = NameStr(partitionAttribute->attname);
+	partitionField->typeMod = partitionAttribute->atttypmod;
+
+	foreach(attnumCell, copyState->attnumlist)
+	{
+		if (lfirst_int(attnumCell) == partitionColumn->varattno)
+		{
+			partitionField->fieldIndex = fieldIndex;
+			break;
+		}
+		fieldIndex++;
+	}
+
+	if (partitionField->fieldIndex < 0)
+	{
+		return false;
+	}
+
+	if (copyState->binary)
+	{
+		getTypeBinaryInputInfo(partitionAttribute->atttypid, &receiveFunctionId,
+							   &partitionField->typeIOParam);
+		fmgr_info(receiveFunctionId, &partitionField->receiveFunction);
+	}
+
+	return true;
+}
+
+
+/*
+ * NextCopyRoutingFields reads the next line of a text or CSV COPY and splits it
+ * into fields, but unlike NextCopyFrom only runs the input function of the
+ * partition column. All other fields are validated by the shard placements,
+ * which receive the line unchanged. Field count checks and CSV null handling
+ * follow NextCopyFrom so that malformed lines are still rejected here. The
+ * function returns false at the end of input.
+ */
+static bool
+NextCopyRoutingFields(CopyStateData *copyState, TupleDesc tupleDescriptor,
+					  PartitionField *partitionField, Var *partitionColumn,
+					  Datum *partitionValue, bool *partitionNull)
+{
+	char **fieldArray = NULL;
+	int fieldCount = 0;
+	int expectedFieldCount = list_length(copyState->attnumlist);
+	int attributeIndex = partitionColumn->varattno - 1;
+	char *partitionString = NULL;
+
+	if (!NextCopyFromRawFields(copyState, &fieldArray, &fieldCount))
+	{
+		return false;
+	}
+
+	if (fieldCount > expectedFieldCount)
+	{
+		ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+						errmsg("extra data after last expected column")));
+	}
+	else if (fieldCount < expectedFieldCount)
+	{
+		int missingAttributeNumber = list_nth_int(copyState->attnumlist, fieldCount);
+		Form_pg_attribute missingAttribute =
+			tupleDescriptor->attrs[missingAttributeNumber - 1];
+
+		ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+						errmsg("missing data for column \"%s\"",
+							   NameStr(missingAttribute->attname))));
+	}
+
+	partitionString = fieldArray[partitionField->fieldIndex];
+	if (copyState->csv_mode)
+	{
+		if (partitionString == NULL && copyState->force_notnull_flags[attributeIndex])
+		{
+			partitionString = copyState->null_print;
+		}
+#if PG_VERSION_NUM >= 90400
+		else if (partitionString != NULL && copyState->force_null_flags[attributeIndex] &&
+				 strcmp(partitionString, copyState->null_print) == 0)
+		{
+			partitionString = NULL;
+		}
+#endif
+	}
+
+	*partitionNull = (partitionString == NULL);
+	if (!(*partitionNull))
+	{
+		copyState->cur_attname = partitionField->columnName;
+		copyState->cur_attval = partitionString;
+		*partitionValue = InputFunctionCall(&copyState->in_functions[attributeIndex],
+											partitionString,
+											copyState->typioparams[attributeIndex],
+											partitionField->typeMod);
+		copyState->cur_attname = NULL;
+		copyState->cur_attval = NULL;
+	}
+
+	return true;
+}
+
+
+/*
+ * AppendToAllPlacements adds the given data to the send buffers of all shard
+ * placements participating in the COPY over connections of their own.
+ */
+static void
+AppendToAllPlacements(HTAB *connectionHash, char const *data, int length)
+{
+	HASH_SEQ_STATUS hashCursor;
+	ShardConnections *shardConn = NULL;
+	int i = 0;
+
+	hash_seq_init(&hashCursor, connectionHash);
+	while ((shardConn = (ShardConnections *) hash_seq_search(&hashCursor)) != NULL)
+	{
+		for (i = 0; i < shardConn->replicaCount; i++)
+		{
+			if (shardConn->placements[i].copyConnection == NULL)
+			{
+				appendBinaryStringInfo(&shardConn->placements[i].buffer, data, length);
+			}
+		}
+	}
+}
+
+
+/*
+ * CopyInputOffset returns the offset in the COPY input file at which the next
+ * line starts: the file position minus the data copy.c has read ahead into its
+ * raw buffer, but not consumed yet.
+ */
+static off_t
+CopyInputOffset(CopyStateData *copyState)
+{
+	off_t filePosition = ftello(copyState->copy_file);
+
+	return filePosition - (copyState->raw_buf_len - copyState->raw_buf_index);
+}
+
+
+/*
+ * PreparedPlacementList returns the prepared transactions of all placements
+ * participating in the COPY and closes their connections without finishing
+ * the transactions.
+ */
+static List *
+PreparedPlacementList(HTAB *connectionHash, HTAB *nodeConnectionHash)
+{
+	List *preparedPlacementList = NIL;
+	HASH_SEQ_STATUS hashCursor;
+	ShardConnections *shardConn = NULL;
+	int i = 0;
+
+	hash_seq_init(&hashCursor, connectionHash);
+	while ((shardConn = (ShardConnections *) hash_seq_search(&hashCursor)) != NULL)
+	{
+		for (i = 0; i < shardConn->replicaCount; i++)
+		{
+			PlacementConnection *placement = &shardConn->placements[i];
+			PreparedPlacement *preparedPlacement = NULL;
+
+			if (placement->copyConnection != NULL)
+			{
+				continue;
+			}
+
+			preparedPlacement = palloc0(sizeof(PreparedPlacement));
+			Assert(placement->prepared);
+			strlcpy(preparedPlacement->nodeName, PQhost(placement->conn),
+					MAX_NODE_LENGTH + 1);
+			preparedPlacement->nodePort = pg_atoi(PQport(placement->conn),
+												  sizeof(int32), 0);
+			strlcpy(preparedPlacement->transactionName,
+					PgShardPreparedTransactionName(placement->id), NAMEDATALEN);
+			preparedPlacementList = lappend(preparedPlacementList, preparedPlacement);
+
+			PQfinish(placement->conn);
+		}
+	}
+
+	if (nodeConnectionHash != NULL)
+	{
+		NodeCopyConnections *nodeConnections = NULL;
+
+		hash_seq_init(&hashCursor, nodeConnectionHash);
+		while ((nodeConnections = (NodeCopyConnections *) hash_seq_search(&hashCursor)) != NULL)
+		{
+			for (i = 0; i < PgShardCopyConnectionsPerNode; i++)
+			{
+				CopyConnection *copyConnection = &nodeConnections->connections[i];
+				PreparedPlacement *preparedPlacement = NULL;
+
+				if (copyConnection->conn == NULL)
+				{
+					continue;
+				}
+
+				preparedPlacement = palloc0(sizeof(PreparedPlacement));
+				Assert(copyConnection->prepared);
+				strlcpy(preparedPlacement->nodeName, nodeConnections->key.nodeName,
+						MAX_NODE_LENGTH + 1);
+				preparedPlacement->nodePort = nodeConnections->key.nodePort;
+				strlcpy(preparedPlacement->transactionName,
+						PgShardPreparedTransactionName(copyConnection->transactionId),
+						NAMEDATALEN);
+				preparedPlacementList = lappend(preparedPlacementList, preparedPlacement);
+
+				PQfinish(copyConnection->conn);
+				copyConnection->conn = NULL;
+			}
+		}
+	}
+
+	return preparedPlacementList;
+}
+
+
+/*
+ * CopyRowsToShards reads the input of a COPY FROM, routes each row to its shard
+ * and sends it to all finalized placements of that shard. By default the rows
+ * are committed through the configured transaction manager before returning.
+ *
+ * If inputRange is given, only lines starting within that byte range of the
+ * input file are copied and the distributed transaction is left prepared; the
+ * prepared placements are returned in preparedPlacementList so that the caller
+ * can commit them. Parallel COPY workers use this mode.
+ */
+static uint64
+CopyRowsToShards(CopyStmt *copyStatement, Oid tableId, CopyInputRange *inputRange,
+				 List **preparedPlacementList)
+{
+	ListCell *shardIntervalCell = NULL;
+	List *shardIntervalList = NULL;
+	char *relationName = NULL;
+	PgShardTransactionManager const *transactionManager =
+		&PgShardTransManagerImpl[PgShardCurrTransManager];
+	HTAB *shardToConn = NULL;
+	HTAB *nodeToConn = NULL;
+	MemoryContext tupleContext = NULL;
+	CopyState copyState = NULL;
+	bool nextRowFound = true;
+	TupleDesc tupleDescriptor = NULL;
+	uint32 columnCount = 0;
+	Datum *columnValues = NULL;
+	bool *columnNulls = NULL;
+	Var *partitionColumn = NULL;
+	ShardId failedShard = INVALID_SHARD_ID;
+	Relation rel = NULL;
+	StringInfo lineBuf;
+	StringInfoData binaryRowBuf;
+	PartitionField partitionField;
+	bool routingFieldsOnly = false;
+	ShardConnections *shardConnections = NULL;
+	ShardInterval **shardIntervalCache = NULL;
+	ShardConnections **shardConnectionArray = NULL;
+	Datum partitionColumnValue = 0;
+	bool partitionColumnNull = false;
+	int i = 0;
+	uint64 processedCount = 0;
+	ErrorContextCallback errorCallback;
+	int bufferThreshold = PgShardCopyBufferSize * 1024;
+	int batchThreshold = (PgShardCopyBufferSize > 0 ? PgShardCopyBufferSize :
+						  DEFAULT_COPY_BUFFER_SIZE) * 1024;
+	int highWaterMark = Max(PgShardCopyHighWaterMark, PgShardCopyBufferSize) * 1024;
+	PlacementBacklog backlog;
+
+	relationName = get_rel_name(tableId);
+
+	shardIntervalList = LookupShardIntervalList(tableId);
+	if (shardIntervalList == NIL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("could not find any shards for query"),
+						errdetail("No shards exist for distributed table \"%s\".",
+								  relationName),
+						errhint("Run master_create_worker_shards to create shards "
+								"and try again.")));
+	}
+
+	partitionColumn = PartitionColumn(tableId);
+
+	/* allocate column values and nulls arrays */
+	rel = heap_open(tableId, AccessShareLock);
+	tupleDescriptor = RelationGetDescr(rel);
+	columnCount = tupleDescriptor->natts;
+	columnValues = palloc0(columnCount * sizeof(Datum));
+	columnNulls = palloc0(columnCount * sizeof(bool));
+
+	/*
+	 * We create a new memory context called tuple context, and read and write
+	 * each row's values within this memory context. After each read and write,
+	 * we reset the memory context. That way, we immediately release memory
+	 * allocated for each row, and don't bloat memory usage with large input
+	 * files.
+	 */
+	tupleContext = AllocSetContextCreate(CurrentMemoryContext,
+										 "COPY Row Memory Context",
+										 ALLOCSET_DEFAULT_MINSIZE,
+										 ALLOCSET_DEFAULT_INITSIZE,
+										 ALLOCSET_DEFAULT_MAXSIZE);
+
+	/*
+	 * Construct hash table used for shardId->Connection mapping.
+	 * We can not use connection cache from connection.c used by GteConnection because
+	 * we need to establish multiple connections with each nodes: one connection per shard
+	 */
+	shardToConn = CreateShardToConnectionHash();
+	InitPlacementBacklog(&backlog);
+
+	/*
+	 * If the number of connections per node is limited, placements share those
+	 * connections instead and receive their rows in per-shard COPY batches.
+	 */
+	if (PgShardCopyConnectionsPerNode > 0)
+	{
+		nodeToConn = CreateNodeToConnectionHash();
+	}
+
+	/* init state to read from COPY data source */
+	copyState = BeginCopyFrom(rel, copyStatement->filename,
+							  copyStatement->is_program,
+							  copyStatement->attlist,
+							  copyStatement->options);
+
+	/*
+	 * Binary rows are forwarded without conversion, so we read them ourselves
+	 * and only decode the partition column.
+	 */
+	if (copyState->binary)
+	{
+		if (copyState->copy_dest == COPY_OLD_FE)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("binary COPY is not supported over the 2.0 "
+								   "frontend protocol")));
+		}
+
+		if (copyState->file_has_oids)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("binary COPY of data with OIDs is not supported "
+								   "for distributed tables")));
+		}
+
+		if (!InitPartitionField(copyState, tupleDescriptor, partitionColumn,
+								&partitionField))
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot copy binary data without the partition "
+								   "column"),
+							errhint("Include column \"%s\" in the column list.",
+									partitionField.columnName)));
+		}
+
+		initStringInfo(&binaryRowBuf);
+	}
+	else
+	{
+		/*
+		 * Text lines are forwarded as they are, so only the partition column
+		 * needs to be converted. If it is not part of the input, its value comes
+		 * from the column default, which only NextCopyFrom evaluates; the same
+		 * goes for OIDs in the input.
+		 */
+		routingFieldsOnly = !copyState->file_has_oids &&
+							InitPartitionField(copyState, tupleDescriptor,
+											   partitionColumn, &partitionField);
+	}
+
+	/* start reading at the first line of the range; nothing was read so far */
+	if (inputRange != NULL && fseeko(copyState->copy_file, inputRange->startOffset,
+									 SEEK_SET) != 0)
+	{
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not seek in COPY file: %m")));
+	}
+
+	/* Set up callback to identify error line number */
+	errorCallback.callback = CopyFromErrorCallback;
+	errorCallback.arg = (void *) copyState;
+	errorCallback.previous = error_context_stack;
+	error_context_stack = &errorCallback;
+
+	PG_TRY();
+	{
+		DistributedTableCacheEntry *cacheEntry = NULL;
+		ShardRouter *shardRouter = NULL;
+		Datum batchValues[SHARD_ROUTER_BATCH_SIZE];
+		int batchShardIndexes[SHARD_ROUTER_BATCH_SIZE];
+		int batchLineEnds[SHARD_ROUTER_BATCH_SIZE];
+		int batchLineNumbers[SHARD_ROUTER_BATCH_SIZE];
+		StringInfoData batchLines;
+		int batchCount = 0;
+
+		/* Lock all shards in shared mode */
+		shardIntervalList = SortList(shardIntervalList, CompareTasksByShardId);
+		foreach(shardIntervalCell, shardIntervalList)
+		{
+			ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
+			LockShardData(shardInterval->id, ShareLock);
+			LockShardDistributionMetadata(shardInterval->id, ShareLock);
+		}
+
+		cacheEntry = LookupDistributedTableCacheEntry(tableId);
+		shardRouter = CreateShardRouter(cacheEntry);
+		shardIntervalCache = shardRouter->shardIntervalArray;
+
+		/* connections by position in shardIntervalCache, set up on first use */
+		shardConnectionArray = palloc0(shardRouter->shardCount * sizeof(ShardConnections*));
+
+		/*
+		 * Rows are read into batches whose partition values are routed together.
+		 * Values may point into the tuple context, which is therefore only reset
+		 * once a batch has been sent.
+		 */
+		initStringInfo(&batchLines);
+
+		while (true)
+		{
+			int batchIndex = 0;
+			int lineStart = 0;
+
+			nextRowFound = false;
+			if (inputRange == NULL ||
+				CopyInputOffset(copyState) < inputRange->endOffset)
+			{
+				MemoryContext oldContext = MemoryContextSwitchTo(tupleContext);
+
+				if (copyState->binary)
+				{
+					nextRowFound = NextBinaryCopyRow(copyState, &binaryRowBuf,
+													 &partitionField,
+													 &partitionColumnValue,
+													 &partitionColumnNull);
+				}
+				else if (routingFieldsOnly)
+				{
+					nextRowFound = NextCopyRoutingFields(copyState, tupleDescriptor,
+														 &partitionField,
+														 partitionColumn,
+														 &partitionColumnValue,
+														 &partitionColumnNull);
+				}
+				else
+				{
+					nextRowFound = NextCopyFrom(copyState, NULL, columnValues,
+												columnNulls, NULL);
+					if (nextRowFound)
+					{
+						partitionColumnValue = columnValues[partitionColumn->varattno - 1];
+						partitionColumnNull = columnNulls[partitionColumn->varattno - 1];
+					}
+				}
+				MemoryContextSwitchTo(oldContext);
+			}
+
+			if (nextRowFound)
+			{
+				CHECK_FOR_INTERRUPTS();
+
+				if (partitionColumnNull)
+				{
+					ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+									errmsg("cannot copy row with NULL value "
+										   "in partition column")));
+				}
+
+				if (copyState->binary)
+				{
+					appendBinaryStringInfo(&batchLines, binaryRowBuf.data,
+										   binaryRowBuf.len);
+				}
+				else
+				{
+					lineBuf = CopyGetLineBuf(copyState);
+					appendBinaryStringInfo(&batchLines, lineBuf->data, lineBuf->len);
+					appendStringInfoChar(&batchLines, '\n');
+				}
+
+				batchValues[batchCount] = partitionColumnValue;
+				batchLineEnds[batchCount] = batchLines.len;
+				batchLineNumbers[batchCount] = copyState->cur_lineno;
+				batchCount++;
+			}
+
+			if (batchCount == SHARD_ROUTER_BATCH_SIZE || (!nextRowFound && batchCount > 0))
+			{
+				ShardRouterRouteBatch(shardRouter, batchValues, batchCount,
+									  batchShardIndexes);
+
+				for (batchIndex = 0; batchIndex < batchCount; batchIndex++)
+				{
+					int shardIndex = batchShardIndexes[batchIndex];
+					char *lineData = batchLines.data + lineStart;
+					int lineLength = batchLineEnds[batchIndex] - lineStart;
+					ShardId shardId = 0;
+					bool found = false;
+
+					lineStart = batchLineEnds[batchIndex];
+
+					if (shardIndex < 0)
+					{
+						/* point the error context at the row, not the last one read */
+						copyState->cur_lineno = batchLineNumbers[batchIndex];
+						copyState->line_buf_valid = false;
+						ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+										errmsg("Inconsistency in distribution table for \"%s\"",
+											   relationName)));
+					}
+					shardId = shardIntervalCache[shardIndex]->id;
+
+					/*
+					 * Rows find their connections through the dense array; the hash
+					 * only serves to iterate over them when the transaction ends.
+					 */
+					shardConnections = shardConnectionArray[shardIndex];
+					if (shardConnections == NULL)
+					{
+						shardConnections =
+							(ShardConnections *) hash_search(shardToConn, &shardId,
+															 HASH_ENTER, &found);
+						Assert(!found);
+						InitializeShardConnections(copyStatement, shardConnections,
+												   shardId, transactionManager,
+												   copyState->binary, nodeToConn);
+						shardConnectionArray[shardIndex] = shardConnections;
+					}
+
+					/*
+					 * Replicate row to all shard placements. Rows are accumulated in
+					 * the placement's buffer and sent once the buffer exceeds the
+					 * threshold; remaining data is flushed when the transaction is
+					 * prepared. A placement that cannot keep up only stops the load
+					 * once its unsent data exceeds the high-water mark. Placements on
+					 * shared connections send each full buffer as a batch instead;
+					 * as each batch starts a COPY, they never send single rows.
+					 */
+					for (i = 0; i < shardConnections->replicaCount; i++)
+					{
+						PlacementConnection *placement = &shardConnections->placements[i];
+						bool sendFailed = false;
+
+						appendBinaryStringInfo(&placement->buffer, lineData, lineLength);
+						if (placement->copyConnection != NULL)
+						{
+							if (placement->buffer.len >= batchThreshold)
+							{
+								sendFailed = !SendPlacementBatch(placement, shardId,
+																 copyState->binary);
+							}
+						}
+						else if (placement->buffer.len >= bufferThreshold)
+						{
+							sendFailed = !SendPlacementBuffer(placement);
+						}
+
+						if (sendFailed)
+						{
+							ereport(ERROR, (errcode(ERRCODE_IO_ERROR),
+											  errmsg("Copy failed for placement %ld for %ld",
+													 (long) placement->id,
+													 (long) shardId)));
+						}
+
+						if (placement->copyConnection == NULL &&
+							(placement->flushPending ||
+							 placement->buffer.len >= bufferThreshold))
+						{
+							AddToPlacementBacklog(&backlog, placement);
+						}
+
+						if (placement->copyConnection == NULL &&
+							placement->buffer.len >= highWaterMark)
+						{
+							WaitForPlacementBuffers(&backlog, placement, highWaterMark);
+						}
+					}
+				}
+
+				processedCount += batchCount;
+				batchCount = 0;
+				resetStringInfo(&batchLines);
+				MemoryContextReset(tupleContext);
+			}
+
+			if (!nextRowFound)
+			{
+				MemoryContextReset(tupleContext);
+				break;
+			}
+		}
+
+		/* terminate the binary data sent to each placement */
+		if (copyState->binary)
+		{
+			AppendToAllPlacements(shardToConn, BinaryTrailer, sizeof(BinaryTrailer));
+		}
+
+		/* Perform two phase commit in replicas */
+		failedShard = PgCopyPrepareTransaction(shardToConn, nodeToConn, &backlog,
+											   copyState->binary);
+	}
+	PG_CATCH(); /* do recovery */
+	{
+		EndCopyFrom(copyState);
+		heap_close(rel, AccessShareLock);
+
+		/* Rollback transactions */
+		PgCopyAbortTransaction(shardToConn, nodeToConn);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	EndCopyFrom(copyState);
+	heap_close(rel, AccessShareLock);
+
+	/* Done, clean up */
+	error_context_stack = errorCallback.previous;
+
+	/* Complete two phase commit */
+	if (failedShard != INVALID_SHARD_ID)
+	{
+		PgCopyAbortTransaction(shardToConn, nodeToConn);
+		ereport(ERROR, (errcode(ERRCODE_IO_ERROR),
+						errmsg("COPY failed for shard %ld", (long) failedShard)));
+	}
+	else if (QueryCancelPending)
+	{
+		PgCopyAbortTransaction(shardToConn, nodeToConn);
+		ereport(ERROR, (errcode(ERRCODE_IO_ERROR),
+						errmsg("COPY was canceled")));
+	}
+	else if (preparedPlacementList != NULL)
+	{
+		*preparedPlacementList = PreparedPlacementList(shardToConn, nodeToConn);
+	}
+	else
+	{
+		PgCopyEndTransaction(shardToConn, nodeToConn);
+	}
+
+	return processedCount;
+}
+
+#if PG_VERSION_NUM >= 90500
+
+/* ParallelCopyWorkerStatus tracks the progress of a parallel COPY worker */
+typedef enum ParallelCopyWorkerStatus
+{
+	PARALLEL_COPY_NOT_STARTED = 0,
+	PARALLEL_COPY_RUNNING = 1,
+	PARALLEL_COPY_PREPARED = 2,
+	PARALLEL_COPY_FAILED = 3
+} ParallelCopyWorkerStatus;
+
+
+/*
+ * ParallelCopyWorkerState is the part of the parallel COPY shared memory owned
+ * by one worker. The leader fills in the input range, the worker reports its
+ * progress, row count and the number of transactions it prepared.
+ */
+typedef struct ParallelCopyWorkerState
+{
+	CopyInputRange inputRange;
+	ParallelCopyWorkerStatus status;
+	uint64 processedCount;
+	int preparedCount;
+	char errorMessage[PARALLEL_COPY_ERROR_LENGTH];
+} ParallelCopyWorkerState;
+
+
+/*
+ * ParallelCopyShared is the header of the dynamic shared memory segment of a
+ * parallel COPY. It is followed by one ParallelCopyWorkerState per worker, by
+ * preparedSlotCount PreparedPlacement slots per worker, and by the text of the
+ * COPY command the workers run.
+ */
+typedef struct ParallelCopyShared
+{
+	Oid databaseId;
+	Oid userId;
+	int copyBufferSize;
+	int copyHighWaterMark;
+	int copyConnectionsPerNode;
+	int workerCount;
+	int preparedSlotCount;
+	Size workerStateOffset;
+	Size preparedOffset;
+	Size commandOffset;
+} ParallelCopyShared;
+
+#define ParallelCopyWorkerStates(shared) \
+	((ParallelCopyWorkerState *) ((char *) (shared) + (shared)->workerStateOffset))
+#define ParallelCopyPreparedSlots(shared, workerIndex) \
+	((PreparedPlacement *) ((char *) (shared) + (shared)->preparedOffset) + \
+	 (workerIndex) * (shared)->preparedSlotCount)
+#define ParallelCopyCommandText(shared) ((char *) (shared) + (shared)->commandOffset)
+
+
+/*
+ * ParallelCopyInputRanges decides whether a COPY FROM can run in parallel and,
+ * if so, splits its input file into newline-aligned ranges, one per worker.
+ * Parallel COPY requires a text format file: program output cannot be split up
+ * front, and CSV fields may contain newlines. Since workers prepare their part
+ * of the load for the leader to commit, it also requires the two-phase commit
+ * transaction manager. The function returns the number of ranges, or zero if
+ * the COPY should run serially.
+ */
+static int
+ParallelCopyInputRanges(CopyStmt *copyStatement, CopyInputRange **inputRangeArray)
+{
+	ListCell *optionCell = NULL;
+	int fileEncoding = pg_get_client_encoding();
+	FILE *copyFile = NULL;
+	off_t fileSize = 0;
+	int rangeCount = 0;
+	int rangeIndex = 0;
+	CopyInputRange *inputRanges = NULL;
+
+	if (PgShardCopyParallelWorkers < 2 || copyStatement->filename == NULL ||
+		copyStatement->is_program ||
+		PgShardCurrTransManager != TRANSACTION_MANAGER_2PC)
+	{
+		return 0;
+	}
+
+	foreach(optionCell, copyStatement->options)
+	{
+		DefElem *option = (DefElem *) lfirst(optionCell);
+
+		if (strcmp(option->defname, "format") == 0 &&
+			strcmp(defGetString(option), "text") != 0)
+		{
+			return 0;
+		}
+		else if (strcmp(option->defname, "oids") == 0 && defGetBoolean(option))
+		{
+			return 0;
+		}
+		else if (strcmp(option->defname, "encoding") == 0)
+		{
+			fileEncoding = pg_char_to_encoding(defGetString(option));
+		}
+	}
+
+	/* newlines can only be found by byte if ASCII never occurs within characters */
+	if (fileEncoding < 0 || PG_ENCODING_IS_CLIENT_ONLY(fileEncoding))
+	{
+		return 0;
+	}
+
+	/* if the file cannot be read, let the serial path report the error */
+	copyFile = AllocateFile(copyStatement->filename, PG_BINARY_R);
+	if (copyFile == NULL)
+	{
+		return 0;
+	}
+
+	if (fseeko(copyFile, 0, SEEK_END) == 0)
+	{
+		fileSize = ftello(copyFile);
+	}
+
+	rangeCount = (int) Min(PgShardCopyParallelWorkers,
+						   fileSize / PARALLEL_COPY_MIN_RANGE_SIZE);
+	if (rangeCount < 2)
+	{
+		FreeFile(copyFile);
+		return 0;
+	}
+
+	inputRanges = palloc0(rangeCount * sizeof(CopyInputRange));
+	inputRanges[0].startOffset = 0;
+	inputRanges[rangeCount - 1].endOffset = fileSize;
+
+	for (rangeIndex = 1; rangeIndex < rangeCount; rangeIndex++)
+	{
+		off_t boundary = Max(fileSize * rangeIndex / rangeCount,
+							 inputRanges[rangeIndex - 1].startOffset);
+		int character = 0;
+
+		if (fseeko(copyFile, boundary, SEEK_SET) != 0)
+		{
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not seek in COPY file: %m")));
+		}
+
+		/* move the boundary past the end of the line it falls into */
+		do
+		{
+			character = getc(copyFile);
+			boundary++;
+		}
+		while (character != EOF && character != '\n');
+
+		boundary = Min(boundary, fileSize);
+		inputRanges[rangeIndex - 1].endOffset = boundary;
+		inputRanges[rangeIndex].startOffset = boundary;
 	}
-	shardConnections->replicaCount = placementCount;
+
+	FreeFile(copyFile);
+
+	*inputRangeArray = inputRanges;
+	return rangeCount;
 }
 
+
 /*
- * Copy data from sepcified table
+ * BuildParallelCopyCommand returns the COPY command parallel workers run. The
+ * relation is qualified by schema, and the session's client encoding is passed
+ * on since it determines how the file is read.
  */
-static void
-PgShardCopyTo(CopyStmt *copyStatement, char const *query, char *completionTag)
+static char *
+BuildParallelCopyCommand(CopyStmt *copyStatement, Oid tableId)
 {
-	RangeVar *relation = copyStatement->relation;
-	uint64 processedCount = 0;
-	char const *qualifiedName = quote_qualified_identifier(relation->schemaname,
-														   relation->relname);
-	StringInfo queryString = makeStringInfo();
-	List *queryList = NULL;
+	StringInfo commandString = makeStringInfo();
+	char *qualifiedName = quote_qualified_identifier(
+		get_namespace_name(get_rel_namespace(tableId)), get_rel_name(tableId));
+	List *optionList = copyStatement->options;
+	ListCell *cell = NULL;
+	bool hasEncoding = false;
+	char sep = '(';
 
-	appendStringInfo(queryString, "select * from %s", qualifiedName);
-	queryList = raw_parser(queryString->data);
+	appendStringInfo(commandString, "COPY %s ", qualifiedName);
+	if (copyStatement->attlist != NIL)
+	{
+		foreach(cell, copyStatement->attlist)
+		{
+			appendStringInfo(commandString, "%c%s", sep,
+							 quote_identifier(strVal(lfirst(cell))));
+			sep = ',';
+		}
+		appendStringInfoString(commandString, ") ");
+	}
+	appendStringInfo(commandString, "FROM %s",
+					 quote_literal_cstr(copyStatement->filename));
 
-	copyStatement->query = linitial(queryList);
-	copyStatement->relation = NULL;
-	
-	/* Collecting data from shards will be done by select handler */
-	DoCopy(copyStatement, query, &processedCount);
-	if (completionTag)
+	foreach(cell, optionList)
 	{
-		snprintf(completionTag, COMPLETION_TAG_BUFSIZE,
-				 "COPY " UINT64_FORMAT, processedCount);
+		DefElem *option = (DefElem *) lfirst(cell);
+		if (strcmp(option->defname, "encoding") == 0)
+		{
+			hasEncoding = true;
+		}
 	}
-}	
 
-static int
-CompareShardIntervalsByMinValue(const void *leftElement, 
-								const void *rightElement, 
-								void *comparator)
-{
-	Datum		leftValue = (*(ShardInterval**)leftElement)->minValue;
-	Datum		rightValue = (*(ShardInterval**)rightElement)->minValue;
-	FmgrInfo   *compareFunction = (FmgrInfo *) comparator;
-	Datum		comparisonResult;
+	if (!hasEncoding)
+	{
+		char *encodingName = (char *) pg_encoding_to_char(pg_get_client_encoding());
+		optionList = lappend(list_copy(optionList),
+							 makeDefElem("encoding", (Node *) makeString(encodingName)));
+	}
+	AppendCopyOptions(commandString, optionList);
 
-	comparisonResult = FunctionCall2Coll(compareFunction, DEFAULT_COLLATION_OID, 
-										 leftValue, rightValue);
-	return DatumGetInt32(comparisonResult);
+	return commandString->data;
 }
 
 
-static ShardInterval*
-FindShardIntervalInCache(ShardInterval** shardIntervalCache, int shardCount, 
-						 Datum partitionColumnValue, FmgrInfo *compareFunction)
+/*
+ * FinishWorkerTransactions commits or rolls back the transactions prepared by
+ * all parallel COPY workers. Failures are reported as warnings, since other
+ * transactions must still be finished.
+ */
+static void
+FinishWorkerTransactions(ParallelCopyShared *shared, bool commit)
 {
-	int lowerBoundIndex = 0, upperBoundIndex = shardCount;
-	while (lowerBoundIndex < upperBoundIndex) 
+	ParallelCopyWorkerState *workerStates = ParallelCopyWorkerStates(shared);
+	int workerIndex = 0;
+
+	for (workerIndex = 0; workerIndex < shared->workerCount; workerIndex++)
 	{
-		int middleIndex = (lowerBoundIndex + upperBoundIndex) >> 1;
-		if (DatumGetInt32(FunctionCall2Coll(compareFunction, 
-											DEFAULT_COLLATION_OID, 
-											partitionColumnValue, 
-											shardIntervalCache[middleIndex]->minValue)) < 0)
-		{
-			upperBoundIndex = middleIndex;
-		} 
-		else if (DatumGetInt32(FunctionCall2Coll(compareFunction, 
-												 DEFAULT_COLLATION_OID, 
-												 partitionColumnValue, 
-												 shardIntervalCache[middleIndex]->maxValue)) <= 0)
-		{
-			return shardIntervalCache[middleIndex];
+		PreparedPlacement *preparedSlots = ParallelCopyPreparedSlots(shared, workerIndex);
+		int slotIndex = 0;
 
-		}
-		else
+		for (slotIndex = 0; slotIndex < workerStates[workerIndex].preparedCount; slotIndex++)
 		{
-			lowerBoundIndex = middleIndex + 1;
+			PreparedPlacement *preparedPlacement = &preparedSlots[slotIndex];
+			PGconn *conn = GetConnection(preparedPlacement->nodeName,
+										 preparedPlacement->nodePort);
+
+			if (conn == NULL ||
+				!PgShardFinishPreparedTransaction(conn, preparedPlacement->transactionName,
+												  commit))
+			{
+				ereport(WARNING, (errcode(ERRCODE_IO_ERROR),
+								  errmsg("Failed to %s prepared transaction %s on "
+										 "node %s:%d",
+										 commit ? "commit" : "rollback",
+										 preparedPlacement->transactionName,
+										 preparedPlacement->nodeName,
+										 preparedPlacement->nodePort)));
+			}
 		}
+
+		workerStates[workerIndex].preparedCount = 0;
 	}
-	return NULL;
 }
 
+
 /*
- * Append data to the specified table
+ * ParallelCopyFrom loads the given input ranges of a COPY FROM file into the
+ * distributed table using one dynamic background worker per range. Each worker
+ * parses and routes its range over its own placement connections and leaves
+ * its part of the distributed transaction prepared. Once all workers succeeded
+ * the leader commits all prepared transactions; if any of them failed, all are
+ * rolled back, so the load stays atomic. The function returns the total number
+ * of rows copied.
  */
-static void
-PgShardCopyFrom(CopyStmt *copyStatement, char const *query, char* completionTag)
+static uint64
+ParallelCopyFrom(CopyStmt *copyStatement, Oid tableId, CopyInputRange *inputRangeArray,
+				 int workerCount)
 {
-	RangeVar *relation = copyStatement->relation;
+	char *copyCommand = BuildParallelCopyCommand(copyStatement, tableId);
+	List *shardIntervalList = NIL;
 	ListCell *shardIntervalCell = NULL;
-	List *shardIntervalList = NULL;
-	char *relationName = NULL;
-	PgShardTransactionManager const *transactionManager =
-		&PgShardTransManagerImpl[PgShardCurrTransManager];
-	bool failOK = true;
-	Oid tableId = RangeVarGetRelid(relation, NoLock, failOK);
-	HTAB *shardToConn = NULL;
-	MemoryContext tupleContext = NULL;
-	CopyState copyState = NULL;
-	bool nextRowFound = true;
-	TupleDesc tupleDescriptor = NULL;
-	uint32 columnCount = 0;
-	Datum *columnValues = NULL;
-	bool *columnNulls = NULL;
-	Var *partitionColumn = NULL;
-	ShardId failedShard = INVALID_SHARD_ID;
-	Relation rel = NULL;
-	StringInfo lineBuf;
-	ShardConnections *shardConnections = NULL;
-	ShardInterval **shardIntervalCache = NULL;
-	Datum partitionColumnValue = 0;
-	int i = 0;
-	TypeCacheEntry *typeEntry = NULL;
-	FmgrInfo *hashFunction = NULL;
-	int shardCount = 0;
-	int shardHashCode = 0;
-	uint32 hashTokenIncrement = 0;
-	FmgrInfo *compareFunction = NULL;
+	int placementCount = 0;
+	Size workerStateOffset = 0;
+	Size preparedOffset = 0;
+	Size commandOffset = 0;
+	Size segmentSize = 0;
+	dsm_segment *segment = NULL;
+	ParallelCopyShared *shared = NULL;
+	ParallelCopyWorkerState *workerStates = NULL;
+	ParallelCopyWorkerState *failedWorker = NULL;
+	BackgroundWorkerHandle **workerHandles = NULL;
+	int workerIndex = 0;
 	uint64 processedCount = 0;
-	ErrorContextCallback errorCallback;
-	bool pipe = (copyStatement->filename == NULL);
-
-	/* Disallow COPY to/from file or program except to superusers. */
-	if (!pipe && !superuser())
-	{
-		if (copyStatement->is_program)
-			ereport(ERROR,
-					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-					 errmsg("must be superuser to COPY to or from an external program"),
-					 errhint("Anyone can COPY to stdout or from stdin. "
-						   "psql's \\copy command also works for anyone.")));
-		else
-			ereport(ERROR,
-					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-					 errmsg("must be superuser to COPY to or from a file"),
-					 errhint("Anyone can COPY to stdout or from stdin. "
-						   "psql's \\copy command also works for anyone.")));
-	}
 
-	relationName = get_rel_name(tableId);
+	LockRelationOid(tableId, AccessShareLock);
 
 	shardIntervalList = LookupShardIntervalList(tableId);
 	if (shardIntervalList == NIL)
 	{
-		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-						errmsg("could not find any shards for query"),
-						errdetail("No shards exist for distributed table \"%s\".",
-								  relationName),
-						errhint("Run master_create_worker_shards to create shards "
-								"and try again.")));
+		/* let the serial path report the missing shards */
+		return CopyRowsToShards(copyStatement, tableId, NULL, NULL);
 	}
 
-	partitionColumn = PartitionColumn(tableId);
-
-	/* resolve hash function for parition column */
-	typeEntry = lookup_type_cache(partitionColumn->vartype, TYPECACHE_HASH_PROC_FINFO|TYPECACHE_CMP_PROC_FINFO);
-	hashFunction = &(typeEntry->hash_proc_finfo);
-
-	/* allocate column values and nulls arrays */
-	rel = heap_open(tableId, AccessShareLock);
-	tupleDescriptor = RelationGetDescr(rel);
-	columnCount = tupleDescriptor->natts;
-	columnValues = palloc0(columnCount * sizeof(Datum));
-	columnNulls = palloc0(columnCount * sizeof(bool));
-
-	/*
-	 * We create a new memory context called tuple context, and read and write
-	 * each row's values within this memory context. After each read and write,
-	 * we reset the memory context. That way, we immediately release memory
-	 * allocated for each row, and don't bloat memory usage with large input
-	 * files.
-	 */
-	tupleContext = AllocSetContextCreate(CurrentMemoryContext,
-										 "COPY Row Memory Context",
-										 ALLOCSET_DEFAULT_MINSIZE,
-										 ALLOCSET_DEFAULT_INITSIZE,
-										 ALLOCSET_DEFAULT_MAXSIZE);
-
-	/*
-	 * Construct hash table used for shardId->Connection mapping.
-	 * We can not use connection cache from connection.c used by GteConnection because
-	 * we need to establish multiple connections with each nodes: one connection per shard
-	 */
-	shardToConn = CreateShardToConnectionHash();
+	/* keep placements from changing while the workers run */
+	shardIntervalList = SortList(shardIntervalList, CompareTasksByShardId);
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
 
-	/* init state to read from COPY data source */
-	copyState = BeginCopyFrom(rel, copyStatement->filename,
-							  copyStatement->is_program,
-							  copyStatement->attlist,
-							  copyStatement->options);
+		LockShardData(shardInterval->id, ShareLock);
+		LockShardDistributionMetadata(shardInterval->id, ShareLock);
+		placementCount += list_length(LoadFinalizedShardPlacementList(shardInterval->id));
+	}
 
-	if (copyState->binary)
+	workerStateOffset = MAXALIGN(sizeof(ParallelCopyShared));
+	preparedOffset = workerStateOffset +
+					 MAXALIGN(workerCount * sizeof(ParallelCopyWorkerState));
+	commandOffset = preparedOffset +
+					MAXALIGN(workerCount * placementCount * sizeof(PreparedPlacement));
+	segmentSize = commandOffset + strlen(copyCommand) + 1;
+
+	segment = dsm_create(segmentSize, 0);
+	shared = (ParallelCopyShared *) dsm_segment_address(segment);
+	memset(shared, 0, segmentSize);
+
+	shared->databaseId = MyDatabaseId;
+	shared->userId = GetUserId();
+	shared->copyBufferSize = PgShardCopyBufferSize;
+	shared->copyHighWaterMark = PgShardCopyHighWaterMark;
+	shared->copyConnectionsPerNode = PgShardCopyConnectionsPerNode;
+	shared->workerCount = workerCount;
+	shared->preparedSlotCount = placementCount;
+	shared->workerStateOffset = workerStateOffset;
+	shared->preparedOffset = preparedOffset;
+	shared->commandOffset = commandOffset;
+	strcpy(ParallelCopyCommandText(shared), copyCommand);
+
+	workerStates = ParallelCopyWorkerStates(shared);
+	for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						errmsg("Copy in binary mode is not currently supported")));
+		workerStates[workerIndex].inputRange = inputRangeArray[workerIndex];
 	}
 
-	/* Set up callback to identify error line number */
-	errorCallback.callback = CopyFromErrorCallback;
-	errorCallback.arg = (void *) copyState;
-	errorCallback.previous = error_context_stack;
-	error_context_stack = &errorCallback;
+	workerHandles = palloc0(workerCount * sizeof(BackgroundWorkerHandle *));
 
 	PG_TRY();
 	{
-		char partitionType = PartitionType(tableId);
-		Oid intervalTypeId = (partitionType == HASH_PARTITION_TYPE) 
-			? INT4OID : partitionColumn->vartype;
-		bool useBinarySearch = (partitionType != HASH_PARTITION_TYPE);
-		int shardIndex = 0;
+		for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
+		{
+			BackgroundWorker worker;
+
+			memset(&worker, 0, sizeof(worker));
+			snprintf(worker.bgw_name, BGW_MAXLEN, "pg_shard copy worker %d",
+					 workerIndex);
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+							   BGWORKER_BACKEND_DATABASE_CONNECTION;
+			worker.bgw_start_time = BgWorkerStart_ConsistentState;
+			worker.bgw_restart_time = BGW_NEVER_RESTART;
+			worker.bgw_main = NULL;
+			snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_shard");
+			snprintf(worker.bgw_function_name, BGW_MAXLEN, "PgShardCopyWorkerMain");
+			worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(segment));
+			memcpy(worker.bgw_extra, &workerIndex, sizeof(int));
+			worker.bgw_notify_pid = MyProcPid;
+
+			if (!RegisterDynamicBackgroundWorker(&worker, &workerHandles[workerIndex]))
+			{
+				ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+								errmsg("could not start parallel COPY worker"),
+								errhint("Increase max_worker_processes or lower "
+										"pg_shard.copy_parallel_workers.")));
+			}
+		}
 
-		/* Lock all shards in shared mode */
-		shardIntervalList = SortList(shardIntervalList, CompareTasksByShardId);
+		for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
+		{
+			BgwHandleStatus handleStatus =
+				WaitForBackgroundWorkerShutdown(workerHandles[workerIndex]);
 
-		shardCount = shardIntervalList->length;
-		shardIntervalCache = palloc0(shardCount * sizeof(ShardInterval*));
-		hashTokenIncrement = (uint32) (HASH_TOKEN_COUNT / shardCount);
+			if (handleStatus == BGWH_POSTMASTER_DIED)
+			{
+				ereport(ERROR, (errcode(ERRCODE_ADMIN_SHUTDOWN),
+								errmsg("postmaster exited during parallel COPY")));
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		/* a second cancel must not stop us from cleaning up after the workers */
+		HOLD_INTERRUPTS();
 
-		foreach(shardIntervalCell, shardIntervalList)
+		for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
 		{
-			ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
-			ShardId shardId = shardInterval->id;
-			LockShardData(shardId, ShareLock);
-			LockShardDistributionMetadata(shardId, ShareLock);
-			shardIntervalCache[shardIndex] = shardInterval;
+			if (workerHandles[workerIndex] != NULL)
+			{
+				TerminateBackgroundWorker(workerHandles[workerIndex]);
+			}
+		}
 
-			if (partitionType == HASH_PARTITION_TYPE)
+		/* workers may still prepare transactions until they have exited */
+		for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
+		{
+			if (workerHandles[workerIndex] != NULL)
 			{
-				int32 shardMinHashToken = INT32_MIN + (shardIndex * hashTokenIncrement);
-				int32 shardMaxHashToken = shardMinHashToken + (hashTokenIncrement - 1);
-				if (shardIndex == (shardCount - 1))
-				{
-					shardMaxHashToken = INT32_MAX;
-				}
-				if (DatumGetInt32(shardInterval->minValue) != shardMinHashToken ||
-					DatumGetInt32(shardInterval->maxValue) != shardMaxHashToken)
-				{
-					useBinarySearch = true;
-				}
+				WaitForBackgroundWorkerShutdown(workerHandles[workerIndex]);
 			}
-			shardIndex += 1;
 		}
-		Assert(shardIndex == shardCount);
 
-		if (useBinarySearch)
-		{	
-			typeEntry = lookup_type_cache(intervalTypeId, TYPECACHE_CMP_PROC_FINFO);
-			compareFunction = &(typeEntry->cmp_proc_finfo);
+		FinishWorkerTransactions(shared, false);
 
-			qsort_arg(shardIntervalCache, shardCount, sizeof(ShardInterval*), 
-					  CompareShardIntervalsByMinValue, compareFunction);
-		}
-		while (true)
+		RESUME_INTERRUPTS();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
+	{
+		if (workerStates[workerIndex].status != PARALLEL_COPY_PREPARED)
 		{
-			ShardInterval *shardInterval = NULL;
-			ShardId shardId = 0;
-			bool found = false;
-			int hashedValue = 0;
-			MemoryContext oldContext;
+			failedWorker = &workerStates[workerIndex];
+			break;
+		}
 
-			oldContext = MemoryContextSwitchTo(tupleContext);
-		  
-			nextRowFound = NextCopyFrom(copyState, NULL, columnValues, columnNulls, NULL);
-			MemoryContextSwitchTo(oldContext);
+		processedCount += workerStates[workerIndex].processedCount;
+	}
 
-			if (!nextRowFound)
-			{
-				MemoryContextReset(tupleContext);
-				break;
-			}
+	if (failedWorker != NULL)
+	{
+		FinishWorkerTransactions(shared, false);
+		ereport(ERROR, (errcode(ERRCODE_IO_ERROR),
+						errmsg("parallel COPY worker failed"),
+						(failedWorker->errorMessage[0] != '\0') ?
+						errdetail("%s", failedWorker->errorMessage) : 0));
+	}
 
-			CHECK_FOR_INTERRUPTS();
+	FinishWorkerTransactions(shared, true);
+	dsm_detach(segment);
 
-			/* write the row to the shard */
-			if (columnNulls[partitionColumn->varattno-1])
-			{
-				ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
-								errmsg("cannot copy row with NULL value "
-									   "in partition column")));
-			}
-			partitionColumnValue = columnValues[partitionColumn->varattno-1];
-			if (partitionType == HASH_PARTITION_TYPE)
-			{
-				hashedValue = DatumGetInt32(FunctionCall1(hashFunction,
-														  partitionColumnValue));
-				if (useBinarySearch)
-				{
-					partitionColumnValue = Int32GetDatum(hashedValue);
-				}
-			}
-			if (!useBinarySearch)
-			{
-				shardHashCode =
-					(int) ((uint32) (hashedValue - INT32_MIN) / hashTokenIncrement);
-				shardInterval = shardIntervalCache[shardHashCode];
-			}
-			else
-			{
-				shardInterval = FindShardIntervalInCache(shardIntervalCache, shardCount, partitionColumnValue, compareFunction);
-			}
-			if (shardInterval == NULL)
-			{	
-				ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-								errmsg("Inconsistency in distribution table for \"%s\"",
-									   relationName)));
-			}
-			shardId = shardInterval->id;
-			shardConnections =
-				(ShardConnections *) hash_search(shardToConn, &shardInterval->id,
-												 HASH_ENTER,
-												 &found);			
-			if (!found)
-			{
-				InitializeShardConnections(copyStatement, shardConnections, shardId,
-										   transactionManager);
-			}
-			lineBuf = CopyGetLineBuf(copyState);
-			lineBuf->data[lineBuf->len++] = '\n';
+	return processedCount;
+}
 
-			/* There was already new line in the buffer, but it was truncated:
-			 * no need to check available space */
 
-			/* Replicate row to all shard placements */
-			for (i = 0; i < shardConnections->replicaCount; i++)
-			{
-				if (PQputCopyData(shardConnections->placements[i].conn, lineBuf->data,
-								  lineBuf->len) <= 0)
-				{
-					ereport(ERROR, (errcode(ERRCODE_IO_ERROR),
-									  errmsg("Copy failed for placement %ld for %ld",
-											 (long) shardConnections->placements[i].id,
-											 (long) shardId)));
-				}
-			}
-			processedCount += 1;
-			MemoryContextReset(tupleContext);
+/*
+ * PgShardCopyWorkerMain is the entry point of parallel COPY background workers.
+ * The worker connects as the user running the COPY, copies the lines of its
+ * input range and records the transactions it prepared in shared memory for
+ * the leader to commit.
+ */
+void
+PgShardCopyWorkerMain(Datum mainArgument)
+{
+	dsm_handle segmentHandle = DatumGetUInt32(mainArgument);
+	dsm_segment *segment = NULL;
+	ParallelCopyShared *shared = NULL;
+	ParallelCopyWorkerState *workerState = NULL;
+	int workerIndex = 0;
+	MemoryContext oldContext = NULL;
+
+	memcpy(&workerIndex, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_shard copy worker");
+	segment = dsm_attach(segmentHandle);
+	if (segment == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("could not map parallel COPY shared memory")));
+	}
+
+	shared = (ParallelCopyShared *) dsm_segment_address(segment);
+	workerState = &ParallelCopyWorkerStates(shared)[workerIndex];
+	workerState->status = PARALLEL_COPY_RUNNING;
+
+	BackgroundWorkerInitializeConnectionByOid(shared->databaseId, shared->userId);
+
+	/* follow the leader's settings; workers always prepare their transactions */
+	PgShardCopyBufferSize = shared->copyBufferSize;
+	PgShardCopyHighWaterMark = shared->copyHighWaterMark;
+	PgShardCopyConnectionsPerNode = shared->copyConnectionsPerNode;
+	PgShardCurrTransManager = TRANSACTION_MANAGER_2PC;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	oldContext = CurrentMemoryContext;
+
+	PG_TRY();
+	{
+		List *parseTreeList = pg_parse_query(ParallelCopyCommandText(shared));
+		CopyStmt *copyStatement = (CopyStmt *) linitial(parseTreeList);
+		Oid tableId = RangeVarGetRelid(copyStatement->relation, NoLock, false);
+		PreparedPlacement *preparedSlots = ParallelCopyPreparedSlots(shared, workerIndex);
+		List *preparedPlacementList = NIL;
+		ListCell *preparedPlacementCell = NULL;
+		int slotIndex = 0;
+
+		workerState->processedCount = CopyRowsToShards(copyStatement, tableId,
+													   &workerState->inputRange,
+													   &preparedPlacementList);
+
+		Assert(list_length(preparedPlacementList) <= shared->preparedSlotCount);
+		foreach(preparedPlacementCell, preparedPlacementList)
+		{
+			PreparedPlacement *preparedPlacement = lfirst(preparedPlacementCell);
+
+			preparedSlots[slotIndex++] = *preparedPlacement;
 		}
 
-		/* Perform two phase commit in replicas */
-		failedShard = PgCopyPrepareTransaction(shardToConn);
+		workerState->preparedCount = slotIndex;
+		workerState->status = PARALLEL_COPY_PREPARED;
 	}
-	PG_CATCH(); /* do recovery */
+	PG_CATCH();
 	{
-		EndCopyFrom(copyState);
-		heap_close(rel, AccessShareLock);
+		ErrorData *errorData = NULL;
+
+		MemoryContextSwitchTo(oldContext);
+		errorData = CopyErrorData();
+		strlcpy(workerState->errorMessage, errorData->message,
+				PARALLEL_COPY_ERROR_LENGTH);
+		workerState->status = PARALLEL_COPY_FAILED;
 
-		/* Rollback transactions */
-		PgCopyAbortTransaction(shardToConn);
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
 
-	EndCopyFrom(copyState);
-	heap_close(rel, AccessShareLock);
+	PopActiveSnapshot();
+	CommitTransactionCommand();
 
-	/* Done, clean up */
-	error_context_stack = errorCallback.previous;
+	dsm_detach(segment);
+}
 
-	/* Complete two phase commit */
-	if (failedShard != INVALID_SHARD_ID)
+#endif
+
+/*
+ * Append data to the specified table
+ */
+static void
+PgShardCopyFrom(CopyStmt *copyStatement, char const *query, char* completionTag)
+{
+	RangeVar *relation = copyStatement->relation;
+	bool failOK = true;
+	Oid tableId = RangeVarGetRelid(relation, NoLock, failOK);
+	uint64 processedCount = 0;
+#if PG_VERSION_NUM >= 90500
+	CopyInputRange *inputRangeArray = NULL;
+	int workerCount = 0;
+#endif
+
+	/* rows are routed by their partition value, which reference tables lack */
+	if (IsReferenceTable(tableId))
 	{
-		PgCopyAbortTransaction(shardToConn);
-		ereport(ERROR, (errcode(ERRCODE_IO_ERROR),
-						errmsg("COPY failed for shard %ld", (long) failedShard)));
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot copy rows into reference table \"%s\"",
+							   get_rel_name(tableId)),
+						errhint("Use INSERT statements to add rows to reference "
+								"tables.")));
 	}
-	else if (QueryCancelPending)
+
+#if PG_VERSION_NUM >= 90500
+	workerCount = ParallelCopyInputRanges(copyStatement, &inputRangeArray);
+	if (workerCount > 1)
 	{
-		PgCopyAbortTransaction(shardToConn);
-		ereport(ERROR, (errcode(ERRCODE_IO_ERROR),
-						errmsg("COPY was canceled")));
+		processedCount = ParallelCopyFrom(copyStatement, tableId, inputRangeArray,
+										  workerCount);
 	}
 	else
+#endif
 	{
-		PgCopyEndTransaction(shardToConn);
+		processedCount = CopyRowsToShards(copyStatement, tableId, NULL, NULL);
 	}
+
 	if (completionTag)
 	{
 		snprintf(completionTag, COMPLETION_TAG_BUFSIZE,
 				 "COPY " UINT64_FORMAT, processedCount);
 	}
-
 }
 
 /*
@@ -894,6 +3628,25 @@ PgShardCopyFrom(CopyStmt *copyStatement, char const *query, char* completionTag)
 void
 PgShardCopy(CopyStmt *copyStatement, char const *query, char *completionTag)
 {
+    bool pipe = (copyStatement->filename == NULL);
+
+    /* Disallow COPY to/from file or program except to superusers. */
+    if (!pipe && !superuser())
+    {
+        if (copyStatement->is_program)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                     errmsg("must be superuser to COPY to or from an external program"),
+                     errhint("Anyone can COPY to stdout or from stdin. "
+                           "psql's \\copy command also works for anyone.")));
+        else
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                     errmsg("must be superuser to COPY to or from a file"),
+                     errhint("Anyone can COPY to stdout or from stdin. "
+                           "psql's \\copy command also works for anyone.")));
+    }
+
     if (copyStatement->is_from)
     {
         PgShardCopyFrom(copyStatement, query, completionTag);
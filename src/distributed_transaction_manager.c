@@ -12,18 +12,22 @@ static bool PgShardPrepareStub(PGconn *conn, ShardId shardId);
 static bool PgShardCommitPreparedStub(PGconn *conn, ShardId shardId);
 static bool PgShardRollbackPreparedStub(PGconn *conn, ShardId shardId);
 static bool PgShardRollbackStub(PGconn *conn);
+static char * PgShardNoCommand(ShardId shardId);
 
 static bool PgShardBegin1PC(PGconn *conn);
 static bool PgShardPrepare1PC(PGconn *conn, ShardId shardId);
 static bool PgShardCommitPrepared1PC(PGconn *conn, ShardId shardId);
 static bool PgShardRollbackPrepared1PC(PGconn *conn, ShardId shardId);
 static bool PgShardRollback1PC(PGconn *conn);
+static char * PgShardCommitCommand1PC(ShardId shardId);
 
 static bool PgShardBegin2PC(PGconn *conn);
 static bool PgShardPrepare2PC(PGconn *conn, ShardId shardId);
 static bool PgShardCommitPrepared2PC(PGconn *conn, ShardId shardId);
 static bool PgShardRollbackPrepared2PC(PGconn *conn, ShardId shardId);
 static bool PgShardRollback2PC(PGconn *conn);
+static char * PgShardPrepareCommand2PC(ShardId shardId);
+static char * PgShardCommitPreparedCommand2PC(ShardId shardId);
 
 static int GlobalTransactionId = 0;
 static bool GlobalTransactionPrepared = false;
@@ -31,11 +35,14 @@ static bool GlobalTransactionPrepared = false;
 PgShardTransactionManager const PgShardTransManagerImpl[] =
 {
 	{ PgShardBeginStub, PgShardPrepareStub, PgShardCommitPreparedStub,
-	  PgShardRollbackPreparedStub, PgShardRollbackStub },
+	  PgShardRollbackPreparedStub, PgShardRollbackStub,
+	  PgShardNoCommand, PgShardNoCommand },
 	{ PgShardBegin1PC, PgShardPrepare1PC, PgShardCommitPrepared1PC,
-	  PgShardRollbackPrepared1PC, PgShardRollback1PC },
+	  PgShardRollbackPrepared1PC, PgShardRollback1PC,
+	  PgShardNoCommand, PgShardCommitCommand1PC },
 	{ PgShardBegin2PC, PgShardPrepare2PC, PgShardCommitPrepared2PC,
-	  PgShardRollbackPrepared2PC, PgShardRollback2PC }
+	  PgShardRollbackPrepared2PC, PgShardRollback2PC,
+	  PgShardPrepareCommand2PC, PgShardCommitPreparedCommand2PC }
 };
 
 /*
@@ -76,6 +83,13 @@ PgShardRollbackStub(PGconn *conn)
 }
 
 
+static char *
+PgShardNoCommand(ShardId shardId)
+{
+	return NULL;
+}
+
+
 /*
  * One-phase commit
  */
@@ -97,7 +111,14 @@ PgShardPrepare1PC(PGconn *conn, ShardId shardId)
 static bool
 PgShardCommitPrepared1PC(PGconn *conn, ShardId shardId)
 {
-	return PgShardExecute(conn, PGRES_COMMAND_OK, "COMMIT");
+	return PgShardExecute(conn, PGRES_COMMAND_OK, PgShardCommitCommand1PC(shardId));
+}
+
+
+static char *
+PgShardCommitCommand1PC(ShardId shardId)
+{
+	return "COMMIT";
 }
 
 
@@ -121,11 +142,43 @@ static char *
 PgShard2pcCommand(char const *cmd, ShardId shardId)
 {
 	StringInfo commandString = makeStringInfo();
-	appendStringInfo(commandString, "%s 'pgshard_%d_%d_%ld'", cmd, MyProcPid, GlobalTransactionId, (long)shardId);
+	appendStringInfo(commandString, "%s '%s'", cmd,
+					 PgShardPreparedTransactionName(shardId));
 	return commandString->data;
 }
 
 
+/*
+ * PgShardPreparedTransactionName returns the global identifier this backend
+ * uses for the prepared transaction of the given shard (placement) in the
+ * current two-phase commit.
+ */
+char *
+PgShardPreparedTransactionName(ShardId shardId)
+{
+	StringInfo transactionName = makeStringInfo();
+	appendStringInfo(transactionName, "pgshard_%d_%d_%ld", MyProcPid,
+					 GlobalTransactionId, (long) shardId);
+	return transactionName->data;
+}
+
+
+/*
+ * PgShardFinishPreparedTransaction commits or rolls back a transaction that was
+ * prepared under the given name, possibly by another backend.
+ */
+bool
+PgShardFinishPreparedTransaction(PGconn *conn, char const *transactionName,
+								 bool commit)
+{
+	StringInfo commandString = makeStringInfo();
+	appendStringInfo(commandString, "%s '%s'",
+					 commit ? "COMMIT PREPARED" : "ROLLBACK PREPARED",
+					 transactionName);
+	return PgShardExecute(conn, PGRES_COMMAND_OK, commandString->data);
+}
+
+
 static bool
 PgShardBegin2PC(PGconn *conn)
 {
@@ -135,23 +188,36 @@ PgShardBegin2PC(PGconn *conn)
 
 static bool
 PgShardPrepare2PC(PGconn *conn, ShardId shardId)
+{
+	return PgShardExecute(conn, PGRES_COMMAND_OK, PgShardPrepareCommand2PC(shardId));
+}
+
+
+static bool
+PgShardCommitPrepared2PC(PGconn *conn, ShardId shardId)
+{
+	return PgShardExecute(conn, PGRES_COMMAND_OK,
+						  PgShardCommitPreparedCommand2PC(shardId));
+}
+
+
+static char *
+PgShardPrepareCommand2PC(ShardId shardId)
 {
 	if (!GlobalTransactionPrepared)
 	{
 		GlobalTransactionId += 1;
 		GlobalTransactionPrepared = true;
 	}
-	return PgShardExecute(conn, PGRES_COMMAND_OK, 
-						  PgShard2pcCommand("PREPARE TRANSACTION", shardId));
+	return PgShard2pcCommand("PREPARE TRANSACTION", shardId);
 }
 
 
-static bool
-PgShardCommitPrepared2PC(PGconn *conn, ShardId shardId)
+static char *
+PgShardCommitPreparedCommand2PC(ShardId shardId)
 {
 	GlobalTransactionPrepared = false;
-	return PgShardExecute(conn, PGRES_COMMAND_OK, 
-						  PgShard2pcCommand("COMMIT PREPARED", shardId));
+	return PgShard2pcCommand("COMMIT PREPARED", shardId);
 }
 
 
@@ -15,7 +15,9 @@
 #include "fmgr.h"
 #include "miscadmin.h"
 
+#include "create_shards.h"
 #include "distribution_metadata.h"
+#include "shard_router.h"
 
 #include <stddef.h>
 #include <string.h>
@@ -23,9 +25,11 @@
 #include "access/attnum.h"
 #include "access/htup.h"
 #include "access/tupdesc.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "catalog/catalog.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_collation.h"
 #include "catalog/pg_type.h"
 #include "nodes/makefuncs.h"
 #include "nodes/memnodes.h" /* IWYU pragma: keep */
@@ -36,19 +40,41 @@
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/errcodes.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/palloc.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+#include "utils/typcache.h"
 
 
 /*
- * ShardIntervalListCache is used for caching shard interval lists. It begins
- * initialized to empty list as there are no items in the cache.
+ * DistributedTableCache maps the relation ids of distributed tables to their
+ * cached metadata. It is created on first use, when the relcache invalidation
+ * callback which keeps it current is registered as well.
  */
-static List *ShardIntervalListCache = NIL;
+static HTAB *DistributedTableCache = NULL;
+
+/*
+ * DistributedTableCacheInvalidationCount counts the invalidations the cache has
+ * received, so that a lookup can tell whether one arrived while it was loading
+ * metadata.
+ */
+static uint64 DistributedTableCacheInvalidationCount = 0;
 
 
 /* local function forward declarations */
+static void InitializeDistributedTableCache(void);
+static void InvalidateDistributedTableCacheCallback(Datum argument, Oid relationId);
+static bool BuildDistributedTableCacheEntry(Oid distributedTableId,
+											DistributedTableCacheEntry *cacheEntry);
+static bool LoadPartitionRow(Oid distributedTableId, char *partitionType,
+							 char **partitionKey);
+static bool HasUniformHashDistribution(ShardInterval **shardIntervalArray,
+									   int shardIntervalCount);
+static void InvalidateTupleRelation(HeapTuple heapTuple, TupleDesc tupleDescriptor);
 static ShardInterval * TupleToShardInterval(HeapTuple heapTuple,
 											TupleDesc tupleDescriptor);
 static ShardPlacement * TupleToShardPlacement(HeapTuple heapTuple,
@@ -57,56 +83,337 @@ static void AcquireShardLock(int64 shardId, ShardLockType shardLockType,
 							 LOCKMODE lockMode);
 
 
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(invalidate_metadata_cache);
+
+
+/*
+ * LookupDistributedTableCacheEntry returns the cached metadata of the given
+ * distributed table, loading it first if it is not cached or was invalidated.
+ * The function returns NULL if the table is not distributed; such tables are
+ * not cached. Metadata replaced by a reload stays allocated until the end of
+ * the transaction, so callers may keep using what they looked up before. If an
+ * invalidation arrives while the metadata is loaded, the loaded metadata may be
+ * stale; it is returned, but cached as invalid so the next lookup reloads it.
+ */
+DistributedTableCacheEntry *
+LookupDistributedTableCacheEntry(Oid distributedTableId)
+{
+	DistributedTableCacheEntry *cacheEntry = NULL;
+	DistributedTableCacheEntry loadedEntry;
+	bool foundInCache = false;
+	bool isDistributedTable = false;
+	uint64 invalidationCount = 0;
+	MemoryContext entryContext = NULL;
+	MemoryContext oldContext = NULL;
+
+	if (DistributedTableCache == NULL)
+	{
+		InitializeDistributedTableCache();
+	}
+
+	cacheEntry = hash_search(DistributedTableCache, &distributedTableId, HASH_FIND,
+							 &foundInCache);
+	if (foundInCache && cacheEntry->isValid)
+	{
+		return cacheEntry;
+	}
+
+	/*
+	 * Load into a context under the current one, so that nothing leaks if the
+	 * load errors out, and only move it under the cache context once loaded.
+	 */
+	entryContext = AllocSetContextCreate(CurrentMemoryContext,
+										 "pg_shard distributed table metadata",
+										 ALLOCSET_SMALL_MINSIZE,
+										 ALLOCSET_SMALL_INITSIZE,
+										 ALLOCSET_DEFAULT_MAXSIZE);
+
+	invalidationCount = DistributedTableCacheInvalidationCount;
+
+	oldContext = MemoryContextSwitchTo(entryContext);
+	memset(&loadedEntry, 0, sizeof(loadedEntry));
+	isDistributedTable = BuildDistributedTableCacheEntry(distributedTableId,
+														 &loadedEntry);
+	MemoryContextSwitchTo(oldContext);
+
+	/* the callback cannot reach an entry under construction; check it missed none */
+	if (DistributedTableCacheInvalidationCount != invalidationCount)
+	{
+		loadedEntry.isValid = false;
+	}
+
+	if (foundInCache)
+	{
+		MemoryContextSetParent(cacheEntry->cacheContext, TopTransactionContext);
+	}
+
+	if (!isDistributedTable)
+	{
+		MemoryContextDelete(entryContext);
+
+		if (foundInCache)
+		{
+			hash_search(DistributedTableCache, &distributedTableId, HASH_REMOVE, NULL);
+		}
+
+		return NULL;
+	}
+
+	MemoryContextSetParent(entryContext, CacheMemoryContext);
+	loadedEntry.cacheContext = entryContext;
+
+	cacheEntry = hash_search(DistributedTableCache, &distributedTableId, HASH_ENTER,
+							 NULL);
+	*cacheEntry = loadedEntry;
+
+	return cacheEntry;
+}
+
+
 /*
- * LookupShardIntervalList is wrapper around LoadShardIntervalList that uses a
- * cache to avoid multiple lookups of a distributed table's shards within a
- * single session.
+ * LookupShardIntervalList returns the cached list of shard intervals of the
+ * given distributed table. The function returns an empty list if the table has
+ * no shards or is not distributed.
  */
 List *
 LookupShardIntervalList(Oid distributedTableId)
 {
-	ShardIntervalListCacheEntry *matchingCacheEntry = NULL;
-	ListCell *cacheEntryCell = NULL;
+	DistributedTableCacheEntry *cacheEntry =
+		LookupDistributedTableCacheEntry(distributedTableId);
+
+	if (cacheEntry == NULL)
+	{
+		return NIL;
+	}
+
+	return cacheEntry->shardIntervalList;
+}
+
+
+/*
+ * InitializeDistributedTableCache creates the distributed table cache and
+ * registers the callback which invalidates its entries.
+ */
+static void
+InitializeDistributedTableCache(void)
+{
+	HASHCTL info;
+	int hashFlags = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(DistributedTableCacheEntry);
+	info.hash = tag_hash;
+	info.hcxt = CacheMemoryContext;
+	hashFlags = (HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	DistributedTableCache = hash_create("pg_shard distributed tables", 32, &info,
+										hashFlags);
+
+	CacheRegisterRelcacheCallback(InvalidateDistributedTableCacheCallback,
+								  (Datum) 0);
+}
+
+
+/*
+ * InvalidateDistributedTableCacheCallback marks the cache entry of the given
+ * relation invalid, or all entries if the relation id is invalid, and counts
+ * the invalidation for lookups which are loading an entry. Entries are only
+ * rebuilt on their next lookup, since the callback may run while their metadata
+ * is in use.
+ */
+static void
+InvalidateDistributedTableCacheCallback(Datum argument, Oid relationId)
+{
+	DistributedTableCacheEntry *cacheEntry = NULL;
+
+	DistributedTableCacheInvalidationCount++;
 
-	/* search the cache */
-	foreach(cacheEntryCell, ShardIntervalListCache)
+	if (OidIsValid(relationId))
 	{
-		ShardIntervalListCacheEntry *cacheEntry = lfirst(cacheEntryCell);
-		if (cacheEntry->distributedTableId == distributedTableId)
+		cacheEntry = hash_search(DistributedTableCache, &relationId, HASH_FIND, NULL);
+		if (cacheEntry != NULL)
 		{
-			matchingCacheEntry = cacheEntry;
-			break;
+			cacheEntry->isValid = false;
+		}
+	}
+	else
+	{
+		HASH_SEQ_STATUS status;
+
+		hash_seq_init(&status, DistributedTableCache);
+		while ((cacheEntry = hash_seq_search(&status)) != NULL)
+		{
+			cacheEntry->isValid = false;
 		}
 	}
+}
+
 
-	/* if not found in the cache, load the shard interval and put it in cache */
-	if (matchingCacheEntry == NULL)
+/*
+ * BuildDistributedTableCacheEntry loads the partition and shard metadata of the
+ * given table into the cache entry, allocating in the current memory context.
+ * Shard intervals are also sorted by their min values and checked for overlaps,
+ * and the functions to compare their values and to hash partition values are
+ * resolved. The function
+ * returns false if the table is not distributed.
+ */
+static bool
+BuildDistributedTableCacheEntry(Oid distributedTableId,
+								DistributedTableCacheEntry *cacheEntry)
+{
+	char partitionType = 0;
+	char *partitionKey = NULL;
+	Oid intervalTypeId = INT4OID;
+	List *shardIntervalList = NIL;
+	int shardIntervalCount = 0;
+	ShardInterval **sortedShardIntervalArray = NULL;
+	ListCell *shardIntervalCell = NULL;
+	int shardIndex = 0;
+
+	if (!LoadPartitionRow(distributedTableId, &partitionType, &partitionKey))
 	{
-		MemoryContext oldContext = MemoryContextSwitchTo(CacheMemoryContext);
+		return false;
+	}
 
-		List *loadedIntervalList = LoadShardIntervalList(distributedTableId);
-		if (loadedIntervalList != NIL)
+	cacheEntry->relationId = distributedTableId;
+	cacheEntry->isValid = true;
+	cacheEntry->partitionType = partitionType;
+
+	/* reference tables have no partition column */
+	if (partitionType != REFERENCE_PARTITION_TYPE)
+	{
+		cacheEntry->partitionColumn = ColumnNameToColumn(distributedTableId,
+														 partitionKey);
+	}
+
+	/* hash and reference tables have shards over ranges of int4 hash tokens */
+	if (partitionType == APPEND_PARTITION_TYPE || partitionType == RANGE_PARTITION_TYPE)
+	{
+		intervalTypeId = cacheEntry->partitionColumn->vartype;
+	}
+
+	if (partitionType == HASH_PARTITION_TYPE)
+	{
+		Oid partitionTypeId = cacheEntry->partitionColumn->vartype;
+		TypeCacheEntry *typeEntry = lookup_type_cache(partitionTypeId,
+													  TYPECACHE_HASH_PROC_FINFO);
+
+		if (!OidIsValid(typeEntry->hash_proc_finfo.fn_oid))
 		{
-			matchingCacheEntry = palloc0(sizeof(ShardIntervalListCacheEntry));
-			matchingCacheEntry->distributedTableId = distributedTableId;
-			matchingCacheEntry->shardIntervalList = loadedIntervalList;
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_FUNCTION),
+							errmsg("could not identify a hash function for type %s",
+								   format_type_be(partitionTypeId)),
+							errdatatype(partitionTypeId)));
+		}
+
+		cacheEntry->hashFunction = &(typeEntry->hash_proc_finfo);
+	}
 
-			ShardIntervalListCache = lappend(ShardIntervalListCache, matchingCacheEntry);
+	shardIntervalList = LoadShardIntervalList(distributedTableId);
+	shardIntervalCount = list_length(shardIntervalList);
+	sortedShardIntervalArray = palloc0((shardIntervalCount + 1) *
+									   sizeof(ShardInterval *));
+
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		sortedShardIntervalArray[shardIndex] =
+			(ShardInterval *) lfirst(shardIntervalCell);
+		shardIndex++;
+	}
+
+	if (shardIntervalCount > 0)
+	{
+		TypeCacheEntry *typeEntry = lookup_type_cache(intervalTypeId,
+													  TYPECACHE_CMP_PROC_FINFO);
+		FmgrInfo *compareFunction = &(typeEntry->cmp_proc_finfo);
+
+		if (!OidIsValid(compareFunction->fn_oid))
+		{
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_FUNCTION),
+							errmsg("could not identify a comparison function for "
+								   "type %s", format_type_be(intervalTypeId)),
+							errdatatype(intervalTypeId)));
 		}
 
-		MemoryContextSwitchTo(oldContext);
+		qsort_arg(sortedShardIntervalArray, shardIntervalCount,
+				  sizeof(ShardInterval *), CompareShardIntervalsByMinValue,
+				  compareFunction);
+
+		cacheEntry->shardIntervalCompareFunction = compareFunction;
 	}
 
-	/*
-	 * The only case we don't cache the shard list is when the distributed table
-	 * doesn't have any shards. This is to force reloading shard list on next call.
-	 */
-	if (matchingCacheEntry == NULL)
+	/* sorted intervals are disjoint if each one ends before the next one begins */
+	cacheEntry->hasDisjointShardIntervals = true;
+	for (shardIndex = 1; shardIndex < shardIntervalCount; shardIndex++)
 	{
-		return NIL;
+		ShardInterval *previousInterval = sortedShardIntervalArray[shardIndex - 1];
+		ShardInterval *shardInterval = sortedShardIntervalArray[shardIndex];
+		Datum comparisonResult =
+			FunctionCall2Coll(cacheEntry->shardIntervalCompareFunction,
+							  DEFAULT_COLLATION_OID, previousInterval->maxValue,
+							  shardInterval->minValue);
+
+		if (DatumGetInt32(comparisonResult) >= 0)
+		{
+			cacheEntry->hasDisjointShardIntervals = false;
+			break;
+		}
+	}
+
+	cacheEntry->shardIntervalList = shardIntervalList;
+	cacheEntry->shardIntervalCount = shardIntervalCount;
+	cacheEntry->sortedShardIntervalArray = sortedShardIntervalArray;
+
+	if (partitionType == HASH_PARTITION_TYPE)
+	{
+		cacheEntry->hasUniformHashDistribution =
+			HasUniformHashDistribution(sortedShardIntervalArray, shardIntervalCount);
+	}
+
+	return true;
+}
+
+
+/*
+ * HasUniformHashDistribution returns whether the given shard intervals, sorted
+ * by their min values, split the hash token space into equal ranges as
+ * master_create_worker_shards creates them, so that the shard of a hash value
+ * can be computed rather than searched for.
+ */
+static bool
+HasUniformHashDistribution(ShardInterval **shardIntervalArray, int shardIntervalCount)
+{
+	uint32 hashTokenIncrement = 0;
+	int shardIndex = 0;
+
+	if (shardIntervalCount == 0)
+	{
+		return false;
+	}
+
+	hashTokenIncrement = (uint32) (HASH_TOKEN_COUNT / shardIntervalCount);
+
+	for (shardIndex = 0; shardIndex < shardIntervalCount; shardIndex++)
+	{
+		ShardInterval *shardInterval = shardIntervalArray[shardIndex];
+		int32 shardMinHashToken = INT32_MIN + (shardIndex * hashTokenIncrement);
+		int32 shardMaxHashToken = shardMinHashToken + (hashTokenIncrement - 1);
+
+		if (shardIndex == (shardIntervalCount - 1))
+		{
+			shardMaxHashToken = INT32_MAX;
+		}
+
+		if (DatumGetInt32(shardInterval->minValue) != shardMinHashToken ||
+			DatumGetInt32(shardInterval->maxValue) != shardMaxHashToken)
+		{
+			return false;
+		}
 	}
 
-	return matchingCacheEntry->shardIntervalList;
+	return true;
 }
 
 
@@ -305,41 +612,16 @@ LoadShardPlacementList(int64 shardId)
 /*
  * PartitionColumn looks up the column used to partition a given distributed
  * table and returns a reference to a Var representing that column. If no entry
- * can be found using the provided identifier, this function throws an error.
+ * can be found using the provided identifier, or the table is a reference table
+ * without a partition column, this function throws an error.
  */
 Var *
 PartitionColumn(Oid distributedTableId)
 {
-	Var *partitionColumn = NULL;
-	Oid argTypes[] = { OIDOID };
-	Datum argValues[] = { ObjectIdGetDatum(distributedTableId) };
-	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
-	int spiStatus PG_USED_FOR_ASSERTS_ONLY = 0;
-	bool isNull = false;
-	Datum keyDatum = 0;
-	char *partitionColumnName = NULL;
-	static SPIPlanPtr spiPlan = NULL;
-
-	/*
-	 * SPI_connect switches to an SPI-specific MemoryContext. See the comment
-	 * in LoadShardIntervalList for a more extensive explanation.
-	 */
-	MemoryContext upperContext = CurrentMemoryContext, oldContext = NULL;
-	SPI_connect();
-
-	if (spiPlan == NULL)
-	{
-		spiPlan = SPI_prepare("SELECT key FROM pgs_distribution_metadata.partition "
-							  "WHERE relation_id = $1", argCount, argTypes);
-
-		spiStatus = SPI_keepplan(spiPlan);
-		Assert(spiStatus == 0);
-	}
-
-	spiStatus = SPI_execute_plan(spiPlan, argValues, NULL, false, 1);
-	Assert(spiStatus == SPI_OK_SELECT);
+	DistributedTableCacheEntry *cacheEntry =
+		LookupDistributedTableCacheEntry(distributedTableId);
 
-	if (SPI_processed != 1)
+	if (cacheEntry == NULL || cacheEntry->partitionColumn == NULL)
 	{
 		char *relationName = get_rel_name(distributedTableId);
 
@@ -348,17 +630,7 @@ PartitionColumn(Oid distributedTableId)
 							   relationName)));
 	}
 
-	keyDatum = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isNull);
-	oldContext = MemoryContextSwitchTo(upperContext);
-	partitionColumnName = TextDatumGetCString(keyDatum);
-
-	partitionColumn = ColumnNameToColumn(distributedTableId, partitionColumnName);
-
-	MemoryContextSwitchTo(oldContext);
-
-	SPI_finish();
-
-	return partitionColumn;
+	return (Var *) copyObject(cacheEntry->partitionColumn);
 }
 
 
@@ -370,20 +642,48 @@ PartitionColumn(Oid distributedTableId)
 char
 PartitionType(Oid distributedTableId)
 {
-	char partitionType = 0;
+	DistributedTableCacheEntry *cacheEntry =
+		LookupDistributedTableCacheEntry(distributedTableId);
+
+	if (cacheEntry == NULL)
+	{
+		char *relationName = get_rel_name(distributedTableId);
+
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("no partition column is defined for relation \"%s\"",
+							   relationName)));
+	}
+
+	return cacheEntry->partitionType;
+}
+
+
+/*
+ * LoadPartitionRow reads the partition method and the partition key of the
+ * given table from the partition metadata table, allocating the key in the
+ * current memory context. The function returns false if there is no partition
+ * row for the table, which means that it is not distributed.
+ */
+static bool
+LoadPartitionRow(Oid distributedTableId, char *partitionType, char **partitionKey)
+{
 	Oid argTypes[] = { OIDOID };
 	Datum argValues[] = { ObjectIdGetDatum(distributedTableId) };
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 	int spiStatus PG_USED_FOR_ASSERTS_ONLY = 0;
-	bool isNull = false;
-	Datum partitionTypeDatum = 0;
+	bool partitionRowFound = false;
 	static SPIPlanPtr spiPlan = NULL;
 
+	/*
+	 * SPI_connect switches to an SPI-specific MemoryContext. See the comment
+	 * in LoadShardIntervalList for a more extensive explanation.
+	 */
+	MemoryContext upperContext = CurrentMemoryContext, oldContext = NULL;
 	SPI_connect();
 
 	if (spiPlan == NULL)
 	{
-		spiPlan = SPI_prepare("SELECT partition_method "
+		spiPlan = SPI_prepare("SELECT partition_method, key "
 							  "FROM pgs_distribution_metadata.partition "
 							  "WHERE relation_id = $1", argCount, argTypes);
 
@@ -394,22 +694,26 @@ PartitionType(Oid distributedTableId)
 	spiStatus = SPI_execute_plan(spiPlan, argValues, NULL, false, 1);
 	Assert(spiStatus == SPI_OK_SELECT);
 
-	if (SPI_processed != 1)
+	partitionRowFound = (SPI_processed == 1);
+	if (partitionRowFound)
 	{
-		char *relationName = get_rel_name(distributedTableId);
+		HeapTuple heapTuple = SPI_tuptable->vals[0];
+		TupleDesc tupleDescriptor = SPI_tuptable->tupdesc;
+		bool isNull = false;
+		Datum partitionTypeDatum = SPI_getbinval(heapTuple, tupleDescriptor, 1, &isNull);
+		Datum keyDatum = SPI_getbinval(heapTuple, tupleDescriptor, 2, &isNull);
 
-		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
-						errmsg("no partition column is defined for relation \"%s\"",
-							   relationName)));
-	}
+		oldContext = MemoryContextSwitchTo(upperContext);
+
+		*partitionType = DatumGetChar(partitionTypeDatum);
+		*partitionKey = TextDatumGetCString(keyDatum);
 
-	partitionTypeDatum = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
-									   &isNull);
-	partitionType = DatumGetChar(partitionTypeDatum);
+		MemoryContextSwitchTo(oldContext);
+	}
 
 	SPI_finish();
 
-	return partitionType;
+	return partitionRowFound;
 }
 
 
@@ -436,6 +740,18 @@ IsDistributedTable(Oid tableId)
 		return false;
 	}
 
+	/* only distributed tables are cached, so valid entries need no query */
+	if (DistributedTableCache != NULL)
+	{
+		DistributedTableCacheEntry *cacheEntry = hash_search(DistributedTableCache,
+															 &tableId, HASH_FIND,
+															 NULL);
+		if (cacheEntry != NULL && cacheEntry->isValid)
+		{
+			return true;
+		}
+	}
+
 	/*
 	 * The query below hits the partition metadata table, so if we don't detect
 	 * that and short-circuit, we'll get infinite recursion in the planner.
@@ -472,6 +788,18 @@ IsDistributedTable(Oid tableId)
 }
 
 
+/*
+ * IsReferenceTable returns whether the given distributed table is a reference
+ * table, which has no partition column and a single shard that is placed on
+ * every worker node.
+ */
+bool
+IsReferenceTable(Oid distributedTableId)
+{
+	return (PartitionType(distributedTableId) == REFERENCE_PARTITION_TYPE);
+}
+
+
 /*
  *  DistributedTablesExist returns true if pg_shard has a record of any
  *  distributed tables; otherwise this function returns false.
@@ -610,6 +938,7 @@ TupleToShardInterval(HeapTuple heapTuple, TupleDesc tupleDescriptor)
 		}
 
 		case HASH_PARTITION_TYPE:
+		case REFERENCE_PARTITION_TYPE:
 		{
 			intervalTypeId = INT4OID;
 			break;
@@ -709,6 +1038,8 @@ InsertPartitionRow(Oid distributedTableId, char partitionType, text *partitionKe
 	Assert(spiStatus == SPI_OK_INSERT);
 
 	SPI_finish();
+
+	InvalidateDistributedTableCache(distributedTableId);
 }
 
 
@@ -756,6 +1087,8 @@ CreateShardRow(Oid distributedTableId, char shardStorage, text *shardMinValue,
 
 	SPI_finish();
 
+	InvalidateDistributedTableCache(distributedTableId);
+
 	return newShardId;
 }
 
@@ -928,6 +1261,83 @@ LockRelationDistributionMetadata(Oid relationId, LOCKMODE lockMode)
 }
 
 
+/*
+ * InvalidateDistributedTableCache invalidates the relcache entry of the given
+ * table, and with it the table's entry in the distributed table cache, in all
+ * backends once the current command completes or the transaction commits. The
+ * metadata triggers call this function on changes to the metadata tables; the
+ * functions which change metadata call it as well, since the metadata are views
+ * without such triggers under CitusDB.
+ */
+void
+InvalidateDistributedTableCache(Oid distributedTableId)
+{
+	/* tables dropped since their metadata was written have no entries left */
+	if (SearchSysCacheExists1(RELOID, ObjectIdGetDatum(distributedTableId)))
+	{
+		CacheInvalidateRelcacheByRelid(distributedTableId);
+	}
+}
+
+
+/*
+ * invalidate_metadata_cache is a trigger function on the shard and partition
+ * metadata tables which invalidates the cached metadata of the tables whose
+ * rows are inserted, updated, or deleted.
+ */
+Datum
+invalidate_metadata_cache(PG_FUNCTION_ARGS)
+{
+	TriggerData *triggerData = (TriggerData *) fcinfo->context;
+	TupleDesc tupleDescriptor = NULL;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR, (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+						errmsg("invalidate_metadata_cache must be called as a "
+							   "trigger")));
+	}
+
+	tupleDescriptor = RelationGetDescr(triggerData->tg_relation);
+
+	/* the trigger tuple is the old row of updates and deletes */
+	InvalidateTupleRelation(triggerData->tg_trigtuple, tupleDescriptor);
+	if (TRIGGER_FIRED_BY_UPDATE(triggerData->tg_event))
+	{
+		InvalidateTupleRelation(triggerData->tg_newtuple, tupleDescriptor);
+	}
+
+	PG_RETURN_POINTER(NULL);
+}
+
+
+/*
+ * InvalidateTupleRelation invalidates the cached metadata of the table which
+ * the given metadata row references in its relation_id column.
+ */
+static void
+InvalidateTupleRelation(HeapTuple heapTuple, TupleDesc tupleDescriptor)
+{
+	int relationIdColumn = SPI_fnumber(tupleDescriptor, "relation_id");
+	bool isNull = false;
+	Datum relationIdDatum = 0;
+
+	if (relationIdColumn <= 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+						errmsg("invalidate_metadata_cache must be fired on a table "
+							   "with a relation_id column")));
+	}
+
+	relationIdDatum = SPI_getbinval(heapTuple, tupleDescriptor, relationIdColumn,
+									&isNull);
+	if (!isNull)
+	{
+		InvalidateDistributedTableCache(DatumGetObjectId(relationIdDatum));
+	}
+}
+
+
 /*
  * AcquireShardLock implements the shared logic needed by LockShardData and
  * LockShardDistributionMetadata. It builds a lock tag with a shard identifier
@@ -0,0 +1,958 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/multi_shard_executor.c
+ *
+ * This file contains functions to run the tasks of a multi-shard SELECT on the
+ * worker nodes concurrently.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "funcapi.h"
+#include "libpq-fe.h"
+#include "miscadmin.h"
+
+#include "pg_shard.h"
+#include "connection.h"
+#include "distribution_metadata.h"
+#include "multi_shard_executor.h"
+#include "remote_results.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup.h"
+#include "access/htup_details.h"
+#include "access/skey.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_extension.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "executor/executor.h"
+#include "executor/tuptable.h"
+#include "lib/stringinfo.h"
+#include "nodes/makefuncs.h"
+#include "nodes/pg_list.h"
+#include "nodes/value.h"
+#include "parser/parse_func.h"
+#include "utils/elog.h"
+#include "utils/errcodes.h"
+#include "utils/fmgroids.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/palloc.h"
+#include "utils/rel.h"
+#include "utils/sortsupport.h"
+#include "utils/tuplestore.h"
+
+
+/* number of connections the executor opens to each worker node */
+int ExecutorConnectionsPerNode = DEFAULT_EXECUTOR_CONNECTIONS_PER_NODE;
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(pg_shard_intermediate_result);
+
+
+/*
+ * TaskExecution tracks the progress of one task. Rows are kept in a tuplestore
+ * of their own until all earlier tasks are done, so that results keep the order
+ * of the task list however the remote queries finish. Once all earlier tasks
+ * are done, unsorted rows may go to the result's tuplestore directly instead.
+ */
+typedef struct TaskExecution
+{
+	Task *task;                     /* task to execute */
+	int placementIndex;             /* placement the task runs or will run on */
+	bool running;                   /* query sent, results not yet received */
+	bool completed;                 /* all results were received */
+	Tuplestorestate *tupleStore;    /* rows received from the current placement */
+	bool storesResult;              /* tupleStore is the result's tuplestore */
+} TaskExecution;
+
+
+/*
+ * TaskConnection is a connection the executor uses to run tasks on a node. The
+ * first connection to each node is the cached one from GetConnection; any
+ * further ones belong to the executor and are closed once it is done.
+ */
+typedef struct TaskConnection
+{
+	PGconn *connection;             /* open connection or NULL */
+	bool cached;                    /* connection comes from the connection cache */
+	TaskExecution *taskExecution;   /* task running on the connection, if any */
+} TaskConnection;
+
+
+/* NodeTaskConnections keeps track of the connections to a worker node. */
+typedef struct NodeTaskConnections
+{
+	NodeConnectionKey key;          /* hash entry key */
+	int connectionLimit;            /* connections that may be open to the node */
+	bool failed;                    /* could not connect to the node at all */
+	TaskConnection *connections;    /* ExecutorConnectionsPerNode entries */
+} NodeTaskConnections;
+
+
+/* TaskResultState holds what is needed to turn remote results into tuples. */
+typedef struct TaskResultState
+{
+	RemoteResultState *remoteResultState;   /* builds tuples from remote rows */
+	int storeMemoryKB;                      /* memory per task tuplestore */
+} TaskResultState;
+
+
+/*
+ * TaskRowMerge merges the sorted rows of all tasks. The heap holds the indexes of
+ * tasks with rows left, ordered by their current rows, with the task whose row
+ * comes first at the top.
+ */
+typedef struct TaskRowMerge
+{
+	TaskExecution *executionArray;  /* tasks whose rows are merged */
+	TupleTableSlot **slotArray;     /* current row of each task */
+	int *taskHeap;                  /* binary heap of task indexes */
+	int heapSize;                   /* number of tasks in the heap */
+	SortSupport sortKeyArray;       /* how to compare rows */
+	int sortKeyCount;               /* number of sort keys */
+} TaskRowMerge;
+
+
+/* local function forward declarations */
+static HTAB * CreateNodeTaskConnectionHash(void);
+static NodeTaskConnections * LookupNodeTaskConnections(HTAB *nodeConnectionHash,
+													   ShardPlacement *placement);
+static TaskConnection * IdleTaskConnection(NodeTaskConnections *nodeConnections);
+static void ReleaseTaskConnection(TaskConnection *taskConnection, bool healthy);
+static bool StartTaskExecution(TaskExecution *execution, HTAB *nodeConnectionHash,
+							   TaskResultState *resultState);
+static bool ReceiveTaskResults(TaskConnection *taskConnection,
+							   TaskResultState *resultState, bool *failed);
+static int64 AppendTupleStore(Tuplestorestate *sourceStore, TupleDesc tupleDescriptor,
+							  Tuplestorestate *targetStore, int64 rowLimit);
+static void StoreTaskRowsInResult(TaskExecution *execution, TupleDesc tupleDescriptor,
+								  Tuplestorestate *tupleStore);
+static void MergeTaskResults(TaskExecution *executionArray, int taskCount,
+							 DistributedPlan *distributedPlan, TupleDesc tupleDescriptor,
+							 Tuplestorestate *tupleStore);
+static void SiftTaskHeapDown(TaskRowMerge *rowMerge, int heapIndex);
+static int CompareTaskRows(TaskRowMerge *rowMerge, int leftTaskIndex, int rightTaskIndex);
+static void ReleaseAllTaskConnections(HTAB *nodeConnectionHash, bool abort);
+static void EndIntermediateResult(Datum argument);
+static Oid ExtensionSchemaId(Oid extensionId);
+
+
+/*
+ * ExecuteTasksConcurrently runs the SELECT tasks of the given plan and stores
+ * their rows in the given tuplestore, in the order of the task list or, if the
+ * plan sorts its rows, merged in sort order; no more rows than the plan's limit
+ * are stored. The queries of all tasks
+ * are sent before any results are awaited, using up to ExecutorConnectionsPerNode
+ * connections to each node, and results are read from whichever connection has
+ * them first. A task that fails on a placement is retried on the next one, as in
+ * ExecuteTaskAndStoreResults; the function errors out if a task fails on all of
+ * its placements. Rows which are neither sorted nor limited are received into
+ * the given tuplestore directly once all earlier tasks are done, rather than
+ * being copied there from the task's own tuplestore.
+ */
+void
+ExecuteTasksConcurrently(DistributedPlan *distributedPlan, TupleDesc tupleDescriptor,
+						 Tuplestorestate *tupleStore)
+{
+	List *taskList = distributedPlan->taskList;
+	int taskCount = list_length(taskList);
+	bool mergeSortedResults = (distributedPlan->sortColumnCount > 0);
+	int64 rowsLeft = distributedPlan->rowLimit;
+	bool storeRowsInResult = (!mergeSortedResults && rowsLeft < 0);
+	TaskExecution *executionArray = palloc0(Max(taskCount, 1) * sizeof(TaskExecution));
+	TaskConnection **pollConnections = palloc0(Max(taskCount, 1) *
+											   sizeof(TaskConnection *));
+	struct pollfd *pollDescriptors = palloc0(Max(taskCount, 1) * sizeof(struct pollfd));
+	HTAB *nodeConnectionHash = CreateNodeTaskConnectionHash();
+	TaskResultState resultState;
+	ListCell *taskCell = NULL;
+	int taskIndex = 0;
+
+	memset(&resultState, 0, sizeof(resultState));
+	resultState.remoteResultState = CreateRemoteResultState(tupleDescriptor);
+	resultState.storeMemoryKB = Max(work_mem / Max(taskCount, 1), 64);
+
+	foreach(taskCell, taskList)
+	{
+		executionArray[taskIndex].task = (Task *) lfirst(taskCell);
+		taskIndex++;
+	}
+
+	PG_TRY();
+	{
+		int nextStoredTask = 0;
+
+		while (nextStoredTask < taskCount)
+		{
+			HASH_SEQ_STATUS hashCursor;
+			NodeTaskConnections *nodeConnections = NULL;
+			int pollCount = 0;
+			int pollIndex = 0;
+
+			/* send the queries of tasks waiting for a connection */
+			for (taskIndex = 0; taskIndex < taskCount; taskIndex++)
+			{
+				TaskExecution *execution = &executionArray[taskIndex];
+				if (!execution->running && !execution->completed)
+				{
+					StartTaskExecution(execution, nodeConnectionHash, &resultState);
+				}
+			}
+
+			/*
+			 * Move rows of tasks that are done into the result, in task order.
+			 * Sorted rows are kept until all tasks are done to be merged.
+			 */
+			while (nextStoredTask < taskCount && executionArray[nextStoredTask].completed)
+			{
+				TaskExecution *execution = &executionArray[nextStoredTask];
+
+				if (execution->storesResult)
+				{
+					execution->tupleStore = NULL;
+				}
+				else if (!mergeSortedResults)
+				{
+					int64 rowCount = AppendTupleStore(execution->tupleStore,
+													  tupleDescriptor, tupleStore,
+													  rowsLeft);
+					if (rowsLeft > 0)
+					{
+						rowsLeft -= rowCount;
+					}
+
+					tuplestore_end(execution->tupleStore);
+					execution->tupleStore = NULL;
+				}
+
+				nextStoredTask++;
+			}
+
+			if (storeRowsInResult && nextStoredTask < taskCount)
+			{
+				StoreTaskRowsInResult(&executionArray[nextStoredTask], tupleDescriptor,
+									  tupleStore);
+			}
+
+			/* wait for results on connections running a task */
+			hash_seq_init(&hashCursor, nodeConnectionHash);
+			while ((nodeConnections = hash_seq_search(&hashCursor)) != NULL)
+			{
+				int connectionIndex = 0;
+				for (connectionIndex = 0; connectionIndex < ExecutorConnectionsPerNode;
+					 connectionIndex++)
+				{
+					TaskConnection *taskConnection =
+						&nodeConnections->connections[connectionIndex];
+					if (taskConnection->taskExecution == NULL)
+					{
+						continue;
+					}
+
+					pollDescriptors[pollCount].fd = PQsocket(taskConnection->connection);
+					pollDescriptors[pollCount].events = POLLIN;
+					pollDescriptors[pollCount].revents = 0;
+					pollConnections[pollCount] = taskConnection;
+					pollCount++;
+				}
+			}
+
+			if (pollCount == 0)
+			{
+				continue;
+			}
+
+			if (poll(pollDescriptors, pollCount, EXECUTOR_POLL_TIMEOUT_MS) < 0 &&
+				errno != EINTR)
+			{
+				ereport(ERROR, (errcode_for_socket_access(),
+								errmsg("could not wait for remote results: %m")));
+			}
+
+			CHECK_FOR_INTERRUPTS();
+
+			for (pollIndex = 0; pollIndex < pollCount; pollIndex++)
+			{
+				TaskConnection *taskConnection = pollConnections[pollIndex];
+				TaskExecution *execution = taskConnection->taskExecution;
+				bool failed = false;
+				bool finished = false;
+
+				if ((pollDescriptors[pollIndex].revents & (POLLIN | POLLERR | POLLHUP)) == 0)
+				{
+					continue;
+				}
+
+				finished = ReceiveTaskResults(taskConnection, &resultState, &failed);
+				if (!finished)
+				{
+					continue;
+				}
+
+				execution->running = false;
+				if (failed)
+				{
+					/* discard partial results and try the next placement */
+					ReleaseTaskConnection(taskConnection, false);
+					if (!execution->storesResult)
+					{
+						tuplestore_clear(execution->tupleStore);
+					}
+					execution->placementIndex++;
+				}
+				else
+				{
+					ReleaseTaskConnection(taskConnection, true);
+					execution->completed = true;
+				}
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		ReleaseAllTaskConnections(nodeConnectionHash, true);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	ReleaseAllTaskConnections(nodeConnectionHash, false);
+
+	if (mergeSortedResults)
+	{
+		MergeTaskResults(executionArray, taskCount, distributedPlan, tupleDescriptor,
+						 tupleStore);
+	}
+
+	hash_destroy(nodeConnectionHash);
+	FreeRemoteResultState(resultState.remoteResultState);
+	pfree(pollDescriptors);
+	pfree(pollConnections);
+	pfree(executionArray);
+}
+
+
+/*
+ * CreateNodeTaskConnectionHash creates the hash that maps worker nodes to the
+ * connections the executor uses for them.
+ */
+static HTAB *
+CreateNodeTaskConnectionHash(void)
+{
+	HASHCTL info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(NodeConnectionKey);
+	info.entrysize = sizeof(NodeTaskConnections);
+	info.hash = tag_hash;
+	info.hcxt = CurrentMemoryContext;
+
+	return hash_create("nodeTaskConnections", 32, &info,
+					   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+}
+
+
+/*
+ * LookupNodeTaskConnections returns the connection entry of the placement's
+ * node, creating it on first use.
+ */
+static NodeTaskConnections *
+LookupNodeTaskConnections(HTAB *nodeConnectionHash, ShardPlacement *placement)
+{
+	NodeConnectionKey nodeKey;
+	NodeTaskConnections *nodeConnections = NULL;
+	bool found = false;
+
+	memset(&nodeKey, 0, sizeof(nodeKey));
+	strlcpy(nodeKey.nodeName, placement->nodeName, MAX_NODE_LENGTH + 1);
+	nodeKey.nodePort = placement->nodePort;
+
+	nodeConnections = (NodeTaskConnections *) hash_search(nodeConnectionHash, &nodeKey,
+														  HASH_ENTER, &found);
+	if (!found)
+	{
+		nodeConnections->connectionLimit = ExecutorConnectionsPerNode;
+		nodeConnections->failed = false;
+		nodeConnections->connections =
+			palloc0(ExecutorConnectionsPerNode * sizeof(TaskConnection));
+	}
+
+	return nodeConnections;
+}
+
+
+/*
+ * IdleTaskConnection returns a connection to the node on which no task runs,
+ * opening a new one if the node's connection limit allows. The function returns
+ * NULL if all connections are busy or no connection could be established. If
+ * connecting fails while other connections to the node are open, the node's
+ * limit is lowered to those; if none are open, the node is marked as failed.
+ */
+static TaskConnection *
+IdleTaskConnection(NodeTaskConnections *nodeConnections)
+{
+	NodeConnectionKey *nodeKey = &nodeConnections->key;
+	TaskConnection *unusedConnection = NULL;
+	int openCount = 0;
+	int connectionIndex = 0;
+
+	for (connectionIndex = 0; connectionIndex < nodeConnections->connectionLimit;
+		 connectionIndex++)
+	{
+		TaskConnection *taskConnection = &nodeConnections->connections[connectionIndex];
+
+		if (taskConnection->connection == NULL)
+		{
+			if (unusedConnection == NULL)
+			{
+				unusedConnection = taskConnection;
+			}
+			continue;
+		}
+
+		openCount++;
+		if (taskConnection->taskExecution == NULL)
+		{
+			return taskConnection;
+		}
+	}
+
+	if (unusedConnection == NULL || nodeConnections->failed)
+	{
+		return NULL;
+	}
+
+	/* the cached connection is used first, any others are opened for the executor */
+	unusedConnection->cached = (unusedConnection == &nodeConnections->connections[0]);
+	if (unusedConnection->cached)
+	{
+		unusedConnection->connection = GetConnection(nodeKey->nodeName,
+													 nodeKey->nodePort);
+	}
+	else
+	{
+		unusedConnection->connection = ConnectToNode(nodeKey->nodeName,
+													 nodeKey->nodePort);
+	}
+
+	if (unusedConnection->connection == NULL)
+	{
+		if (openCount > 0)
+		{
+			nodeConnections->connectionLimit = openCount;
+		}
+		else
+		{
+			nodeConnections->failed = true;
+		}
+
+		return NULL;
+	}
+
+	return unusedConnection;
+}
+
+
+/*
+ * ReleaseTaskConnection marks the connection as idle. A connection that is not
+ * healthy is closed, or purged from the cache if it came from there.
+ */
+static void
+ReleaseTaskConnection(TaskConnection *taskConnection, bool healthy)
+{
+	taskConnection->taskExecution = NULL;
+
+	if (!healthy && taskConnection->connection != NULL)
+	{
+		if (taskConnection->cached)
+		{
+			PurgeConnection(taskConnection->connection);
+		}
+		else
+		{
+			PQfinish(taskConnection->connection);
+		}
+
+		taskConnection->connection = NULL;
+	}
+}
+
+
+/*
+ * StartTaskExecution sends the task's query to its current placement, moving
+ * on to later placements while the query cannot be sent. The function returns
+ * false if all connections to the placement's node are busy, in which case the
+ * task stays pending. It errors out once no placements are left.
+ */
+static bool
+StartTaskExecution(TaskExecution *execution, HTAB *nodeConnectionHash,
+				   TaskResultState *resultState)
+{
+	Task *task = execution->task;
+	List *taskPlacementList = task->taskPlacementList;
+
+	while (execution->placementIndex < list_length(taskPlacementList))
+	{
+		ShardPlacement *taskPlacement = (ShardPlacement *)
+			list_nth(taskPlacementList, execution->placementIndex);
+		NodeTaskConnections *nodeConnections =
+			LookupNodeTaskConnections(nodeConnectionHash, taskPlacement);
+		TaskConnection *taskConnection = NULL;
+		PGconn *connection = NULL;
+
+		taskConnection = IdleTaskConnection(nodeConnections);
+		if (taskConnection == NULL)
+		{
+			if (!nodeConnections->failed)
+			{
+				return false;
+			}
+
+			execution->placementIndex++;
+			continue;
+		}
+
+		connection = taskConnection->connection;
+		if (!SendRemoteQuery(connection, task->queryString->data,
+							 resultState->remoteResultState))
+		{
+			ReleaseTaskConnection(taskConnection, false);
+			execution->placementIndex++;
+			continue;
+		}
+
+		if (execution->tupleStore == NULL)
+		{
+			execution->tupleStore = tuplestore_begin_heap(false, false,
+														  resultState->storeMemoryKB);
+		}
+
+		taskConnection->taskExecution = execution;
+		execution->running = true;
+
+		return true;
+	}
+
+	ereport(ERROR, (errmsg("could not receive query results")));
+
+	return false;
+}
+
+
+/*
+ * ReceiveTaskResults reads the results available on the connection without
+ * blocking and stores their rows in the tuplestore of the task running on it.
+ * The function returns true once all results of the task's query were read or
+ * the query failed, in which case failed is set.
+ */
+static bool
+ReceiveTaskResults(TaskConnection *taskConnection, TaskResultState *resultState,
+				   bool *failed)
+{
+	PGconn *connection = taskConnection->connection;
+	TaskExecution *execution = taskConnection->taskExecution;
+
+	if (PQconsumeInput(connection) == 0)
+	{
+		ReportRemoteError(connection, NULL);
+		*failed = true;
+		return true;
+	}
+
+	return ReadRemoteResults(connection, resultState->remoteResultState,
+							 execution->tupleStore, false, failed);
+}
+
+
+/*
+ * AppendTupleStore copies the tuples of the source tuplestore to the end of the
+ * target tuplestore, but no more than rowLimit of them unless rowLimit is
+ * negative. The function returns the number of copied tuples.
+ */
+static int64
+AppendTupleStore(Tuplestorestate *sourceStore, TupleDesc tupleDescriptor,
+				 Tuplestorestate *targetStore, int64 rowLimit)
+{
+	TupleTableSlot *tupleSlot = MakeSingleTupleTableSlot(tupleDescriptor);
+	int64 rowCount = 0;
+
+	while ((rowLimit < 0 || rowCount < rowLimit) &&
+		   tuplestore_gettupleslot(sourceStore, true, false, tupleSlot))
+	{
+		tuplestore_puttupleslot(targetStore, tupleSlot);
+		rowCount++;
+	}
+
+	ExecDropSingleTupleTableSlot(tupleSlot);
+
+	return rowCount;
+}
+
+
+/*
+ * StoreTaskRowsInResult makes the given task receive its rows into the result's
+ * tuplestore directly, after moving there the rows it already received. This is
+ * only done once the task runs, or is about to run, on its last placement: there,
+ * a failure ends the query rather than discarding the rows received so far.
+ */
+static void
+StoreTaskRowsInResult(TaskExecution *execution, TupleDesc tupleDescriptor,
+					  Tuplestorestate *tupleStore)
+{
+	int lastPlacementIndex = list_length(execution->task->taskPlacementList) - 1;
+
+	if (execution->storesResult || execution->placementIndex != lastPlacementIndex)
+	{
+		return;
+	}
+
+	if (execution->tupleStore != NULL)
+	{
+		AppendTupleStore(execution->tupleStore, tupleDescriptor, tupleStore, -1);
+		tuplestore_end(execution->tupleStore);
+	}
+
+	execution->tupleStore = tupleStore;
+	execution->storesResult = true;
+}
+
+
+/*
+ * MergeTaskResults merges the sorted rows of all tasks into the given tuplestore
+ * in the plan's sort order, and stops once the plan's row limit is reached. The
+ * rows of each task come sorted from its shard, so a heap of the tasks ordered
+ * by their next rows yields the rows in order, as in a MergeAppend node. Rows
+ * which compare equal keep the order of the task list.
+ */
+static void
+MergeTaskResults(TaskExecution *executionArray, int taskCount,
+				 DistributedPlan *distributedPlan, TupleDesc tupleDescriptor,
+				 Tuplestorestate *tupleStore)
+{
+	TaskRowMerge rowMerge;
+	int64 rowsLeft = distributedPlan->rowLimit;
+	int sortKeyIndex = 0;
+	int taskIndex = 0;
+	int heapIndex = 0;
+
+	memset(&rowMerge, 0, sizeof(TaskRowMerge));
+	rowMerge.executionArray = executionArray;
+	rowMerge.slotArray = palloc0(taskCount * sizeof(TupleTableSlot *));
+	rowMerge.taskHeap = palloc0(taskCount * sizeof(int));
+	rowMerge.sortKeyCount = distributedPlan->sortColumnCount;
+	rowMerge.sortKeyArray = palloc0(rowMerge.sortKeyCount * sizeof(SortSupportData));
+
+	for (sortKeyIndex = 0; sortKeyIndex < rowMerge.sortKeyCount; sortKeyIndex++)
+	{
+		SortSupport sortKey = &rowMerge.sortKeyArray[sortKeyIndex];
+
+		sortKey->ssup_cxt = CurrentMemoryContext;
+		sortKey->ssup_collation = distributedPlan->sortCollations[sortKeyIndex];
+		sortKey->ssup_nulls_first = distributedPlan->sortNullsFirst[sortKeyIndex];
+		sortKey->ssup_attno = distributedPlan->sortColumnIndexes[sortKeyIndex];
+
+		PrepareSortSupportFromOrderingOp(distributedPlan->sortOperators[sortKeyIndex],
+										 sortKey);
+	}
+
+	/* read the first row of each task and build the heap from them */
+	for (taskIndex = 0; taskIndex < taskCount; taskIndex++)
+	{
+		Tuplestorestate *taskStore = executionArray[taskIndex].tupleStore;
+		TupleTableSlot *taskSlot = MakeSingleTupleTableSlot(tupleDescriptor);
+
+		rowMerge.slotArray[taskIndex] = taskSlot;
+		if (tuplestore_gettupleslot(taskStore, true, false, taskSlot))
+		{
+			rowMerge.taskHeap[rowMerge.heapSize] = taskIndex;
+			rowMerge.heapSize++;
+		}
+	}
+
+	for (heapIndex = rowMerge.heapSize / 2 - 1; heapIndex >= 0; heapIndex--)
+	{
+		SiftTaskHeapDown(&rowMerge, heapIndex);
+	}
+
+	/* store the first row of the heap and replace it by the task's next row */
+	while (rowMerge.heapSize > 0 && rowsLeft != 0)
+	{
+		int firstTaskIndex = rowMerge.taskHeap[0];
+		Tuplestorestate *taskStore = executionArray[firstTaskIndex].tupleStore;
+		TupleTableSlot *taskSlot = rowMerge.slotArray[firstTaskIndex];
+
+		tuplestore_puttupleslot(tupleStore, taskSlot);
+		if (rowsLeft > 0)
+		{
+			rowsLeft--;
+		}
+
+		if (!tuplestore_gettupleslot(taskStore, true, false, taskSlot))
+		{
+			rowMerge.heapSize--;
+			rowMerge.taskHeap[0] = rowMerge.taskHeap[rowMerge.heapSize];
+		}
+
+		SiftTaskHeapDown(&rowMerge, 0);
+	}
+
+	for (taskIndex = 0; taskIndex < taskCount; taskIndex++)
+	{
+		ExecDropSingleTupleTableSlot(rowMerge.slotArray[taskIndex]);
+		tuplestore_end(executionArray[taskIndex].tupleStore);
+		executionArray[taskIndex].tupleStore = NULL;
+	}
+
+	pfree(rowMerge.sortKeyArray);
+	pfree(rowMerge.taskHeap);
+	pfree(rowMerge.slotArray);
+}
+
+
+/*
+ * SiftTaskHeapDown moves the task at the given heap index down the heap until
+ * its current row comes before those of the tasks below it.
+ */
+static void
+SiftTaskHeapDown(TaskRowMerge *rowMerge, int heapIndex)
+{
+	int *taskHeap = rowMerge->taskHeap;
+
+	for (;;)
+	{
+		int firstIndex = heapIndex;
+		int leftChildIndex = 2 * heapIndex + 1;
+		int rightChildIndex = leftChildIndex + 1;
+		int taskIndex = 0;
+
+		if (leftChildIndex < rowMerge->heapSize &&
+			CompareTaskRows(rowMerge, taskHeap[leftChildIndex], taskHeap[firstIndex]) < 0)
+		{
+			firstIndex = leftChildIndex;
+		}
+
+		if (rightChildIndex < rowMerge->heapSize &&
+			CompareTaskRows(rowMerge, taskHeap[rightChildIndex], taskHeap[firstIndex]) < 0)
+		{
+			firstIndex = rightChildIndex;
+		}
+
+		if (firstIndex == heapIndex)
+		{
+			break;
+		}
+
+		taskIndex = taskHeap[heapIndex];
+		taskHeap[heapIndex] = taskHeap[firstIndex];
+		taskHeap[firstIndex] = taskIndex;
+		heapIndex = firstIndex;
+	}
+}
+
+
+/*
+ * CompareTaskRows compares the current rows of the given tasks by the sort keys
+ * of the merge. Equal rows are ordered by the position of their tasks.
+ */
+static int
+CompareTaskRows(TaskRowMerge *rowMerge, int leftTaskIndex, int rightTaskIndex)
+{
+	TupleTableSlot *leftSlot = rowMerge->slotArray[leftTaskIndex];
+	TupleTableSlot *rightSlot = rowMerge->slotArray[rightTaskIndex];
+	int sortKeyIndex = 0;
+
+	for (sortKeyIndex = 0; sortKeyIndex < rowMerge->sortKeyCount; sortKeyIndex++)
+	{
+		SortSupport sortKey = &rowMerge->sortKeyArray[sortKeyIndex];
+		AttrNumber columnId = sortKey->ssup_attno;
+		bool leftIsNull = false;
+		bool rightIsNull = false;
+		Datum leftValue = slot_getattr(leftSlot, columnId, &leftIsNull);
+		Datum rightValue = slot_getattr(rightSlot, columnId, &rightIsNull);
+		int comparison = ApplySortComparator(leftValue, leftIsNull, rightValue,
+											 rightIsNull, sortKey);
+		if (comparison != 0)
+		{
+			return comparison;
+		}
+	}
+
+	return leftTaskIndex - rightTaskIndex;
+}
+
+
+/*
+ * ReleaseAllTaskConnections closes the connections the executor opened. On
+ * abort, connections with a query still running are closed too, or purged from
+ * the connection cache; otherwise cached connections are left open for reuse.
+ */
+static void
+ReleaseAllTaskConnections(HTAB *nodeConnectionHash, bool abort)
+{
+	HASH_SEQ_STATUS hashCursor;
+	NodeTaskConnections *nodeConnections = NULL;
+
+	hash_seq_init(&hashCursor, nodeConnectionHash);
+	while ((nodeConnections = hash_seq_search(&hashCursor)) != NULL)
+	{
+		int connectionIndex = 0;
+		for (connectionIndex = 0; connectionIndex < ExecutorConnectionsPerNode;
+			 connectionIndex++)
+		{
+			TaskConnection *taskConnection = &nodeConnections->connections[connectionIndex];
+			bool healthy = taskConnection->cached &&
+						   (!abort || taskConnection->taskExecution == NULL);
+
+			ReleaseTaskConnection(taskConnection, healthy);
+		}
+	}
+}
+
+
+/*
+ * CreateIntermediateResult creates an empty intermediate result in the memory of
+ * the given executor state. If the function scan never reads the rows, they are
+ * released together with the executor state.
+ */
+IntermediateResult *
+CreateIntermediateResult(EState *executorState, TupleDesc tupleDescriptor)
+{
+	MemoryContext oldContext = MemoryContextSwitchTo(executorState->es_query_cxt);
+	ExprContext *expressionContext = CreateExprContext(executorState);
+	IntermediateResult *intermediateResult = palloc0(sizeof(IntermediateResult));
+
+	intermediateResult->tupleDescriptor = CreateTupleDescCopy(tupleDescriptor);
+	intermediateResult->tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	RegisterExprContextCallback(expressionContext, EndIntermediateResult,
+								PointerGetDatum(intermediateResult));
+
+	MemoryContextSwitchTo(oldContext);
+
+	return intermediateResult;
+}
+
+
+/*
+ * EndIntermediateResult releases the rows of an intermediate result that were
+ * not handed over to a function scan.
+ */
+static void
+EndIntermediateResult(Datum argument)
+{
+	IntermediateResult *intermediateResult =
+		(IntermediateResult *) DatumGetPointer(argument);
+
+	if (intermediateResult->tupleStore != NULL)
+	{
+		tuplestore_end(intermediateResult->tupleStore);
+		intermediateResult->tupleStore = NULL;
+	}
+}
+
+
+/*
+ * IntermediateResultFunctionId returns the identifier of the function that
+ * returns intermediate results, looked up in the schema of the extension.
+ */
+Oid
+IntermediateResultFunctionId(void)
+{
+	bool missingOK = false;
+	Oid extensionId = get_extension_oid(PG_SHARD_EXTENSION_NAME, missingOK);
+	char *schemaName = get_namespace_name(ExtensionSchemaId(extensionId));
+	List *functionName = list_make2(makeString(schemaName),
+									makeString(INTERMEDIATE_RESULT_FUNCTION_NAME));
+	Oid argumentTypes[1] = { INTERNALOID };
+
+	return LookupFuncName(functionName, 1, argumentTypes, missingOK);
+}
+
+
+/*
+ * ExtensionSchemaId returns the identifier of the schema holding the objects of
+ * the given extension.
+ */
+static Oid
+ExtensionSchemaId(Oid extensionId)
+{
+	Relation extensionRelation = heap_open(ExtensionRelationId, AccessShareLock);
+	SysScanDesc scanDescriptor = NULL;
+	ScanKeyData scanKey[1];
+	HeapTuple extensionTuple = NULL;
+	Oid schemaId = InvalidOid;
+
+	ScanKeyInit(&scanKey[0], ObjectIdAttributeNumber, BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(extensionId));
+
+	scanDescriptor = systable_beginscan(extensionRelation, ExtensionOidIndexId, true,
+										NULL, 1, scanKey);
+
+	extensionTuple = systable_getnext(scanDescriptor);
+	if (!HeapTupleIsValid(extensionTuple))
+	{
+		ereport(ERROR, (errmsg("could not find extension with OID %u", extensionId)));
+	}
+
+	schemaId = ((Form_pg_extension) GETSTRUCT(extensionTuple))->extnamespace;
+
+	systable_endscan(scanDescriptor);
+	heap_close(extensionRelation, AccessShareLock);
+
+	return schemaId;
+}
+
+
+/*
+ * pg_shard_intermediate_result returns the rows of the intermediate result it
+ * is passed. The executor passes the result of a multi-shard SELECT as the value
+ * of an executor parameter, so the function cannot be called from SQL, which has
+ * no values of type internal. The tuplestore is handed over to the function scan,
+ * which reads it directly.
+ */
+Datum
+pg_shard_intermediate_result(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	IntermediateResult *intermediateResult = NULL;
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("set-valued function called in context that cannot "
+							   "accept a set")));
+	}
+
+	if (!PG_ARGISNULL(0))
+	{
+		intermediateResult = (IntermediateResult *) PG_GETARG_POINTER(0);
+	}
+
+	if (intermediateResult == NULL || intermediateResult->tupleStore == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("intermediate result is not available")));
+	}
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = intermediateResult->tupleStore;
+	resultInfo->setDesc = CreateTupleDescCopy(intermediateResult->tupleDescriptor);
+
+	intermediateResult->tupleStore = NULL;
+
+	PG_RETURN_NULL();
+}
@@ -0,0 +1,517 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/partial_aggregates.c
+ *
+ * This file contains functions to split the aggregates of multi-shard SELECTs
+ * into partial aggregates, which the shards compute, and expressions which
+ * combine the partial results on the master node.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+
+#include "partial_aggregates.h"
+
+#include <string.h>
+
+#if (PG_VERSION_NUM >= 90400)
+#include "catalog/pg_aggregate.h"
+#endif
+#include "catalog/pg_namespace.h"
+#include "catalog/pg_type.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/nodes.h"
+#include "nodes/primnodes.h"
+#include "optimizer/clauses.h"
+#include "optimizer/tlist.h"
+#include "parser/parse_coerce.h"
+#include "parser/parse_func.h"
+#include "parser/parse_oper.h"
+#include "utils/lsyscache.h"
+
+
+/*
+ * PartialAggregateKind identifies how an aggregate is split into a partial
+ * aggregate on the shards and an expression combining the partial results.
+ */
+typedef enum
+{
+	PARTIAL_AGGREGATE_UNSUPPORTED = 0,
+	PARTIAL_AGGREGATE_COUNT = 1,   /* counts are summed up */
+	PARTIAL_AGGREGATE_SUM = 2,     /* sums are summed up */
+	PARTIAL_AGGREGATE_AVERAGE = 3, /* sum of sums divided by sum of counts */
+	PARTIAL_AGGREGATE_REAPPLY = 4  /* min, max, bool_and, bool_or, every */
+} PartialAggregateKind;
+
+
+/*
+ * PartialAggregateContext keeps the state of splitting a query's aggregates.
+ * The remote target list starts with the query's grouping expressions and is
+ * extended with a partial aggregate for each aggregate found in the query.
+ */
+typedef struct PartialAggregateContext
+{
+	List *groupExpressionList; /* grouping expressions of the query */
+	List *remoteTargetList;    /* columns the shards return */
+	bool pushdownSafe;         /* false once part of the query cannot be split */
+} PartialAggregateContext;
+
+
+/* local function forward declarations */
+static Node * CombineAggregatesMutator(Node *node, PartialAggregateContext *context);
+static Node * CombineAggregate(Aggref *aggregate, PartialAggregateContext *context);
+static PartialAggregateKind AggregateKind(Aggref *aggregate);
+static Var * AddPartialAggregate(Aggref *partialAggregate,
+								 PartialAggregateContext *context);
+static Aggref * ReapplyAggregate(Aggref *aggregate, Oid functionId, Var *partialColumn);
+static Node * SumPartialAggregates(Aggref *aggregate, Var *partialColumn,
+								   Oid resultType);
+static Oid AggregateFunctionId(char *aggregateName, Oid argumentType);
+static Var * IntermediateResultColumn(Node *expression, AttrNumber columnId);
+
+
+/*
+ * BuildPartialAggregateQueries splits an aggregate or grouping query on a single
+ * table into a remote query, which computes partial aggregates over the rows of
+ * a shard grouped by the query's grouping expressions, and a local query, which
+ * combines these partial results over the intermediate result the shards return.
+ * The columns of the local query already refer to those of the remote target
+ * list. The function returns false without building any queries if the query
+ * has no aggregates, must filter rows locally, or uses an aggregate which can't
+ * be split; callers should then fetch the rows themselves instead.
+ */
+bool
+BuildPartialAggregateQueries(Query *query, List *remoteRestrictList,
+							 List *localRestrictList, Query **remoteQuery,
+							 Query **localQuery)
+{
+	Query *partialQuery = NULL;
+	Query *combineQuery = NULL;
+	List *remoteGroupClauseList = NIL;
+	ListCell *groupClauseCell = NULL;
+	ListCell *targetEntryCell = NULL;
+	FromExpr *remoteJoinTree = NULL;
+	RangeTblRef *intermediateResultReference = makeNode(RangeTblRef);
+	PartialAggregateContext context;
+
+	if (!query->hasAggs && query->groupClause == NIL)
+	{
+		return false;
+	}
+
+	/* local filters and window functions need the rows, not partial aggregates */
+	if (localRestrictList != NIL || query->hasWindowFuncs)
+	{
+		return false;
+	}
+
+#if (PG_VERSION_NUM >= 90500)
+	if (query->groupingSets != NIL)
+	{
+		return false;
+	}
+#endif
+
+	memset(&context, 0, sizeof(PartialAggregateContext));
+	context.pushdownSafe = true;
+
+	combineQuery = copyObject(query);
+
+	/* the shards group by the grouping expressions and return them first */
+	foreach(groupClauseCell, combineQuery->groupClause)
+	{
+		SortGroupClause *groupClause = (SortGroupClause *) lfirst(groupClauseCell);
+		SortGroupClause *remoteGroupClause = copyObject(groupClause);
+		Node *groupExpression = get_sortgroupclause_expr(groupClause,
+														 combineQuery->targetList);
+		AttrNumber columnId = list_length(context.remoteTargetList) + 1;
+		TargetEntry *remoteTargetEntry = NULL;
+
+		if (contain_volatile_functions(groupExpression))
+		{
+			return false;
+		}
+
+		remoteTargetEntry = makeTargetEntry((Expr *) copyObject(groupExpression),
+											columnId, NULL, false);
+		remoteTargetEntry->ressortgroupref = columnId;
+		remoteGroupClause->tleSortGroupRef = columnId;
+
+		context.groupExpressionList = lappend(context.groupExpressionList,
+											  groupExpression);
+		context.remoteTargetList = lappend(context.remoteTargetList,
+										   remoteTargetEntry);
+		remoteGroupClauseList = lappend(remoteGroupClauseList, remoteGroupClause);
+	}
+
+	/* replace aggregates and grouping expressions by combining expressions */
+	foreach(targetEntryCell, combineQuery->targetList)
+	{
+		TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+		Node *expression = (Node *) targetEntry->expr;
+
+		targetEntry->expr = (Expr *) CombineAggregatesMutator(expression, &context);
+	}
+
+	combineQuery->havingQual = CombineAggregatesMutator(combineQuery->havingQual,
+														&context);
+	if (!context.pushdownSafe)
+	{
+		return false;
+	}
+
+	/* the combining query reads the intermediate result in the first entry only */
+	Assert(combineQuery->jointree != NULL);
+	intermediateResultReference->rtindex = 1;
+	combineQuery->jointree->fromlist = list_make1(intermediateResultReference);
+	combineQuery->jointree->quals = NULL;
+
+	remoteJoinTree = makeFromExpr(copyObject(query->jointree->fromlist),
+								  (Node *) make_ands_explicit(remoteRestrictList));
+
+	partialQuery = makeNode(Query);
+	partialQuery->commandType = CMD_SELECT;
+	partialQuery->rtable = copyObject(query->rtable);
+	partialQuery->jointree = remoteJoinTree;
+	partialQuery->targetList = context.remoteTargetList;
+	partialQuery->groupClause = remoteGroupClauseList;
+	partialQuery->hasAggs = query->hasAggs;
+
+	*remoteQuery = partialQuery;
+	*localQuery = combineQuery;
+
+	return true;
+}
+
+
+/*
+ * CombineAggregatesMutator replaces grouping expressions in the given expression
+ * tree by the intermediate result columns holding them, and aggregates by
+ * expressions combining their partial results. Columns outside of aggregates
+ * and grouping expressions can't be computed from the partial results; the
+ * function marks the context as unsafe for pushdown when it finds one.
+ */
+static Node *
+CombineAggregatesMutator(Node *node, PartialAggregateContext *context)
+{
+	ListCell *groupExpressionCell = NULL;
+	AttrNumber columnId = 0;
+
+	if (node == NULL)
+	{
+		return NULL;
+	}
+
+	foreach(groupExpressionCell, context->groupExpressionList)
+	{
+		Node *groupExpression = (Node *) lfirst(groupExpressionCell);
+
+		columnId++;
+		if (equal(node, groupExpression))
+		{
+			return (Node *) IntermediateResultColumn(groupExpression, columnId);
+		}
+	}
+
+	if (IsA(node, Aggref))
+	{
+		return CombineAggregate((Aggref *) node, context);
+	}
+
+	if (IsA(node, Var))
+	{
+		context->pushdownSafe = false;
+
+		return node;
+	}
+
+	return expression_tree_mutator(node, CombineAggregatesMutator, (void *) context);
+}
+
+
+/*
+ * CombineAggregate adds the partial aggregates needed to compute the given
+ * aggregate to the remote target list, and returns an expression computing the
+ * aggregate's value from them.
+ */
+static Node *
+CombineAggregate(Aggref *aggregate, PartialAggregateContext *context)
+{
+	PartialAggregateKind aggregateKind = AggregateKind(aggregate);
+	Node *combineExpression = NULL;
+
+	if (aggregateKind == PARTIAL_AGGREGATE_COUNT)
+	{
+		Var *partialCount = AddPartialAggregate(copyObject(aggregate), context);
+		Node *countSum = SumPartialAggregates(aggregate, partialCount, INT8OID);
+
+		/* a sum over no partial counts is null, whereas the count is zero */
+		if (countSum != NULL)
+		{
+			CoalesceExpr *coalesceExpression = makeNode(CoalesceExpr);
+			Const *zeroCount = makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+										 Int64GetDatum(0), false, FLOAT8PASSBYVAL);
+
+			coalesceExpression->coalescetype = INT8OID;
+			coalesceExpression->coalescecollid = InvalidOid;
+			coalesceExpression->args = list_make2(countSum, zeroCount);
+			coalesceExpression->location = -1;
+
+			combineExpression = (Node *) coalesceExpression;
+		}
+	}
+	else if (aggregateKind == PARTIAL_AGGREGATE_SUM)
+	{
+		Var *partialSum = AddPartialAggregate(copyObject(aggregate), context);
+
+		combineExpression = SumPartialAggregates(aggregate, partialSum,
+												 aggregate->aggtype);
+	}
+	else if (aggregateKind == PARTIAL_AGGREGATE_REAPPLY)
+	{
+		Var *partialResult = AddPartialAggregate(copyObject(aggregate), context);
+
+		combineExpression = (Node *) ReapplyAggregate(aggregate, aggregate->aggfnoid,
+													  partialResult);
+	}
+	else if (aggregateKind == PARTIAL_AGGREGATE_AVERAGE)
+	{
+		/*
+		 * The shards sum up the values after casting them to the average's type,
+		 * as avg accumulates them in that type. Intervals are divided by a float
+		 * count, other averages by a count of their own type.
+		 */
+		Oid averageType = aggregate->aggtype;
+		Oid countType = (averageType == INTERVALOID) ? FLOAT8OID : averageType;
+		TargetEntry *argument = (TargetEntry *) linitial(aggregate->args);
+		Node *argumentExpression = (Node *) argument->expr;
+		Oid sumFunctionId = AggregateFunctionId("sum", averageType);
+		Oid countFunctionId = AggregateFunctionId("count", ANYOID);
+		Node *sumArgument = coerce_to_target_type(NULL, argumentExpression,
+												  exprType(argumentExpression),
+												  averageType, -1, COERCION_IMPLICIT,
+												  COERCE_EXPLICIT_CAST, -1);
+
+		if (OidIsValid(sumFunctionId) && OidIsValid(countFunctionId) &&
+			sumArgument != NULL)
+		{
+			Aggref *sumAggregate = copyObject(aggregate);
+			Aggref *countAggregate = copyObject(aggregate);
+			Var *partialSum = NULL;
+			Var *partialCount = NULL;
+			Node *valueSum = NULL;
+			Node *countSum = NULL;
+
+			sumAggregate->aggfnoid = sumFunctionId;
+			sumAggregate->aggtype = get_func_rettype(sumFunctionId);
+			sumAggregate->args = list_make1(makeTargetEntry((Expr *) sumArgument, 1,
+															NULL, false));
+			countAggregate->aggfnoid = countFunctionId;
+			countAggregate->aggtype = INT8OID;
+
+			partialSum = AddPartialAggregate(sumAggregate, context);
+			partialCount = AddPartialAggregate(countAggregate, context);
+
+			valueSum = SumPartialAggregates(aggregate, partialSum, averageType);
+			countSum = SumPartialAggregates(aggregate, partialCount, countType);
+			if (valueSum != NULL && countSum != NULL)
+			{
+				List *divisionOperator = list_make2(makeString("pg_catalog"),
+													makeString("/"));
+				Node *average = (Node *) make_op(NULL, divisionOperator, valueSum,
+												 countSum, -1);
+
+				if (exprType(average) == averageType)
+				{
+					combineExpression = average;
+				}
+			}
+		}
+	}
+
+	if (combineExpression == NULL)
+	{
+		context->pushdownSafe = false;
+
+		return (Node *) aggregate;
+	}
+
+	return combineExpression;
+}
+
+
+/*
+ * AggregateKind determines how the given aggregate can be split into partial
+ * aggregates. Only plain calls of the built-in aggregates listed in
+ * PartialAggregateKind can be split; averages further need to be of a type
+ * which has a division operator.
+ */
+static PartialAggregateKind
+AggregateKind(Aggref *aggregate)
+{
+	Oid aggregateId = aggregate->aggfnoid;
+	char *aggregateName = NULL;
+
+	if (aggregate->aggdistinct != NIL || aggregate->aggorder != NIL)
+	{
+		return PARTIAL_AGGREGATE_UNSUPPORTED;
+	}
+
+#if (PG_VERSION_NUM >= 90400)
+	if (aggregate->aggfilter != NULL || aggregate->aggkind != AGGKIND_NORMAL)
+	{
+		return PARTIAL_AGGREGATE_UNSUPPORTED;
+	}
+#endif
+
+	if (get_func_namespace(aggregateId) != PG_CATALOG_NAMESPACE)
+	{
+		return PARTIAL_AGGREGATE_UNSUPPORTED;
+	}
+
+	aggregateName = get_func_name(aggregateId);
+	if (strcmp(aggregateName, "count") == 0)
+	{
+		return PARTIAL_AGGREGATE_COUNT;
+	}
+	else if (strcmp(aggregateName, "sum") == 0)
+	{
+		return PARTIAL_AGGREGATE_SUM;
+	}
+	else if (strcmp(aggregateName, "avg") == 0)
+	{
+		Oid averageType = aggregate->aggtype;
+
+		if (averageType == NUMERICOID || averageType == FLOAT8OID ||
+			averageType == INTERVALOID)
+		{
+			return PARTIAL_AGGREGATE_AVERAGE;
+		}
+	}
+	else if (strcmp(aggregateName, "min") == 0 || strcmp(aggregateName, "max") == 0 ||
+			 strcmp(aggregateName, "bool_and") == 0 ||
+			 strcmp(aggregateName, "bool_or") == 0 ||
+			 strcmp(aggregateName, "every") == 0)
+	{
+		return PARTIAL_AGGREGATE_REAPPLY;
+	}
+
+	return PARTIAL_AGGREGATE_UNSUPPORTED;
+}
+
+
+/*
+ * AddPartialAggregate adds the given partial aggregate to the remote target list
+ * unless an equal one is already there, and returns the intermediate result
+ * column holding its values.
+ */
+static Var *
+AddPartialAggregate(Aggref *partialAggregate, PartialAggregateContext *context)
+{
+	ListCell *targetEntryCell = NULL;
+	AttrNumber columnId = 0;
+	TargetEntry *targetEntry = NULL;
+
+	foreach(targetEntryCell, context->remoteTargetList)
+	{
+		targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+
+		columnId++;
+		if (equal(targetEntry->expr, partialAggregate))
+		{
+			return IntermediateResultColumn((Node *) partialAggregate, columnId);
+		}
+	}
+
+	columnId++;
+	targetEntry = makeTargetEntry((Expr *) partialAggregate, columnId, NULL, false);
+	context->remoteTargetList = lappend(context->remoteTargetList, targetEntry);
+
+	return IntermediateResultColumn((Node *) partialAggregate, columnId);
+}
+
+
+/*
+ * ReapplyAggregate returns a copy of the given aggregate which calls the given
+ * aggregate function over the partial results in the given column.
+ */
+static Aggref *
+ReapplyAggregate(Aggref *aggregate, Oid functionId, Var *partialColumn)
+{
+	Aggref *combineAggregate = copyObject(aggregate);
+	TargetEntry *argument = makeTargetEntry((Expr *) partialColumn, 1, NULL, false);
+
+	combineAggregate->aggfnoid = functionId;
+	combineAggregate->aggtype = get_func_rettype(functionId);
+	combineAggregate->args = list_make1(argument);
+	combineAggregate->aggstar = false;
+#if (PG_VERSION_NUM >= 90400)
+	combineAggregate->aggvariadic = false;
+#endif
+
+	return combineAggregate;
+}
+
+
+/*
+ * SumPartialAggregates returns an expression which sums up the partial results
+ * in the given column and casts the sum to the given result type. Summing up
+ * bigint counts yields numeric sums, for instance, which are cast back to the
+ * type of the original aggregate. The function returns NULL if the partial
+ * results can't be summed up or their sum can't be cast.
+ */
+static Node *
+SumPartialAggregates(Aggref *aggregate, Var *partialColumn, Oid resultType)
+{
+	Oid sumFunctionId = AggregateFunctionId("sum", partialColumn->vartype);
+	Aggref *sumAggregate = NULL;
+
+	if (!OidIsValid(sumFunctionId))
+	{
+		return NULL;
+	}
+
+	sumAggregate = ReapplyAggregate(aggregate, sumFunctionId, partialColumn);
+	sumAggregate->aggcollid = InvalidOid;
+	sumAggregate->inputcollid = InvalidOid;
+
+	return coerce_to_target_type(NULL, (Node *) sumAggregate, sumAggregate->aggtype,
+								 resultType, -1, COERCION_EXPLICIT,
+								 COERCE_IMPLICIT_CAST, -1);
+}
+
+
+/*
+ * AggregateFunctionId looks up the built-in aggregate function with the given
+ * name which takes a single argument of the given type, and returns InvalidOid
+ * if there is none.
+ */
+static Oid
+AggregateFunctionId(char *aggregateName, Oid argumentType)
+{
+	List *qualifiedName = list_make2(makeString("pg_catalog"),
+									 makeString(aggregateName));
+	Oid argumentTypes[1] = { argumentType };
+	bool missingOK = true;
+
+	return LookupFuncName(qualifiedName, 1, argumentTypes, missingOK);
+}
+
+
+/*
+ * IntermediateResultColumn returns a column referencing the intermediate result
+ * column with the given identifier, whose values the given expression computes.
+ */
+static Var *
+IntermediateResultColumn(Node *expression, AttrNumber columnId)
+{
+	Index tableId = 1;
+
+	return makeVar(tableId, columnId, exprType(expression), exprTypmod(expression),
+				   exprCollation(expression), 0);
+}
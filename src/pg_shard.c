@@ -16,15 +16,18 @@
 #include "funcapi.h"
 #include "libpq-fe.h"
 #include "miscadmin.h"
-#include "plpgsql.h"
 
 #include "pg_shard.h"
 #include "distributed_copy.h"
 #include "distributed_transaction_manager.h"
+#include "colocated_join.h"
 #include "connection.h"
 #include "create_shards.h"
 #include "distribution_metadata.h"
+#include "multi_shard_executor.h"
+#include "partial_aggregates.h"
 #include "prune_shard_list.h"
+#include "remote_results.h"
 #include "ruleutils.h"
 
 #include <stddef.h>
@@ -43,8 +46,10 @@
 #include "access/xact.h"
 #include "catalog/namespace.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_inherits_fn.h"
 #include "catalog/pg_type.h"
 #include "commands/extension.h"
+#include "commands/prepare.h"
 #include "executor/execdesc.h"
 #include "executor/executor.h"
 #include "executor/instrument.h"
@@ -60,14 +65,14 @@
 #include "nodes/pg_list.h"
 #include "nodes/plannodes.h"
 #include "nodes/primnodes.h"
+#include "nodes/relation.h"
 #include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/planner.h"
+#include "optimizer/tlist.h"
 #include "optimizer/var.h"
-#include "parser/analyze.h"
-#include "parser/parse_node.h"
 #include "parser/parsetree.h"
-#include "parser/parse_type.h"
+#include "postmaster/postmaster.h"
 #include "storage/lock.h"
 #include "tcop/dest.h"
 #include "tcop/tcopprot.h"
@@ -78,6 +83,7 @@
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
 #include "utils/palloc.h"
+#include "utils/plancache.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
 #include "utils/snapmgr.h"
@@ -99,61 +105,76 @@ bool LogDistributedStatements = false;
 static PlannedStmt * PgShardPlanner(Query *parse, int cursorOptions,
 									ParamListInfo boundParams);
 static PlannerType DeterminePlannerType(Query *query);
+static PlannedStmt * DeferredDistributedStatement(Query *query, int cursorOptions);
+static PlannedStmt * PlanDeferredStatement(PlannedStmt *deferredStatement,
+										   ParamListInfo boundParams, int eflags);
+static PlannedStmt * PlanDistributedQuery(Query *query, int cursorOptions,
+										  ParamListInfo boundParams);
+static PlannedStmt * PlanRouterQuery(Query *query, int cursorOptions,
+									 ParamListInfo boundParams);
+static bool RouterQuerySupported(Query *query, int cursorOptions);
+static bool ContainsParamWalker(Node *node, void *context);
 static void ErrorIfQueryNotSupported(Query *queryTree);
 static Oid ExtractFirstDistributedTableId(Query *query);
 static bool ExtractRangeTableEntryWalker(Node *node, List **rangeTableList);
 static List * DistributedQueryShardList(Query *query);
 static bool SelectFromMultipleShards(Query *query, List *queryShardList);
+static bool RequiresLocalCursorPlan(Query *query, int cursorOptions);
 static void ClassifyRestrictions(List *queryRestrictList, List **remoteRestrictList,
 								 List **localRestrictList);
 static Query * RowAndColumnFilterQuery(Query *query, List *remoteRestrictList,
 									   List *localRestrictList);
+static void PushDownSortAndLimit(Query *query, Query *filterQuery,
+								 List *localRestrictList);
+static bool ConstLimitValue(Node *limitExpression, int64 *limitValue);
 static Query * BuildLocalQuery(Query *query, List *localRestrictList);
-static PlannedStmt * PlanSequentialScan(Query *query, int cursorOptions,
-										ParamListInfo boundParams);
+static PlannedStmt * PlanIntermediateResultScan(Query *query, Query *remoteQuery,
+												int cursorOptions,
+												ParamListInfo boundParams,
+												int *paramId);
+static bool RenumberIntermediateResultColumns(Node *node, List *remoteTargetList);
+static void IntermediateResultRangeTableEntry(RangeTblEntry *rangeTableEntry,
+											 Query *remoteQuery);
+static FunctionScan * FindFunctionScan(Plan *plan);
 static List * QueryRestrictList(Query *query);
 static Const * ExtractPartitionValue(Query *query, Var *partitionColumn);
 static bool ExtractFromExpressionWalker(Node *node, List **qualifierList);
 static List * QueryFromList(List *rangeTableList);
 static List * TargetEntryList(List *expressionList);
-static CreateStmt * CreateTemporaryTableLikeStmt(Oid sourceRelationId);
 static DistributedPlan * BuildDistributedPlan(Query *query, List *shardIntervalList);
+static void MakeJoinTreeDeparsable(Node *joinTreeNode);
+static void SetResultMergeOrder(DistributedPlan *distributedPlan, Query *query);
 
 /* executor functions forward declarations */
 static void PgShardExecutorStart(QueryDesc *queryDesc, int eflags);
+static bool IsDeferredDistributedPlan(PlannedStmt *plannedStmt);
 static bool IsPgShardPlan(PlannedStmt *plannedStmt);
 static void NextExecutorStartHook(QueryDesc *queryDesc, int eflags);
 static LOCKMODE CommutativityRuleToLockMode(CmdType commandType);
 static void AcquireExecutorShardLocks(List *taskList, LOCKMODE lockMode);
-static void ExecuteMultipleShardSelect(DistributedPlan *distributedPlan,
-									   RangeVar *intermediateTable);
-static bool SendQueryInSingleRowMode(PGconn *connection, StringInfo query);
-static bool StoreQueryResult(PGconn *connection, TupleDesc tupleDescriptor,
+static IntermediateResult * ExecuteMultipleShardSelect(DistributedPlan *distributedPlan,
+													   EState *executorState);
+static bool StoreQueryResult(PGconn *connection, RemoteResultState *resultState,
 							 Tuplestorestate *tupleStore);
-static void TupleStoreToTable(RangeVar *tableRangeVar, List *remoteTargetList,
-							  TupleDesc storeTupleDescriptor, Tuplestorestate *store);
 static void PgShardExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count);
 static int32 ExecuteDistributedModify(DistributedPlan *distributedPlan);
-static void ExecuteSingleShardSelect(DistributedPlan *distributedPlan,
-									 EState *executorState, TupleDesc tupleDescriptor,
-									 DestReceiver *destination);
+static int32 ExecuteReferenceTableModify(DistributedPlan *distributedPlan);
+static void ExecuteSingleShardSelect(DistributedExecState *execState,
+									 EState *executorState, ScanDirection direction,
+									 long count, DestReceiver *destination);
+static bool StartSingleShardSelect(DistributedExecState *execState, Task *task,
+								   bool useCachedConnection);
+static void CloseSingleShardConnection(DistributedExecState *execState, bool healthy);
+static void CreateDistributedExecState(QueryDesc *queryDesc,
+									   DistributedPlan *distributedPlan);
 static void PgShardExecutorFinish(QueryDesc *queryDesc);
 static void PgShardExecutorEnd(QueryDesc *queryDesc);
 static void PgShardProcessUtility(Node *parsetree, const char *queryString,
 								  ProcessUtilityContext context, ParamListInfo params,
 								  DestReceiver *dest, char *completionTag);
+static Query * ExplainedPreparedQuery(ExplainStmt *explainStatement);
 static void ErrorOnDropIfDistributedTablesExist(DropStmt *dropStatement);
 
-/* PL/pgSQL plugin declarations */
-static void SetupPLErrorTransformation(PLpgSQL_execstate *estate, PLpgSQL_function *func);
-static void TeardownPLErrorTransformation(PLpgSQL_execstate *estate,
-										  PLpgSQL_function *func);
-static void PgShardErrorTransform(void *arg);
-static PLpgSQL_plugin PluginFuncs = {
-	.func_beg = SetupPLErrorTransformation,
-	.func_end = TeardownPLErrorTransformation
-};
-
 /* declarations for dynamic loading */
 PG_MODULE_MAGIC;
 
@@ -168,9 +189,10 @@ static ProcessUtility_hook_type PreviousProcessUtilityHook = NULL;
 
 struct config_enum_entry const PgShardTransManagerEnum[] = 
 { 
-    { "no",  0, false },
-    { "1PC", 1, false },
-    { "2PC", 2, false }
+    { "no",  TRANSACTION_MANAGER_NONE, false },
+    { "1PC", TRANSACTION_MANAGER_1PC, false },
+    { "2PC", TRANSACTION_MANAGER_2PC, false },
+    { NULL, 0, false }
 };
                                                 
 
@@ -182,8 +204,6 @@ struct config_enum_entry const PgShardTransManagerEnum[] =
 void
 _PG_init(void)
 {
-	PLpgSQL_plugin **plugin_ptr = NULL;
-
 	PreviousPlannerHook = planner_hook;
 	planner_hook = PgShardPlanner;
 
@@ -217,221 +237,549 @@ _PG_init(void)
 							 &LogDistributedStatements, false, PGC_USERSET, 0, NULL,
 							 NULL, NULL);
 
+	DefineCustomIntVariable("pg_shard.executor_connections_per_node",
+							"Sets the number of connections a multi-shard SELECT "
+							"opens to each node",
+							"Queries of all shards are sent at once; tasks beyond "
+							"this many per node wait for a connection to finish.",
+							&ExecutorConnectionsPerNode,
+							DEFAULT_EXECUTOR_CONNECTIONS_PER_NODE, 1, MAX_BACKENDS,
+							PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_shard.use_binary_results",
+							 "Fetches the results of remote SELECTs in binary format",
+							 "Queries whose result columns include types without a "
+							 "portable binary format still fetch text results.",
+							 &UseBinaryResults, false, PGC_USERSET, 0, NULL, NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_shard.use_copy_fetch",
+							 "Fetches the results of remote SELECTs through COPY",
+							 "Rows then arrive in one stream per query instead of "
+							 "a separate result for each row.",
+							 &UseCopyFetch, false, PGC_USERSET, 0, NULL, NULL,
+							 NULL);
+
 	DefineCustomEnumVariable("pg_shard.copy_transaction_manager",
-                             "Transaction manager for distributed copy", 
+                             "Transaction manager for distributed copy and reference "
+                             "table modifications", 
                              NULL, 
-                             &PgShardCurrTransManager, 1, PgShardTransManagerEnum, PGC_USERSET, 0, NULL,
+                             &PgShardCurrTransManager, TRANSACTION_MANAGER_1PC, PgShardTransManagerEnum, PGC_USERSET, 0, NULL,
                              NULL, NULL);
 
-	EmitWarningsOnPlaceholders("pg_shard");
+	DefineCustomIntVariable("pg_shard.copy_buffer_size",
+							"Sets the amount of COPY data buffered for each placement",
+							"Rows are sent to a shard placement once this much data "
+							"has accumulated for it. Zero sends each row at once, "
+							"except over shared connections, which then send "
+							"batches of the default size.",
+							&PgShardCopyBufferSize, DEFAULT_COPY_BUFFER_SIZE, 0,
+							MAX_KILOBYTES, PGC_USERSET, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.copy_high_water_mark",
+							"Sets the amount of unsent COPY data allowed per placement",
+							"COPY keeps routing rows while slow placements drain, and "
+							"only waits once a placement's unsent data exceeds this. "
+							"Values below pg_shard.copy_buffer_size act as that size.",
+							&PgShardCopyHighWaterMark, DEFAULT_COPY_HIGH_WATER_MARK, 1,
+							MAX_KILOBYTES, PGC_USERSET, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.copy_connections_per_node",
+							"Sets the number of connections COPY opens to each node",
+							"When set, shard placements on a node share this many "
+							"connections and receive rows in per-shard batches. Zero "
+							"opens one connection per shard placement.",
+							&PgShardCopyConnectionsPerNode, 0, 0, MAX_BACKENDS,
+							PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_shard.copy_prefetch_shards",
+							"Sets the number of shards COPY TO reads ahead",
+							"COPY TO emits shards in order. This many following "
+							"shards are read concurrently on their own connections, "
+							"and their data is buffered until their turn comes: in "
+							"memory up to work_mem in total, and in temporary files "
+							"beyond it. Zero reads one shard at a time.",
+							&PgShardCopyPrefetchShards, 0, 0, MAX_BACKENDS,
+							PGC_USERSET, 0, NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 90500
+	DefineCustomIntVariable("pg_shard.copy_parallel_workers",
+							"Sets the number of background workers loading a COPY file",
+							"Text format files are split into ranges that are parsed "
+							"and routed in parallel. Requires the 2PC transaction "
+							"manager; zero disables parallel COPY.",
+							&PgShardCopyParallelWorkers, 0, 0, MAX_BACKENDS,
+							PGC_USERSET, 0, NULL, NULL, NULL);
+#endif
 
-	/* install error transformation handler for PL/pgSQL invocations */
-	plugin_ptr = (PLpgSQL_plugin **) find_rendezvous_variable("PLpgSQL_plugin");
-	*plugin_ptr = &PluginFuncs;
+	EmitWarningsOnPlaceholders("pg_shard");
 }
 
 
 /*
- * SetupPLErrorTransformation is intended to run before entering PL/pgSQL
- * functions. It pushes an error transform onto the error context stack.
+ * _PG_fini is called when the module is unloaded. This function uninstalls the
+ * extension's hooks.
  */
-static void
-SetupPLErrorTransformation(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+void
+_PG_fini(void)
 {
-	ErrorContextCallback *pgShardErrorContext = NULL;
-	pgShardErrorContext = MemoryContextAllocZero(TopTransactionContext,
-												 sizeof(ErrorContextCallback));
-
-	pgShardErrorContext->previous = error_context_stack;
-	pgShardErrorContext->callback = PgShardErrorTransform;
-	pgShardErrorContext->arg = NULL;
-
-	error_context_stack = pgShardErrorContext;
+	ProcessUtility_hook = PreviousProcessUtilityHook;
+	ExecutorRun_hook = PreviousExecutorRunHook;
+	ExecutorStart_hook = PreviousExecutorStartHook;
+	ExecutorFinish_hook = PreviousExecutorFinishHook;
+	ExecutorEnd_hook = PreviousExecutorEndHook;
+	planner_hook = PreviousPlannerHook;
 }
 
 
 /*
- * TeardownPLErrorTransformation is intended to run after a PL/pgSQL function
- * successfully returns. It pops the error context stack in order to remove and
- * free the transform placed on that stack by SetupPLErrorTransformation.
+ * PgShardPlanner implements custom planner logic to plan queries involving
+ * distributed tables. As the shards a statement touches depend on the values
+ * of its parameters, statements on distributed tables are only planned once
+ * they are executed: the planner returns a placeholder plan which holds the
+ * statement, and which PostgreSQL may cache and reuse like any other plan.
+ * Other statements are planned by CitusDB or the standard planner.
  */
-static void
-TeardownPLErrorTransformation(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+static PlannedStmt *
+PgShardPlanner(Query *query, int cursorOptions, ParamListInfo boundParams)
 {
-	ErrorContextCallback *pgShardErrorContext = error_context_stack;
+	PlannedStmt *plannedStatement = NULL;
+	PlannerType plannerType = DeterminePlannerType(query);
+
+	if (plannerType == PLANNER_TYPE_PG_SHARD)
+	{
+		plannedStatement = DeferredDistributedStatement(query, cursorOptions);
+	}
+	else if (plannerType == PLANNER_TYPE_CITUSDB)
+	{
+		if (PreviousPlannerHook == NULL)
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							errmsg("could not plan SELECT query"),
+							errdetail("Configured to use CitusDB's SELECT "
+									  "logic, but CitusDB is not installed."),
+							errhint("Install CitusDB or set the "
+									"\"use_citusdb_select_logic\" "
+									"configuration parameter to \"false\".")));
+		}
+
+		plannedStatement = PreviousPlannerHook(query, cursorOptions, boundParams);
+	}
+	else if (plannerType == PLANNER_TYPE_POSTGRES)
+	{
+		if (PreviousPlannerHook != NULL)
+		{
+			plannedStatement = PreviousPlannerHook(query, cursorOptions, boundParams);
+		}
+		else
+		{
+			plannedStatement = standard_planner(query, cursorOptions, boundParams);
+		}
+	}
+	else
+	{
+		ereport(ERROR, (errmsg("unrecognized planner type: %d", plannerType)));
+	}
 
-	error_context_stack = pgShardErrorContext->previous;
-	pfree(pgShardErrorContext);
+	return plannedStatement;
 }
 
 
 /*
- * PgShardErrorTransform detects an uninformative error message produced when
- * a pg_shard-distributed relation is referenced in bare SQL within a PL/pgSQL
- * function and replaces it with a more specific message to help the user work
- * around the underlying issue.
+ * DeferredDistributedStatement returns the placeholder plan PgShardPlanner
+ * produces for the given statement on distributed tables. Its plan tree is a
+ * Result node whose constant qualifier holds the statement and the cursor
+ * options it was planned with, which keeps the plan copyable for the plan cache.
+ * The placeholder is replaced by the distributed plan when the executor starts.
  */
-static void
-PgShardErrorTransform(void *arg)
+static PlannedStmt *
+DeferredDistributedStatement(Query *query, int cursorOptions)
 {
-	int sqlCode = geterrcode();
-	MemoryContext errorContext = NULL;
-	ErrorData *errorData = NULL;
+	PlannedStmt *plannedStatement = makeNode(PlannedStmt);
+	Result *deferredPlan = makeNode(Result);
+	List *relationIdList = NIL;
+	ListCell *rangeTableCell = NULL;
 
-	/* short-circuit if it's not an internal error */
-	if (sqlCode != ERRCODE_INTERNAL_ERROR)
+	deferredPlan->plan.targetlist = query->targetList;
+	deferredPlan->resconstantqual = (Node *) list_make2(query,
+														makeInteger(cursorOptions));
+
+	/* changes to any of the tables should invalidate cached plans */
+	foreach(rangeTableCell, query->rtable)
 	{
-		return;
+		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
+
+		if (rangeTableEntry->rtekind == RTE_RELATION)
+		{
+			relationIdList = lappend_oid(relationIdList, rangeTableEntry->relid);
+		}
 	}
 
-	/* get current error data */
-	errorContext = MemoryContextSwitchTo(TopTransactionContext);
-	errorData = CopyErrorData();
-	MemoryContextSwitchTo(errorContext);
+	plannedStatement->commandType = query->commandType;
+	plannedStatement->queryId = query->queryId;
+	plannedStatement->hasReturning = false;
+	plannedStatement->hasModifyingCTE = false;
+	plannedStatement->canSetTag = query->canSetTag;
+	plannedStatement->transientPlan = false;
+	plannedStatement->planTree = (Plan *) deferredPlan;
+	plannedStatement->rtable = query->rtable;
+	plannedStatement->utilityStmt = query->utilityStmt;
+	plannedStatement->relationOids = relationIdList;
+	plannedStatement->nParamExec = 0;
 
-	/* if it's an error about a distributed plan, clean up the fields */
-	if (strcmp("unrecognized node type: 2100", errorData->message) == 0)
+	if (query->resultRelation > 0)
 	{
-		errcode(ERRCODE_FEATURE_NOT_SUPPORTED);
-		errmsg("cannot cache distributed plan");
-		errdetail("PL/pgSQL's statement caching is unsupported by pg_shard.");
-		errhint("Bypass caching by using the EXECUTE keyword instead.");
+		plannedStatement->resultRelations = list_make1_int(query->resultRelation);
 	}
+
+	return plannedStatement;
 }
 
 
 /*
- * _PG_fini is called when the module is unloaded. This function uninstalls the
- * extension's hooks.
+ * PlanDeferredStatement plans the statement held by the given placeholder plan
+ * using the values of the bound parameters, so that shards are pruned and the
+ * statements sent to them are deparsed with the values of this execution.
  */
-void
-_PG_fini(void)
+static PlannedStmt *
+PlanDeferredStatement(PlannedStmt *deferredStatement, ParamListInfo boundParams,
+					  int eflags)
 {
-	ProcessUtility_hook = PreviousProcessUtilityHook;
-	ExecutorRun_hook = PreviousExecutorRunHook;
-	ExecutorStart_hook = PreviousExecutorStartHook;
-	ExecutorFinish_hook = PreviousExecutorFinishHook;
-	ExecutorEnd_hook = PreviousExecutorEndHook;
-	planner_hook = PreviousPlannerHook;
+	Result *deferredPlan = (Result *) deferredStatement->planTree;
+	List *deferredList = (List *) deferredPlan->resconstantqual;
+	Query *query = (Query *) linitial(deferredList);
+	int cursorOptions = intVal(lsecond(deferredList));
+
+	if ((eflags & EXEC_FLAG_EXPLAIN_ONLY) != 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("EXPLAIN commands on distributed tables "
+							   "are unsupported")));
+	}
+
+	return PlanDistributedQuery(query, cursorOptions, boundParams);
 }
 
 
 /*
- * PgShardPlanner implements custom planner logic to plan queries involving
- * distributed tables. It first calls the standard planner to perform common
- * mutations and normalizations on the query and retrieve the "normal" planned
- * statement for the query. Further functions actually produce the distributed
- * plan should one be necessary.
+ * PlanDistributedQuery produces the distributed plan for the given statement.
+ * Simple statements which only touch a single shard are routed to it directly.
+ * For other queries, it first calls the standard planner to perform common
+ * mutations and normalizations on a copy of the query and retrieve the "normal"
+ * planned statement for the query. Further functions actually produce the
+ * distributed plan. The given query is left unchanged, as cached plans share it.
  */
 static PlannedStmt *
-PgShardPlanner(Query *query, int cursorOptions, ParamListInfo boundParams)
+PlanDistributedQuery(Query *query, int cursorOptions, ParamListInfo boundParams)
 {
 	PlannedStmt *plannedStatement = NULL;
-	PlannerType plannerType = DeterminePlannerType(query);
+	DistributedPlan *distributedPlan = NULL;
+	Query *distributedQuery = NULL;
+	List *queryShardList = NIL;
+	bool selectFromMultipleShards = false;
+	int intermediateResultParamId = -1;
 
-	if (plannerType == PLANNER_TYPE_PG_SHARD)
+	/* statements on a single shard of a single table need no local plan */
+	plannedStatement = PlanRouterQuery(query, cursorOptions, boundParams);
+	if (plannedStatement != NULL)
 	{
-		DistributedPlan *distributedPlan = NULL;
-		Query *distributedQuery = copyObject(query);
-		List *queryShardList = NIL;
-		bool selectFromMultipleShards = false;
-		CreateStmt *createTemporaryTableStmt = NULL;
+		return plannedStatement;
+	}
 
-		/* call standard planner first to have Query transformations performed */
-		plannedStatement = standard_planner(distributedQuery, cursorOptions,
-											boundParams);
+	/* call standard planner first to have Query transformations performed */
+	distributedQuery = copyObject(query);
+	plannedStatement = standard_planner(distributedQuery, cursorOptions,
+										boundParams);
 
-		ErrorIfQueryNotSupported(distributedQuery);
+	ErrorIfQueryNotSupported(distributedQuery);
 
-		/*
-		 * Compute the list of shards this query needs to access.
-		 * Error out if there are no existing shards for the table.
-		 */
-		queryShardList = DistributedQueryShardList(distributedQuery);
+	/*
+	 * Compute the list of shards this query needs to access.
+	 * Error out if there are no existing shards for the table.
+	 */
+	queryShardList = DistributedQueryShardList(distributedQuery);
+
+	/*
+	 * If a select query touches multiple shards, we don't push down the
+	 * query as-is, and instead only push down the filter clauses and select
+	 * needed columns or partial aggregates. The local plan then reads the
+	 * fetched rows through a function scan, which takes the place of the
+	 * scans on the tables. Cursors that scroll or outlive their transaction
+	 * need such a local plan too, as a single-shard select can only stream
+	 * its rows forward.
+	 */
+	selectFromMultipleShards = SelectFromMultipleShards(query, queryShardList) ||
+							   (queryShardList != NIL &&
+								RequiresLocalCursorPlan(query, cursorOptions));
+	if (selectFromMultipleShards)
+	{
+		Query *localQuery = NULL;
+		Query *tableQuery = FlattenJoinAliasColumns(query);
+		List *queryRestrictList = QueryRestrictList(distributedQuery);
+		List *remoteRestrictList = NIL;
+		List *localRestrictList = NIL;
+
+		/* partition restrictions into remote and local lists */
+		ClassifyRestrictions(queryRestrictList, &remoteRestrictList,
+							 &localRestrictList);
 
 		/*
-		 * If a select query touches multiple shards, we don't push down the
-		 * query as-is, and instead only push down the filter clauses and select
-		 * needed columns. We then copy those results to a local temporary table
-		 * and then modify the original PostgreSQL plan to perform a sequential
-		 * scan on that temporary table.
-		 * XXX: This approach is limited as we cannot handle index or foreign
-		 * scans. We will revisit this by potentially using another type of scan
-		 * node instead of a sequential scan.
+		 * Let the shards compute partial aggregates where possible, so they
+		 * only return a row per group. Otherwise, build a distributed query
+		 * that fetches the needed rows and columns, and a local query which
+		 * reads the fetched columns. Both refer to the columns of tables
+		 * rather than those of joins, which the local query doesn't have.
 		 */
-		selectFromMultipleShards = SelectFromMultipleShards(query, queryShardList);
-		if (selectFromMultipleShards)
+		if (!BuildPartialAggregateQueries(tableQuery, remoteRestrictList,
+										  localRestrictList, &distributedQuery,
+										  &localQuery))
 		{
-			Oid distributedTableId = InvalidOid;
-			Query *localQuery = NULL;
-			List *queryRestrictList = QueryRestrictList(distributedQuery);
-			List *remoteRestrictList = NIL;
-			List *localRestrictList = NIL;
-
-			/* partition restrictions into remote and local lists */
-			ClassifyRestrictions(queryRestrictList, &remoteRestrictList,
-								 &localRestrictList);
+			Query *filterQuery = RowAndColumnFilterQuery(distributedQuery,
+														 remoteRestrictList,
+														 localRestrictList);
 
-			/* build local and distributed query */
-			distributedQuery = RowAndColumnFilterQuery(distributedQuery,
-													   remoteRestrictList,
-													   localRestrictList);
-			localQuery = BuildLocalQuery(query, localRestrictList);
+			PushDownSortAndLimit(distributedQuery, filterQuery, localRestrictList);
 
-			/*
-			 * Force a sequential scan as we change the underlying table to
-			 * point to our intermediate temporary table which contains the
-			 * fetched data.
-			 */
-			plannedStatement = PlanSequentialScan(localQuery, cursorOptions, boundParams);
+			distributedQuery = filterQuery;
+			localQuery = BuildLocalQuery(tableQuery, localRestrictList);
 
-			/* construct a CreateStmt to clone the existing table */
-			distributedTableId = ExtractFirstDistributedTableId(distributedQuery);
-			createTemporaryTableStmt = CreateTemporaryTableLikeStmt(distributedTableId);
+			query_tree_walker(localQuery, RenumberIntermediateResultColumns,
+							  distributedQuery->targetList, QTW_IGNORE_JOINALIASES);
 		}
 
-		distributedPlan = BuildDistributedPlan(distributedQuery, queryShardList);
-		distributedPlan->originalPlan = plannedStatement->planTree;
-		distributedPlan->selectFromMultipleShards = selectFromMultipleShards;
-		distributedPlan->createTemporaryTableStmt = createTemporaryTableStmt;
+		/* plan the local query over the rows the remote queries return */
+		plannedStatement = PlanIntermediateResultScan(localQuery, distributedQuery,
+													  cursorOptions, boundParams,
+													  &intermediateResultParamId);
+	}
+
+	distributedPlan = BuildDistributedPlan(distributedQuery, queryShardList);
+	distributedPlan->originalPlan = plannedStatement->planTree;
+	distributedPlan->selectFromMultipleShards = selectFromMultipleShards;
+	distributedPlan->intermediateResultParamId = intermediateResultParamId;
+	distributedPlan->modifyReferenceTable =
+		(distributedQuery->commandType != CMD_SELECT &&
+		 IsReferenceTable(ExtractFirstDistributedTableId(distributedQuery)));
 
-		plannedStatement->planTree = (Plan *) distributedPlan;
+	if (selectFromMultipleShards)
+	{
+		SetResultMergeOrder(distributedPlan, distributedQuery);
 	}
-	else if (plannerType == PLANNER_TYPE_CITUSDB)
+
+	plannedStatement->planTree = (Plan *) distributedPlan;
+
+	return plannedStatement;
+}
+
+
+/*
+ * PlanRouterQuery plans a statement on a single distributed table which only
+ * touches a single shard without calling the standard planner, whose local
+ * plan such statements never use. It folds constants and bound parameters in a
+ * flat copy of the query, as the standard planner would, prunes the table's
+ * shards and builds a distributed plan with a single task directly from it.
+ * The function returns NULL if the statement needs the full planning logic,
+ * for instance because it touches several shards or none at all.
+ */
+static PlannedStmt *
+PlanRouterQuery(Query *query, int cursorOptions, ParamListInfo boundParams)
+{
+	PlannedStmt *plannedStatement = NULL;
+	DistributedPlan *distributedPlan = NULL;
+	PlannerGlobal *plannerGlobal = NULL;
+	PlannerInfo *plannerInfo = NULL;
+	RangeTblEntry *rangeTableEntry = NULL;
+	FromExpr *joinTree = NULL;
+	Oid distributedTableId = InvalidOid;
+	List *shardIntervalList = NIL;
+	List *restrictClauseList = NIL;
+	List *queryShardList = NIL;
+	ShardInterval *shardInterval = NULL;
+
+	if (!RouterQuerySupported(query, cursorOptions))
 	{
-		if (PreviousPlannerHook == NULL)
-		{
-			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-							errmsg("could not plan SELECT query"),
-							errdetail("Configured to use CitusDB's SELECT "
-									  "logic, but CitusDB is not installed."),
-							errhint("Install CitusDB or set the "
-									"\"use_citusdb_select_logic\" "
-									"configuration parameter to \"false\".")));
-		}
+		return NULL;
+	}
 
-		plannedStatement = PreviousPlannerHook(query, cursorOptions, boundParams);
+	/* leave the given query intact, copying the nodes changed below */
+	query = (Query *) memcpy(palloc(sizeof(Query)), query, sizeof(Query));
+
+	rangeTableEntry = (RangeTblEntry *) memcpy(palloc(sizeof(RangeTblEntry)),
+											   linitial(query->rtable),
+											   sizeof(RangeTblEntry));
+	query->rtable = list_make1(rangeTableEntry);
+
+	if (query->jointree != NULL)
+	{
+		joinTree = (FromExpr *) memcpy(palloc(sizeof(FromExpr)), query->jointree,
+									   sizeof(FromExpr));
+		query->jointree = joinTree;
 	}
-	else if (plannerType == PLANNER_TYPE_POSTGRES)
+
+	/* fold constant expressions and bound parameters like the planner does */
+	plannerGlobal = makeNode(PlannerGlobal);
+	plannerGlobal->boundParams = boundParams;
+
+	plannerInfo = makeNode(PlannerInfo);
+	plannerInfo->parse = query;
+	plannerInfo->glob = plannerGlobal;
+	plannerInfo->query_level = 1;
+
+	query->targetList = (List *) eval_const_expressions(plannerInfo,
+														(Node *) query->targetList);
+	query->havingQual = eval_const_expressions(plannerInfo, query->havingQual);
+	query->limitOffset = eval_const_expressions(plannerInfo, query->limitOffset);
+	query->limitCount = eval_const_expressions(plannerInfo, query->limitCount);
+	if (joinTree != NULL)
 	{
-		if (PreviousPlannerHook != NULL)
-		{
-			plannedStatement = PreviousPlannerHook(query, cursorOptions, boundParams);
-		}
-		else
-		{
-			plannedStatement = standard_planner(query, cursorOptions, boundParams);
-		}
+		joinTree->quals = eval_const_expressions(plannerInfo, joinTree->quals);
 	}
-	else
+
+	/* parameters without values cannot be sent to the shard */
+	if (query_tree_walker(query, ContainsParamWalker, NULL, 0))
 	{
-		ereport(ERROR, (errmsg("unrecognized planner type: %d", plannerType)));
+		return NULL;
+	}
+
+	ErrorIfQueryNotSupported(query);
+
+	/* let the full planning logic report a table without shards */
+	distributedTableId = ExtractFirstDistributedTableId(query);
+	shardIntervalList = LookupShardIntervalList(distributedTableId);
+	if (shardIntervalList == NIL)
+	{
+		return NULL;
+	}
+
+	if (query->commandType == CMD_INSERT)
+	{
+		restrictClauseList = QueryRestrictList(query);
+	}
+	else if (joinTree != NULL)
+	{
+		restrictClauseList = make_ands_implicit((Expr *) joinTree->quals);
+	}
+
+	queryShardList = PruneShardList(distributedTableId, restrictClauseList,
+									shardIntervalList);
+	if (list_length(queryShardList) != 1)
+	{
+		return NULL;
+	}
+
+	shardInterval = (ShardInterval *) linitial(queryShardList);
+	ereport(DEBUG2, (errmsg("routing statement to shard with ID " INT64_FORMAT,
+							shardInterval->id)));
+
+	/* the planner scans a table without children as if ONLY was specified */
+	if (rangeTableEntry->inh && !has_subclass(rangeTableEntry->relid))
+	{
+		rangeTableEntry->inh = false;
+	}
+
+	distributedPlan = BuildDistributedPlan(query, queryShardList);
+	distributedPlan->originalPlan = NULL;
+	distributedPlan->selectFromMultipleShards = false;
+	distributedPlan->intermediateResultParamId = -1;
+	distributedPlan->modifyReferenceTable = (query->commandType != CMD_SELECT &&
+											 IsReferenceTable(distributedTableId));
+
+	plannedStatement = makeNode(PlannedStmt);
+	plannedStatement->commandType = query->commandType;
+	plannedStatement->queryId = query->queryId;
+	plannedStatement->hasReturning = false;
+	plannedStatement->hasModifyingCTE = false;
+	plannedStatement->canSetTag = query->canSetTag;
+	plannedStatement->transientPlan = false;
+	plannedStatement->planTree = (Plan *) distributedPlan;
+	plannedStatement->rtable = query->rtable;
+	plannedStatement->utilityStmt = query->utilityStmt;
+	plannedStatement->relationOids = list_make1_oid(distributedTableId);
+	plannedStatement->invalItems = plannerGlobal->invalItems;
+	plannedStatement->nParamExec = 0;
+
+	if (query->resultRelation > 0)
+	{
+		plannedStatement->resultRelations = list_make1_int(query->resultRelation);
 	}
 
 	return plannedStatement;
 }
 
 
+/*
+ * RouterQuerySupported checks whether the given statement may be planned by
+ * PlanRouterQuery: it needs to scan or modify a single table, and may use no
+ * feature which needs the standard planner, such as subqueries, common table
+ * expressions, row locks or cursors which need a local plan.
+ */
+static bool
+RouterQuerySupported(Query *query, int cursorOptions)
+{
+	RangeTblEntry *rangeTableEntry = NULL;
+	FromExpr *joinTree = query->jointree;
+
+	if (query->utilityStmt != NULL || query->cteList != NIL || query->hasSubLinks ||
+		query->hasModifyingCTE || query->setOperations != NULL ||
+		query->rowMarks != NIL || query->returningList != NIL)
+	{
+		return false;
+	}
+
+	if (RequiresLocalCursorPlan(query, cursorOptions))
+	{
+		return false;
+	}
+
+	/* single-row INSERTs have no range table entries besides their target */
+	if (list_length(query->rtable) != 1)
+	{
+		return false;
+	}
+
+	rangeTableEntry = (RangeTblEntry *) linitial(query->rtable);
+	if (rangeTableEntry->rtekind != RTE_RELATION)
+	{
+		return false;
+	}
+
+	/* security barrier quals are only merged into the query by the planner */
+#if (PG_VERSION_NUM >= 90400)
+	if (rangeTableEntry->securityQuals != NIL)
+	{
+		return false;
+	}
+#endif
+
+	if (query->commandType != CMD_INSERT &&
+		(joinTree == NULL || list_length(joinTree->fromlist) != 1 ||
+		 !IsA(linitial(joinTree->fromlist), RangeTblRef)))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/* ContainsParamWalker returns whether the given expression contains a Param. */
+static bool
+ContainsParamWalker(Node *node, void *context)
+{
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	if (IsA(node, Param))
+	{
+		return true;
+	}
+
+	return expression_tree_walker(node, ContainsParamWalker, context);
+}
+
+
 /*
  * DeterminePlannerType chooses the appropriate planner to use in order to plan
  * the given query.
@@ -489,7 +837,7 @@ static void
 ErrorIfQueryNotSupported(Query *queryTree)
 {
 	Oid distributedTableId = ExtractFirstDistributedTableId(queryTree);
-	Var *partitionColumn = PartitionColumn(distributedTableId);
+	Var *partitionColumn = NULL;
 	List *rangeTableList = NIL;
 	ListCell *rangeTableCell = NULL;
 	bool hasValuesScan = false;
@@ -502,8 +850,9 @@ ErrorIfQueryNotSupported(Query *queryTree)
 	Assert(commandType == CMD_SELECT || commandType == CMD_INSERT ||
 		   commandType == CMD_UPDATE || commandType == CMD_DELETE);
 
-	/* prevent utility statements like DECLARE CURSOR attached to selects */
-	if (commandType == CMD_SELECT && queryTree->utilityStmt != NULL)
+	/* prevent utility statements other than DECLARE CURSOR attached to selects */
+	if (commandType == CMD_SELECT && queryTree->utilityStmt != NULL &&
+		!IsA(queryTree->utilityStmt, DeclareCursorStmt))
 	{
 		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 						errmsg("cannot perform distributed planning for the given"
@@ -566,6 +915,12 @@ ErrorIfQueryNotSupported(Query *queryTree)
 			}
 			else if (rangeTableEntry->rtekind == RTE_JOIN)
 			{
+				if (commandType == CMD_SELECT)
+				{
+					/* the joined tables are checked below */
+					continue;
+				}
+
 				rangeTableEntryErrorDetail = "Joins are not supported in distributed"
 											 " queries.";
 			}
@@ -586,8 +941,8 @@ ErrorIfQueryNotSupported(Query *queryTree)
 		}
 	}
 
-	/* reject queries which involve joins */
-	if (queryTableCount != 1)
+	/* reject modifications which involve joins */
+	if (queryTableCount != 1 && commandType != CMD_SELECT)
 	{
 		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 						errmsg("cannot perform distributed planning for the given"
@@ -595,6 +950,12 @@ ErrorIfQueryNotSupported(Query *queryTree)
 						errdetail("Joins are not supported in distributed queries.")));
 	}
 
+	/* selects may join co-located tables on their partition columns */
+	if (queryTableCount > 1)
+	{
+		ErrorIfJoinNotSupported(queryTree);
+	}
+
 	/* reject queries which involve multi-row inserts */
 	if (hasValuesScan)
 	{
@@ -621,6 +982,12 @@ ErrorIfQueryNotSupported(Query *queryTree)
 		FromExpr *joinTree = NULL;
 		ListCell *targetEntryCell = NULL;
 
+		/* reference tables have no partition column to check */
+		if (!IsReferenceTable(distributedTableId))
+		{
+			partitionColumn = PartitionColumn(distributedTableId);
+		}
+
 		foreach(targetEntryCell, queryTree->targetList)
 		{
 			TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
@@ -636,7 +1003,8 @@ ErrorIfQueryNotSupported(Query *queryTree)
 				hasNonConstTargetEntryExprs = true;
 			}
 
-			if (targetEntry->resno == partitionColumn->varattno)
+			if (partitionColumn != NULL &&
+				targetEntry->resno == partitionColumn->varattno)
 			{
 				specifiesPartitionValue = true;
 			}
@@ -735,6 +1103,9 @@ ExtractRangeTableEntryWalker(Node *node, List **rangeTableList)
  * that all shards will be pruned if a query's restrictions are unsatisfiable.
  * In that case, this function can return an empty list; however, if the table
  * being queried has no shards created whatsoever, this function errors out.
+ * For joins between co-located tables, the list holds the shards of the first
+ * table other than a reference table whose groups of co-located shards remain
+ * after pruning.
  */
 static List *
 DistributedQueryShardList(Query *query)
@@ -760,8 +1131,15 @@ DistributedQueryShardList(Query *query)
 	}
 
 	restrictClauseList = QueryRestrictList(query);
-	prunedShardList = PruneShardList(distributedTableId, restrictClauseList,
-									 shardIntervalList);
+	if (QueryHasJoin(query))
+	{
+		prunedShardList = PruneColocatedShardList(query, restrictClauseList);
+	}
+	else
+	{
+		prunedShardList = PruneShardList(distributedTableId, restrictClauseList,
+										 shardIntervalList);
+	}
 
 	return prunedShardList;
 }
@@ -782,6 +1160,31 @@ SelectFromMultipleShards(Query *query, List *queryShardList)
 }
 
 
+/*
+ * RequiresLocalCursorPlan returns whether the given select is to be run as a
+ * cursor that may scroll backwards or be held past the end of its transaction.
+ * The options of DECLARE CURSOR come with the query rather than the planner's
+ * cursor options.
+ */
+static bool
+RequiresLocalCursorPlan(Query *query, int cursorOptions)
+{
+	Node *utilityStatement = query->utilityStmt;
+
+	if (query->commandType != CMD_SELECT)
+	{
+		return false;
+	}
+
+	if (utilityStatement != NULL && IsA(utilityStatement, DeclareCursorStmt))
+	{
+		cursorOptions |= ((DeclareCursorStmt *) utilityStatement)->options;
+	}
+
+	return (cursorOptions & (CURSOR_OPT_SCROLL | CURSOR_OPT_HOLD)) != 0;
+}
+
+
 /*
  * ClassifyRestrictions divides a query's restriction list in two: the subset
  * of restrictions safe for remote evaluation and the subset of restrictions
@@ -820,7 +1223,8 @@ ClassifyRestrictions(List *queryRestrictList, List **remoteRestrictList,
 /*
  * RowAndColumnFilterQuery builds a query which contains the filter clauses from
  * the original query and also only selects columns needed for the original
- * query. This new query can then be pushed down to the worker nodes.
+ * query. This new query can then be pushed down to the worker nodes. Joins keep
+ * their join clauses, so the worker nodes return the joined rows.
  */
 static Query *
 RowAndColumnFilterQuery(Query *query, List *remoteRestrictList, List *localRestrictList)
@@ -839,13 +1243,19 @@ RowAndColumnFilterQuery(Query *query, List *remoteRestrictList, List *localRestr
 	PVCPlaceHolderBehavior placeHolderBehavior = PVC_REJECT_PLACEHOLDERS;
 
 	ExtractRangeTableEntryWalker((Node *) query, &rangeTableList);
-	Assert(list_length(rangeTableList) == 1);
 
 	/* build the expression to supply FROM/WHERE for the remote query */
 	fromExpr = makeNode(FromExpr);
 	fromExpr->quals = (Node *) make_ands_explicit((List *) remoteRestrictList);
-	fromExpr->fromlist = QueryFromList(rangeTableList);
-
+	if (QueryHasJoin(query))
+	{
+		fromExpr->fromlist = copyObject(query->jointree->fromlist);
+	}
+	else
+	{
+		fromExpr->fromlist = QueryFromList(rangeTableList);
+	}
+
 	/* must retrieve all columns referenced by local WHERE clauses... */
 	whereColumnList = pull_var_clause((Node *) localRestrictList, aggregateBehavior,
 									  placeHolderBehavior);
@@ -897,19 +1307,147 @@ RowAndColumnFilterQuery(Query *query, List *remoteRestrictList, List *localRestr
 }
 
 
+/*
+ * PushDownSortAndLimit adds the ORDER BY and LIMIT clauses of the given query to
+ * the filter query sent to the shards, so that each shard returns only the rows
+ * which may be among the first ones of the final result, in order. The shards
+ * return as many rows as the limit and offset together, since the offset can
+ * only be applied to the merged rows. Sort expressions missing from the filter
+ * query's target list are added to it. Nothing is pushed down for queries whose
+ * rows are aggregated, deduplicated or filtered locally, for queries without a
+ * constant limit, for sorts on volatile expressions, or for queries with set
+ * returning functions, which may change the number of rows after the limit.
+ */
+static void
+PushDownSortAndLimit(Query *query, Query *filterQuery, List *localRestrictList)
+{
+	List *sortExpressionList = NIL;
+	List *remoteSortClauseList = NIL;
+	ListCell *sortClauseCell = NULL;
+	int64 limitCount = 0;
+	int64 limitOffset = 0;
+	Const *remoteLimit = NULL;
+
+	if (query->hasAggs || query->groupClause != NIL || query->havingQual != NULL ||
+		query->distinctClause != NIL || query->hasWindowFuncs ||
+		localRestrictList != NIL)
+	{
+		return;
+	}
+
+	if (!ConstLimitValue(query->limitCount, &limitCount))
+	{
+		return;
+	}
+
+	if (query->limitOffset != NULL && !ConstLimitValue(query->limitOffset, &limitOffset))
+	{
+		return;
+	}
+
+	if (limitCount > INT64_MAX - limitOffset)
+	{
+		return;
+	}
+
+	sortExpressionList = get_sortgrouplist_exprs(query->sortClause, query->targetList);
+	if (contain_volatile_functions((Node *) sortExpressionList))
+	{
+		return;
+	}
+
+	if (expression_returns_set((Node *) query->targetList) ||
+		expression_returns_set((Node *) sortExpressionList))
+	{
+		return;
+	}
+
+	foreach(sortClauseCell, query->sortClause)
+	{
+		SortGroupClause *sortClause = (SortGroupClause *) lfirst(sortClauseCell);
+		SortGroupClause *remoteSortClause = copyObject(sortClause);
+		Node *sortExpression = get_sortgroupclause_expr(sortClause, query->targetList);
+		TargetEntry *remoteTargetEntry = NULL;
+		ListCell *targetEntryCell = NULL;
+		Index sortGroupRef = list_length(remoteSortClauseList) + 1;
+
+		foreach(targetEntryCell, filterQuery->targetList)
+		{
+			TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+			if (equal(targetEntry->expr, sortExpression))
+			{
+				remoteTargetEntry = targetEntry;
+				break;
+			}
+		}
+
+		if (remoteTargetEntry == NULL)
+		{
+			remoteTargetEntry = makeTargetEntry((Expr *) copyObject(sortExpression), -1,
+												NULL, false);
+			filterQuery->targetList = lappend(filterQuery->targetList,
+											  remoteTargetEntry);
+		}
+
+		remoteTargetEntry->ressortgroupref = sortGroupRef;
+		remoteSortClause->tleSortGroupRef = sortGroupRef;
+
+		remoteSortClauseList = lappend(remoteSortClauseList, remoteSortClause);
+	}
+
+	remoteLimit = makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+							Int64GetDatum(limitCount + limitOffset), false,
+							FLOAT8PASSBYVAL);
+
+	filterQuery->sortClause = remoteSortClauseList;
+	filterQuery->limitCount = (Node *) remoteLimit;
+}
+
+
+/*
+ * ConstLimitValue extracts the value of the given LIMIT or OFFSET expression
+ * into limitValue. The function returns false if the expression is missing or
+ * isn't a non-null, non-negative constant; LIMIT ALL is a null constant.
+ */
+static bool
+ConstLimitValue(Node *limitExpression, int64 *limitValue)
+{
+	Const *limitConst = NULL;
+
+	if (limitExpression == NULL || !IsA(limitExpression, Const))
+	{
+		return false;
+	}
+
+	limitConst = (Const *) limitExpression;
+	Assert(limitConst->consttype == INT8OID);
+	if (limitConst->constisnull)
+	{
+		return false;
+	}
+
+	*limitValue = DatumGetInt64(limitConst->constvalue);
+
+	return (*limitValue >= 0);
+}
+
+
 /*
  * BuildLocalQuery returns a copy of query with its quals replaced by those
- * in localRestrictList. Expects queries with a single entry in their FROM
- * list.
+ * in localRestrictList. Its FROM list is replaced by a single reference to the
+ * first range table entry, which is to become the intermediate result; the
+ * shards already evaluated any join clauses.
  */
 static Query *
 BuildLocalQuery(Query *query, List *localRestrictList)
 {
 	Query *localQuery = copyObject(query);
 	FromExpr *joinTree = localQuery->jointree;
+	RangeTblRef *rangeTableReference = makeNode(RangeTblRef);
 
 	Assert(joinTree != NULL);
-	Assert(list_length(joinTree->fromlist) == 1);
+	rangeTableReference->rtindex = 1;
+	joinTree->fromlist = list_make1(rangeTableReference);
 	joinTree->quals = (Node *) make_ands_explicit((List *) localRestrictList);
 
 	return localQuery;
@@ -917,51 +1455,233 @@ BuildLocalQuery(Query *query, List *localRestrictList)
 
 
 /*
- * PlanSequentialScan attempts to plan the given query using only a sequential
- * scan of the underlying table. The function disables index scan types and
- * plans the query. If the plan still contains a non-sequential scan plan node,
- * the function errors out. Note this function modifies the query parameter, so
- * make a copy before calling PlanSequentialScan if that is unacceptable.
+ * PlanIntermediateResultScan plans the given local query over the rows which
+ * the given remote query fetches from the shards. The tables in the query are
+ * replaced by a single call to pg_shard_intermediate_result whose columns are
+ * those of the remote target list; the columns the query uses must already
+ * refer to these. After planning, the argument of the function becomes
+ * an executor parameter, through which the executor passes the fetched rows;
+ * the parameter's identifier is returned in paramId. Note this function modifies
+ * the query parameter, so make a copy before calling it if that is unacceptable.
  */
 static PlannedStmt *
-PlanSequentialScan(Query *query, int cursorOptions, ParamListInfo boundParams)
+PlanIntermediateResultScan(Query *query, Query *remoteQuery, int cursorOptions,
+						   ParamListInfo boundParams, int *paramId)
 {
-	PlannedStmt *sequentialScanPlan = NULL;
-	bool indexScanEnabledOldValue = false;
-	bool bitmapScanEnabledOldValue = false;
-	List *rangeTableList = NIL;
+	PlannedStmt *plannedStatement = NULL;
+	RangeTblEntry *rangeTableEntry = NULL;
+	FunctionScan *functionScan = NULL;
 	ListCell *rangeTableCell = NULL;
 
-	/* error out if the table is a foreign table */
-	ExtractRangeTableEntryWalker((Node *) query, &rangeTableList);
+	/* error out if any table is a foreign table */
+	foreach(rangeTableCell, query->rtable)
+	{
+		RangeTblEntry *tableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
 
-	foreach(rangeTableCell, rangeTableList)
+		if (tableEntry->rtekind == RTE_RELATION &&
+			tableEntry->relkind == RELKIND_FOREIGN_TABLE)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("multi-shard SELECTs from foreign tables are "
+								   "unsupported")));
+		}
+	}
+
+	/* the query's columns and FROM list already refer to the first entry only */
+	rangeTableEntry = (RangeTblEntry *) linitial(query->rtable);
+	Assert(rangeTableEntry->rtekind == RTE_RELATION);
+	query->rtable = list_make1(rangeTableEntry);
+
+	IntermediateResultRangeTableEntry(rangeTableEntry, remoteQuery);
+
+	plannedStatement = standard_planner(query, cursorOptions, boundParams);
+
+	/* the planner may have left out the scan, e.g. for contradictory quals */
+	*paramId = plannedStatement->nParamExec++;
+	functionScan = FindFunctionScan(plannedStatement->planTree);
+	if (functionScan != NULL)
 	{
-		RangeTblEntry *rangeTableEntry = (RangeTblEntry *) lfirst(rangeTableCell);
-		if (rangeTableEntry->rtekind == RTE_RELATION)
+		Param *resultParam = makeNode(Param);
+		FuncExpr *functionCall = NULL;
+
+#if (PG_VERSION_NUM >= 90400)
+		RangeTblFunction *rangeTableFunction = linitial(functionScan->functions);
+		functionCall = (FuncExpr *) rangeTableFunction->funcexpr;
+#else
+		functionCall = (FuncExpr *) functionScan->funcexpr;
+#endif
+
+		resultParam->paramkind = PARAM_EXEC;
+		resultParam->paramid = *paramId;
+		resultParam->paramtype = INTERNALOID;
+		resultParam->paramtypmod = -1;
+		resultParam->paramcollid = InvalidOid;
+		resultParam->location = -1;
+
+		Assert(IsA(functionCall, FuncExpr));
+		functionCall->args = list_make1(resultParam);
+	}
+
+	return plannedStatement;
+}
+
+
+/*
+ * RenumberIntermediateResultColumns changes the attribute numbers of columns in
+ * the given expression tree to their positions in the remote target list, that
+ * is, to the columns of the intermediate result. The columns of all joined tables
+ * then refer to the intermediate result in the first range table entry.
+ */
+static bool
+RenumberIntermediateResultColumns(Node *node, List *remoteTargetList)
+{
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	if (IsA(node, Var))
+	{
+		Var *column = (Var *) node;
+		ListCell *targetEntryCell = NULL;
+		AttrNumber resultColumnId = 0;
+
+		Assert(column->varlevelsup == 0);
+
+		foreach(targetEntryCell, remoteTargetList)
 		{
-			if (rangeTableEntry->relkind == RELKIND_FOREIGN_TABLE)
+			TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+			Expr *expression = targetEntry->expr;
+
+			resultColumnId++;
+			if (IsA(expression, Var) &&
+				((Var *) expression)->varno == column->varno &&
+				((Var *) expression)->varattno == column->varattno)
 			{
-				ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-								errmsg("multi-shard SELECTs from foreign tables are "
-									   "unsupported")));
+				column->varno = 1;
+				column->varnoold = 1;
+				column->varattno = resultColumnId;
+				column->varoattno = resultColumnId;
+
+				return false;
 			}
 		}
+
+		ereport(ERROR, (errmsg("could not find column %d in remote target list",
+							   column->varattno)));
 	}
 
-	/* disable index scan types */
-	indexScanEnabledOldValue = enable_indexscan;
-	bitmapScanEnabledOldValue = enable_bitmapscan;
+	return expression_tree_walker(node, RenumberIntermediateResultColumns,
+								  remoteTargetList);
+}
+
 
-	enable_indexscan = false;
-	enable_bitmapscan = false;
+/*
+ * IntermediateResultRangeTableEntry turns the given relation range table entry
+ * into a call of pg_shard_intermediate_result returning the columns of the
+ * remote query's target list, named after the table columns they hold. The
+ * call's argument is a placeholder until the plan is made.
+ */
+static void
+IntermediateResultRangeTableEntry(RangeTblEntry *rangeTableEntry, Query *remoteQuery)
+{
+	List *remoteTargetList = remoteQuery->targetList;
 
-	sequentialScanPlan = standard_planner(query, cursorOptions, boundParams);
+	/* ExecType instead of ExecCleanType so we don't ignore junk columns */
+	TupleDesc resultDescriptor = ExecTypeFromTL(remoteTargetList, false);
+	char *aliasName = rangeTableEntry->eref->aliasname;
+	List *columnNames = NIL;
+	List *columnTypes = NIL;
+	List *columnTypmods = NIL;
+	List *columnCollations = NIL;
+	ListCell *targetEntryCell = NULL;
+	int columnIndex = 0;
+	Const *placeholder = makeConst(INTERNALOID, -1, InvalidOid, SIZEOF_DATUM,
+								   (Datum) 0, true, true);
+	FuncExpr *functionCall = makeFuncExpr(IntermediateResultFunctionId(), RECORDOID,
+										  list_make1(placeholder), InvalidOid,
+										  InvalidOid, COERCE_EXPLICIT_CALL);
+	functionCall->funcretset = true;
+
+	foreach(targetEntryCell, remoteTargetList)
+	{
+		TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+		Form_pg_attribute attribute = resultDescriptor->attrs[columnIndex];
+		char *columnName = "?column?";
+
+		if (IsA(targetEntry->expr, Var))
+		{
+			Var *column = (Var *) targetEntry->expr;
+			RangeTblEntry *tableEntry = rt_fetch(column->varno, remoteQuery->rtable);
+			List *tableColumnNames = tableEntry->eref->colnames;
+			AttrNumber columnId = column->varattno;
 
-	enable_indexscan = indexScanEnabledOldValue;
-	enable_bitmapscan = bitmapScanEnabledOldValue;
+			columnName = (columnId > 0) ? strVal(list_nth(tableColumnNames, columnId - 1))
+										: tableEntry->eref->aliasname;
+		}
+
+		columnNames = lappend(columnNames, makeString(columnName));
+		columnTypes = lappend_oid(columnTypes, attribute->atttypid);
+		columnTypmods = lappend_int(columnTypmods, attribute->atttypmod);
+		columnCollations = lappend_oid(columnCollations, attribute->attcollation);
+		columnIndex++;
+	}
+
+	rangeTableEntry->rtekind = RTE_FUNCTION;
+	rangeTableEntry->relid = InvalidOid;
+	rangeTableEntry->relkind = 0;
+	rangeTableEntry->inh = false;
+	rangeTableEntry->requiredPerms = 0;
+	rangeTableEntry->eref = makeAlias(aliasName, columnNames);
+
+#if (PG_VERSION_NUM >= 90400)
+	{
+		RangeTblFunction *rangeTableFunction = makeNode(RangeTblFunction);
+		rangeTableFunction->funcexpr = (Node *) functionCall;
+		rangeTableFunction->funccolcount = columnIndex;
+		rangeTableFunction->funccolnames = columnNames;
+		rangeTableFunction->funccoltypes = columnTypes;
+		rangeTableFunction->funccoltypmods = columnTypmods;
+		rangeTableFunction->funccolcollations = columnCollations;
+
+		rangeTableEntry->functions = list_make1(rangeTableFunction);
+		rangeTableEntry->funcordinality = false;
+	}
+#else
+	rangeTableEntry->funcexpr = (Node *) functionCall;
+	rangeTableEntry->funccoltypes = columnTypes;
+	rangeTableEntry->funccoltypmods = columnTypmods;
+	rangeTableEntry->funccolcollations = columnCollations;
+#endif
+}
+
+
+/*
+ * FindFunctionScan returns the function scan in the given plan tree, or NULL if
+ * there is none. Plans of multi-shard SELECTs scan a single range table entry.
+ */
+static FunctionScan *
+FindFunctionScan(Plan *plan)
+{
+	FunctionScan *functionScan = NULL;
+
+	if (plan == NULL)
+	{
+		return NULL;
+	}
+
+	if (IsA(plan, FunctionScan))
+	{
+		return (FunctionScan *) plan;
+	}
+
+	functionScan = FindFunctionScan(plan->lefttree);
+	if (functionScan == NULL)
+	{
+		functionScan = FindFunctionScan(plan->righttree);
+	}
 
-	return sequentialScanPlan;
+	return functionScan;
 }
 
 
@@ -969,7 +1689,7 @@ PlanSequentialScan(Query *query, int cursorOptions, ParamListInfo boundParams)
  * QueryRestrictList returns the restriction clauses for the query. For a SELECT
  * statement these are the where-clause expressions. For INSERT statements we
  * build an equality clause based on the partition-column and its supplied
- * insert value.
+ * insert value, unless the table is a reference table without such a column.
  */
 static List *
 QueryRestrictList(Query *query)
@@ -977,7 +1697,13 @@ QueryRestrictList(Query *query)
 	List *queryRestrictList = NIL;
 	CmdType commandType = query->commandType;
 
-	if (commandType == CMD_INSERT)
+	if (commandType == CMD_INSERT &&
+		IsReferenceTable(ExtractFirstDistributedTableId(query)))
+	{
+		/* all rows of a reference table go to its single shard */
+		queryRestrictList = NIL;
+	}
+	else if (commandType == CMD_INSERT)
 	{
 		/* build equality expression based on partition column value for row */
 		Oid distributedTableId = ExtractFirstDistributedTableId(query);
@@ -1108,91 +1834,87 @@ TargetEntryList(List *expressionList)
 }
 
 
-/*
- * CreateTemporaryTableLikeStmt returns a CreateStmt node which will create a
- * clone of the given relation using the CREATE TEMPORARY TABLE LIKE option.
- * Note that the function only creates the table, and doesn't copy over indexes,
- * constraints, or default values.
- */
-static CreateStmt *
-CreateTemporaryTableLikeStmt(Oid sourceRelationId)
-{
-	static unsigned long temporaryTableId = 0;
-	CreateStmt *createStmt = NULL;
-	StringInfo clonedTableName = NULL;
-	RangeVar *clonedRelation = NULL;
-
-	char *sourceTableName = get_rel_name(sourceRelationId);
-	Oid sourceSchemaId = get_rel_namespace(sourceRelationId);
-	char *sourceSchemaName = get_namespace_name(sourceSchemaId);
-	RangeVar *sourceRelation = makeRangeVar(sourceSchemaName, sourceTableName, -1);
-
-	TableLikeClause *tableLikeClause = makeNode(TableLikeClause);
-	tableLikeClause->relation = sourceRelation;
-	tableLikeClause->options = 0; /* don't copy over indexes/constraints etc */
-
-	/* create a unique name for the cloned table */
-	clonedTableName = makeStringInfo();
-	appendStringInfo(clonedTableName, "%s_%d_%lu", TEMPORARY_TABLE_PREFIX, MyProcPid,
-					 temporaryTableId);
-	temporaryTableId++;
-
-	clonedRelation = makeRangeVar(NULL, clonedTableName->data, -1);
-	clonedRelation->relpersistence = RELPERSISTENCE_TEMP;
-
-	createStmt = makeNode(CreateStmt);
-	createStmt->relation = clonedRelation;
-	createStmt->tableElts = list_make1(tableLikeClause);
-	createStmt->oncommit = ONCOMMIT_DROP;
-
-	return createStmt;
-}
-
-
 /*
  * BuildDistributedPlan simply creates the DistributedPlan instance from the
- * provided query and shard interval list.
+ * provided query and shard interval list. Joins between co-located tables get
+ * a task per shard of the first table, which joins it with the shards of the
+ * other tables at the same position in their sorted shard lists. Other queries
+ * send each shard only the values of IN lists on the partition column which
+ * the shard holds.
  */
 static DistributedPlan *
 BuildDistributedPlan(Query *query, List *shardIntervalList)
 {
 	ListCell *shardIntervalCell = NULL;
 	List *taskList = NIL;
+	FromExpr *joinTree = query->jointree;
+	Node *whereClause = NULL;
+	Oid distributedTableId = ExtractFirstDistributedTableId(query);
 	DistributedPlan *distributedPlan = palloc0(sizeof(DistributedPlan));
 	distributedPlan->plan.type = (NodeTag) T_DistributedPlan;
 	distributedPlan->targetList = query->targetList;
+	distributedPlan->rowLimit = -1;
+
+	/*
+	 * Convert the qualifiers to explicitly and'd clauses, which is needed
+	 * before we deparse the query. This applies to SELECT, UPDATE and
+	 * DELETE statements.
+	 */
+	MakeJoinTreeDeparsable((Node *) joinTree);
+	if (joinTree != NULL)
+	{
+		whereClause = joinTree->quals;
+	}
 
 	foreach(shardIntervalCell, shardIntervalList)
 	{
 		ShardInterval *shardInterval = (ShardInterval *) lfirst(shardIntervalCell);
 		int64 shardId = shardInterval->id;
 		List *finalizedPlacementList = NIL;
-		FromExpr *joinTree = NULL;
+		List *relationShardList = NIL;
 		Task *task = NULL;
 		StringInfo queryString = makeStringInfo();
 
-		/* grab shared metadata lock to stop concurrent placement additions */
-		LockShardDistributionMetadata(shardId, ShareLock);
+		if (QueryHasJoin(query))
+		{
+			ListCell *relationShardCell = NULL;
 
-		/* now safe to populate placement list */
-		finalizedPlacementList = LoadFinalizedShardPlacementList(shardId);
+			relationShardList = ColocatedRelationShardList(query, shardInterval);
 
-		/*
-		 * Convert the qualifiers to an explicitly and'd clause, which is needed
-		 * before we deparse the query. This applies to SELECT, UPDATE and
-		 * DELETE statements.
-		 */
-		joinTree = query->jointree;
-		if ((joinTree != NULL) && (joinTree->quals != NULL))
-		{
-			Node *whereClause = joinTree->quals;
-			if (IsA(whereClause, List))
+			/* grab shared metadata locks to stop concurrent placement changes */
+			foreach(relationShardCell, relationShardList)
 			{
-				joinTree->quals = (Node *) make_ands_explicit((List *) whereClause);
+				RelationShard *relationShard = lfirst(relationShardCell);
+				LockShardDistributionMetadata(relationShard->shardId, ShareLock);
 			}
+
+			/* now safe to find the placements holding all joined shards */
+			finalizedPlacementList = ColocatedPlacementList(relationShardList);
+
+			deparse_shard_join_query(query, relationShardList, queryString);
 		}
+		else
+		{
+			/* grab shared metadata lock to stop concurrent placement additions */
+			LockShardDistributionMetadata(shardId, ShareLock);
 
-		deparse_shard_query(query, shardId, queryString);
+			/* now safe to populate placement list */
+			finalizedPlacementList = LoadFinalizedShardPlacementList(shardId);
+
+			/* only send the shard those values of IN lists which it holds */
+			if (joinTree != NULL)
+			{
+				joinTree->quals = FilterPartitionValueArrays(distributedTableId,
+															 whereClause, shardInterval);
+			}
+
+			deparse_shard_query(query, shardId, queryString);
+
+			if (joinTree != NULL)
+			{
+				joinTree->quals = whereClause;
+			}
+		}
 
 		if (LogDistributedStatements)
 		{
@@ -1213,9 +1935,125 @@ BuildDistributedPlan(Query *query, List *shardIntervalList)
 }
 
 
+/*
+ * MakeJoinTreeDeparsable converts the implicitly and'd qualifier lists in the
+ * given join tree to explicit clauses. The planner also flattens the columns of
+ * joins to those of the joined tables, which the FROM clause only exposes if
+ * joins have neither aliases nor USING clauses, so these are dropped in favor
+ * of the join clauses. It may further turn left joins whose right side the
+ * WHERE clause requires to be null into anti joins; as the WHERE clause stays
+ * in place, these go back to being left joins.
+ */
+static void
+MakeJoinTreeDeparsable(Node *joinTreeNode)
+{
+	if (joinTreeNode == NULL || IsA(joinTreeNode, RangeTblRef))
+	{
+		return;
+	}
+
+	if (IsA(joinTreeNode, FromExpr))
+	{
+		FromExpr *fromExpr = (FromExpr *) joinTreeNode;
+		ListCell *fromCell = NULL;
+
+		if (fromExpr->quals != NULL && IsA(fromExpr->quals, List))
+		{
+			fromExpr->quals = (Node *) make_ands_explicit((List *) fromExpr->quals);
+		}
+
+		foreach(fromCell, fromExpr->fromlist)
+		{
+			MakeJoinTreeDeparsable((Node *) lfirst(fromCell));
+		}
+	}
+	else if (IsA(joinTreeNode, JoinExpr))
+	{
+		JoinExpr *joinExpr = (JoinExpr *) joinTreeNode;
+
+		if (joinExpr->quals != NULL && IsA(joinExpr->quals, List))
+		{
+			joinExpr->quals = (Node *) make_ands_explicit((List *) joinExpr->quals);
+		}
+
+		if (joinExpr->jointype == JOIN_ANTI)
+		{
+			joinExpr->jointype = JOIN_LEFT;
+		}
+
+		joinExpr->isNatural = false;
+		joinExpr->usingClause = NIL;
+		joinExpr->alias = NULL;
+
+		MakeJoinTreeDeparsable(joinExpr->larg);
+		MakeJoinTreeDeparsable(joinExpr->rarg);
+	}
+}
+
+
+/*
+ * SetResultMergeOrder records in the distributed plan how the executor merges
+ * the rows the shards return for the given remote query. If the query sorts its
+ * rows, the executor merges the sorted rows of all shards by the sort's columns
+ * and operators; if it has a limit, the executor keeps only as many rows.
+ */
+static void
+SetResultMergeOrder(DistributedPlan *distributedPlan, Query *query)
+{
+	int sortColumnCount = list_length(query->sortClause);
+	ListCell *sortClauseCell = NULL;
+	int sortColumnIndex = 0;
+
+	if (query->limitCount != NULL)
+	{
+		Const *limitConst = (Const *) query->limitCount;
+
+		Assert(IsA(limitConst, Const) && !limitConst->constisnull);
+		distributedPlan->rowLimit = DatumGetInt64(limitConst->constvalue);
+	}
+
+	if (sortColumnCount == 0)
+	{
+		return;
+	}
+
+	distributedPlan->sortColumnCount = sortColumnCount;
+	distributedPlan->sortColumnIndexes = palloc0(sortColumnCount * sizeof(AttrNumber));
+	distributedPlan->sortOperators = palloc0(sortColumnCount * sizeof(Oid));
+	distributedPlan->sortCollations = palloc0(sortColumnCount * sizeof(Oid));
+	distributedPlan->sortNullsFirst = palloc0(sortColumnCount * sizeof(bool));
+
+	foreach(sortClauseCell, query->sortClause)
+	{
+		SortGroupClause *sortClause = (SortGroupClause *) lfirst(sortClauseCell);
+		ListCell *targetEntryCell = NULL;
+		AttrNumber columnIndex = 0;
+
+		foreach(targetEntryCell, query->targetList)
+		{
+			TargetEntry *targetEntry = (TargetEntry *) lfirst(targetEntryCell);
+
+			columnIndex++;
+			if (targetEntry->ressortgroupref == sortClause->tleSortGroupRef)
+			{
+				distributedPlan->sortCollations[sortColumnIndex] =
+					exprCollation((Node *) targetEntry->expr);
+				break;
+			}
+		}
+
+		distributedPlan->sortColumnIndexes[sortColumnIndex] = columnIndex;
+		distributedPlan->sortOperators[sortColumnIndex] = sortClause->sortop;
+		distributedPlan->sortNullsFirst[sortColumnIndex] = sortClause->nulls_first;
+		sortColumnIndex++;
+	}
+}
+
+
 /*
  * PgShardExecutorStart sets up the executor state and queryDesc for pgShard
- * executed statements. The function also handles multi-shard selects
+ * executed statements, whose distributed plan it first produces with the values
+ * of the statement's parameters. The function also handles multi-shard selects
  * differently by fetching the remote data and modifying the existing plan to
  * scan that data.
  */
@@ -1223,7 +2061,16 @@ static void
 PgShardExecutorStart(QueryDesc *queryDesc, int eflags)
 {
 	PlannedStmt *plannedStatement = queryDesc->plannedstmt;
-	bool pgShardExecution = IsPgShardPlan(plannedStatement);
+	bool pgShardExecution = false;
+
+	if (IsDeferredDistributedPlan(plannedStatement))
+	{
+		plannedStatement = PlanDeferredStatement(plannedStatement, queryDesc->params,
+												 eflags);
+		queryDesc->plannedstmt = plannedStatement;
+	}
+
+	pgShardExecution = IsPgShardPlan(plannedStatement);
 
 	if (pgShardExecution)
 	{
@@ -1253,8 +2100,14 @@ PgShardExecutorStart(QueryDesc *queryDesc, int eflags)
 			LOCKMODE lockMode = NoLock;
 			EState *executorState = NULL;
 
-			/* disallow transactions and triggers during distributed commands */
-			PreventTransactionChain(topLevel, "distributed commands");
+			/*
+			 * Disallow transactions and triggers during distributed modifications.
+			 * Selects may run in transaction blocks, which cursors need.
+			 */
+			if (plannedStatement->commandType != CMD_SELECT)
+			{
+				PreventTransactionChain(topLevel, "distributed commands");
+			}
 			eflags |= EXEC_FLAG_SKIP_TRIGGERS;
 
 			/* build empty executor state to obtain per-query memory context */
@@ -1264,6 +2117,11 @@ PgShardExecutorStart(QueryDesc *queryDesc, int eflags)
 
 			queryDesc->estate = executorState;
 
+			if (plannedStatement->commandType == CMD_SELECT)
+			{
+				CreateDistributedExecState(queryDesc, distributedPlan);
+			}
+
 			lockMode = CommutativityRuleToLockMode(plannedStatement->commandType);
 			if (lockMode != NoLock)
 			{
@@ -1273,46 +2131,29 @@ PgShardExecutorStart(QueryDesc *queryDesc, int eflags)
 		else
 		{
 			/*
-			 * If its a SELECT query over multiple shards, we fetch the relevant
-			 * data from the remote nodes and insert it into a temp table. We then
-			 * point the existing plan to scan this temp table instead of the
-			 * original one.
+			 * If its a SELECT query over multiple shards, we start the local plan
+			 * and then fetch the relevant data from the remote nodes. The rows are
+			 * passed to the plan's function scan through an executor parameter.
 			 */
-			Plan *originalPlan = NULL;
-			RangeTblEntry *sequentialScanRangeTable = NULL;
-			Oid intermediateResultTableId = InvalidOid;
-			bool missingOK = false;
-
-			/* execute the previously created statement to create a temp table */
-			CreateStmt *createStmt = distributedPlan->createTemporaryTableStmt;
-			const char *queryDescription = "create temp table like";
-			RangeVar *intermediateResultTable = createStmt->relation;
-
-			ProcessUtility((Node *) createStmt, queryDescription,
-						   PROCESS_UTILITY_TOPLEVEL, NULL, None_Receiver, NULL);
-
-			/* execute select queries and fetch results into the temp table */
-			ExecuteMultipleShardSelect(distributedPlan, intermediateResultTable);
-
-			/* update the query descriptor snapshot so results are visible */
-			UnregisterSnapshot(queryDesc->snapshot);
-			UpdateActiveSnapshotCommandId();
-			queryDesc->snapshot = RegisterSnapshot(GetActiveSnapshot());
-
-			/* update sequential scan's table entry to point to intermediate table */
-			intermediateResultTableId = RangeVarGetRelid(intermediateResultTable,
-														 NoLock, missingOK);
-
-			Assert(list_length(plannedStatement->rtable) == 1);
-			sequentialScanRangeTable = linitial(plannedStatement->rtable);
-			Assert(sequentialScanRangeTable->rtekind == RTE_RELATION);
-			sequentialScanRangeTable->relid = intermediateResultTableId;
+			Plan *originalPlan = distributedPlan->originalPlan;
+			int paramId = distributedPlan->intermediateResultParamId;
+			EState *executorState = NULL;
+			ParamExecData *resultParam = NULL;
 
 			/* swap in modified (local) plan for compatibility with standard start hook */
-			originalPlan = distributedPlan->originalPlan;
 			plannedStatement->planTree = originalPlan;
 
 			NextExecutorStartHook(queryDesc, eflags);
+
+			if ((eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+			{
+				executorState = queryDesc->estate;
+				resultParam = &(executorState->es_param_exec_vals[paramId]);
+				resultParam->value =
+					PointerGetDatum(ExecuteMultipleShardSelect(distributedPlan,
+															   executorState));
+				resultParam->isnull = false;
+			}
 		}
 	}
 	else
@@ -1322,6 +2163,38 @@ PgShardExecutorStart(QueryDesc *queryDesc, int eflags)
 }
 
 
+/*
+ * IsDeferredDistributedPlan determines whether the provided plannedStmt is a
+ * placeholder for a distributed plan, as built by DeferredDistributedStatement.
+ */
+static bool
+IsDeferredDistributedPlan(PlannedStmt *plannedStmt)
+{
+	Plan *plan = plannedStmt->planTree;
+	Node *constantQual = NULL;
+	List *deferredList = NIL;
+
+	if (plan == NULL || !IsA(plan, Result))
+	{
+		return false;
+	}
+
+	constantQual = ((Result *) plan)->resconstantqual;
+	if (constantQual == NULL || !IsA(constantQual, List))
+	{
+		return false;
+	}
+
+	deferredList = (List *) constantQual;
+	if (list_length(deferredList) != 2 || !IsA(linitial(deferredList), Query))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * IsPgShardPlan determines whether the provided plannedStmt contains a plan
  * suitable for execution by PgShard.
@@ -1449,41 +2322,23 @@ CompareTasksByShardId(const void *leftElement, const void *rightElement)
 
 /*
  * ExecuteMultipleShardSelect executes the SELECT queries in the distributed
- * plan and inserts the returned rows into the given tableId.
+ * plan concurrently and returns their rows as an intermediate result kept in
+ * the given executor state's memory.
  */
-static void
-ExecuteMultipleShardSelect(DistributedPlan *distributedPlan,
-						   RangeVar *intermediateTable)
+static IntermediateResult *
+ExecuteMultipleShardSelect(DistributedPlan *distributedPlan, EState *executorState)
 {
-	List *taskList = distributedPlan->taskList;
 	List *targetList = distributedPlan->targetList;
 
 	/* ExecType instead of ExecCleanType so we don't ignore junk columns */
 	TupleDesc tupleStoreDescriptor = ExecTypeFromTL(targetList, false);
+	IntermediateResult *intermediateResult = CreateIntermediateResult(executorState,
+																	  tupleStoreDescriptor);
 
-	ListCell *taskCell = NULL;
-	foreach(taskCell, taskList)
-	{
-		Task *task = (Task *) lfirst(taskCell);
-		Tuplestorestate *tupleStore = tuplestore_begin_heap(false, false, work_mem);
-		bool resultsOK = false;
-
-		resultsOK = ExecuteTaskAndStoreResults(task, tupleStoreDescriptor, tupleStore);
-		if (!resultsOK)
-		{
-			ereport(ERROR, (errmsg("could not receive query results")));
-		}
-
-		/*
-		 * We successfully fetched data into local tuplestore. Now move results from
-		 * the tupleStore into the table.
-		 */
-		Assert(tupleStore != NULL);
-		TupleStoreToTable(intermediateTable, targetList, tupleStoreDescriptor,
-						  tupleStore);
+	ExecuteTasksConcurrently(distributedPlan, tupleStoreDescriptor,
+							 intermediateResult->tupleStore);
 
-		tuplestore_end(tupleStore);
-	}
+	return intermediateResult;
 }
 
 
@@ -1499,6 +2354,7 @@ ExecuteTaskAndStoreResults(Task *task, TupleDesc tupleDescriptor,
 	bool resultsOK = false;
 	List *taskPlacementList = task->taskPlacementList;
 	ListCell *taskPlacementCell = NULL;
+	RemoteResultState *resultState = CreateRemoteResultState(tupleDescriptor);
 
 	/*
 	 * Try to run the query to completion on one placement. If the query fails
@@ -1514,240 +2370,54 @@ ExecuteTaskAndStoreResults(Task *task, TupleDesc tupleDescriptor,
 
 		PGconn *connection = GetConnection(nodeName, nodePort);
 		if (connection == NULL)
-		{
-			continue;
-		}
-
-		queryOK = SendQueryInSingleRowMode(connection, task->queryString);
-		if (!queryOK)
-		{
-			PurgeConnection(connection);
-			continue;
-		}
-
-		storedOK = StoreQueryResult(connection, tupleDescriptor, tupleStore);
-		if (storedOK)
-		{
-			resultsOK = true;
-			break;
-		}
-		else
-		{
-			tuplestore_clear(tupleStore);
-			PurgeConnection(connection);
-		}
-	}
-
-	return resultsOK;
-}
-
-
-/*
- * SendQueryInSingleRowMode sends the given query on the connection in an
- * asynchronous way. The function also sets the single-row mode on the
- * connection so that we receive results a row at a time.
- */
-static bool
-SendQueryInSingleRowMode(PGconn *connection, StringInfo query)
-{
-	int querySent = 0;
-	int singleRowMode = 0;
-
-	querySent = PQsendQuery(connection, query->data);
-	if (querySent == 0)
-	{
-		ReportRemoteError(connection, NULL);
-		return false;
-	}
-
-	singleRowMode = PQsetSingleRowMode(connection);
-	if (singleRowMode == 0)
-	{
-		ReportRemoteError(connection, NULL);
-		return false;
-	}
-
-	return true;
-}
-
-
-/*
- * StoreQueryResult gets the query results from the given connection, builds
- * tuples from the results and stores them in the given tuple-store. If the
- * function can't receive query results, it returns false. Note that this
- * function assumes the query has already been sent on the connection and the
- * tuplestore has earlier been initialized.
- */
-static bool
-StoreQueryResult(PGconn *connection, TupleDesc tupleDescriptor,
-				 Tuplestorestate *tupleStore)
-{
-	AttInMetadata *attributeInputMetadata = TupleDescGetAttInMetadata(tupleDescriptor);
-	uint32 expectedColumnCount = tupleDescriptor->natts;
-	char **columnArray = (char **) palloc0(expectedColumnCount * sizeof(char *));
-	MemoryContext ioContext = AllocSetContextCreate(CurrentMemoryContext,
-													"StoreQueryResult",
-													ALLOCSET_DEFAULT_MINSIZE,
-													ALLOCSET_DEFAULT_INITSIZE,
-													ALLOCSET_DEFAULT_MAXSIZE);
-
-	Assert(tupleStore != NULL);
-
-	for (;;)
-	{
-		uint32 rowIndex = 0;
-		uint32 columnIndex = 0;
-		uint32 rowCount = 0;
-		uint32 columnCount = 0;
-		ExecStatusType resultStatus = 0;
-
-		PGresult *result = PQgetResult(connection);
-		if (result == NULL)
-		{
-			break;
-		}
-
-		resultStatus = PQresultStatus(result);
-		if ((resultStatus != PGRES_SINGLE_TUPLE) && (resultStatus != PGRES_TUPLES_OK))
-		{
-			ReportRemoteError(connection, result);
-			PQclear(result);
-
-			return false;
-		}
-
-		rowCount = PQntuples(result);
-		columnCount = PQnfields(result);
-		Assert(columnCount == expectedColumnCount);
-
-		for (rowIndex = 0; rowIndex < rowCount; rowIndex++)
-		{
-			HeapTuple heapTuple = NULL;
-			MemoryContext oldContext = NULL;
-			memset(columnArray, 0, columnCount * sizeof(char *));
-
-			for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
-			{
-				if (PQgetisnull(result, rowIndex, columnIndex))
-				{
-					columnArray[columnIndex] = NULL;
-				}
-				else
-				{
-					columnArray[columnIndex] = PQgetvalue(result, rowIndex, columnIndex);
-				}
-			}
-
-			/*
-			 * Switch to a temporary memory context that we reset after each tuple. This
-			 * protects us from any memory leaks that might be present in I/O functions
-			 * called by BuildTupleFromCStrings.
-			 */
-			oldContext = MemoryContextSwitchTo(ioContext);
-
-			heapTuple = BuildTupleFromCStrings(attributeInputMetadata, columnArray);
-
-			MemoryContextSwitchTo(oldContext);
-
-			tuplestore_puttuple(tupleStore, heapTuple);
-			MemoryContextReset(ioContext);
-		}
-
-		PQclear(result);
-	}
-
-	pfree(columnArray);
-
-	return true;
-}
-
-
-/*
- * TupleStoreToTable inserts the tuples from the given tupleStore into the given
- * table. Before doing so, the function extracts the values from the tuple and
- * sets the right attributes for the given table based on the column attribute
- * numbers.
- */
-static void
-TupleStoreToTable(RangeVar *tableRangeVar, List *storeToTableColumnList,
-				  TupleDesc storeTupleDescriptor, Tuplestorestate *store)
-{
-	Relation table = heap_openrv(tableRangeVar, RowExclusiveLock);
-	TupleDesc tableTupleDescriptor = RelationGetDescr(table);
-
-	int tableColumnCount = tableTupleDescriptor->natts;
-	Datum *tableTupleValues = palloc0(tableColumnCount * sizeof(Datum));
-	bool *tableTupleNulls = palloc0(tableColumnCount * sizeof(bool));
-
-	int storeColumnCount = storeTupleDescriptor->natts;
-	Datum *storeTupleValues = palloc0(storeColumnCount * sizeof(Datum));
-	bool *storeTupleNulls = palloc0(storeColumnCount * sizeof(bool));
-	TupleTableSlot *storeTableSlot = MakeSingleTupleTableSlot(storeTupleDescriptor);
+		{
+			continue;
+		}
 
-	for (;;)
-	{
-		HeapTuple storeTuple = NULL;
-		HeapTuple tableTuple = NULL;
-		int storeColumnIndex = 0;
+		queryOK = SendRemoteQuery(connection, task->queryString->data, resultState);
+		if (!queryOK)
+		{
+			PurgeConnection(connection);
+			continue;
+		}
 
-		bool nextTuple = tuplestore_gettupleslot(store, true, false, storeTableSlot);
-		if (!nextTuple)
+		storedOK = StoreQueryResult(connection, resultState, tupleStore);
+		if (storedOK)
 		{
+			resultsOK = true;
 			break;
 		}
-
-		storeTuple = ExecFetchSlotTuple(storeTableSlot);
-		heap_deform_tuple(storeTuple, storeTupleDescriptor,
-						  storeTupleValues, storeTupleNulls);
-
-		/* set all values to null for the table tuple */
-		memset(tableTupleNulls, true, tableColumnCount * sizeof(bool));
-
-		/*
-		 * Extract values from the returned tuple and set them in the right
-		 * attribute location for the new table. We determine this attribute
-		 * location based on the attribute number in the column from the remote
-		 * query's target list.
-		 */
-		for (storeColumnIndex = 0; storeColumnIndex < storeColumnCount;
-			 storeColumnIndex++)
+		else
 		{
-			TargetEntry *tableEntry = (TargetEntry *) list_nth(storeToTableColumnList,
-															   storeColumnIndex);
-			Expr *tableExpression = tableEntry->expr;
-			Var *tableColumn = NULL;
-			int tableColumnId = 0;
-
-			/* special case for count(*) as we expect a NULL const */
-			if (IsA(tableExpression, Const))
-			{
-				Const *constValue PG_USED_FOR_ASSERTS_ONLY = (Const *) tableExpression;
-				Assert(constValue->consttype == UNKNOWNOID);
+			tuplestore_clear(tupleStore);
+			PurgeConnection(connection);
+		}
+	}
 
-				/* skip over the null consts */
-				continue;
-			}
+	FreeRemoteResultState(resultState);
 
-			Assert(IsA(tableExpression, Var));
-			tableColumn = (Var *) tableExpression;
-			tableColumnId = tableColumn->varattno;
+	return resultsOK;
+}
 
-			tableTupleValues[tableColumnId - 1] = storeTupleValues[storeColumnIndex];
-			tableTupleNulls[tableColumnId - 1] = storeTupleNulls[storeColumnIndex];
-		}
 
-		tableTuple = heap_form_tuple(tableTupleDescriptor,
-									 tableTupleValues, tableTupleNulls);
+/*
+ * StoreQueryResult gets the query results from the given connection, builds
+ * tuples from the results and stores them in the given tuple-store. If the
+ * function can't receive query results, it returns false. Note that this
+ * function assumes the query has already been sent on the connection and the
+ * tuplestore has earlier been initialized.
+ */
+static bool
+StoreQueryResult(PGconn *connection, RemoteResultState *resultState,
+				 Tuplestorestate *tupleStore)
+{
+	bool failed = false;
 
-		simple_heap_insert(table, tableTuple);
-		CommandCounterIncrement();
+	Assert(tupleStore != NULL);
 
-		ExecClearTuple(storeTableSlot);
-		heap_freetuple(tableTuple);
-	}
+	ReadRemoteResults(connection, resultState, tupleStore, true, &failed);
 
-	ExecDropSingleTupleTableSlot(storeTableSlot);
-	heap_close(table, RowExclusiveLock);
+	return !failed;
 }
 
 
@@ -1770,14 +2440,14 @@ PgShardExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count)
 		Assert(estate != NULL);
 		Assert(!(estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY));
 
-		/* we only support default scan direction and row fetch count */
-		if (!ScanDirectionIsForward(direction))
+		/* we only support forward scans, and row fetch counts only for selects */
+		if (ScanDirectionIsBackward(direction))
 		{
 			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 							errmsg("scan directions other than forward scans "
 								   "are unsupported")));
 		}
-		if (count != 0)
+		if (count != 0 && operation != CMD_SELECT)
 		{
 			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 							errmsg("fetching rows from a query using a cursor "
@@ -1794,16 +2464,26 @@ PgShardExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count)
 		if (operation == CMD_INSERT || operation == CMD_UPDATE ||
 			operation == CMD_DELETE)
 		{
-			int32 affectedRowCount = ExecuteDistributedModify(plan);
+			int32 affectedRowCount = -1;
+
+			if (plan->modifyReferenceTable)
+			{
+				affectedRowCount = ExecuteReferenceTableModify(plan);
+			}
+			else
+			{
+				affectedRowCount = ExecuteDistributedModify(plan);
+			}
+
 			estate->es_processed = affectedRowCount;
 		}
 		else if (operation == CMD_SELECT)
 		{
+			DistributedExecState *execState =
+				(DistributedExecState *) queryDesc->planstate;
 			DestReceiver *destination = queryDesc->dest;
-			List *targetList = plan->targetList;
-			TupleDesc tupleDescriptor = ExecCleanTypeFromTL(targetList, false);
 
-			ExecuteSingleShardSelect(plan, estate, tupleDescriptor, destination);
+			ExecuteSingleShardSelect(execState, estate, direction, count, destination);
 		}
 		else
 		{
@@ -1924,57 +2604,347 @@ ExecuteDistributedModify(DistributedPlan *plan)
 
 
 /*
- * ExecuteSingleShardSelect executes the remote select query and sends the
- * resultant tuples to the given destination receiver. If the query fails on a
- * given placement, the function attempts it on its replica.
+ * ExecuteReferenceTableModify applies a modification of a reference table to all
+ * reachable placements of its shard in one distributed transaction, run by the
+ * configured transaction manager. Unlike other modifications, which succeed if
+ * any placement does, the modification is rolled back on all placements if it
+ * fails on any of them, so that the copies of the table stay identical. With
+ * the 2PC transaction manager, placements only commit once all of them have
+ * prepared. Placements which cannot be reached, or which fail to commit, are
+ * marked as inactive.
  */
-static void
-ExecuteSingleShardSelect(DistributedPlan *distributedPlan, EState *executorState,
-						 TupleDesc tupleDescriptor, DestReceiver *destination)
+static int32
+ExecuteReferenceTableModify(DistributedPlan *plan)
 {
-	Task *task = NULL;
-	Tuplestorestate *tupleStore = NULL;
-	bool resultsOK = false;
-	TupleTableSlot *tupleTableSlot = NULL;
+	PgShardTransactionManager const *transactionManager =
+		&PgShardTransManagerImpl[PgShardCurrTransManager];
+	Task *task = (Task *) linitial(plan->taskList);
+	ShardId shardId = task->shardId;
+	List *connectionList = NIL;
+	List *openPlacementList = NIL;
+	List *failedPlacementList = NIL;
+	ListCell *taskPlacementCell = NULL;
+	ListCell *connectionCell = NULL;
+	ListCell *placementCell = NULL;
+	ListCell *failedPlacementCell = NULL;
+	int32 affectedTupleCount = -1;
+	int preparedCount = 0;
+	bool transactionFailed = false;
+
+	Assert(list_length(plan->taskList) == 1);
+
+	/* open a remote transaction on each placement that can be reached */
+	foreach(taskPlacementCell, task->taskPlacementList)
+	{
+		ShardPlacement *taskPlacement = (ShardPlacement *) lfirst(taskPlacementCell);
+		PGconn *connection = GetConnection(taskPlacement->nodeName,
+										   taskPlacement->nodePort);
+
+		if (connection == NULL || !transactionManager->Begin(connection))
+		{
+			failedPlacementList = lappend(failedPlacementList, taskPlacement);
+			continue;
+		}
+
+		connectionList = lappend(connectionList, connection);
+		openPlacementList = lappend(openPlacementList, taskPlacement);
+	}
+
+	if (connectionList == NIL)
+	{
+		ereport(ERROR, (errmsg("could not modify any active placements")));
+	}
+
+	forboth(connectionCell, connectionList, placementCell, openPlacementList)
+	{
+		PGconn *connection = (PGconn *) lfirst(connectionCell);
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+		PGresult *result = PQexec(connection, task->queryString->data);
+		int32 currentAffectedTupleCount = -1;
+
+		if (PQresultStatus(result) != PGRES_COMMAND_OK)
+		{
+			ReportRemoteError(connection, result);
+			PQclear(result);
+
+			transactionFailed = true;
+			break;
+		}
+
+		currentAffectedTupleCount = pg_atoi(PQcmdTuples(result), sizeof(int32), 0);
+		PQclear(result);
+
+		if ((affectedTupleCount == -1) ||
+			(affectedTupleCount == currentAffectedTupleCount))
+		{
+			affectedTupleCount = currentAffectedTupleCount;
+		}
+		else
+		{
+			ereport(WARNING, (errmsg("modified %d tuples, but expected to modify %d",
+									 currentAffectedTupleCount, affectedTupleCount),
+							  errdetail("modified placement on %s:%d",
+										placement->nodeName, placement->nodePort)));
+		}
+	}
+
+	if (!transactionFailed)
+	{
+		foreach(connectionCell, connectionList)
+		{
+			PGconn *connection = (PGconn *) lfirst(connectionCell);
+
+			if (!transactionManager->Prepare(connection, shardId))
+			{
+				transactionFailed = true;
+				break;
+			}
+
+			preparedCount++;
+		}
+	}
+
+	/* undo the modification everywhere if any placement could not apply it */
+	if (transactionFailed)
+	{
+		int connectionIndex = 0;
+
+		foreach(connectionCell, connectionList)
+		{
+			PGconn *connection = (PGconn *) lfirst(connectionCell);
+
+			if (connectionIndex < preparedCount)
+			{
+				transactionManager->RollbackPrepared(connection, shardId);
+			}
+			else
+			{
+				transactionManager->Rollback(connection);
+			}
+
+			connectionIndex++;
+		}
+
+		ereport(ERROR, (errmsg("could not modify all placements of reference table "
+							   "shard " INT64_FORMAT, shardId),
+						errdetail("The modification was rolled back on all "
+								  "placements.")));
+	}
 
-	List *taskList = distributedPlan->taskList;
-	Assert(list_length(taskList) == 1);
+	forboth(connectionCell, connectionList, placementCell, openPlacementList)
+	{
+		PGconn *connection = (PGconn *) lfirst(connectionCell);
+		ShardPlacement *placement = (ShardPlacement *) lfirst(placementCell);
+
+		if (!transactionManager->CommitPrepared(connection, shardId))
+		{
+			ereport(WARNING, (errmsg("could not commit modification on %s:%d",
+									 placement->nodeName, placement->nodePort)));
 
-	task = (Task *) linitial(taskList);
-	tupleStore = tuplestore_begin_heap(false, false, work_mem);
+			failedPlacementList = lappend(failedPlacementList, placement);
+		}
+	}
 
-	resultsOK = ExecuteTaskAndStoreResults(task, tupleDescriptor, tupleStore);
-	if (!resultsOK)
+	/* mark failed placements as inactive: they're stale */
+	foreach(failedPlacementCell, failedPlacementList)
 	{
-		ereport(ERROR, (errmsg("could not receive query results")));
+		ShardPlacement *failedPlacement = (ShardPlacement *) lfirst(failedPlacementCell);
+
+		UpdateShardPlacementRowState(failedPlacement->id, STATE_INACTIVE);
 	}
 
-	tupleTableSlot = MakeSingleTupleTableSlot(tupleDescriptor);
+	return affectedTupleCount;
+}
+
+
+/*
+ * ExecuteSingleShardSelect sends up to count rows of the remote select query to
+ * the given destination receiver, or all remaining rows if count is zero. Rows
+ * are streamed as they arrive, and the remote query is left running between
+ * calls so that a cursor can fetch its rows in portions. If the query fails on a
+ * placement before any rows were sent, the function attempts it on the next
+ * placement; once rows have been sent, a failure can no longer be hidden from
+ * the receiver and the function errors out.
+ */
+static void
+ExecuteSingleShardSelect(DistributedExecState *execState, EState *executorState,
+						 ScanDirection direction, long count,
+						 DestReceiver *destination)
+{
+	DistributedPlan *distributedPlan = (DistributedPlan *) execState->planState.plan;
+	RemoteResultState *resultState = execState->remoteResultState;
+	TupleDesc tupleDescriptor = resultState->tupleDescriptor;
+	Task *task = (Task *) linitial(distributedPlan->taskList);
+	int placementCount = list_length(task->taskPlacementList);
+	int64 previousRowCount = resultState->sentRowCount;
+
+	Assert(list_length(distributedPlan->taskList) == 1);
 
 	/* startup the tuple receiver */
 	(*destination->rStartup)(destination, CMD_SELECT, tupleDescriptor);
 
-	/* iterate over tuples in tuple store, and send them to destination */
-	for (;;)
+	SetRemoteResultDestination(resultState, destination, count);
+
+	while (!execState->finished && !ScanDirectionIsNoMovement(direction))
 	{
-		bool nextTuple = tuplestore_gettupleslot(tupleStore, true, false, tupleTableSlot);
-		if (!nextTuple)
+		bool failed = false;
+
+		if (execState->connection == NULL)
 		{
-			break;
+			if (execState->placementIndex >= placementCount)
+			{
+				ereport(ERROR, (errmsg("could not receive query results")));
+			}
+
+			/*
+			 * A query whose rows are all read at once leaves the connection idle
+			 * again, so it may use the cached one. A cursor's query would keep
+			 * that busy between fetches and gets a connection of its own.
+			 */
+			if (!StartSingleShardSelect(execState, task, count == 0))
+			{
+				execState->placementIndex++;
+				continue;
+			}
+		}
+
+		/* an error while receiving would leave the query running on the connection */
+		PG_TRY();
+		{
+			execState->finished = ReadRemoteResults(execState->connection, resultState,
+													NULL, true, &failed);
+		}
+		PG_CATCH();
+		{
+			CloseSingleShardConnection(execState, false);
+
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		if (failed)
+		{
+			execState->finished = false;
+			CloseSingleShardConnection(execState, false);
+
+			if (resultState->sentRowCount > 0)
+			{
+				ereport(ERROR, (errmsg("could not receive query results")));
+			}
+
+			execState->placementIndex++;
+			continue;
 		}
 
-		(*destination->receiveSlot)(tupleTableSlot, destination);
-		executorState->es_processed++;
+		if (execState->finished)
+		{
+			CloseSingleShardConnection(execState, true);
+		}
 
-		ExecClearTuple(tupleTableSlot);
+		break;
 	}
 
+	executorState->es_processed = resultState->sentRowCount - previousRowCount;
+
 	/* shutdown the tuple receiver */
 	(*destination->rShutdown)(destination);
+}
+
+
+/*
+ * StartSingleShardSelect connects to the current placement of the task, from
+ * the connection cache or with a connection of its own, and sends the task's
+ * query. The function returns false if either step fails.
+ */
+static bool
+StartSingleShardSelect(DistributedExecState *execState, Task *task,
+					   bool useCachedConnection)
+{
+	ShardPlacement *taskPlacement = (ShardPlacement *)
+		list_nth(task->taskPlacementList, execState->placementIndex);
+	PGconn *connection = NULL;
+	bool queryOK = false;
+
+	if (useCachedConnection)
+	{
+		connection = GetConnection(taskPlacement->nodeName, taskPlacement->nodePort);
+	}
+	else
+	{
+		connection = ConnectToNode(taskPlacement->nodeName, taskPlacement->nodePort);
+	}
+
+	if (connection == NULL)
+	{
+		return false;
+	}
+
+	execState->connection = connection;
+	execState->cachedConnection = useCachedConnection;
+
+	queryOK = SendRemoteQuery(connection, task->queryString->data,
+							  execState->remoteResultState);
+	if (!queryOK)
+	{
+		CloseSingleShardConnection(execState, false);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * CloseSingleShardConnection lets go of the connection of a single-shard select,
+ * if it has one. A cached connection is kept for reuse if it is healthy, and
+ * purged otherwise; a connection of the select's own is closed, which also ends
+ * a remote query that is still running.
+ */
+static void
+CloseSingleShardConnection(DistributedExecState *execState, bool healthy)
+{
+	PGconn *connection = execState->connection;
+
+	if (connection == NULL)
+	{
+		return;
+	}
+
+	if (!execState->cachedConnection)
+	{
+		PQfinish(connection);
+	}
+	else if (!healthy)
+	{
+		PurgeConnection(connection);
+	}
+
+	execState->connection = NULL;
+}
 
-	ExecDropSingleTupleTableSlot(tupleTableSlot);
 
-	tuplestore_end(tupleStore);
+/*
+ * CreateDistributedExecState sets up the state of a single-shard select in the
+ * per-query memory of the executor state, and describes the select's rows in
+ * the query descriptor as the standard executor does, for portals to use.
+ */
+static void
+CreateDistributedExecState(QueryDesc *queryDesc, DistributedPlan *distributedPlan)
+{
+	EState *executorState = queryDesc->estate;
+	MemoryContext oldContext = MemoryContextSwitchTo(executorState->es_query_cxt);
+	DistributedExecState *execState = palloc0(sizeof(DistributedExecState));
+	TupleDesc tupleDescriptor = ExecCleanTypeFromTL(distributedPlan->targetList, false);
+
+	execState->planState.type = (NodeTag) T_DistributedExecState;
+	execState->planState.plan = (Plan *) distributedPlan;
+	execState->planState.state = executorState;
+	execState->remoteResultState = CreateRemoteResultState(tupleDescriptor);
+
+	queryDesc->tupDesc = tupleDescriptor;
+	queryDesc->planstate = (PlanState *) execState;
+
+	MemoryContextSwitchTo(oldContext);
 }
 
 
@@ -2023,10 +2993,22 @@ PgShardExecutorEnd(QueryDesc *queryDesc)
 	if (pgShardExecution)
 	{
 		EState *estate = queryDesc->estate;
+		PlanState *planState = queryDesc->planstate;
 
 		Assert(estate != NULL);
 		Assert(estate->es_finished);
 
+		/* a cursor closed before reading all rows leaves its connection open */
+		if (planState != NULL &&
+			(DistributedNodeTag) nodeTag(planState) == T_DistributedExecState)
+		{
+			DistributedExecState *execState = (DistributedExecState *) planState;
+
+			CloseSingleShardConnection(execState, false);
+			FreeRemoteResultState(execState->remoteResultState);
+			queryDesc->planstate = NULL;
+		}
+
 		FreeExecutorState(estate);
 		queryDesc->estate = NULL;
 		queryDesc->totaltime = NULL;
@@ -2061,6 +3043,12 @@ PgShardProcessUtility(Node *parsetree, const char *queryString,
 		/* extract the query from the explain statement */
 		Query *query = UtilityContainsQuery(parsetree);
 
+		/* EXPLAIN EXECUTE explains the query of a prepared statement */
+		if (query == NULL)
+		{
+			query = ExplainedPreparedQuery((ExplainStmt *) parsetree);
+		}
+
 		if (query != NULL)
 		{
 			PlannerType plannerType = DeterminePlannerType(query);
@@ -2072,50 +3060,6 @@ PgShardProcessUtility(Node *parsetree, const char *queryString,
 			}
 		}
 	}
-	else if (statementType == T_PrepareStmt)
-	{
-		PrepareStmt *prepareStatement = (PrepareStmt *) parsetree;
-		Query *parsedQuery = NULL;
-		Node *rawQuery = copyObject(prepareStatement->query);
-		int argumentCount = list_length(prepareStatement->argtypes);
-		Oid *argumentTypeArray = NULL;
-		PlannerType plannerType = PLANNER_INVALID_FIRST;
-
-		/* transform list of TypeNames to array of type OID's if they exist */
-		if (argumentCount > 0)
-		{
-			List *argumentTypeList = prepareStatement->argtypes;
-			ListCell *argumentTypeCell = NULL;
-			uint32 argumentTypeIndex = 0;
-
-			ParseState *parseState = make_parsestate(NULL);
-			parseState->p_sourcetext = queryString;
-
-			argumentTypeArray = (Oid *) palloc0(argumentCount * sizeof(Oid));
-
-			foreach(argumentTypeCell, argumentTypeList)
-			{
-				TypeName *typeName = lfirst(argumentTypeCell);
-				Oid typeId = typenameTypeId(parseState, typeName);
-
-				argumentTypeArray[argumentTypeIndex] = typeId;
-				argumentTypeIndex++;
-			}
-		}
-
-		/* analyze the statement using these parameter types */
-		parsedQuery = parse_analyze_varparams(rawQuery, queryString,
-											  &argumentTypeArray, &argumentCount);
-
-		/* determine if the query runs on a distributed table */
-		plannerType = DeterminePlannerType(parsedQuery);
-		if (plannerType == PLANNER_TYPE_PG_SHARD)
-		{
-			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							errmsg("PREPARE commands on distributed tables "
-								   "are unsupported")));
-		}
-	}
 	else if (statementType == T_CopyStmt)
 	{
 		CopyStmt *copyStatement = (CopyStmt *) parsetree;
@@ -2154,6 +3098,43 @@ PgShardProcessUtility(Node *parsetree, const char *queryString,
 }
 
 
+/*
+ * ExplainedPreparedQuery returns the query of the prepared statement which the
+ * given EXPLAIN EXECUTE statement explains, or NULL if the statement explains
+ * something else or no such prepared statement exists.
+ */
+static Query *
+ExplainedPreparedQuery(ExplainStmt *explainStatement)
+{
+	Query *explainedQuery = (Query *) explainStatement->query;
+	ExecuteStmt *executeStatement = NULL;
+	PreparedStatement *preparedStatement = NULL;
+	List *queryList = NIL;
+	bool throwError = false;
+
+	if (!IsA(explainedQuery, Query) || explainedQuery->utilityStmt == NULL ||
+		!IsA(explainedQuery->utilityStmt, ExecuteStmt))
+	{
+		return NULL;
+	}
+
+	executeStatement = (ExecuteStmt *) explainedQuery->utilityStmt;
+	preparedStatement = FetchPreparedStatement(executeStatement->name, throwError);
+	if (preparedStatement == NULL)
+	{
+		return NULL;
+	}
+
+	queryList = preparedStatement->plansource->query_list;
+	if (list_length(queryList) != 1)
+	{
+		return NULL;
+	}
+
+	return (Query *) linitial(queryList);
+}
+
+
 /*
  * ErrorOnDropIfDistributedTablesExist prevents attempts to drop the pg_shard
  * extension if any distributed tables still exist. This prevention will be
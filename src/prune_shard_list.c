@@ -15,20 +15,25 @@
 #include "c.h"
 #include "fmgr.h"
 
+#include "create_shards.h"
 #include "distribution_metadata.h"
 #include "prune_shard_list.h"
+#include "shard_router.h"
 
 #include <stddef.h>
 
 #include "access/attnum.h"
+#include "access/nbtree.h"
 #if (PG_VERSION_NUM >= 90500 && PG_VERSION_NUM < 90600)
 #include "access/stratnum.h"
 #else
 #include "access/skey.h"
 #endif
 #include "catalog/pg_am.h"
+#include "catalog/pg_collation.h"
 #include "catalog/pg_type.h"
 #include "commands/defrem.h"
+#include "nodes/bitmapset.h"
 #include "nodes/makefuncs.h"
 #include "nodes/memnodes.h" /* IWYU pragma: keep */
 #include "nodes/nodeFuncs.h"
@@ -39,6 +44,7 @@
 #include "optimizer/clauses.h"
 #include "optimizer/predtest.h"
 #include "optimizer/restrictinfo.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/errcodes.h"
@@ -56,7 +62,62 @@
 static List *OperatorIdCache = NIL;
 
 
+/*
+ * ShardIndexRestriction holds the positions in a table's sorted shard interval
+ * array which the clauses seen so far allow. Equality and IN clauses allow a
+ * set of positions, and range clauses a contiguous span of them.
+ */
+typedef struct ShardIndexRestriction
+{
+	int firstShardIndex;       /* first position range clauses allow */
+	int lastShardIndex;        /* last position range clauses allow */
+	bool hasShardIndexSet;     /* do equality or IN clauses restrict positions? */
+	Bitmapset *shardIndexSet;  /* positions equality and IN clauses allow */
+} ShardIndexRestriction;
+
+
 /* local function forward declarations */
+static bool SearchShardIntervals(DistributedTableCacheEntry *cacheEntry,
+								 List *whereClauseList, List **remainingShardList);
+static bool RestrictShardIndexes(DistributedTableCacheEntry *cacheEntry, Node *clause,
+								 ShardIndexRestriction *restriction);
+static bool RestrictShardIndexesByOpExpr(DistributedTableCacheEntry *cacheEntry,
+										 OpExpr *operatorExpression,
+										 ShardIndexRestriction *restriction);
+static bool RestrictShardIndexesByArray(DistributedTableCacheEntry *cacheEntry,
+										ScalarArrayOpExpr *arrayOperatorExpression,
+										ShardIndexRestriction *restriction);
+static bool RestrictShardIndexesByOr(DistributedTableCacheEntry *cacheEntry,
+									 BoolExpr *orExpression,
+									 ShardIndexRestriction *restriction);
+static void InitShardIndexRestriction(DistributedTableCacheEntry *cacheEntry,
+									  ShardIndexRestriction *restriction);
+static void RestrictShardIndexSet(ShardIndexRestriction *restriction,
+								  Bitmapset *shardIndexSet);
+static Bitmapset * AllowedShardIndexSet(ShardIndexRestriction *restriction);
+static bool SearchableShardIntervals(DistributedTableCacheEntry *cacheEntry);
+static bool PartitionValueArray(DistributedTableCacheEntry *cacheEntry,
+								ScalarArrayOpExpr *arrayOperatorExpression);
+static void DeconstructArrayConstant(Const *arrayConstant, Datum **elementArray,
+									 bool **elementNullArray, int *elementCount);
+static int ElementShardIndex(DistributedTableCacheEntry *cacheEntry, Oid elementTypeId,
+							 Datum elementValue);
+static ScalarArrayOpExpr * FilterArrayForShard(DistributedTableCacheEntry *cacheEntry,
+											   ScalarArrayOpExpr *arrayOperatorExpression,
+											   int shardIndex);
+static int SortedShardIndex(DistributedTableCacheEntry *cacheEntry,
+							ShardInterval *shardInterval);
+static int BtreeStrategyForColumnType(Oid operatorId, Var *partitionColumn);
+static bool IsPartitionColumn(Node *node, Var *partitionColumn);
+static bool ContainsPartitionColumn(Node *node, Var *partitionColumn);
+static int FindShardIndex(DistributedTableCacheEntry *cacheEntry, Datum value);
+static int FirstShardIndexEndingAbove(DistributedTableCacheEntry *cacheEntry,
+									  Datum value, bool inclusive);
+static int LastShardIndexStartingBelow(DistributedTableCacheEntry *cacheEntry,
+									   Datum value, bool inclusive);
+static int CompareShardValue(DistributedTableCacheEntry *cacheEntry, Datum shardValue,
+							 Datum value);
+static int32 HashConstantValue(Oid constantTypeId, Datum constantValue);
 static Oid LookupOperatorByType(Oid typeId, Oid accessMethodId, int16 strategyNumber);
 static bool SimpleOpExpression(Expr *clause);
 static Node * HashableClauseMutator(Node *originalNode, Var *partitionColumn);
@@ -64,6 +125,10 @@ static bool OpExpressionContainsColumn(OpExpr *operatorExpression, Var *partitio
 static Var * MakeInt4Column(void);
 static Const * MakeInt4Constant(Datum constantValue);
 static OpExpr * MakeHashedOperatorExpression(OpExpr *operatorExpression);
+static bool HashableArrayExpression(ScalarArrayOpExpr *arrayOperatorExpression,
+									Var *partitionColumn);
+static Node * MakeHashedArrayExpression(ScalarArrayOpExpr *arrayOperatorExpression);
+static OpExpr * MakeHashedEqualityExpression(int32 hashedValue);
 static OpExpr * MakeOpExpressionWithZeroConst(void);
 static List * BuildRestrictInfoList(List *qualList);
 static Node * BuildBaseConstraint(Var *column);
@@ -71,78 +136,986 @@ static void UpdateConstraint(Node *baseConstraint, ShardInterval *shardInterval)
 
 
 /*
- * PruneShardList prunes shards from given list based on the selection criteria,
- * and returns remaining shards in another list.
+ * PruneShardList prunes shards from given list based on the selection criteria,
+ * and returns remaining shards in another list. The single shard of a reference
+ * table holds all of its rows and is never pruned. If the given list is the
+ * table's cached shard list, the shards are found by searching its sorted shard
+ * intervals where the clauses allow it; otherwise, each shard is checked by
+ * trying to refute its range constraint with the clauses.
+ */
+List *
+PruneShardList(Oid relationId, List *whereClauseList, List *shardIntervalList)
+{
+	List *remainingShardList = NIL;
+	ListCell *shardIntervalCell = NULL;
+	List *restrictInfoList = NIL;
+	Node *baseConstraint = NULL;
+	Var *partitionColumn = NULL;
+	DistributedTableCacheEntry *cacheEntry = NULL;
+
+	char partitionMethod = PartitionType(relationId);
+	if (partitionMethod == REFERENCE_PARTITION_TYPE)
+	{
+		return shardIntervalList;
+	}
+
+	cacheEntry = LookupDistributedTableCacheEntry(relationId);
+	if (shardIntervalList == cacheEntry->shardIntervalList &&
+		SearchShardIntervals(cacheEntry, whereClauseList, &remainingShardList))
+	{
+		return remainingShardList;
+	}
+
+	partitionColumn = PartitionColumn(relationId);
+
+	/* build the filter clause list for the partition method */
+	switch (partitionMethod)
+	{
+		case APPEND_PARTITION_TYPE:
+		case RANGE_PARTITION_TYPE:
+		{
+			restrictInfoList = BuildRestrictInfoList(whereClauseList);
+			break;
+		}
+
+		case HASH_PARTITION_TYPE:
+		{
+			Node *hashedNode = HashableClauseMutator((Node *) whereClauseList,
+													 partitionColumn);
+
+			List *hashedClauseList = (List *) hashedNode;
+			restrictInfoList = BuildRestrictInfoList(hashedClauseList);
+
+			/* override the partition column for hash partitioning */
+			partitionColumn = MakeInt4Column();
+			break;
+		}
+
+		default:
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("unsupported table partition type: %c",
+								   partitionMethod)));
+		}
+	}
+
+	/* build the base expression for constraint */
+	baseConstraint = BuildBaseConstraint(partitionColumn);
+
+	/* walk over shard list and check if shards can be pruned */
+	foreach(shardIntervalCell, shardIntervalList)
+	{
+		ShardInterval *shardInterval = lfirst(shardIntervalCell);
+		List *constraintList = NIL;
+		bool shardPruned = false;
+
+		/* set the min/max values in the base constraint */
+		UpdateConstraint(baseConstraint, shardInterval);
+		constraintList = list_make1(baseConstraint);
+
+		shardPruned = predicate_refuted_by(constraintList, restrictInfoList);
+		if (shardPruned)
+		{
+			ereport(DEBUG2, (errmsg("predicate pruning for shard with ID "
+									INT64_FORMAT, shardInterval->id)));
+		}
+		else
+		{
+			remainingShardList = lappend(remainingShardList, &(shardInterval->id));
+		}
+	}
+
+	return remainingShardList;
+}
+
+
+/*
+ * FilterPartitionValueArrays returns the given where clause as it is to be sent
+ * to the given shard. IN clauses and other comparisons of the partition column
+ * with any element of a constant array have their arrays filtered down to the
+ * elements stored in that shard, so that a shard is not searched for values
+ * which other shards hold. Only clauses which the where clause requires as a
+ * whole are filtered; the where clause is returned unchanged if the table's
+ * shards cannot be searched for values.
+ */
+Node *
+FilterPartitionValueArrays(Oid relationId, Node *whereClause,
+						   ShardInterval *shardInterval)
+{
+	DistributedTableCacheEntry *cacheEntry = NULL;
+	List *clauseList = NIL;
+	List *filteredClauseList = NIL;
+	ListCell *clauseCell = NULL;
+	int shardIndex = 0;
+	bool clauseFiltered = false;
+
+	if (whereClause == NULL)
+	{
+		return whereClause;
+	}
+
+	cacheEntry = LookupDistributedTableCacheEntry(relationId);
+	if (cacheEntry == NULL || cacheEntry->partitionType == REFERENCE_PARTITION_TYPE ||
+		!SearchableShardIntervals(cacheEntry))
+	{
+		return whereClause;
+	}
+
+	shardIndex = SortedShardIndex(cacheEntry, shardInterval);
+	if (shardIndex < 0)
+	{
+		return whereClause;
+	}
+
+	clauseList = make_ands_implicit((Expr *) whereClause);
+	foreach(clauseCell, clauseList)
+	{
+		Node *clause = (Node *) lfirst(clauseCell);
+
+		if (IsA(clause, ScalarArrayOpExpr) &&
+			PartitionValueArray(cacheEntry, (ScalarArrayOpExpr *) clause))
+		{
+			ScalarArrayOpExpr *arrayOperatorExpression = (ScalarArrayOpExpr *) clause;
+
+			clause = (Node *) FilterArrayForShard(cacheEntry, arrayOperatorExpression,
+												  shardIndex);
+			clauseFiltered = true;
+		}
+
+		filteredClauseList = lappend(filteredClauseList, clause);
+	}
+
+	if (!clauseFiltered)
+	{
+		return whereClause;
+	}
+
+	return (Node *) make_ands_explicit(filteredClauseList);
+}
+
+
+/*
+ * SearchShardIntervals finds the shards which the given clauses allow by binary
+ * searches over the sorted shard intervals in the given cache entry, or by
+ * arithmetic on hash values if the shards split the hash space evenly. It
+ * handles equality and IN clauses on the partition column of hash partitioned
+ * tables, comparisons of the partition column with constants on other tables,
+ * and ORs of such clauses. The function returns false if the shard intervals
+ * cannot be searched or if it cannot handle a clause on the partition column;
+ * the caller then falls back to predicate refutation, which also copes with
+ * those.
+ */
+static bool
+SearchShardIntervals(DistributedTableCacheEntry *cacheEntry, List *whereClauseList,
+					 List **remainingShardList)
+{
+	ShardIndexRestriction restriction;
+	Bitmapset *shardIndexSet = NULL;
+	ListCell *clauseCell = NULL;
+	int shardIndex = 0;
+
+	if (!SearchableShardIntervals(cacheEntry))
+	{
+		return false;
+	}
+
+	InitShardIndexRestriction(cacheEntry, &restriction);
+
+	foreach(clauseCell, whereClauseList)
+	{
+		Node *clause = (Node *) lfirst(clauseCell);
+
+		if (!RestrictShardIndexes(cacheEntry, clause, &restriction))
+		{
+			return false;
+		}
+	}
+
+	*remainingShardList = NIL;
+
+	/* bms_first_member returns the positions in increasing order */
+	shardIndexSet = AllowedShardIndexSet(&restriction);
+	while ((shardIndex = bms_first_member(shardIndexSet)) >= 0)
+	{
+		ShardInterval *shardInterval = cacheEntry->sortedShardIntervalArray[shardIndex];
+		*remainingShardList = lappend(*remainingShardList, shardInterval);
+	}
+
+	return true;
+}
+
+
+/*
+ * SearchableShardIntervals returns whether the shard intervals in the given
+ * cache entry may be searched for the values of partition columns. This
+ * requires them to be disjoint and, unless they hold hash values, sorted by
+ * the partition column's collation.
+ */
+static bool
+SearchableShardIntervals(DistributedTableCacheEntry *cacheEntry)
+{
+	Var *partitionColumn = cacheEntry->partitionColumn;
+
+	if (!cacheEntry->hasDisjointShardIntervals)
+	{
+		return false;
+	}
+
+	/* shard values are sorted and compared by the default collation */
+	if (cacheEntry->partitionType != HASH_PARTITION_TYPE &&
+		OidIsValid(partitionColumn->varcollid) &&
+		partitionColumn->varcollid != DEFAULT_COLLATION_OID)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * RestrictShardIndexes narrows down the shard positions in the restriction to
+ * those the given clause allows. Clauses which do not refer to the partition
+ * column allow all positions. The function returns false if it cannot tell
+ * which positions a clause on the partition column allows.
+ */
+static bool
+RestrictShardIndexes(DistributedTableCacheEntry *cacheEntry, Node *clause,
+					 ShardIndexRestriction *restriction)
+{
+	Var *partitionColumn = cacheEntry->partitionColumn;
+
+	if (!ContainsPartitionColumn(clause, partitionColumn))
+	{
+		return true;
+	}
+
+	if (and_clause(clause))
+	{
+		ListCell *argumentCell = NULL;
+
+		foreach(argumentCell, ((BoolExpr *) clause)->args)
+		{
+			Node *argument = (Node *) lfirst(argumentCell);
+
+			if (!RestrictShardIndexes(cacheEntry, argument, restriction))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+	else if (or_clause(clause))
+	{
+		return RestrictShardIndexesByOr(cacheEntry, (BoolExpr *) clause, restriction);
+	}
+	else if (IsA(clause, OpExpr))
+	{
+		return RestrictShardIndexesByOpExpr(cacheEntry, (OpExpr *) clause, restriction);
+	}
+	else if (IsA(clause, ScalarArrayOpExpr))
+	{
+		return RestrictShardIndexesByArray(cacheEntry, (ScalarArrayOpExpr *) clause,
+										   restriction);
+	}
+	else if (IsA(clause, NullTest))
+	{
+		NullTest *nullTest = (NullTest *) clause;
+
+		/* null partition values hash to zero, see MakeOpExpressionWithZeroConst */
+		if (cacheEntry->partitionType == HASH_PARTITION_TYPE &&
+			nullTest->nulltesttype == IS_NULL &&
+			IsPartitionColumn((Node *) nullTest->arg, partitionColumn))
+		{
+			int shardIndex = FindShardIndex(cacheEntry, Int32GetDatum(0));
+			Bitmapset *shardIndexSet = NULL;
+
+			if (shardIndex >= 0)
+			{
+				shardIndexSet = bms_make_singleton(shardIndex);
+			}
+
+			RestrictShardIndexSet(restriction, shardIndexSet);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * RestrictShardIndexesByOpExpr narrows down the shard positions in the
+ * restriction to those a comparison between the partition column and a
+ * constant allows. Hash partitioned tables are only restricted by equality;
+ * other comparisons tell nothing about hash values.
+ */
+static bool
+RestrictShardIndexesByOpExpr(DistributedTableCacheEntry *cacheEntry,
+							 OpExpr *operatorExpression,
+							 ShardIndexRestriction *restriction)
+{
+	Var *partitionColumn = cacheEntry->partitionColumn;
+	Node *leftOperand = NULL;
+	Node *rightOperand = NULL;
+	Const *constant = NULL;
+	int strategyNumber = 0;
+	int shardIndex = 0;
+
+	if (!SimpleOpExpression((Expr *) operatorExpression))
+	{
+		return false;
+	}
+
+	leftOperand = get_leftop((Expr *) operatorExpression);
+	rightOperand = get_rightop((Expr *) operatorExpression);
+	if (IsA(rightOperand, Const) && IsPartitionColumn(leftOperand, partitionColumn))
+	{
+		constant = (Const *) rightOperand;
+	}
+	else if (IsA(leftOperand, Const) && IsPartitionColumn(rightOperand, partitionColumn))
+	{
+		constant = (Const *) leftOperand;
+	}
+	else
+	{
+		return false;
+	}
+
+	if (cacheEntry->partitionType == HASH_PARTITION_TYPE)
+	{
+		Oid leftHashFunction = InvalidOid;
+		Oid rightHashFunction = InvalidOid;
+		Bitmapset *shardIndexSet = NULL;
+		int32 hashedValue = 0;
+
+		if (!get_op_hash_functions(operatorExpression->opno, &leftHashFunction,
+								   &rightHashFunction))
+		{
+			return true;
+		}
+
+		hashedValue = HashConstantValue(constant->consttype, constant->constvalue);
+		shardIndex = FindShardIndex(cacheEntry, Int32GetDatum(hashedValue));
+		if (shardIndex >= 0)
+		{
+			shardIndexSet = bms_make_singleton(shardIndex);
+		}
+
+		RestrictShardIndexSet(restriction, shardIndexSet);
+		return true;
+	}
+
+	if (constant->consttype != partitionColumn->vartype ||
+		(OidIsValid(operatorExpression->inputcollid) &&
+		 operatorExpression->inputcollid != DEFAULT_COLLATION_OID))
+	{
+		return false;
+	}
+
+	strategyNumber = BtreeStrategyForColumnType(operatorExpression->opno,
+												partitionColumn);
+
+	/* turn "constant op column" around into "column op constant" */
+	if (constant == (Const *) leftOperand)
+	{
+		strategyNumber = BTCommuteStrategyNumber(strategyNumber);
+	}
+
+	switch (strategyNumber)
+	{
+		case BTLessStrategyNumber:
+		case BTLessEqualStrategyNumber:
+		{
+			bool inclusive = (strategyNumber == BTLessEqualStrategyNumber);
+			shardIndex = LastShardIndexStartingBelow(cacheEntry, constant->constvalue,
+													 inclusive);
+			restriction->lastShardIndex = Min(restriction->lastShardIndex, shardIndex);
+			break;
+		}
+
+		case BTGreaterStrategyNumber:
+		case BTGreaterEqualStrategyNumber:
+		{
+			bool inclusive = (strategyNumber == BTGreaterEqualStrategyNumber);
+			shardIndex = FirstShardIndexEndingAbove(cacheEntry, constant->constvalue,
+													inclusive);
+			restriction->firstShardIndex = Max(restriction->firstShardIndex, shardIndex);
+			break;
+		}
+
+		case BTEqualStrategyNumber:
+		{
+			Bitmapset *shardIndexSet = NULL;
+
+			shardIndex = FindShardIndex(cacheEntry, constant->constvalue);
+			if (shardIndex >= 0)
+			{
+				shardIndexSet = bms_make_singleton(shardIndex);
+			}
+
+			RestrictShardIndexSet(restriction, shardIndexSet);
+			break;
+		}
+
+		default:
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * RestrictShardIndexesByArray narrows down the shard positions in the
+ * restriction to those holding any of the elements of a constant array which
+ * the partition column is compared with for equality, as in an IN clause. Each
+ * element is routed on its own, so the shards holding none of them are left
+ * out.
+ */
+static bool
+RestrictShardIndexesByArray(DistributedTableCacheEntry *cacheEntry,
+							ScalarArrayOpExpr *arrayOperatorExpression,
+							ShardIndexRestriction *restriction)
+{
+	Const *arrayConstant = NULL;
+	Oid elementTypeId = InvalidOid;
+	Datum *elementArray = NULL;
+	bool *elementNullArray = NULL;
+	int elementCount = 0;
+	int elementIndex = 0;
+	Bitmapset *shardIndexSet = NULL;
+
+	if (!PartitionValueArray(cacheEntry, arrayOperatorExpression))
+	{
+		return false;
+	}
+
+	arrayConstant = (Const *) lsecond(arrayOperatorExpression->args);
+	elementTypeId = get_element_type(arrayConstant->consttype);
+	DeconstructArrayConstant(arrayConstant, &elementArray, &elementNullArray,
+							 &elementCount);
+
+	for (elementIndex = 0; elementIndex < elementCount; elementIndex++)
+	{
+		int shardIndex = 0;
+
+		/* null elements never compare equal to a partition value */
+		if (elementNullArray[elementIndex])
+		{
+			continue;
+		}
+
+		shardIndex = ElementShardIndex(cacheEntry, elementTypeId,
+									   elementArray[elementIndex]);
+		if (shardIndex >= 0)
+		{
+			shardIndexSet = bms_add_member(shardIndexSet, shardIndex);
+		}
+	}
+
+	RestrictShardIndexSet(restriction, shardIndexSet);
+
+	return true;
+}
+
+
+/*
+ * RestrictShardIndexesByOr narrows down the shard positions in the restriction
+ * to those any of the arguments of the given OR clause allows, as for ORs of
+ * equalities on the partition column. Every argument needs to be handled for
+ * this; otherwise, the function returns false.
+ */
+static bool
+RestrictShardIndexesByOr(DistributedTableCacheEntry *cacheEntry, BoolExpr *orExpression,
+						 ShardIndexRestriction *restriction)
+{
+	Bitmapset *shardIndexSet = NULL;
+	ListCell *argumentCell = NULL;
+
+	foreach(argumentCell, orExpression->args)
+	{
+		Node *argument = (Node *) lfirst(argumentCell);
+		ShardIndexRestriction argumentRestriction;
+		Bitmapset *argumentShardIndexSet = NULL;
+
+		InitShardIndexRestriction(cacheEntry, &argumentRestriction);
+
+		if (!RestrictShardIndexes(cacheEntry, argument, &argumentRestriction))
+		{
+			return false;
+		}
+
+		argumentShardIndexSet = AllowedShardIndexSet(&argumentRestriction);
+		shardIndexSet = bms_add_members(shardIndexSet, argumentShardIndexSet);
+	}
+
+	RestrictShardIndexSet(restriction, shardIndexSet);
+
+	return true;
+}
+
+
+/*
+ * InitShardIndexRestriction initializes the given restriction to allow all shard
+ * positions of the given cache entry.
+ */
+static void
+InitShardIndexRestriction(DistributedTableCacheEntry *cacheEntry,
+						  ShardIndexRestriction *restriction)
+{
+	restriction->firstShardIndex = 0;
+	restriction->lastShardIndex = cacheEntry->shardIntervalCount - 1;
+	restriction->hasShardIndexSet = false;
+	restriction->shardIndexSet = NULL;
+}
+
+
+/*
+ * RestrictShardIndexSet narrows down the set of shard positions the restriction
+ * allows to those in the given set as well.
+ */
+static void
+RestrictShardIndexSet(ShardIndexRestriction *restriction, Bitmapset *shardIndexSet)
+{
+	if (restriction->hasShardIndexSet)
+	{
+		restriction->shardIndexSet = bms_int_members(restriction->shardIndexSet,
+													 shardIndexSet);
+	}
+	else
+	{
+		restriction->shardIndexSet = shardIndexSet;
+		restriction->hasShardIndexSet = true;
+	}
+}
+
+
+/*
+ * AllowedShardIndexSet returns a new set of the shard positions the given
+ * restriction allows, which lie in its span and in its set of positions if it
+ * has one.
+ */
+static Bitmapset *
+AllowedShardIndexSet(ShardIndexRestriction *restriction)
+{
+	Bitmapset *allowedShardIndexSet = NULL;
+	int shardIndex = 0;
+
+	if (restriction->hasShardIndexSet)
+	{
+		Bitmapset *shardIndexSet = bms_copy(restriction->shardIndexSet);
+
+		while ((shardIndex = bms_first_member(shardIndexSet)) >= 0)
+		{
+			if (shardIndex >= restriction->firstShardIndex &&
+				shardIndex <= restriction->lastShardIndex)
+			{
+				allowedShardIndexSet = bms_add_member(allowedShardIndexSet, shardIndex);
+			}
+		}
+	}
+	else
+	{
+		for (shardIndex = restriction->firstShardIndex;
+			 shardIndex <= restriction->lastShardIndex; shardIndex++)
+		{
+			allowedShardIndexSet = bms_add_member(allowedShardIndexSet, shardIndex);
+		}
+	}
+
+	return allowedShardIndexSet;
+}
+
+
+/*
+ * PartitionValueArray returns whether the given expression compares the
+ * partition column for equality with any element of a constant array, in a
+ * way which lets each element be routed to the shard holding it.
+ */
+static bool
+PartitionValueArray(DistributedTableCacheEntry *cacheEntry,
+					ScalarArrayOpExpr *arrayOperatorExpression)
+{
+	Var *partitionColumn = cacheEntry->partitionColumn;
+	Node *leftOperand = (Node *) linitial(arrayOperatorExpression->args);
+	Node *rightOperand = (Node *) lsecond(arrayOperatorExpression->args);
+	Const *arrayConstant = NULL;
+	Oid elementTypeId = InvalidOid;
+
+	if (!arrayOperatorExpression->useOr || !IsA(rightOperand, Const) ||
+		!IsPartitionColumn(leftOperand, partitionColumn))
+	{
+		return false;
+	}
+
+	arrayConstant = (Const *) rightOperand;
+	if (arrayConstant->constisnull)
+	{
+		return false;
+	}
+
+	elementTypeId = get_element_type(arrayConstant->consttype);
+	if (!OidIsValid(elementTypeId))
+	{
+		return false;
+	}
+
+	if (cacheEntry->partitionType == HASH_PARTITION_TYPE)
+	{
+		Oid leftHashFunction = InvalidOid;
+		Oid rightHashFunction = InvalidOid;
+
+		return get_op_hash_functions(arrayOperatorExpression->opno, &leftHashFunction,
+									 &rightHashFunction);
+	}
+
+	if (elementTypeId != partitionColumn->vartype ||
+		(OidIsValid(arrayOperatorExpression->inputcollid) &&
+		 arrayOperatorExpression->inputcollid != DEFAULT_COLLATION_OID) ||
+		BtreeStrategyForColumnType(arrayOperatorExpression->opno,
+								   partitionColumn) != BTEqualStrategyNumber)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * DeconstructArrayConstant extracts the elements of the given non-null array
+ * constant and their null flags into newly allocated arrays.
  */
-List *
-PruneShardList(Oid relationId, List *whereClauseList, List *shardIntervalList)
+static void
+DeconstructArrayConstant(Const *arrayConstant, Datum **elementArray,
+						 bool **elementNullArray, int *elementCount)
 {
-	List *remainingShardList = NIL;
-	ListCell *shardIntervalCell = NULL;
-	List *restrictInfoList = NIL;
-	Node *baseConstraint = NULL;
+	ArrayType *array = DatumGetArrayTypeP(arrayConstant->constvalue);
+	Oid elementTypeId = ARR_ELEMTYPE(array);
+	int16 elementTypeLength = 0;
+	bool elementTypeByValue = false;
+	char elementTypeAlignment = 0;
+
+	get_typlenbyvalalign(elementTypeId, &elementTypeLength, &elementTypeByValue,
+						 &elementTypeAlignment);
+	deconstruct_array(array, elementTypeId, elementTypeLength, elementTypeByValue,
+					  elementTypeAlignment, elementArray, elementNullArray,
+					  elementCount);
+}
 
-	Var *partitionColumn = PartitionColumn(relationId);
-	char partitionMethod = PartitionType(relationId);
 
-	/* build the filter clause list for the partition method */
-	switch (partitionMethod)
+/*
+ * ElementShardIndex returns the position of the shard interval holding rows with
+ * the given partition value in the cache entry's sorted shard interval array,
+ * or -1 if there is no such shard. Values of hash partitioned tables are hashed
+ * with the hash function of their type first.
+ */
+static int
+ElementShardIndex(DistributedTableCacheEntry *cacheEntry, Oid elementTypeId,
+				  Datum elementValue)
+{
+	Datum value = elementValue;
+
+	if (cacheEntry->partitionType == HASH_PARTITION_TYPE)
 	{
-		case APPEND_PARTITION_TYPE:
-		case RANGE_PARTITION_TYPE:
+		value = Int32GetDatum(HashConstantValue(elementTypeId, elementValue));
+	}
+
+	return FindShardIndex(cacheEntry, value);
+}
+
+
+/*
+ * BtreeStrategyForColumnType returns the strategy number of the given operator
+ * in the default btree operator family of the partition column's type, or zero
+ * if the operator does not compare two values of that type in the family.
+ */
+static int
+BtreeStrategyForColumnType(Oid operatorId, Var *partitionColumn)
+{
+	Oid columnTypeId = partitionColumn->vartype;
+	TypeCacheEntry *typeEntry = lookup_type_cache(columnTypeId, TYPECACHE_BTREE_OPFAMILY);
+	Oid leftTypeId = InvalidOid;
+	Oid rightTypeId = InvalidOid;
+
+	if (!OidIsValid(typeEntry->btree_opf))
+	{
+		return 0;
+	}
+
+	op_input_types(operatorId, &leftTypeId, &rightTypeId);
+	if (leftTypeId != columnTypeId || rightTypeId != columnTypeId)
+	{
+		return 0;
+	}
+
+	return get_op_opfamily_strategy(operatorId, typeEntry->btree_opf);
+}
+
+
+/*
+ * IsPartitionColumn returns whether the given node is a column of the first
+ * range table entry with the partition column's attribute number.
+ */
+static bool
+IsPartitionColumn(Node *node, Var *partitionColumn)
+{
+	Var *column = NULL;
+
+	if (node == NULL || !IsA(node, Var))
+	{
+		return false;
+	}
+
+	column = (Var *) node;
+
+	return (column->varno == partitionColumn->varno &&
+			column->varattno == partitionColumn->varattno &&
+			column->varlevelsup == 0);
+}
+
+
+/*
+ * ContainsPartitionColumn returns whether the given node refers to the partition
+ * column anywhere.
+ */
+static bool
+ContainsPartitionColumn(Node *node, Var *partitionColumn)
+{
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	if (IsPartitionColumn(node, partitionColumn))
+	{
+		return true;
+	}
+
+	return expression_tree_walker(node, ContainsPartitionColumn,
+								  (void *) partitionColumn);
+}
+
+
+/*
+ * FilterArrayForShard returns a copy of the given comparison of the partition
+ * column with the elements of a constant array, which only keeps the elements
+ * stored in the shard at the given position. Null elements never compare equal
+ * and are left out; if no element remains, the array is empty.
+ */
+static ScalarArrayOpExpr *
+FilterArrayForShard(DistributedTableCacheEntry *cacheEntry,
+					ScalarArrayOpExpr *arrayOperatorExpression, int shardIndex)
+{
+	ScalarArrayOpExpr *filteredExpression = palloc(sizeof(ScalarArrayOpExpr));
+	Node *partitionColumn = (Node *) linitial(arrayOperatorExpression->args);
+	Const *arrayConstant = (Const *) lsecond(arrayOperatorExpression->args);
+	Const *filteredConstant = NULL;
+	ArrayType *filteredArray = NULL;
+	Oid elementTypeId = get_element_type(arrayConstant->consttype);
+	int16 elementTypeLength = 0;
+	bool elementTypeByValue = false;
+	char elementTypeAlignment = 0;
+	Datum *elementArray = NULL;
+	bool *elementNullArray = NULL;
+	int elementCount = 0;
+	int elementIndex = 0;
+	int filteredElementCount = 0;
+
+	DeconstructArrayConstant(arrayConstant, &elementArray, &elementNullArray,
+							 &elementCount);
+
+	/* keep the shard's elements in place, in their original order */
+	for (elementIndex = 0; elementIndex < elementCount; elementIndex++)
+	{
+		Datum elementValue = elementArray[elementIndex];
+
+		if (elementNullArray[elementIndex] ||
+			ElementShardIndex(cacheEntry, elementTypeId, elementValue) != shardIndex)
 		{
-			restrictInfoList = BuildRestrictInfoList(whereClauseList);
-			break;
+			continue;
 		}
 
-		case HASH_PARTITION_TYPE:
-		{
-			Node *hashedNode = HashableClauseMutator((Node *) whereClauseList,
-													 partitionColumn);
+		elementArray[filteredElementCount] = elementValue;
+		filteredElementCount++;
+	}
 
-			List *hashedClauseList = (List *) hashedNode;
-			restrictInfoList = BuildRestrictInfoList(hashedClauseList);
+	if (filteredElementCount > 0)
+	{
+		get_typlenbyvalalign(elementTypeId, &elementTypeLength, &elementTypeByValue,
+							 &elementTypeAlignment);
+		filteredArray = construct_array(elementArray, filteredElementCount,
+										elementTypeId, elementTypeLength,
+										elementTypeByValue, elementTypeAlignment);
+	}
+	else
+	{
+		filteredArray = construct_empty_array(elementTypeId);
+	}
 
-			/* override the partition column for hash partitioning */
-			partitionColumn = MakeInt4Column();
-			break;
-		}
+	filteredConstant = makeConst(arrayConstant->consttype, arrayConstant->consttypmod,
+								 arrayConstant->constcollid, arrayConstant->constlen,
+								 PointerGetDatum(filteredArray), false, false);
+	filteredConstant->location = arrayConstant->location;
 
-		default:
+	/* the rest of the expression is shared with the original one */
+	memcpy(filteredExpression, arrayOperatorExpression, sizeof(ScalarArrayOpExpr));
+	filteredExpression->args = list_make2(partitionColumn, filteredConstant);
+
+	return filteredExpression;
+}
+
+
+/*
+ * SortedShardIndex returns the position of the given shard interval in the
+ * cache entry's sorted shard interval array, or -1 if the array does not hold
+ * a shard interval with its identifier at the position of its min value.
+ */
+static int
+SortedShardIndex(DistributedTableCacheEntry *cacheEntry, ShardInterval *shardInterval)
+{
+	int shardIndex = LastShardIndexStartingBelow(cacheEntry, shardInterval->minValue,
+												 true);
+
+	if (shardIndex < 0 ||
+		cacheEntry->sortedShardIntervalArray[shardIndex]->id != shardInterval->id)
+	{
+		return -1;
+	}
+
+	return shardIndex;
+}
+
+
+/*
+ * FindShardIndex returns the position of the shard interval containing the
+ * given value in the cache entry's sorted shard interval array, or -1 if no
+ * shard interval contains it. Values of hash partitioned tables are hash
+ * values; if their shards split the hash space evenly, the position is
+ * computed instead of searched for.
+ */
+static int
+FindShardIndex(DistributedTableCacheEntry *cacheEntry, Datum value)
+{
+	int shardCount = cacheEntry->shardIntervalCount;
+	int shardIndex = 0;
+
+	if (shardCount == 0)
+	{
+		return -1;
+	}
+
+	if (cacheEntry->hasUniformHashDistribution)
+	{
+		uint64 hashTokenIncrement = HASH_TOKEN_COUNT / shardCount;
+		uint64 hashTokenOffset = (uint64) ((int64) DatumGetInt32(value) - INT32_MIN);
+
+		/* the last shard also covers the remainder of the hash space */
+		shardIndex = (int) Min(hashTokenOffset / hashTokenIncrement,
+							   (uint64) (shardCount - 1));
+
+		return shardIndex;
+	}
+
+	shardIndex = LastShardIndexStartingBelow(cacheEntry, value, true);
+	if (shardIndex < 0)
+	{
+		return -1;
+	}
+
+	if (CompareShardValue(cacheEntry,
+						  cacheEntry->sortedShardIntervalArray[shardIndex]->maxValue,
+						  value) < 0)
+	{
+		return -1;
+	}
+
+	return shardIndex;
+}
+
+
+/*
+ * FirstShardIndexEndingAbove returns the position of the first shard interval
+ * whose max value is above the given value, or equal to it if inclusive is set.
+ * If there is no such shard interval, the function returns the shard count.
+ * Since the shard intervals are disjoint, their max values are sorted as well.
+ */
+static int
+FirstShardIndexEndingAbove(DistributedTableCacheEntry *cacheEntry, Datum value,
+						   bool inclusive)
+{
+	ShardInterval **shardIntervalArray = cacheEntry->sortedShardIntervalArray;
+	int lowerBoundIndex = 0;
+	int upperBoundIndex = cacheEntry->shardIntervalCount;
+
+	while (lowerBoundIndex < upperBoundIndex)
+	{
+		int middleIndex = lowerBoundIndex + ((upperBoundIndex - lowerBoundIndex) / 2);
+		int comparison = CompareShardValue(cacheEntry,
+										   shardIntervalArray[middleIndex]->maxValue,
+										   value);
+
+		if (comparison > 0 || (inclusive && comparison == 0))
 		{
-			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							errmsg("unsupported table partition type: %c",
-								   partitionMethod)));
+			upperBoundIndex = middleIndex;
+		}
+		else
+		{
+			lowerBoundIndex = middleIndex + 1;
 		}
 	}
 
-	/* build the base expression for constraint */
-	baseConstraint = BuildBaseConstraint(partitionColumn);
+	return lowerBoundIndex;
+}
 
-	/* walk over shard list and check if shards can be pruned */
-	foreach(shardIntervalCell, shardIntervalList)
-	{
-		ShardInterval *shardInterval = lfirst(shardIntervalCell);
-		List *constraintList = NIL;
-		bool shardPruned = false;
 
-		/* set the min/max values in the base constraint */
-		UpdateConstraint(baseConstraint, shardInterval);
-		constraintList = list_make1(baseConstraint);
+/*
+ * LastShardIndexStartingBelow returns the position of the last shard interval
+ * whose min value is below the given value, or equal to it if inclusive is set.
+ * If there is no such shard interval, the function returns -1.
+ */
+static int
+LastShardIndexStartingBelow(DistributedTableCacheEntry *cacheEntry, Datum value,
+							bool inclusive)
+{
+	ShardInterval **shardIntervalArray = cacheEntry->sortedShardIntervalArray;
+	int lowerBoundIndex = 0;
+	int upperBoundIndex = cacheEntry->shardIntervalCount;
 
-		shardPruned = predicate_refuted_by(constraintList, restrictInfoList);
-		if (shardPruned)
+	while (lowerBoundIndex < upperBoundIndex)
+	{
+		int middleIndex = lowerBoundIndex + ((upperBoundIndex - lowerBoundIndex) / 2);
+		int comparison = CompareShardValue(cacheEntry,
+										   shardIntervalArray[middleIndex]->minValue,
+										   value);
+
+		if (comparison < 0 || (inclusive && comparison == 0))
 		{
-			ereport(DEBUG2, (errmsg("predicate pruning for shard with ID "
-									INT64_FORMAT, shardInterval->id)));
+			lowerBoundIndex = middleIndex + 1;
 		}
 		else
 		{
-			remainingShardList = lappend(remainingShardList, &(shardInterval->id));
+			upperBoundIndex = middleIndex;
 		}
 	}
 
-	return remainingShardList;
+	return lowerBoundIndex - 1;
+}
+
+
+/* CompareShardValue compares a shard min or max value with the given value. */
+static int
+CompareShardValue(DistributedTableCacheEntry *cacheEntry, Datum shardValue,
+				  Datum value)
+{
+	Datum comparisonResult = FunctionCall2Coll(cacheEntry->shardIntervalCompareFunction,
+											   DEFAULT_COLLATION_OID, shardValue, value);
+
+	return DatumGetInt32(comparisonResult);
 }
 
 
@@ -440,8 +1413,19 @@ HashableClauseMutator(Node *originalNode, Var *partitionColumn)
 	}
 	else if (IsA(originalNode, ScalarArrayOpExpr))
 	{
-		ereport(NOTICE, (errmsg("cannot use shard pruning with ANY (array expression)"),
-						 errhint("Consider rewriting the expression with OR clauses.")));
+		ScalarArrayOpExpr *arrayOperatorExpression = (ScalarArrayOpExpr *) originalNode;
+
+		if (HashableArrayExpression(arrayOperatorExpression, partitionColumn))
+		{
+			newNode = MakeHashedArrayExpression(arrayOperatorExpression);
+		}
+		else
+		{
+			ereport(NOTICE, (errmsg("cannot use shard pruning with ANY (array "
+									"expression)"),
+							 errhint("Consider rewriting the expression with OR "
+									 "clauses.")));
+		}
 	}
 
 	/*
@@ -491,19 +1475,10 @@ OpExpressionContainsColumn(OpExpr *operatorExpression, Var *partitionColumn)
 static OpExpr *
 MakeHashedOperatorExpression(OpExpr *operatorExpression)
 {
-	const Oid hashResultTypeId = INT4OID;
-	TypeCacheEntry *hashResultTypeEntry = NULL;
-	Oid operatorId = InvalidOid;
-	OpExpr *hashedExpression = NULL;
-	Var *hashedColumn = NULL;
-	Datum hashedValue = 0;
-	Const *hashedConstant = NULL;
-	FmgrInfo *hashFunction = NULL;
-	TypeCacheEntry *typeEntry = NULL;
-
 	Node *leftOperand = get_leftop((Expr *) operatorExpression);
 	Node *rightOperand = get_rightop((Expr *) operatorExpression);
 	Const *constant = NULL;
+	int32 hashedValue = 0;
 
 	if (IsA(rightOperand, Const))
 	{
@@ -514,30 +1489,111 @@ MakeHashedOperatorExpression(OpExpr *operatorExpression)
 		constant = (Const *) leftOperand;
 	}
 
+	hashedValue = HashConstantValue(constant->consttype, constant->constvalue);
+
+	return MakeHashedEqualityExpression(hashedValue);
+}
+
+
+/*
+ * HashableArrayExpression checks if the given expression compares the partition
+ * column for equality with any element of a non-null constant array, using an
+ * operator whose operands may be hashed.
+ */
+static bool
+HashableArrayExpression(ScalarArrayOpExpr *arrayOperatorExpression, Var *partitionColumn)
+{
+	Node *leftOperand = (Node *) linitial(arrayOperatorExpression->args);
+	Node *rightOperand = (Node *) lsecond(arrayOperatorExpression->args);
+	Oid leftHashFunction = InvalidOid;
+	Oid rightHashFunction = InvalidOid;
+
+	if (!arrayOperatorExpression->useOr || !IsA(leftOperand, Var) ||
+		!equal(leftOperand, partitionColumn))
+	{
+		return false;
+	}
+
+	if (!IsA(rightOperand, Const) || ((Const *) rightOperand)->constisnull)
+	{
+		return false;
+	}
+
+	return get_op_hash_functions(arrayOperatorExpression->opno, &leftHashFunction,
+								 &rightHashFunction);
+}
+
+
+/*
+ * MakeHashedArrayExpression turns a comparison of the partition column with the
+ * elements of a constant array into an OR of equalities between a column of
+ * int4 type and the hashed elements. Null elements never compare equal and are
+ * left out; if no element remains, the result is a false constant.
+ */
+static Node *
+MakeHashedArrayExpression(ScalarArrayOpExpr *arrayOperatorExpression)
+{
+	Const *arrayConstant = (Const *) lsecond(arrayOperatorExpression->args);
+	Oid elementTypeId = get_element_type(arrayConstant->consttype);
+	Datum *elementArray = NULL;
+	bool *elementNullArray = NULL;
+	int elementCount = 0;
+	int elementIndex = 0;
+	List *hashedExpressionList = NIL;
+
+	DeconstructArrayConstant(arrayConstant, &elementArray, &elementNullArray,
+							 &elementCount);
+
+	for (elementIndex = 0; elementIndex < elementCount; elementIndex++)
+	{
+		int32 hashedValue = 0;
+		OpExpr *hashedExpression = NULL;
+
+		if (elementNullArray[elementIndex])
+		{
+			continue;
+		}
+
+		hashedValue = HashConstantValue(elementTypeId, elementArray[elementIndex]);
+		hashedExpression = MakeHashedEqualityExpression(hashedValue);
+
+		hashedExpressionList = lappend(hashedExpressionList, hashedExpression);
+	}
+
+	if (hashedExpressionList == NIL)
+	{
+		return makeBoolConst(false, false);
+	}
+	else if (list_length(hashedExpressionList) == 1)
+	{
+		return (Node *) linitial(hashedExpressionList);
+	}
+
+	return (Node *) make_orclause(hashedExpressionList);
+}
+
+
+/*
+ * MakeHashedEqualityExpression creates a new operator expression which checks a
+ * column of int4 type for equality with the given hashed value.
+ */
+static OpExpr *
+MakeHashedEqualityExpression(int32 hashedValue)
+{
+	const Oid hashResultTypeId = INT4OID;
+	TypeCacheEntry *hashResultTypeEntry = NULL;
+	Oid operatorId = InvalidOid;
+	OpExpr *hashedExpression = NULL;
+	Var *hashedColumn = NULL;
+	Const *hashedConstant = NULL;
+
 	/* Load the operator from type cache */
 	hashResultTypeEntry = lookup_type_cache(hashResultTypeId, TYPECACHE_EQ_OPR);
 	operatorId = hashResultTypeEntry->eq_opr;
 
 	/* Get a column with int4 type */
 	hashedColumn = MakeInt4Column();
-
-	/* Load the hash function from type cache */
-	typeEntry = lookup_type_cache(constant->consttype, TYPECACHE_HASH_PROC_FINFO);
-	hashFunction = &(typeEntry->hash_proc_finfo);
-	if (!OidIsValid(hashFunction->fn_oid))
-	{
-		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_FUNCTION),
-						errmsg("could not identify a hash function for type %s",
-							   format_type_be(constant->consttype)),
-						errdatatype(constant->consttype)));
-	}
-
-	/*
-	 * Note that any changes to PostgreSQL's hashing functions will change the
-	 * new value created by this function.
-	 */
-	hashedValue = FunctionCall1(hashFunction, constant->constvalue);
-	hashedConstant = MakeInt4Constant(hashedValue);
+	hashedConstant = MakeInt4Constant(Int32GetDatum(hashedValue));
 
 	/* Now create the expression with modified partition column and hashed constant */
 	hashedExpression = (OpExpr *) make_opclause(operatorId,
@@ -555,6 +1611,30 @@ MakeHashedOperatorExpression(OpExpr *operatorExpression)
 }
 
 
+/*
+ * HashConstantValue hashes the given constant value with the hash function of
+ * its type, as shards of hash partitioned tables are chosen. Note that any
+ * changes to PostgreSQL's hashing functions will change the returned value.
+ */
+static int32
+HashConstantValue(Oid constantTypeId, Datum constantValue)
+{
+	TypeCacheEntry *typeEntry = lookup_type_cache(constantTypeId,
+												  TYPECACHE_HASH_PROC_FINFO);
+	FmgrInfo *hashFunction = &(typeEntry->hash_proc_finfo);
+
+	if (!OidIsValid(hashFunction->fn_oid))
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_FUNCTION),
+						errmsg("could not identify a hash function for type %s",
+							   format_type_be(constantTypeId)),
+						errdatatype(constantTypeId)));
+	}
+
+	return HashPartitionValue(hashFunction, constantValue);
+}
+
+
 /*
  * MakeInt4Column creates a column of int4 type with invalid table id and max
  * attribute number.
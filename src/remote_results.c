@@ -0,0 +1,914 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/remote_results.c
+ *
+ * This file contains functions to send SELECT queries to worker nodes and turn
+ * the rows they return into tuples, in text or in binary format, either from
+ * single-row results or from a COPY stream.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "libpq-fe.h"
+
+#include "connection.h"
+#include "remote_results.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include "access/htup.h"
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "executor/tuptable.h"
+#include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
+#include "utils/elog.h"
+#include "utils/errcodes.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/palloc.h"
+
+
+/* whether to fetch the results of remote SELECTs in binary format */
+bool UseBinaryResults = false;
+
+/* whether to fetch the results of remote SELECTs through COPY */
+bool UseCopyFetch = false;
+
+
+/* local function forward declarations */
+static int RemoteResultFormat(RemoteResultState *resultState, PGconn *connection);
+static bool SendQueryInSingleRowMode(PGconn *connection, char *queryString,
+									 int resultFormat);
+static bool SendCopyQuery(PGconn *connection, char *queryString, int resultFormat);
+static bool StoreRemoteResultRows(PGconn *connection, PGresult *result,
+								  RemoteResultState *resultState,
+								  Tuplestorestate *tupleStore);
+static bool StoreCopyRows(PGconn *connection, RemoteResultState *resultState,
+						  Tuplestorestate *tupleStore, bool binaryCopy, bool wait,
+						  bool *failed);
+static bool BinaryFormatSafe(Oid typeId);
+static HeapTuple BuildTupleFromBinaryValues(RemoteResultState *resultState,
+											PGresult *result, int rowIndex);
+static HeapTuple BuildTupleFromTextValues(RemoteResultState *resultState,
+										  PGresult *result, int rowIndex);
+static bool SendRowLimitReached(RemoteResultState *resultState,
+								Tuplestorestate *tupleStore);
+static void StoreRemoteTuple(RemoteResultState *resultState,
+							 Tuplestorestate *tupleStore, HeapTuple heapTuple);
+static HeapTuple BuildTupleFromBinaryCopyRow(RemoteResultState *resultState,
+											 char *rowData, int rowLength);
+static HeapTuple BuildTupleFromTextCopyRow(RemoteResultState *resultState,
+										   char *rowData, int rowLength);
+static Datum ReceiveBinaryValue(RemoteResultState *resultState, int columnIndex,
+								char *valueData, int valueLength);
+static int DecodeCopyEscape(char **readPointer, char *endPointer);
+
+
+/*
+ * CreateRemoteResultState sets up the state to build tuples of the given shape
+ * from remote results. Receive functions are looked up only if binary results
+ * are enabled and all columns may be received in binary format.
+ */
+RemoteResultState *
+CreateRemoteResultState(TupleDesc tupleDescriptor)
+{
+	RemoteResultState *resultState = palloc0(sizeof(RemoteResultState));
+	int columnCount = tupleDescriptor->natts;
+	int columnIndex = 0;
+
+	resultState->tupleDescriptor = tupleDescriptor;
+	resultState->attributeInputMetadata = TupleDescGetAttInMetadata(tupleDescriptor);
+	resultState->columnArray = palloc0(Max(columnCount, 1) * sizeof(char *));
+	resultState->ioContext = AllocSetContextCreate(CurrentMemoryContext,
+												   "RemoteResultState",
+												   ALLOCSET_DEFAULT_MINSIZE,
+												   ALLOCSET_DEFAULT_INITSIZE,
+												   ALLOCSET_DEFAULT_MAXSIZE);
+
+	resultState->binaryFormatSafe = UseBinaryResults;
+	for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+	{
+		Form_pg_attribute attribute = tupleDescriptor->attrs[columnIndex];
+		if (!BinaryFormatSafe(attribute->atttypid))
+		{
+			resultState->binaryFormatSafe = false;
+		}
+	}
+
+	if (resultState->binaryFormatSafe)
+	{
+		resultState->receiveFunctionArray = palloc0(Max(columnCount, 1) *
+													sizeof(FmgrInfo));
+		resultState->typeIOParamArray = palloc0(Max(columnCount, 1) * sizeof(Oid));
+		resultState->valueArray = palloc0(Max(columnCount, 1) * sizeof(Datum));
+		resultState->isNullArray = palloc0(Max(columnCount, 1) * sizeof(bool));
+
+		for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+		{
+			Form_pg_attribute attribute = tupleDescriptor->attrs[columnIndex];
+			Oid receiveFunctionId = InvalidOid;
+
+			getTypeBinaryInputInfo(attribute->atttypid, &receiveFunctionId,
+								   &resultState->typeIOParamArray[columnIndex]);
+			fmgr_info(receiveFunctionId, &resultState->receiveFunctionArray[columnIndex]);
+		}
+	}
+
+	return resultState;
+}
+
+
+/*
+ * SetRemoteResultDestination makes ReadRemoteResults send the tuples it builds
+ * to the given receiver when it is not given a tuplestore, and stop once it sent
+ * rowCount further tuples, unless rowCount is zero. The caller starts up the
+ * receiver and may check sentRowCount to learn whether any rows were sent.
+ */
+void
+SetRemoteResultDestination(RemoteResultState *resultState, DestReceiver *destination,
+						   int64 rowCount)
+{
+	resultState->destination = destination;
+	if (resultState->tupleSlot == NULL)
+	{
+		resultState->tupleSlot = MakeSingleTupleTableSlot(resultState->tupleDescriptor);
+	}
+
+	if (rowCount > 0)
+	{
+		resultState->sendRowLimit = resultState->sentRowCount + rowCount;
+	}
+	else
+	{
+		resultState->sendRowLimit = 0;
+	}
+}
+
+
+/* FreeRemoteResultState releases the memory of the given result state. */
+void
+FreeRemoteResultState(RemoteResultState *resultState)
+{
+	MemoryContextDelete(resultState->ioContext);
+
+	if (resultState->tupleSlot != NULL)
+	{
+		ExecDropSingleTupleTableSlot(resultState->tupleSlot);
+	}
+
+	pfree(resultState->columnArray);
+	if (resultState->binaryFormatSafe)
+	{
+		pfree(resultState->receiveFunctionArray);
+		pfree(resultState->typeIOParamArray);
+		pfree(resultState->valueArray);
+		pfree(resultState->isNullArray);
+	}
+
+	pfree(resultState);
+}
+
+
+/*
+ * SendRemoteQuery sends the given SELECT query on the connection so that its
+ * rows can be read with ReadRemoteResults, asking for binary results where it
+ * is safe to do so. If COPY fetching is enabled, the query runs as a COPY to
+ * STDOUT, whose rows come in a single stream instead of one result each.
+ */
+bool
+SendRemoteQuery(PGconn *connection, char *queryString, RemoteResultState *resultState)
+{
+	int resultFormat = RemoteResultFormat(resultState, connection);
+
+	if (UseCopyFetch)
+	{
+		return SendCopyQuery(connection, queryString, resultFormat);
+	}
+
+	return SendQueryInSingleRowMode(connection, queryString, resultFormat);
+}
+
+
+/*
+ * ReadRemoteResults reads the results of a query sent with SendRemoteQuery and
+ * stores their rows in the given tuplestore, or sends them to the destination of
+ * the result state if no tuplestore is given. If wait is false, the function only
+ * reads what the connection has already received and returns false if more is
+ * to come; it also returns false once the destination got as many rows as were
+ * asked for. It returns true once all results were read or the query failed, in
+ * which case the error is reported and failed is set.
+ */
+bool
+ReadRemoteResults(PGconn *connection, RemoteResultState *resultState,
+				  Tuplestorestate *tupleStore, bool wait, bool *failed)
+{
+	*failed = false;
+
+	for (;;)
+	{
+		PGresult *result = NULL;
+		ExecStatusType resultStatus = PGRES_EMPTY_QUERY;
+		bool storedOK = false;
+
+		if (SendRowLimitReached(resultState, tupleStore) ||
+			(!wait && PQisBusy(connection)))
+		{
+			return false;
+		}
+
+		result = PQgetResult(connection);
+		if (result == NULL)
+		{
+			return true;
+		}
+
+		resultStatus = PQresultStatus(result);
+		if (resultStatus == PGRES_COPY_OUT)
+		{
+			bool binaryCopy = (PQbinaryTuples(result) == 1);
+			bool copyDone = false;
+
+			PQclear(result);
+
+			copyDone = StoreCopyRows(connection, resultState, tupleStore, binaryCopy,
+									 wait, failed);
+			if (!copyDone || *failed)
+			{
+				return copyDone;
+			}
+
+			continue;
+		}
+		else if (resultStatus == PGRES_COMMAND_OK)
+		{
+			/* a COPY reports its completion like this */
+			PQclear(result);
+			continue;
+		}
+
+		storedOK = StoreRemoteResultRows(connection, result, resultState, tupleStore);
+		PQclear(result);
+
+		if (!storedOK)
+		{
+			*failed = true;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * RemoteResultFormat returns the format in which the rows of a query should be
+ * fetched over the given connection. Binary format is used if enabled and safe
+ * for all columns, and if the node stores date and time values the same way as
+ * this one does.
+ */
+static int
+RemoteResultFormat(RemoteResultState *resultState, PGconn *connection)
+{
+	const char *localIntegerDatetimes = NULL;
+	const char *remoteIntegerDatetimes = NULL;
+
+	if (!resultState->binaryFormatSafe)
+	{
+		return TEXT_RESULT_FORMAT;
+	}
+
+	localIntegerDatetimes = GetConfigOption("integer_datetimes", false, false);
+	remoteIntegerDatetimes = PQparameterStatus(connection, "integer_datetimes");
+	if (remoteIntegerDatetimes == NULL ||
+		strcmp(localIntegerDatetimes, remoteIntegerDatetimes) != 0)
+	{
+		return TEXT_RESULT_FORMAT;
+	}
+
+	return BINARY_RESULT_FORMAT;
+}
+
+
+/*
+ * SendQueryInSingleRowMode sends the given query on the connection in an
+ * asynchronous way, asking for results in the given format. The function also
+ * sets the single-row mode on the connection so that we receive results a row
+ * at a time.
+ */
+static bool
+SendQueryInSingleRowMode(PGconn *connection, char *queryString, int resultFormat)
+{
+	int querySent = 0;
+	int singleRowMode = 0;
+
+	querySent = PQsendQueryParams(connection, queryString, 0, NULL, NULL, NULL, NULL,
+								  resultFormat);
+	if (querySent == 0)
+	{
+		ReportRemoteError(connection, NULL);
+		return false;
+	}
+
+	singleRowMode = PQsetSingleRowMode(connection);
+	if (singleRowMode == 0)
+	{
+		ReportRemoteError(connection, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * SendCopyQuery sends the given query wrapped into a COPY to STDOUT on the
+ * connection, in binary or text format depending on the given result format.
+ */
+static bool
+SendCopyQuery(PGconn *connection, char *queryString, int resultFormat)
+{
+	StringInfo copyCommand = makeStringInfo();
+	int querySent = 0;
+
+	appendStringInfo(copyCommand, "COPY (%s) TO STDOUT", queryString);
+	if (resultFormat == BINARY_RESULT_FORMAT)
+	{
+		appendStringInfoString(copyCommand, " (FORMAT binary)");
+	}
+
+	querySent = PQsendQuery(connection, copyCommand->data);
+	pfree(copyCommand->data);
+	pfree(copyCommand);
+
+	if (querySent == 0)
+	{
+		ReportRemoteError(connection, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * StoreRemoteResultRows builds tuples from the rows of the given result and
+ * puts them into the tuplestore. The function reports the error and returns
+ * false if the result is an error.
+ */
+static bool
+StoreRemoteResultRows(PGconn *connection, PGresult *result,
+					  RemoteResultState *resultState, Tuplestorestate *tupleStore)
+{
+	ExecStatusType resultStatus = PQresultStatus(result);
+	bool binaryResult = false;
+	int rowCount = 0;
+	int rowIndex = 0;
+
+	if ((resultStatus != PGRES_SINGLE_TUPLE) && (resultStatus != PGRES_TUPLES_OK))
+	{
+		ReportRemoteError(connection, result);
+		return false;
+	}
+
+	rowCount = PQntuples(result);
+	binaryResult = (PQbinaryTuples(result) == 1);
+	Assert(PQnfields(result) == resultState->tupleDescriptor->natts);
+	Assert(!binaryResult || resultState->binaryFormatSafe);
+
+	for (rowIndex = 0; rowIndex < rowCount; rowIndex++)
+	{
+		HeapTuple heapTuple = NULL;
+
+		/*
+		 * Switch to a temporary memory context that we reset after each tuple. This
+		 * protects us from any memory leaks that might be present in I/O functions.
+		 */
+		MemoryContext oldContext = MemoryContextSwitchTo(resultState->ioContext);
+
+		if (binaryResult)
+		{
+			heapTuple = BuildTupleFromBinaryValues(resultState, result, rowIndex);
+		}
+		else
+		{
+			heapTuple = BuildTupleFromTextValues(resultState, result, rowIndex);
+		}
+
+		MemoryContextSwitchTo(oldContext);
+
+		StoreRemoteTuple(resultState, tupleStore, heapTuple);
+		MemoryContextReset(resultState->ioContext);
+	}
+
+	return true;
+}
+
+
+/*
+ * StoreCopyRows builds tuples from the rows of a COPY stream on the connection
+ * and puts them into the tuplestore. Each row arrives in a message of its own,
+ * except that the first message of a binary stream also carries the header and
+ * the last one only has the trailer. If wait is false, the function returns
+ * false once no more data was received, and it does so too once the destination
+ * got as many rows as were asked for. It returns true at the end of the stream
+ * or if the connection fails, in which case failed is set.
+ */
+static bool
+StoreCopyRows(PGconn *connection, RemoteResultState *resultState,
+			  Tuplestorestate *tupleStore, bool binaryCopy, bool wait, bool *failed)
+{
+	for (;;)
+	{
+		char *rowData = NULL;
+		int rowLength = 0;
+		HeapTuple heapTuple = NULL;
+		MemoryContext oldContext = NULL;
+
+		if (SendRowLimitReached(resultState, tupleStore))
+		{
+			return false;
+		}
+
+		rowLength = PQgetCopyData(connection, &rowData, wait ? 0 : 1);
+		if (rowLength == 0)
+		{
+			return false;
+		}
+		else if (rowLength == -1)
+		{
+			return true;
+		}
+		else if (rowLength < -1)
+		{
+			ReportRemoteError(connection, NULL);
+			*failed = true;
+			return true;
+		}
+
+		/* as in StoreRemoteResultRows, build tuples in a context reset after each */
+		oldContext = MemoryContextSwitchTo(resultState->ioContext);
+
+		if (binaryCopy)
+		{
+			heapTuple = BuildTupleFromBinaryCopyRow(resultState, rowData, rowLength);
+		}
+		else
+		{
+			heapTuple = BuildTupleFromTextCopyRow(resultState, rowData, rowLength);
+		}
+
+		MemoryContextSwitchTo(oldContext);
+		PQfreemem(rowData);
+
+		if (heapTuple != NULL)
+		{
+			StoreRemoteTuple(resultState, tupleStore, heapTuple);
+		}
+
+		MemoryContextReset(resultState->ioContext);
+	}
+}
+
+
+/*
+ * SendRowLimitReached returns whether tuples are sent to the destination of the
+ * result state rather than stored, and the destination got all it asked for.
+ */
+static bool
+SendRowLimitReached(RemoteResultState *resultState, Tuplestorestate *tupleStore)
+{
+	return tupleStore == NULL && resultState->sendRowLimit > 0 &&
+		   resultState->sentRowCount >= resultState->sendRowLimit;
+}
+
+
+/*
+ * StoreRemoteTuple puts the given tuple into the tuplestore if there is one, and
+ * otherwise sends it right away to the destination of the result state.
+ */
+static void
+StoreRemoteTuple(RemoteResultState *resultState, Tuplestorestate *tupleStore,
+				 HeapTuple heapTuple)
+{
+	TupleTableSlot *tupleSlot = resultState->tupleSlot;
+	DestReceiver *destination = resultState->destination;
+
+	if (tupleStore != NULL)
+	{
+		tuplestore_puttuple(tupleStore, heapTuple);
+		return;
+	}
+
+	Assert(destination != NULL && tupleSlot != NULL);
+
+	ExecStoreTuple(heapTuple, tupleSlot, InvalidBuffer, false);
+	(*destination->receiveSlot)(tupleSlot, destination);
+	ExecClearTuple(tupleSlot);
+
+	resultState->sentRowCount++;
+}
+
+
+/*
+ * BinaryFormatSafe returns whether values of the given type may be exchanged
+ * between nodes in binary format. This holds for built-in types whose binary
+ * format depends neither on encodings nor on type OIDs which may differ between
+ * nodes, and for arrays of them. Date and time types additionally depend on
+ * integer_datetimes, which RemoteResultFormat checks.
+ */
+static bool
+BinaryFormatSafe(Oid typeId)
+{
+	Oid elementTypeId = get_element_type(typeId);
+	if (OidIsValid(elementTypeId))
+	{
+		typeId = elementTypeId;
+	}
+
+	switch (typeId)
+	{
+		case BOOLOID:
+		case BYTEAOID:
+		case CHAROID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+		case CASHOID:
+		case DATEOID:
+		case TIMEOID:
+		case TIMETZOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+		case INTERVALOID:
+		case UUIDOID:
+		case INETOID:
+		case CIDROID:
+		case MACADDROID:
+		case BITOID:
+		case VARBITOID:
+		{
+			return true;
+		}
+
+		default:
+		{
+			return false;
+		}
+	}
+}
+
+
+/*
+ * BuildTupleFromBinaryValues builds a tuple from the given row of a result in
+ * binary format, using the receive functions of the columns.
+ */
+static HeapTuple
+BuildTupleFromBinaryValues(RemoteResultState *resultState, PGresult *result,
+						   int rowIndex)
+{
+	TupleDesc tupleDescriptor = resultState->tupleDescriptor;
+	int columnCount = tupleDescriptor->natts;
+	int columnIndex = 0;
+
+	for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+	{
+		if (PQgetisnull(result, rowIndex, columnIndex))
+		{
+			resultState->valueArray[columnIndex] = (Datum) 0;
+			resultState->isNullArray[columnIndex] = true;
+			continue;
+		}
+
+		resultState->valueArray[columnIndex] =
+			ReceiveBinaryValue(resultState, columnIndex,
+							   PQgetvalue(result, rowIndex, columnIndex),
+							   PQgetlength(result, rowIndex, columnIndex));
+		resultState->isNullArray[columnIndex] = false;
+	}
+
+	return heap_form_tuple(tupleDescriptor, resultState->valueArray,
+						   resultState->isNullArray);
+}
+
+
+/*
+ * BuildTupleFromTextValues builds a tuple from the given row of a result in text
+ * format, using the input functions of the columns.
+ */
+static HeapTuple
+BuildTupleFromTextValues(RemoteResultState *resultState, PGresult *result,
+						 int rowIndex)
+{
+	char **columnArray = resultState->columnArray;
+	int columnCount = resultState->tupleDescriptor->natts;
+	int columnIndex = 0;
+
+	for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+	{
+		if (PQgetisnull(result, rowIndex, columnIndex))
+		{
+			columnArray[columnIndex] = NULL;
+		}
+		else
+		{
+			columnArray[columnIndex] = PQgetvalue(result, rowIndex, columnIndex);
+		}
+	}
+
+	return BuildTupleFromCStrings(resultState->attributeInputMetadata, columnArray);
+}
+
+
+/*
+ * BuildTupleFromBinaryCopyRow builds a tuple from a row of a binary COPY stream,
+ * using the receive functions of the columns. The function skips the header of
+ * the stream, and returns NULL for its trailer.
+ */
+static HeapTuple
+BuildTupleFromBinaryCopyRow(RemoteResultState *resultState, char *rowData,
+							int rowLength)
+{
+	static const char copySignature[11] = "PGCOPY\n\377\r\n\0";
+	TupleDesc tupleDescriptor = resultState->tupleDescriptor;
+	int columnCount = tupleDescriptor->natts;
+	int columnIndex = 0;
+	StringInfoData rowBuffer;
+	int16 fieldCount = 0;
+
+	rowBuffer.data = rowData;
+	rowBuffer.len = rowLength;
+	rowBuffer.maxlen = rowLength + 1;
+	rowBuffer.cursor = 0;
+
+	/* a row starts with its field count, which is never as high as the signature */
+	if (rowLength >= (int) sizeof(copySignature) &&
+		memcmp(rowData, copySignature, sizeof(copySignature)) == 0)
+	{
+		int32 headerExtensionLength = 0;
+
+		rowBuffer.cursor = sizeof(copySignature);
+		pq_getmsgint(&rowBuffer, 4);
+		headerExtensionLength = pq_getmsgint(&rowBuffer, 4);
+		pq_getmsgbytes(&rowBuffer, headerExtensionLength);
+
+		if (rowBuffer.cursor == rowBuffer.len)
+		{
+			return NULL;
+		}
+	}
+
+	fieldCount = (int16) pq_getmsgint(&rowBuffer, 2);
+	if (fieldCount == -1)
+	{
+		return NULL;
+	}
+	else if (fieldCount != columnCount)
+	{
+		ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+						errmsg("remote COPY row has %d columns instead of %d",
+							   fieldCount, columnCount)));
+	}
+
+	for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+	{
+		int32 valueLength = (int32) pq_getmsgint(&rowBuffer, 4);
+		char *valueData = NULL;
+
+		if (valueLength == -1)
+		{
+			resultState->valueArray[columnIndex] = (Datum) 0;
+			resultState->isNullArray[columnIndex] = true;
+			continue;
+		}
+
+		valueData = (char *) pq_getmsgbytes(&rowBuffer, valueLength);
+		resultState->valueArray[columnIndex] =
+			ReceiveBinaryValue(resultState, columnIndex, valueData, valueLength);
+		resultState->isNullArray[columnIndex] = false;
+	}
+
+	return heap_form_tuple(tupleDescriptor, resultState->valueArray,
+						   resultState->isNullArray);
+}
+
+
+/*
+ * BuildTupleFromTextCopyRow builds a tuple from a row of a text COPY stream,
+ * using the input functions of the columns. Columns are split at tabs and their
+ * backslash escapes decoded in place, as COPY FROM does.
+ */
+static HeapTuple
+BuildTupleFromTextCopyRow(RemoteResultState *resultState, char *rowData,
+						  int rowLength)
+{
+	char **columnArray = resultState->columnArray;
+	int columnCount = resultState->tupleDescriptor->natts;
+	char *readPointer = rowData;
+	char *endPointer = rowData + rowLength;
+	int columnIndex = 0;
+
+	if (endPointer > rowData && endPointer[-1] == '\n')
+	{
+		endPointer--;
+	}
+
+	for (columnIndex = 0; columnIndex < columnCount; columnIndex++)
+	{
+		char *columnStart = readPointer;
+		char *writePointer = readPointer;
+		bool lastColumn = (columnIndex == columnCount - 1);
+		bool nullColumn = false;
+
+		/* check for the null marker before escapes are decoded in place */
+		if (endPointer - readPointer >= 2 && readPointer[0] == '\\' &&
+			readPointer[1] == 'N' &&
+			(readPointer + 2 == endPointer || readPointer[2] == '\t'))
+		{
+			nullColumn = true;
+		}
+
+		while (readPointer < endPointer && *readPointer != '\t')
+		{
+			char character = *readPointer;
+
+			readPointer++;
+			if (character == '\\' && readPointer < endPointer)
+			{
+				character = (char) DecodeCopyEscape(&readPointer, endPointer);
+			}
+
+			*writePointer = character;
+			writePointer++;
+		}
+
+		if ((readPointer < endPointer) == lastColumn)
+		{
+			break;
+		}
+
+		columnArray[columnIndex] = nullColumn ? NULL : columnStart;
+
+		/* libpq terminates the row data, so the column can always be terminated */
+		*writePointer = '\0';
+		readPointer++;
+	}
+
+	if (columnIndex != columnCount)
+	{
+		ereport(ERROR, (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+						errmsg("remote COPY row does not have %d columns",
+							   columnCount)));
+	}
+
+	return BuildTupleFromCStrings(resultState->attributeInputMetadata, columnArray);
+}
+
+
+/*
+ * ReceiveBinaryValue turns the given binary value into a datum of the column's
+ * type. The byte after the value is set to zero during the call, as receive
+ * functions expect, and restored afterwards.
+ */
+static Datum
+ReceiveBinaryValue(RemoteResultState *resultState, int columnIndex, char *valueData,
+				   int valueLength)
+{
+	Form_pg_attribute attribute = resultState->tupleDescriptor->attrs[columnIndex];
+	char savedCharacter = valueData[valueLength];
+	StringInfoData valueBuffer;
+	Datum value = 0;
+
+	valueData[valueLength] = '\0';
+	valueBuffer.data = valueData;
+	valueBuffer.len = valueLength;
+	valueBuffer.maxlen = valueLength + 1;
+	valueBuffer.cursor = 0;
+
+	value = ReceiveFunctionCall(&resultState->receiveFunctionArray[columnIndex],
+								&valueBuffer, resultState->typeIOParamArray[columnIndex],
+								attribute->atttypmod);
+
+	if (valueBuffer.cursor != valueBuffer.len)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						errmsg("incorrect binary data format in remote result "
+							   "column %d", columnIndex + 1)));
+	}
+
+	valueData[valueLength] = savedCharacter;
+
+	return value;
+}
+
+
+/*
+ * DecodeCopyEscape decodes the backslash escape sequence at the read pointer,
+ * which points just past the backslash, and advances the pointer past it.
+ */
+static int
+DecodeCopyEscape(char **readPointer, char *endPointer)
+{
+	char *escape = *readPointer;
+	char character = *escape;
+	int value = 0;
+	int digitCount = 0;
+
+	escape++;
+	switch (character)
+	{
+		case 'b':
+		{
+			value = '\b';
+			break;
+		}
+
+		case 'f':
+		{
+			value = '\f';
+			break;
+		}
+
+		case 'n':
+		{
+			value = '\n';
+			break;
+		}
+
+		case 'r':
+		{
+			value = '\r';
+			break;
+		}
+
+		case 't':
+		{
+			value = '\t';
+			break;
+		}
+
+		case 'v':
+		{
+			value = '\v';
+			break;
+		}
+
+		case '0': case '1': case '2': case '3':
+		case '4': case '5': case '6': case '7':
+		{
+			value = character - '0';
+			for (digitCount = 1; digitCount < 3 && escape < endPointer &&
+				 *escape >= '0' && *escape <= '7'; digitCount++)
+			{
+				value = (value << 3) + (*escape - '0');
+				escape++;
+			}
+
+			value &= 0377;
+			break;
+		}
+
+		case 'x':
+		{
+			if (escape < endPointer && isxdigit((unsigned char) *escape))
+			{
+				for (digitCount = 0; digitCount < 2 && escape < endPointer &&
+					 isxdigit((unsigned char) *escape); digitCount++)
+				{
+					char digit = *escape;
+					int digitValue = (digit >= 'a') ? digit - 'a' + 10 :
+									 (digit >= 'A') ? digit - 'A' + 10 : digit - '0';
+
+					value = (value << 4) + digitValue;
+					escape++;
+				}
+			}
+			else
+			{
+				value = 'x';
+			}
+
+			break;
+		}
+
+		default:
+		{
+			value = character;
+			break;
+		}
+	}
+
+	*readPointer = escape;
+
+	return value;
+}
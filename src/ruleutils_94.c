@@ -118,6 +118,7 @@ typedef struct
 	int			indentLevel;	/* current indent level for prettyprint */
 	bool		varprefix;		/* TRUE to print prefixes on Vars */
 	int64		shardid;		/* a distributed table's shardid, if positive */
+	List	   *relationShardList;	/* shardids of joined relations, if any */
 } deparse_context;
 
 /*
@@ -324,8 +325,9 @@ static void get_query_def(Query *query, StringInfo buf, List *parentnamespace,
 			  TupleDesc resultDesc,
 			  int prettyFlags, int wrapColumn, int startIndent);
 static void get_shard_query_def(Query *query, StringInfo buf,
-					List *parentnamespace, int64 shardid, TupleDesc resultDesc,
-					int prettyFlags, int wrapColumn, int startIndent);
+					List *parentnamespace, int64 shardid, List *relationShardList,
+					TupleDesc resultDesc, int prettyFlags, int wrapColumn,
+					int startIndent);
 static void get_values_def(List *values_lists, deparse_context *context);
 static void get_with_clause(Query *query, deparse_context *context);
 static void get_select_query_def(Query *query, deparse_context *context,
@@ -388,6 +390,7 @@ static Node *processIndirection(Node *node, deparse_context *context,
 static void printSubscripts(ArrayRef *aref, deparse_context *context);
 static char *get_relation_name(Oid relid);
 static char *generate_shard_name(Oid relid, int64 shardid);
+static int64 relation_shard_id(deparse_context *context, Oid relid);
 static char *generate_function_name(Oid funcid, int nargs,
 					   List *argnames, Oid *argtypes,
 					   bool has_variadic, bool *use_variadic_p);
@@ -1694,7 +1697,24 @@ pop_ancestor_plan(deparse_namespace *dpns, deparse_namespace *save_dpns)
 void
 deparse_shard_query(Query *query, int64 shardid, StringInfo buffer)
 {
-	get_shard_query_def(query, buffer, NIL, shardid, NULL, 0, WRAP_COLUMN_DEFAULT, 0);
+	get_shard_query_def(query, buffer, NIL, shardid, NIL, NULL, 0,
+						WRAP_COLUMN_DEFAULT, 0);
+}
+
+
+/* ----------
+ * deparse_shard_join_query	- Parse back a join query for co-located shards
+ *
+ * Builds an SQL string to perform the provided query on the shards given for
+ * each of its relations in relationShardList, and places this string into the
+ * provided buffer.
+ * ----------
+ */
+void
+deparse_shard_join_query(Query *query, List *relationShardList, StringInfo buffer)
+{
+	get_shard_query_def(query, buffer, NIL, 0, relationShardList, NULL, 0,
+						WRAP_COLUMN_DEFAULT, 0);
 }
 
 
@@ -1710,8 +1730,8 @@ get_query_def(Query *query, StringInfo buf, List *parentnamespace,
 			  TupleDesc resultDesc,
 			  int prettyFlags, int wrapColumn, int startIndent)
 {
-	get_shard_query_def(query, buf, parentnamespace, 0, resultDesc, prettyFlags,
-						wrapColumn, startIndent);
+	get_shard_query_def(query, buf, parentnamespace, 0, NIL, resultDesc,
+						prettyFlags, wrapColumn, startIndent);
 }
 
 
@@ -1719,12 +1739,13 @@ get_query_def(Query *query, StringInfo buf, List *parentnamespace,
  * get_shard_query_def		- Parse back one query parsetree for a given shard
  *
  * If shardid is positive, it is appended to the query's "main" relation name so
- * that the query may be executed on a placement for the given shard.
+ * that the query may be executed on a placement for the given shard. Relations
+ * listed in relationShardList instead get the shardid given for them there.
  * ----------
  */
 static void
 get_shard_query_def(Query *query, StringInfo buf, List *parentnamespace,
-					int64 shardid, TupleDesc resultDesc,
+					int64 shardid, List *relationShardList, TupleDesc resultDesc,
 					int prettyFlags, int wrapColumn, int startIndent)
 {
 	deparse_context context;
@@ -1755,6 +1776,7 @@ get_shard_query_def(Query *query, StringInfo buf, List *parentnamespace,
 	context.wrapColumn = wrapColumn;
 	context.indentLevel = startIndent;
 	context.shardid = shardid;
+	context.relationShardList = relationShardList;
 
 	set_deparse_for_query(&dpns, query, parentnamespace);
 
@@ -2719,7 +2741,7 @@ get_insert_query_def(Query *query, deparse_context *context)
 		appendStringInfoChar(buf, ' ');
 	}
 	appendStringInfo(buf, "INSERT INTO %s ",
-					 generate_shard_name(rte->relid, context->shardid));
+					 generate_shard_name(rte->relid, relation_shard_id(context, rte->relid)));
 
 	/*
 	 * Add the insert-column-names list.  To handle indirection properly, we
@@ -2839,7 +2861,7 @@ get_update_query_def(Query *query, deparse_context *context)
 	}
 	appendStringInfo(buf, "UPDATE %s%s",
 					 only_marker(rte),
-					 generate_shard_name(rte->relid, context->shardid));
+					 generate_shard_name(rte->relid, relation_shard_id(context, rte->relid)));
 	if (rte->alias != NULL)
 		appendStringInfo(buf, " %s",
 						 quote_identifier(rte->alias->aliasname));
@@ -2923,7 +2945,7 @@ get_delete_query_def(Query *query, deparse_context *context)
 	}
 	appendStringInfo(buf, "DELETE FROM %s%s",
 					 only_marker(rte),
-					 generate_shard_name(rte->relid, context->shardid));
+					 generate_shard_name(rte->relid, relation_shard_id(context, rte->relid)));
 	if (rte->alias != NULL)
 		appendStringInfo(buf, " %s",
 						 quote_identifier(rte->alias->aliasname));
@@ -5867,7 +5889,7 @@ get_from_clause_item(Node *jtnode, Query *query, deparse_context *context)
 				/* Normal relation RTE */
 				appendStringInfo(buf, "%s%s",
 								 only_marker(rte),
-								 generate_shard_name(rte->relid, context->shardid));
+								 generate_shard_name(rte->relid, relation_shard_id(context, rte->relid)));
 				break;
 			case RTE_SUBQUERY:
 				/* Subquery RTE */
@@ -6007,6 +6029,10 @@ get_from_clause_item(Node *jtnode, Query *query, deparse_context *context)
 			 */
 			if (strcmp(refname, get_relation_name(rte->relid)) != 0)
 				printalias = true;
+
+			/* joined shards have other names than their relations */
+			if (context->relationShardList != NIL)
+				printalias = true;
 		}
 		else if (rte->rtekind == RTE_FUNCTION)
 		{
@@ -6378,6 +6404,29 @@ generate_shard_name(Oid relid, int64 shardid)
 	return relname;
 }
 
+/*
+ * relation_shard_id
+ *		Return the shardid whose suffix the name of the given relation takes
+ *
+ * Relations of a join between co-located shards are looked up in the context's
+ * relationShardList; all other relations take the context's shardid.
+ */
+static int64
+relation_shard_id(deparse_context *context, Oid relid)
+{
+	ListCell   *lc;
+
+	foreach(lc, context->relationShardList)
+	{
+		RelationShard *relationShard = (RelationShard *) lfirst(lc);
+
+		if (relationShard->relationId == relid)
+			return relationShard->shardId;
+	}
+
+	return context->shardid;
+}
+
 /*
  * generate_function_name
  *		Compute the name to display for a function specified by OID,
@@ -0,0 +1,385 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/shard_router.c
+ *
+ * This file contains functions to route partition column values to the shards
+ * of a distributed table. Routing runs once per row in COPY, so hashes of the
+ * common partition column types are computed without the function manager and
+ * evenly split hash spaces are divided up without a division.
+ *
+ * Copyright (c) 2014-2015, Citus Data, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "c.h"
+#include "fmgr.h"
+
+#include "create_shards.h"
+#include "distribution_metadata.h"
+#include "shard_router.h"
+
+#include <stddef.h>
+
+#include "access/hash.h"
+#include "catalog/pg_collation.h"
+#include "catalog/pg_type.h"
+#include "nodes/pg_list.h"
+#include "nodes/primnodes.h"
+#include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/palloc.h"
+#include "utils/uuid.h"
+
+
+/* local function forward declarations */
+static PartitionHashKind PartitionHashKindForFunction(Oid hashFunctionId);
+static inline int32 HashValue(PartitionHashKind hashKind, FmgrInfo *hashFunction,
+							  Datum partitionValue);
+static inline int32 HashInt8Value(int64 value);
+static inline int HashTokenShardIndex(ShardRouter *router, int32 hashValue);
+static int SearchShardIndex(ShardRouter *router, Datum partitionValue);
+
+
+/*
+ * CreateShardRouter creates a router for the shards of a table from its cached
+ * metadata, which already holds the shard intervals sorted by their minimum
+ * values along with the functions to hash and compare values. Positions
+ * returned by the router refer to the router's shardIntervalArray, which is the
+ * cache entry's sorted array.
+ */
+ShardRouter *
+CreateShardRouter(DistributedTableCacheEntry *cacheEntry)
+{
+	ShardRouter *router = palloc0(sizeof(ShardRouter));
+
+	Assert(cacheEntry->shardIntervalCount > 0);
+
+	router->partitionType = cacheEntry->partitionType;
+	router->shardCount = cacheEntry->shardIntervalCount;
+	router->shardIntervalArray = cacheEntry->sortedShardIntervalArray;
+	router->compareFunction = cacheEntry->shardIntervalCompareFunction;
+	router->useBinarySearch = !cacheEntry->hasUniformHashDistribution;
+
+	if (router->partitionType == HASH_PARTITION_TYPE)
+	{
+		router->hashFunction = cacheEntry->hashFunction;
+		router->hashKind = PartitionHashKindForFunction(router->hashFunction->fn_oid);
+		router->hashTokenIncrement = HASH_TOKEN_COUNT / router->shardCount;
+		router->hashTokenReciprocal = HASH_TOKEN_COUNT / router->hashTokenIncrement;
+	}
+
+	return router;
+}
+
+
+/*
+ * ShardRouterRoute returns the position of the shard interval containing the
+ * given partition value, or -1 if no shard interval contains it.
+ */
+int
+ShardRouterRoute(ShardRouter *router, Datum partitionValue)
+{
+	int shardIndex = 0;
+
+	ShardRouterRouteBatch(router, &partitionValue, 1, &shardIndex);
+
+	return shardIndex;
+}
+
+
+/*
+ * ShardRouterRouteBatch routes an array of partition values at once and stores
+ * the position of each value's shard interval, or -1 if there is none, in the
+ * shard index array. The dispatch on the hash function and routing method is
+ * done once per batch, which leaves tight loops over the values.
+ */
+void
+ShardRouterRouteBatch(ShardRouter *router, Datum *partitionValues, int valueCount,
+					  int *shardIndexArray)
+{
+	int valueIndex = 0;
+
+	if (router->partitionType != HASH_PARTITION_TYPE)
+	{
+		for (valueIndex = 0; valueIndex < valueCount; valueIndex++)
+		{
+			shardIndexArray[valueIndex] = SearchShardIndex(router,
+														   partitionValues[valueIndex]);
+		}
+
+		return;
+	}
+
+	/* first store the hash values in the output array ... */
+	switch (router->hashKind)
+	{
+		case PARTITION_HASH_INT4:
+		{
+			for (valueIndex = 0; valueIndex < valueCount; valueIndex++)
+			{
+				shardIndexArray[valueIndex] =
+					HashValue(PARTITION_HASH_INT4, NULL, partitionValues[valueIndex]);
+			}
+			break;
+		}
+
+		case PARTITION_HASH_INT8:
+		{
+			for (valueIndex = 0; valueIndex < valueCount; valueIndex++)
+			{
+				shardIndexArray[valueIndex] =
+					HashValue(PARTITION_HASH_INT8, NULL, partitionValues[valueIndex]);
+			}
+			break;
+		}
+
+		case PARTITION_HASH_TEXT:
+		{
+			for (valueIndex = 0; valueIndex < valueCount; valueIndex++)
+			{
+				shardIndexArray[valueIndex] =
+					HashValue(PARTITION_HASH_TEXT, NULL, partitionValues[valueIndex]);
+			}
+			break;
+		}
+
+		case PARTITION_HASH_UUID:
+		{
+			for (valueIndex = 0; valueIndex < valueCount; valueIndex++)
+			{
+				shardIndexArray[valueIndex] =
+					HashValue(PARTITION_HASH_UUID, NULL, partitionValues[valueIndex]);
+			}
+			break;
+		}
+
+		default:
+		{
+			for (valueIndex = 0; valueIndex < valueCount; valueIndex++)
+			{
+				shardIndexArray[valueIndex] = HashValue(PARTITION_HASH_FMGR,
+														router->hashFunction,
+														partitionValues[valueIndex]);
+			}
+			break;
+		}
+	}
+
+	/* ... then replace them with the positions of their shards */
+	if (router->useBinarySearch)
+	{
+		for (valueIndex = 0; valueIndex < valueCount; valueIndex++)
+		{
+			Datum hashedValue = Int32GetDatum(shardIndexArray[valueIndex]);
+			shardIndexArray[valueIndex] = SearchShardIndex(router, hashedValue);
+		}
+	}
+	else
+	{
+		for (valueIndex = 0; valueIndex < valueCount; valueIndex++)
+		{
+			shardIndexArray[valueIndex] = HashTokenShardIndex(router,
+															  shardIndexArray[valueIndex]);
+		}
+	}
+}
+
+
+/*
+ * HashPartitionValue hashes a single partition value with the given hash
+ * function, running the code of common built-in hash functions directly.
+ */
+int32
+HashPartitionValue(FmgrInfo *hashFunction, Datum partitionValue)
+{
+	PartitionHashKind hashKind = PartitionHashKindForFunction(hashFunction->fn_oid);
+
+	return HashValue(hashKind, hashFunction, partitionValue);
+}
+
+
+/*
+ * PartitionHashKindForFunction returns the kind of hash code the router can run
+ * in place of the given hash function, or PARTITION_HASH_FMGR if the function
+ * has to be called.
+ */
+static PartitionHashKind
+PartitionHashKindForFunction(Oid hashFunctionId)
+{
+	switch (hashFunctionId)
+	{
+		case F_HASHINT4:
+		{
+			return PARTITION_HASH_INT4;
+		}
+
+		case F_HASHINT8:
+		{
+			return PARTITION_HASH_INT8;
+		}
+
+		case F_HASHTEXT:
+		{
+			return PARTITION_HASH_TEXT;
+		}
+
+		case F_UUID_HASH:
+		{
+			return PARTITION_HASH_UUID;
+		}
+
+		default:
+		{
+			return PARTITION_HASH_FMGR;
+		}
+	}
+}
+
+
+/*
+ * HashValue computes the same hash value as hashint4, hashint8, hashtext and
+ * uuid_hash for the corresponding hash kinds, and calls the hash function for
+ * any other partition column type.
+ */
+static inline int32
+HashValue(PartitionHashKind hashKind, FmgrInfo *hashFunction, Datum partitionValue)
+{
+	switch (hashKind)
+	{
+		case PARTITION_HASH_INT4:
+		{
+			return DatumGetInt32(hash_uint32((uint32) DatumGetInt32(partitionValue)));
+		}
+
+		case PARTITION_HASH_INT8:
+		{
+			return HashInt8Value(DatumGetInt64(partitionValue));
+		}
+
+		case PARTITION_HASH_TEXT:
+		{
+			text *textValue = DatumGetTextPP(partitionValue);
+			return DatumGetInt32(hash_any((unsigned char *) VARDATA_ANY(textValue),
+										  VARSIZE_ANY_EXHDR(textValue)));
+		}
+
+		case PARTITION_HASH_UUID:
+		{
+			pg_uuid_t *uuidValue = DatumGetUUIDP(partitionValue);
+			return DatumGetInt32(hash_any(uuidValue->data, UUID_LEN));
+		}
+
+		default:
+		{
+			return DatumGetInt32(FunctionCall1(hashFunction, partitionValue));
+		}
+	}
+}
+
+
+/*
+ * HashInt8Value mirrors hashint8, which folds the high half of the value into
+ * the low half so that int8 values within the int4 range hash like int4 values.
+ */
+static inline int32
+HashInt8Value(int64 value)
+{
+	uint32 lowHalf = (uint32) value;
+	uint32 highHalf = (uint32) (value >> 32);
+
+	lowHalf ^= (value >= 0) ? highHalf : ~highHalf;
+
+	return DatumGetInt32(hash_uint32(lowHalf));
+}
+
+
+/*
+ * HashTokenShardIndex returns the position of the shard whose part of an evenly
+ * split hash space contains the given hash value. The division by the tokens
+ * per shard is done by multiplying with its reciprocal, which is rounded down
+ * and may leave the quotient one too small; a single correction step fixes
+ * that. Since the token count per shard is rounded down as well, the last
+ * shard also covers the remaining tokens at the end of the hash space, so the
+ * position is capped at the last shard.
+ */
+static inline int
+HashTokenShardIndex(ShardRouter *router, int32 hashValue)
+{
+	uint64 hashToken = (uint64) ((uint32) hashValue - (uint32) INT32_MIN);
+	uint64 shardIndex = (hashToken * router->hashTokenReciprocal) >> 32;
+
+	if (hashToken - (shardIndex * router->hashTokenIncrement) >=
+		router->hashTokenIncrement)
+	{
+		shardIndex++;
+	}
+
+	if (shardIndex >= (uint64) router->shardCount)
+	{
+		shardIndex = router->shardCount - 1;
+	}
+
+	return (int) shardIndex;
+}
+
+
+/*
+ * SearchShardIndex finds the shard interval containing the given value, or the
+ * hash value for hash partitioned tables, by binary search over the shard
+ * intervals sorted by their minimum values. The function returns the position
+ * of the shard interval, or -1 if there is none.
+ */
+static int
+SearchShardIndex(ShardRouter *router, Datum partitionValue)
+{
+	ShardInterval **shardIntervalArray = router->shardIntervalArray;
+	FmgrInfo *compareFunction = router->compareFunction;
+	int lowerBoundIndex = 0;
+	int upperBoundIndex = router->shardCount;
+
+	while (lowerBoundIndex < upperBoundIndex)
+	{
+		int middleIndex = (lowerBoundIndex + upperBoundIndex) >> 1;
+		if (DatumGetInt32(FunctionCall2Coll(compareFunction,
+											DEFAULT_COLLATION_OID,
+											partitionValue,
+											shardIntervalArray[middleIndex]->minValue)) < 0)
+		{
+			upperBoundIndex = middleIndex;
+		}
+		else if (DatumGetInt32(FunctionCall2Coll(compareFunction,
+												 DEFAULT_COLLATION_OID,
+												 partitionValue,
+												 shardIntervalArray[middleIndex]->maxValue)) <= 0)
+		{
+			return middleIndex;
+		}
+		else
+		{
+			lowerBoundIndex = middleIndex + 1;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * CompareShardIntervalsByMinValue orders pointers to shard intervals by their
+ * minimum values, which the given comparison function compares. It is meant to
+ * be passed to qsort_arg.
+ */
+int
+CompareShardIntervalsByMinValue(const void *leftElement, const void *rightElement,
+								void *comparator)
+{
+	Datum leftValue = (*(ShardInterval **) leftElement)->minValue;
+	Datum rightValue = (*(ShardInterval **) rightElement)->minValue;
+	FmgrInfo *compareFunction = (FmgrInfo *) comparator;
+	Datum comparisonResult = FunctionCall2Coll(compareFunction, DEFAULT_COLLATION_OID,
+											   leftValue, rightValue);
+
+	return DatumGetInt32(comparisonResult);
+}
@@ -22,6 +22,21 @@ CREATE FUNCTION prune_using_both_values(regclass, text, text)
 	AS 'pg_shard'
 	LANGUAGE C STRICT;
 
+CREATE FUNCTION prune_using_any_value(regclass, text[])
+	RETURNS text[]
+	AS 'pg_shard'
+	LANGUAGE C STRICT;
+
+CREATE FUNCTION prune_using_comparison(regclass, text, text)
+	RETURNS text[]
+	AS 'pg_shard'
+	LANGUAGE C STRICT;
+
+CREATE FUNCTION prune_uncached_using_single_value(regclass, text)
+	RETURNS text[]
+	AS 'pg_shard'
+	LANGUAGE C;
+
 CREATE FUNCTION debug_equality_expression(regclass)
 	RETURNS cstring
 	AS 'pg_shard'
@@ -64,5 +79,113 @@ SELECT prune_using_both_values('pruning', 'tomato', 'petunia');
 -- but if both values are on the same shard, should get back that shard
 SELECT prune_using_both_values('pruning', 'tomato', 'rose');
 
+-- an IN clause returns the shards holding any of its values
+SELECT prune_using_any_value('pruning', ARRAY['tomato', 'petunia']);
+
+-- values on the same shard only return that shard, and nulls are ignored
+SELECT prune_using_any_value('pruning', ARRAY['tomato', 'rose', NULL]);
+
+-- pruning without the shard cache refutes each shard, with the same result
+SELECT prune_uncached_using_single_value('pruning', 'tomato');
+
+-- and maps nulls to the same shard
+SELECT prune_uncached_using_single_value('pruning', NULL);
+
+-- shards which split the hash space evenly let pruning compute a value's shard
+CREATE TABLE even_pruning ( species text, last_pruned date, plant_id integer );
+
+INSERT INTO pgs_distribution_metadata.partition (relation_id, partition_method, key)
+VALUES
+	('even_pruning'::regclass, 'h', 'species');
+
+INSERT INTO pgs_distribution_metadata.shard
+	(id, relation_id, storage, min_value, max_value)
+VALUES
+	(20, 'even_pruning'::regclass, 't', '-2147483648', '-1073741825'),
+	(21, 'even_pruning'::regclass, 't', '-1073741824', '-1'),
+	(22, 'even_pruning'::regclass, 't', '0', '1073741823'),
+	(23, 'even_pruning'::regclass, 't', '1073741824', '2147483647');
+
+-- values hashing to the first and last shards
+SELECT prune_using_single_value('even_pruning', 'sage');
+
+SELECT prune_using_single_value('even_pruning', 'tulip');
+
+-- and to those in between, with nulls hashing to zero
+SELECT prune_using_single_value('even_pruning', 'petunia');
+
+SELECT prune_using_single_value('even_pruning', NULL);
+
+-- an IN clause computes the shard of each of its values
+SELECT prune_using_any_value('even_pruning', ARRAY['sage', 'tomato', 'tulip']);
+
+-- range partitioned tables are pruned by searching their shard bounds
+CREATE TABLE range_pruning ( species text, last_pruned date, plant_id integer );
+
+INSERT INTO pgs_distribution_metadata.partition (relation_id, partition_method, key)
+VALUES
+	('range_pruning'::regclass, 'r', 'species');
+
+INSERT INTO pgs_distribution_metadata.shard
+	(id, relation_id, storage, min_value, max_value)
+VALUES
+	(30, 'range_pruning'::regclass, 't', 'aster', 'daisy'),
+	(31, 'range_pruning'::regclass, 't', 'fern', 'lilac'),
+	(32, 'range_pruning'::regclass, 't', 'mint', 'rose'),
+	(33, 'range_pruning'::regclass, 't', 'sage', 'tulip');
+
+-- equality finds the shard containing a value
+SELECT prune_using_comparison('range_pruning', '=', 'iris');
+
+SELECT prune_using_comparison('range_pruning', '=', 'rose');
+
+-- but no shard for values between shards or outside all of them
+SELECT prune_using_comparison('range_pruning', '=', 'dill');
+
+SELECT prune_using_comparison('range_pruning', '=', 'zinnia');
+
+-- upper bounds keep the shards starting below them
+SELECT prune_using_comparison('range_pruning', '<', 'mint');
+
+SELECT prune_using_comparison('range_pruning', '<=', 'mint');
+
+SELECT prune_using_comparison('range_pruning', '<', 'aster');
+
+SELECT prune_using_comparison('range_pruning', '<=', 'zinnia');
+
+-- lower bounds keep the shards ending above them
+SELECT prune_using_comparison('range_pruning', '>', 'rose');
+
+SELECT prune_using_comparison('range_pruning', '>=', 'rose');
+
+SELECT prune_using_comparison('range_pruning', '>', 'tulip');
+
+SELECT prune_using_comparison('range_pruning', '>=', 'acacia');
+
+-- an IN clause keeps the shards holding any of its values
+SELECT prune_using_any_value('range_pruning', ARRAY['iris', 'dill', 'thyme']);
+
+-- overlapping shards cannot be searched, so they fall back to refutation
+CREATE TABLE overlap_pruning ( species text, last_pruned date, plant_id integer );
+
+INSERT INTO pgs_distribution_metadata.partition (relation_id, partition_method, key)
+VALUES
+	('overlap_pruning'::regclass, 'a', 'species');
+
+INSERT INTO pgs_distribution_metadata.shard
+	(id, relation_id, storage, min_value, max_value)
+VALUES
+	(40, 'overlap_pruning'::regclass, 't', 'aster', 'lilac'),
+	(41, 'overlap_pruning'::regclass, 't', 'fern', 'rose');
+
+-- values in both shards return both
+SELECT prune_using_comparison('overlap_pruning', '=', 'iris');
+
+SELECT prune_using_comparison('overlap_pruning', '=', 'daisy');
+
+SELECT prune_using_comparison('overlap_pruning', '>', 'lilac');
+
+SELECT prune_using_comparison('overlap_pruning', '<', 'aster');
+
 -- unit test of the equality expression generation code
 SELECT debug_equality_expression('pruning');
@@ -46,6 +46,14 @@ INSERT INTO limit_orders VALUES (430, upper('ibm'), 214, timestamp '2003-01-28 1
 								 interval '5 hours', 'buy', sqrt(2));
 SELECT COUNT(*) FROM limit_orders WHERE id = 430;
 
+-- prepared INSERTs are routed using the values of each execution
+PREPARE prepared_insert (bigint, text) AS
+	INSERT INTO limit_orders VALUES ($1, $2, 9580, '2004-10-19 10:23:54', 'buy', 20.69);
+EXECUTE prepared_insert(22037, 'GOOG');
+EXECUTE prepared_insert(22038, 'YHOO');
+SELECT id, symbol FROM limit_orders WHERE id = 22037 OR id = 22038 ORDER BY id;
+DEALLOCATE prepared_insert;
+
 -- INSERT without partition key
 INSERT INTO limit_orders DEFAULT VALUES;
 
@@ -134,10 +134,10 @@ FROM articles, (SELECT id, word_count FROM articles) AS test WHERE test.id = art
 SELECT a.title AS name, (SELECT a2.id FROM authors a2 WHERE a.id = a2.id  LIMIT 1)
 						 AS special_price FROM articles a;
 
--- joins are not supported in WHERE clause
+-- joins with local tables are not supported in WHERE clause
 SELECT title, authors.name FROM authors, articles WHERE authors.id = articles.author_id;
 
--- joins are not supported in FROM clause
+-- joins with local tables are not supported in FROM clause
 SELECT * FROM  (articles INNER JOIN authors ON articles.id = authors.id);
 
 -- with normal PostgreSQL, expect error about CitusDB being missing
@@ -154,16 +154,49 @@ DO $sharded_execute$
 	END
 $sharded_execute$;
 
--- test use of bare SQL within plpgsql
+-- test use of bare SQL within plpgsql, whose plans are cached across iterations
 DO $sharded_sql$
+	DECLARE
+		article_count bigint := 0;
+		author_article_count bigint;
 	BEGIN
-		SELECT COUNT(*) FROM articles WHERE author_id = 1 AND author_id = 2;
+		FOR author IN 1..10 LOOP
+			SELECT COUNT(*) INTO author_article_count FROM articles
+			WHERE author_id = author;
+
+			article_count := article_count + author_article_count;
+		END LOOP;
+
+		RAISE NOTICE 'counted % articles', article_count;
 	END
 $sharded_sql$;
 
+-- test prepared statements, which are planned with each execution's values
+PREPARE author_articles (bigint) AS
+	SELECT COUNT(*) FROM articles WHERE author_id = $1;
+EXECUTE author_articles(1);
+EXECUTE author_articles(2);
+
+PREPARE authors_articles (bigint, bigint) AS
+	SELECT COUNT(*) FROM articles WHERE author_id IN ($1, $2);
+EXECUTE authors_articles(1, 2);
+
+DEALLOCATE author_articles;
+DEALLOCATE authors_articles;
+
 -- test cross-shard queries
 SELECT COUNT(*) FROM articles;
 
+-- run cross-shard queries over a single connection per node
+SET pg_shard.executor_connections_per_node TO 1;
+SELECT COUNT(*) FROM articles;
+RESET pg_shard.executor_connections_per_node;
+
+-- unsorted cross-shard rows keep the order of the shards over several connections
+SET pg_shard.executor_connections_per_node TO 2;
+SELECT id, author_id, word_count FROM articles WHERE word_count > 17000;
+RESET pg_shard.executor_connections_per_node;
+
 -- try query with more SQL features
 SELECT author_id, sum(word_count) AS corpus_size FROM articles
 	GROUP BY author_id
@@ -171,6 +204,153 @@ SELECT author_id, sum(word_count) AS corpus_size FROM articles
 	ORDER BY sum(word_count) DESC
 	LIMIT 5;
 
+-- aggregates are computed partially on the shards and combined locally
+SELECT author_id, count(*), round(avg(word_count), 2) AS average_words,
+	   min(title), max(word_count), bool_and(word_count > 2000)
+	FROM articles
+	GROUP BY author_id
+	ORDER BY author_id
+	LIMIT 5;
+
+-- ORDER BY and LIMIT are pushed down, and the sorted shard results merged
+SELECT id, word_count FROM articles ORDER BY word_count DESC LIMIT 3 OFFSET 1;
+
+-- but not when set returning functions may drop rows before the limit applies
+SELECT id, generate_series(1, word_count / 15000) AS part FROM articles
+	ORDER BY id LIMIT 3;
+
+-- fetch results in binary format, except for queries with text columns
+SET pg_shard.use_binary_results TO on;
+SELECT author_id, count(*), round(avg(word_count), 2) AS average_words
+	FROM articles
+	GROUP BY author_id
+	ORDER BY author_id
+	LIMIT 2;
+SELECT id, title, word_count FROM articles WHERE author_id = 1 ORDER BY id LIMIT 2;
+RESET pg_shard.use_binary_results;
+
+-- fetch results through COPY, in text and in binary format
+SET pg_shard.use_copy_fetch TO on;
+SELECT id, title, word_count FROM articles WHERE author_id = 1 ORDER BY id LIMIT 2;
+SELECT id, word_count FROM articles ORDER BY word_count DESC LIMIT 3 OFFSET 1;
+SET pg_shard.use_binary_results TO on;
+SELECT author_id, count(*), round(avg(word_count), 2) AS average_words
+	FROM articles
+	GROUP BY author_id
+	ORDER BY author_id
+	LIMIT 2;
+RESET pg_shard.use_binary_results;
+RESET pg_shard.use_copy_fetch;
+
+-- COPY escapes and null markers in fetched values are decoded
+CREATE TABLE copy_fetch_values ( id bigint, value text, note text );
+SELECT master_create_distributed_table('copy_fetch_values', 'id');
+\set VERBOSITY terse
+SELECT master_create_worker_shards('copy_fetch_values', 2, 1);
+\set VERBOSITY default
+
+INSERT INTO copy_fetch_values VALUES (1, E'tab\there', 'tab');
+INSERT INTO copy_fetch_values VALUES (2, E'new\nline', 'newline');
+INSERT INTO copy_fetch_values VALUES (3, E'back\\slash', 'backslash');
+INSERT INTO copy_fetch_values VALUES (4, E'\\N', 'null marker');
+INSERT INTO copy_fetch_values VALUES (5, NULL, 'null');
+INSERT INTO copy_fetch_values VALUES (6, 'last', NULL);
+
+SET pg_shard.use_copy_fetch TO on;
+SELECT id, encode(convert_to(value, 'UTF8'), 'escape') AS value,
+	   value IS NULL AS is_null, note
+	FROM copy_fetch_values
+	ORDER BY id;
+RESET pg_shard.use_copy_fetch;
+
+-- cursors fetch rows of a single shard in portions, and scroll over local plans
+BEGIN;
+DECLARE single_shard_cursor CURSOR FOR
+	SELECT id, title FROM articles WHERE author_id = 1 ORDER BY id;
+FETCH 2 FROM single_shard_cursor;
+FETCH ALL FROM single_shard_cursor;
+CLOSE single_shard_cursor;
+DECLARE scroll_cursor SCROLL CURSOR FOR
+	SELECT id FROM articles WHERE author_id = 1 ORDER BY id;
+FETCH LAST FROM scroll_cursor;
+FETCH BACKWARD 2 FROM scroll_cursor;
+DECLARE multi_shard_cursor CURSOR FOR
+	SELECT id, word_count FROM articles ORDER BY word_count DESC LIMIT 4;
+FETCH 3 FROM multi_shard_cursor;
+FETCH 3 FROM multi_shard_cursor;
+COMMIT;
+
+-- joins between co-located tables are pushed down to the shards
+CREATE TABLE article_authors (
+	author_id bigint NOT NULL,
+	name text NOT NULL
+);
+SELECT master_create_distributed_table('article_authors', 'author_id');
+\set VERBOSITY terse
+SELECT master_create_worker_shards('article_authors', 2, 1);
+\set VERBOSITY default
+
+INSERT INTO article_authors VALUES (1, 'alice');
+INSERT INTO article_authors VALUES (2, 'bob');
+INSERT INTO article_authors VALUES (3, 'carol');
+INSERT INTO article_authors VALUES (8, 'dave');
+
+SELECT title, name FROM articles a JOIN article_authors w ON a.author_id = w.author_id
+	WHERE a.author_id = 1
+	ORDER BY a.id;
+
+SELECT name, count(*), sum(word_count)
+	FROM articles, article_authors
+	WHERE articles.author_id = article_authors.author_id
+	GROUP BY name
+	ORDER BY name;
+
+SELECT author_id, name FROM articles LEFT JOIN article_authors USING (author_id)
+	WHERE id < 11
+	ORDER BY author_id;
+
+SELECT count(*) FROM articles a LEFT JOIN article_authors w ON a.author_id = w.author_id
+	WHERE w.author_id IS NULL;
+
+-- joins must equate the partition columns
+SELECT count(*) FROM articles a JOIN article_authors w ON a.id = w.author_id;
+
+-- joined tables must be partitioned alike
+CREATE TABLE article_tags ( article_id bigint, tag text );
+SELECT master_create_distributed_table('article_tags', 'tag');
+SELECT count(*) FROM articles a JOIN article_tags t ON a.title = t.tag;
+
+-- reference tables are replicated to all nodes and join with any table
+CREATE TABLE word_classes (
+	min_words integer NOT NULL,
+	max_words integer NOT NULL,
+	class text NOT NULL
+);
+\set VERBOSITY terse
+SELECT master_create_reference_table('word_classes');
+\set VERBOSITY default
+
+INSERT INTO word_classes VALUES (1, 999, 'short');
+INSERT INTO word_classes VALUES (1000, 9999, 'medium');
+INSERT INTO word_classes VALUES (10000, 99999, 'long');
+UPDATE word_classes SET class = 'brief' WHERE class = 'short';
+
+SELECT * FROM word_classes ORDER BY min_words;
+
+SELECT id, class FROM articles JOIN word_classes
+	ON word_count BETWEEN min_words AND max_words
+	WHERE author_id = 1
+	ORDER BY id;
+
+SELECT class, count(*) FROM articles, word_classes
+	WHERE word_count BETWEEN min_words AND max_words
+	GROUP BY class
+	ORDER BY class;
+
+-- reference tables may not keep their rows in outer joins with distributed tables
+SELECT count(*) FROM word_classes LEFT JOIN articles
+	ON word_count BETWEEN min_words AND max_words;
+
 -- cross-shard queries on a foreign table should fail
 -- we'll just point the article shards to a foreign table
 BEGIN;
@@ -196,9 +376,34 @@ SET client_min_messages = log;
 
 SELECT count(*) FROM articles WHERE word_count > 10000;
 
+-- single-shard statements are planned without the local planner
+SELECT title FROM articles WHERE author_id = 7 AND id = 7;
+
+-- IN lists are split up among the shards holding their values
+SELECT count(*) FROM articles WHERE author_id IN (1, 2, 3, 6);
+SELECT count(*) FROM articles WHERE author_id IN (7, 8);
+
+-- prepared statements send the values bound at execution to the shard
+PREPARE titled_article (bigint, bigint) AS
+	SELECT title FROM articles WHERE author_id = $1 AND id = $2;
+EXECUTE titled_article(7, 7);
+DEALLOCATE titled_article;
+
 SET client_min_messages = DEFAULT;
 SET pg_shard.log_distributed_statements = DEFAULT;
 
+-- statements on a single shard are routed to it without the local planner
+SET client_min_messages = debug2;
+SELECT title FROM articles WHERE author_id = 7 AND id = 7;
+INSERT INTO articles VALUES (51, 7, 'antiphony', 3020);
+UPDATE articles SET word_count = 3021 WHERE author_id = 7 AND id = 51;
+SELECT title, word_count FROM articles WHERE author_id = 7 AND id = 51;
+DELETE FROM articles WHERE author_id = 7 AND id = 51;
+
+-- while statements on several shards take the full planning logic
+SELECT count(*) FROM articles WHERE author_id IN (1, 2);
+SET client_min_messages = DEFAULT;
+
 -- use HAVING without its variable in target list
 SELECT author_id FROM articles
 	GROUP BY author_id
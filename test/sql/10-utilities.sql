@@ -5,11 +5,18 @@
 CREATE TABLE sharded_table ( name text, id bigint );
 SELECT master_create_distributed_table('sharded_table', 'id');
 
--- cursors may not involve distributed tables
+-- cursors are planned like other selects, so they need shards
+BEGIN;
 DECLARE all_sharded_rows CURSOR FOR SELECT * FROM sharded_table;
+ROLLBACK;
 
 -- EXPLAIN support isn't implemented
 EXPLAIN SELECT * FROM sharded_table;
 
--- PREPARE support isn't implemented
+-- prepared statements are planned when executed, which needs shards
 PREPARE sharded_query (bigint) AS SELECT * FROM sharded_table WHERE id = $1;
+EXECUTE sharded_query(1);
+
+-- nor can prepared statements be explained
+EXPLAIN EXECUTE sharded_query(1);
+DEALLOCATE sharded_query;
@@ -26,17 +26,28 @@
 #include "access/skey.h"
 #endif
 #include "catalog/pg_type.h"
+#include "nodes/makefuncs.h"
 #include "nodes/pg_list.h"
 #include "nodes/primnodes.h"
 #include "nodes/nodes.h"
 #include "optimizer/clauses.h"
 #include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/elog.h"
+#include "utils/errcodes.h"
 #include "utils/palloc.h"
 
 
 /* local function forward declarations */
 static Expr * MakeTextPartitionExpression(Oid distributedTableId, text *value);
+static Expr * MakeTextComparisonExpression(Oid distributedTableId, int16 strategyNumber,
+										   text *value);
+static int16 ComparisonStrategyNumber(char *operatorName);
+static Expr * MakeTextArrayPartitionExpression(Oid distributedTableId,
+											   ArrayType *valueArray);
 static ArrayType * PrunedShardIdsForTable(Oid distributedTableId, List *whereClauseList);
+static ArrayType * PrunedShardIdsForList(Oid distributedTableId, List *whereClauseList,
+										 List *shardList);
 
 
 /* declarations for dynamic loading */
@@ -44,6 +55,9 @@ PG_FUNCTION_INFO_V1(prune_using_no_values);
 PG_FUNCTION_INFO_V1(prune_using_single_value);
 PG_FUNCTION_INFO_V1(prune_using_either_value);
 PG_FUNCTION_INFO_V1(prune_using_both_values);
+PG_FUNCTION_INFO_V1(prune_using_any_value);
+PG_FUNCTION_INFO_V1(prune_using_comparison);
+PG_FUNCTION_INFO_V1(prune_uncached_using_single_value);
 PG_FUNCTION_INFO_V1(debug_equality_expression);
 
 
@@ -123,6 +137,69 @@ prune_using_both_values(PG_FUNCTION_ARGS)
 }
 
 
+/*
+ * prune_using_any_value returns the shards for the specified distributed table
+ * after pruning using any of the values in an array provided by the caller, as
+ * with an IN clause.
+ */
+Datum
+prune_using_any_value(PG_FUNCTION_ARGS)
+{
+	Oid distributedTableId = PG_GETARG_OID(0);
+	ArrayType *valueArray = PG_GETARG_ARRAYTYPE_P(1);
+	Expr *arrayExpr = MakeTextArrayPartitionExpression(distributedTableId, valueArray);
+	List *whereClauseList = list_make1(arrayExpr);
+	ArrayType *shardIdArrayType = PrunedShardIdsForTable(distributedTableId,
+														 whereClauseList);
+
+	PG_RETURN_ARRAYTYPE_P(shardIdArrayType);
+}
+
+
+/*
+ * prune_using_comparison returns the shards for the specified distributed table
+ * after pruning using a comparison of its partition column with a value, both
+ * provided by the caller. The comparison is named by its operator: <, <=, =, >=
+ * or >.
+ */
+Datum
+prune_using_comparison(PG_FUNCTION_ARGS)
+{
+	Oid distributedTableId = PG_GETARG_OID(0);
+	char *operatorName = text_to_cstring(PG_GETARG_TEXT_P(1));
+	text *value = PG_GETARG_TEXT_P(2);
+	int16 strategyNumber = ComparisonStrategyNumber(operatorName);
+	Expr *comparisonExpr = MakeTextComparisonExpression(distributedTableId,
+														strategyNumber, value);
+	List *whereClauseList = list_make1(comparisonExpr);
+	ArrayType *shardIdArrayType = PrunedShardIdsForTable(distributedTableId,
+														 whereClauseList);
+
+	PG_RETURN_ARRAYTYPE_P(shardIdArrayType);
+}
+
+
+/*
+ * prune_uncached_using_single_value returns the shards for the specified
+ * distributed table after pruning using a single value provided by the caller.
+ * Unlike prune_using_single_value, it prunes a freshly loaded shard list rather
+ * than the cached one, so shards are always pruned by predicate refutation.
+ */
+Datum
+prune_uncached_using_single_value(PG_FUNCTION_ARGS)
+{
+	Oid distributedTableId = PG_GETARG_OID(0);
+	text *value = (PG_ARGISNULL(1)) ? NULL : PG_GETARG_TEXT_P(1);
+	Expr *equalityExpr = MakeTextPartitionExpression(distributedTableId, value);
+	List *whereClauseList = list_make1(equalityExpr);
+	List *shardList = LoadShardIntervalList(distributedTableId);
+	ArrayType *shardIdArrayType = PrunedShardIdsForList(distributedTableId,
+														whereClauseList, shardList);
+
+	PG_RETURN_ARRAYTYPE_P(shardIdArrayType);
+}
+
+
 /*
  * debug_equality_expression returns the textual representation of an equality
  * expression generated by a call to MakeOpExpression.
@@ -145,22 +222,16 @@ debug_equality_expression(PG_FUNCTION_ARGS)
 static Expr *
 MakeTextPartitionExpression(Oid distributedTableId, text *value)
 {
-	Var *partitionColumn = PartitionColumn(distributedTableId);
 	Expr *partitionExpression = NULL;
 
 	if (value != NULL)
 	{
-		OpExpr *equalityExpr = MakeOpExpression(partitionColumn, BTEqualStrategyNumber);
-		Const *rightConst = (Const *) get_rightop((Expr *) equalityExpr);
-
-		rightConst->constvalue = (Datum) value;
-		rightConst->constisnull = false;
-		rightConst->constbyval = false;
-
-		partitionExpression = (Expr *) equalityExpr;
+		partitionExpression = MakeTextComparisonExpression(distributedTableId,
+														   BTEqualStrategyNumber, value);
 	}
 	else
 	{
+		Var *partitionColumn = PartitionColumn(distributedTableId);
 		NullTest *nullTest = makeNode(NullTest);
 		nullTest->arg = (Expr *) partitionColumn;
 		nullTest->nulltesttype = IS_NULL;
@@ -173,19 +244,113 @@ MakeTextPartitionExpression(Oid distributedTableId, text *value)
 
 
 /*
- * PrunedShardIdsForTable loads the shard intervals for the specified table,
- * prunes them using the provided clauses. It returns an ArrayType containing
- * the shard identifiers, suitable for return from an SQL-facing function.
+ * MakeTextComparisonExpression returns an expression comparing the specified
+ * table's partition column with the provided value using the operator of the
+ * given btree strategy.
+ */
+static Expr *
+MakeTextComparisonExpression(Oid distributedTableId, int16 strategyNumber, text *value)
+{
+	Var *partitionColumn = PartitionColumn(distributedTableId);
+	OpExpr *comparisonExpr = MakeOpExpression(partitionColumn, strategyNumber);
+	Const *rightConst = (Const *) get_rightop((Expr *) comparisonExpr);
+
+	rightConst->constvalue = (Datum) value;
+	rightConst->constisnull = false;
+	rightConst->constbyval = false;
+
+	return (Expr *) comparisonExpr;
+}
+
+
+/*
+ * ComparisonStrategyNumber returns the btree strategy number of the comparison
+ * operator with the given name, and errors out for other operators.
+ */
+static int16
+ComparisonStrategyNumber(char *operatorName)
+{
+	if (strcmp(operatorName, "<") == 0)
+	{
+		return BTLessStrategyNumber;
+	}
+	else if (strcmp(operatorName, "<=") == 0)
+	{
+		return BTLessEqualStrategyNumber;
+	}
+	else if (strcmp(operatorName, "=") == 0)
+	{
+		return BTEqualStrategyNumber;
+	}
+	else if (strcmp(operatorName, ">=") == 0)
+	{
+		return BTGreaterEqualStrategyNumber;
+	}
+	else if (strcmp(operatorName, ">") == 0)
+	{
+		return BTGreaterStrategyNumber;
+	}
+
+	ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					errmsg("unsupported comparison operator: \"%s\"", operatorName)));
+
+	return InvalidStrategy;
+}
+
+
+/*
+ * MakeTextArrayPartitionExpression returns an expression which compares the
+ * specified table's partition column for equality with any of the provided
+ * values.
+ */
+static Expr *
+MakeTextArrayPartitionExpression(Oid distributedTableId, ArrayType *valueArray)
+{
+	Var *partitionColumn = PartitionColumn(distributedTableId);
+	OpExpr *equalityExpr = MakeOpExpression(partitionColumn, BTEqualStrategyNumber);
+	ScalarArrayOpExpr *arrayExpr = makeNode(ScalarArrayOpExpr);
+	Const *arrayConst = makeConst(TEXTARRAYOID, -1, partitionColumn->varcollid, -1,
+								  PointerGetDatum(valueArray), false, false);
+
+	arrayExpr->opno = equalityExpr->opno;
+	arrayExpr->opfuncid = equalityExpr->opfuncid;
+	arrayExpr->useOr = true;
+	arrayExpr->inputcollid = partitionColumn->varcollid;
+	arrayExpr->args = list_make2(partitionColumn, arrayConst);
+	arrayExpr->location = -1;
+
+	return (Expr *) arrayExpr;
+}
+
+
+/*
+ * PrunedShardIdsForTable looks up the cached shard intervals for the specified
+ * table, as the planner does, and prunes them using the provided clauses. It
+ * returns an ArrayType containing the remaining shard identifiers, suitable for
+ * return from an SQL-facing function.
  */
 static ArrayType *
 PrunedShardIdsForTable(Oid distributedTableId, List *whereClauseList)
+{
+	List *shardList = LookupShardIntervalList(distributedTableId);
+
+	return PrunedShardIdsForList(distributedTableId, whereClauseList, shardList);
+}
+
+
+/*
+ * PrunedShardIdsForList prunes the provided shard list of the specified table
+ * using the provided clauses, and returns an ArrayType containing the remaining
+ * shard identifiers.
+ */
+static ArrayType *
+PrunedShardIdsForList(Oid distributedTableId, List *whereClauseList, List *shardList)
 {
 	ArrayType *shardIdArrayType = NULL;
 	ListCell *shardCell = NULL;
 	int shardIdIndex = 0;
 	Oid shardIdTypeId = INT8OID;
 
-	List *shardList = LoadShardIntervalList(distributedTableId);
 	int shardIdCount = -1;
 	Datum *shardIdDatumArray = NULL;
 
@@ -0,0 +1,35 @@
+-- define the function through which multi-shard SELECTs read fetched rows
+CREATE FUNCTION pg_shard_intermediate_result(internal)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- define the function which replicates a table to every worker node
+CREATE FUNCTION master_create_reference_table(table_name text)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- define the function through which metadata changes invalidate cached metadata
+CREATE FUNCTION invalidate_metadata_cache()
+RETURNS trigger
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- metadata relations are views without triggers under CitusDB
+DO $$
+BEGIN
+	IF (SELECT relkind FROM pg_class
+		WHERE oid = 'pgs_distribution_metadata.shard'::regclass) = 'r' THEN
+		CREATE TRIGGER shard_invalidate_cache
+			AFTER INSERT OR UPDATE OR DELETE ON pgs_distribution_metadata.shard
+			FOR EACH ROW
+			EXECUTE PROCEDURE invalidate_metadata_cache();
+
+		CREATE TRIGGER partition_invalidate_cache
+			AFTER INSERT OR UPDATE OR DELETE ON pgs_distribution_metadata.partition
+			FOR EACH ROW
+			EXECUTE PROCEDURE invalidate_metadata_cache();
+	END IF;
+END;
+$$;